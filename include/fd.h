@@ -54,6 +54,9 @@ void fd_leak(struct fd *fd, where_t where);
 ssize_t fd_sendmsg(const struct fd *fd, const struct msghdr *msg, int flags);
 ssize_t fd_read(const struct fd *fd, void *buf, size_t nbytes);
 
+/* the underlying descriptor, for event loops; -1 when invalid */
+int fd_fileno(const struct fd *fd);
+
 /*
  * Is FD valid (as in something non-negative)?
  *
@@ -83,6 +83,9 @@ enum keyword_numeric_config_field {
 	KBF_AUDIT_LOG,
 	KBF_IKEBUF,
 	KBF_IKE_ERRQUEUE,
+	KBF_IKE_BATCH,
+	KBF_IKE_REUSEPORT,
+	KBF_IKE_STEER_SPI,
 	KBF_PERPEERLOG,
 	KBF_XFRMLIFETIME,
 	KBF_CRL_STRICT,
@@ -101,9 +104,18 @@ enum keyword_numeric_config_field {
 	KBF_PLUTODEBUG,
 	KBF_NHELPERS,
 	KBF_SHUNTLIFETIME,
+	KBF_REKEY_WINDOW,
+	KBF_REKEY_RATE,
+	KBF_SA_COUNTER_CACHE,
 	KBF_FORCEBUSY, 		/* obsoleted for KBF_DDOS_MODE */
 	KBF_DDOS_IKE_THRESHOLD,
 	KBF_MAX_HALFOPEN_IKE,
+	KBF_COMPACT_HALFOPEN_IKE,
+	KBF_DDOS_SOURCE_RATE,
+	KBF_DH_POOL_SIZE,
+	KBF_DH_POOL_LOW_WATER,
+	KBF_IKE_SK_OFFLOAD,
+	KBF_CERT_VERIFY_CACHE,
 	KBF_SECCTX,		/* security context attribute value for labeled ipsec */
 	KBF_NFLOG_ALL,		/* Enable global nflog device */
 	KBF_DDOS_MODE,		/* set DDOS mode */
@@ -65,9 +65,21 @@ enum ike_version {
 #define SA_REPLACEMENT_FUZZ_DEFAULT 100 /* (IPSEC & IKE) 100% of MARGIN */
 #define SA_REPLACEMENT_RETRIES_DEFAULT 0 /* (IPSEC & IKE) */
 
+#define PLUTO_REKEY_WINDOW_DEFAULT 0 /* don't spread rekeys */
+#define PLUTO_REKEY_WINDOW_MAX secs_per_day
+#define PLUTO_REKEY_RATE_DEFAULT 0 /* no per-second rekey budget */
+#define PLUTO_REKEY_RATE_MAX 100000
+
+#define PLUTO_SA_COUNTER_CACHE_DEFAULT 0 /* query each kernel SA */
+#define PLUTO_SA_COUNTER_CACHE_MAX secs_per_hour
+
 #define SA_LIFE_DURATION_K_DEFAULT 0xFFFFFFFFlu
 
 #define IKE_BUF_AUTO 0 /* use system values for IKE socket buffer size */
+#define IKE_SOCKET_BATCH_DEFAULT 1 /* datagrams read per wakeup; 1 disables recvmmsg() */
+#define IKE_SOCKET_BATCH_MAX 64
+#define IKE_SOCKET_REUSEPORT_DEFAULT 1 /* sockets per IKE endpoint; 1 disables SO_REUSEPORT */
+#define IKE_SOCKET_REUSEPORT_MAX 16
 
 #define DEFAULT_XFRM_IF_NAME "ipsec1"
 
@@ -192,6 +204,10 @@ enum global_timer {
 	EVENT_NAT_T_KEEPALIVE,		/* NAT Traversal Keepalive */
 
 	EVENT_PROCESS_KERNEL_QUEUE,	/* non-netkey */
+
+	EVENT_FLUSH_SEND_QUEUE,		/* send batched IKE messages */
+
+	EVENT_v2_HALF_OPEN,		/* compact/expire half-open IKE SAs */
 };
 
 enum event_type {
@@ -355,6 +371,14 @@ typedef enum {
 #define KERNEL_PROCESS_Q_PERIOD 1 /* seconds */
 #define DEFAULT_MAXIMUM_HALFOPEN_IKE_SA 50000 /* fairly arbitrary */
 #define DEFAULT_IKE_SA_DDOS_THRESHOLD 25000 /* fairly arbitrary */
+#define PLUTO_DDOS_SOURCE_RATE_DEFAULT 0 /* no per-source IKE_SA_INIT limit */
+#define PLUTO_DDOS_SOURCE_RATE_MAX 1000000
+#define PLUTO_DH_POOL_SIZE_DEFAULT 0 /* no pre-computed KE */
+#define PLUTO_DH_POOL_SIZE_MAX 4096
+#define PLUTO_DH_POOL_LOW_WATER_DEFAULT 0 /* half of dh-pool-size */
+#define PLUTO_CERT_VERIFY_CACHE_DEFAULT 0 /* no cached chain verifications */
+#define PLUTO_CERT_VERIFY_CACHE_MAX 262144
+#define PLUTO_CERT_VERIFY_CACHE_LIFETIME 300 /* seconds */
 
 #define IPSEC_SA_DEFAULT_REPLAY_WINDOW 32
 
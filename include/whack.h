@@ -66,7 +66,7 @@
  */
 
 #define WHACK_BASIC_MAGIC (((((('w' << 8) + 'h') << 8) + 'k') << 8) + 25)
-#define WHACK_MAGIC (((((('o' << 8) + 'h') << 8) + 'k') << 8) + 49)
+#define WHACK_MAGIC (((((('o' << 8) + 'h') << 8) + 'k') << 8) + 50)
 
 /* struct whack_end is a lot like connection.h's struct end
  * It differs because it is going to be shipped down a socket
@@ -150,6 +150,7 @@ struct whack_message {
 	 */
 
 	bool whack_process_status; /* non-basic */
+	bool whack_unsorted; /* stream --status without sorting */
 
 	bool whack_leave_state; /* dont send delete or  clean kernel state on shutdown */
 	/* name is used in connection and initiate */
@@ -77,6 +77,8 @@ extern deltatime_t crl_check_interval;
 extern bool same_dn(chunk_t a, chunk_t b);
 extern bool match_dn(chunk_t a, chunk_t b, int *wildcards);
 extern int dn_count_wildcards(chunk_t dn);
+typedef void (dn_rdn_fn)(chunk_t oid, chunk_t value, void *context);
+extern err_t walk_dn_rdns(chunk_t dn, dn_rdn_fn *rdn_fn, void *context);
 extern err_t atodn(const char *src, chunk_t *dn);
 extern void free_generalNames(generalName_t *gn, bool free_name);
 extern void load_crls(void);
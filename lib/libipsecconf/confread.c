@@ -83,6 +83,9 @@ static void ipsecconf_default_values(struct starter_config *cfg)
 	SOPT(KBF_PERPEERLOG, FALSE);
 	SOPT(KBF_IKEBUF, IKE_BUF_AUTO);
 	SOPT(KBF_IKE_ERRQUEUE, TRUE);
+	SOPT(KBF_IKE_BATCH, IKE_SOCKET_BATCH_DEFAULT);
+	SOPT(KBF_IKE_REUSEPORT, IKE_SOCKET_REUSEPORT_DEFAULT);
+	SOPT(KBF_IKE_STEER_SPI, FALSE);
 	SOPT(KBF_NFLOG_ALL, 0); /* disabled per default */
 	SOPT(KBF_XFRMLIFETIME, XFRM_LIFETIME_DEFAULT); /* not used by pluto itself */
 	SOPT(KBF_NHELPERS, -1); /* see also plutomain.c */
@@ -90,7 +93,16 @@ static void ipsecconf_default_values(struct starter_config *cfg)
 	SOPT(KBF_KEEPALIVE, 0);                  /* config setup */
 	SOPT(KBF_DDOS_IKE_THRESHOLD, DEFAULT_IKE_SA_DDOS_THRESHOLD);
 	SOPT(KBF_MAX_HALFOPEN_IKE, DEFAULT_MAXIMUM_HALFOPEN_IKE_SA);
+	SOPT(KBF_COMPACT_HALFOPEN_IKE, FALSE);
+	SOPT(KBF_DDOS_SOURCE_RATE, PLUTO_DDOS_SOURCE_RATE_DEFAULT);
+	SOPT(KBF_DH_POOL_SIZE, PLUTO_DH_POOL_SIZE_DEFAULT);
+	SOPT(KBF_DH_POOL_LOW_WATER, PLUTO_DH_POOL_LOW_WATER_DEFAULT);
+	SOPT(KBF_IKE_SK_OFFLOAD, FALSE);
+	SOPT(KBF_CERT_VERIFY_CACHE, PLUTO_CERT_VERIFY_CACHE_DEFAULT);
 	SOPT(KBF_SHUNTLIFETIME, PLUTO_SHUNT_LIFE_DURATION_DEFAULT);
+	SOPT(KBF_REKEY_WINDOW, PLUTO_REKEY_WINDOW_DEFAULT);
+	SOPT(KBF_REKEY_RATE, PLUTO_REKEY_RATE_DEFAULT);
+	SOPT(KBF_SA_COUNTER_CACHE, PLUTO_SA_COUNTER_CACHE_DEFAULT);
 	/* Don't inflict BSI requirements on everyone */
 	SOPT(KBF_SEEDBITS, 0);
 	SOPT(KBF_DROP_OPPO_NULL, FALSE);
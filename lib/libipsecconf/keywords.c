@@ -396,6 +396,9 @@ const struct keyword_def ipsec_conf_keywords[] = {
   { "statsbin",  kv_config,  kt_dirname,  KSF_STATSBINARY, NULL, NULL, },
   { "uniqueids",  kv_config,  kt_bool,  KBF_UNIQUEIDS, NULL, NULL, },
   { "shuntlifetime",  kv_config,  kt_time,  KBF_SHUNTLIFETIME, NULL, NULL, },
+  { "rekey-window",  kv_config,  kt_time,  KBF_REKEY_WINDOW, NULL, NULL, },
+  { "rekey-rate",  kv_config,  kt_number,  KBF_REKEY_RATE, NULL, NULL, },
+  { "sa-counter-cache",  kv_config,  kt_time,  KBF_SA_COUNTER_CACHE, NULL, NULL, },
   { "global-redirect", kv_config, kt_string, KSF_GLOBAL_REDIRECT, NULL, NULL },
   { "global-redirect-to", kv_config, kt_string, KSF_GLOBAL_REDIRECT_TO, NULL, NULL, },
 
@@ -418,8 +421,17 @@ const struct keyword_def ipsec_conf_keywords[] = {
 #endif
   { "ddos-ike-threshold",  kv_config,  kt_number,  KBF_DDOS_IKE_THRESHOLD, NULL, NULL, },
   { "max-halfopen-ike",  kv_config,  kt_number,  KBF_MAX_HALFOPEN_IKE, NULL, NULL, },
+  { "compact-halfopen-ike",  kv_config,  kt_bool,  KBF_COMPACT_HALFOPEN_IKE, NULL, NULL, },
+  { "ddos-source-rate",  kv_config,  kt_number,  KBF_DDOS_SOURCE_RATE, NULL, NULL, },
+  { "dh-pool-size",  kv_config,  kt_number,  KBF_DH_POOL_SIZE, NULL, NULL, },
+  { "dh-pool-low-water",  kv_config,  kt_number,  KBF_DH_POOL_LOW_WATER, NULL, NULL, },
+  { "ike-sk-offload",  kv_config,  kt_bool,  KBF_IKE_SK_OFFLOAD, NULL, NULL, },
+  { "cert-verify-cache",  kv_config,  kt_number,  KBF_CERT_VERIFY_CACHE, NULL, NULL, },
   { "ike-socket-bufsize",  kv_config,  kt_number,  KBF_IKEBUF, NULL, NULL, },
   { "ike-socket-errqueue",  kv_config,  kt_bool,  KBF_IKE_ERRQUEUE, NULL, NULL, },
+  { "ike-socket-batch",  kv_config,  kt_number,  KBF_IKE_BATCH, NULL, NULL, },
+  { "ike-socket-reuseport",  kv_config,  kt_number,  KBF_IKE_REUSEPORT, NULL, NULL, },
+  { "ike-socket-steer-spi",  kv_config,  kt_bool,  KBF_IKE_STEER_SPI, NULL, NULL, },
   { "nflog-all",  kv_config,  kt_number,  KBF_NFLOG_ALL, NULL, NULL, },
   { "xfrmlifetime",  kv_config,  kt_number,  KBF_XFRMLIFETIME, NULL, NULL, },
   { "virtual-private",  kv_config,  kt_string,  KSF_VIRTUALPRIVATE, NULL, NULL, },
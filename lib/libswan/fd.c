@@ -117,6 +117,14 @@ ssize_t fd_read(const struct fd *fd, void *buf, size_t nbytes)
 	return s < 0 ? -errno : s;
 }
 
+int fd_fileno(const struct fd *fd)
+{
+	if (fd == NULL || fd->magic != FD_MAGIC) {
+		return -1;
+	}
+	return fd->fd;
+}
+
 bool fd_p(const struct fd *fd)
 {
 	if (fd == NULL) {
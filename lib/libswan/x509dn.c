@@ -253,6 +253,32 @@ int dn_count_wildcards(chunk_t dn)
 	return wildcards;
 }
 
+/*
+ * Pass each RDN's OID and value contents (but not the value's type)
+ * to RDN_FN in order; these are what same_dn() compares.  On a parse
+ * error, some RDNs may already have been passed.
+ */
+err_t walk_dn_rdns(chunk_t dn, dn_rdn_fn *rdn_fn, void *context)
+{
+	chunk_t rdn;
+	chunk_t attribute;
+	bool more;
+
+	RETURN_IF_ERR(init_rdn(dn, &rdn, &attribute, &more));
+
+	while (more) {
+		chunk_t oid;
+		chunk_t value_ber;
+		asn1_t value_type;
+		chunk_t value_content;
+		RETURN_IF_ERR(get_next_rdn(&rdn, &attribute, &oid,
+					   &value_ber, &value_type, &value_content,
+					   &more));
+		rdn_fn(oid, value_content, context);
+	}
+	return NULL;
+}
+
 /*
  * Formats an ASN.1 Distinguished Name into an ASCII string of
  * OID/value pairs.  If there's a problem, return err_t (buf's
@@ -31,6 +31,7 @@
 
 #include "lswalloc.h"
 #include "connections.h"
+#include "connection_db.h"
 #include "defs.h"
 #include "constants.h"
 #include "addresspool.h"
@@ -645,6 +646,7 @@ err_t lease_that_address(struct connection *c, const struct state *st)
 	c->spd.that.has_lease = true;
 	c->spd.that.has_client = true;
 	c->spd.that.client = selector_from_address(&ia);
+	rehash_connection_spd_routes(c);
 	new_lease->assigned_to = c->serialno;
 
 	if (DBGP(DBG_BASE)) {
@@ -13,10 +13,14 @@
  * for more details.
  */
 
+#include <string.h>
+#include <stdlib.h>		/* for qsort() */
+
 #include "connection_db.h"
 #include "connections.h"
 #include "log.h"
 #include "hash_table.h"
+#include "ip_info.h"
 
 const co_serial_t unset_co_serial;
 
@@ -82,6 +86,453 @@ struct connection *connection_by_serialno(co_serial_t serialno)
 	return NULL;
 }
 
+/*
+ * A table hashed by name.
+ *
+ * Only connections on the connections list are included; see
+ * add_connection_to_name_db().
+ */
+
+static void jam_connection_name(struct jambuf *buf, const void *data)
+{
+	if (data == NULL) {
+		jam(buf, "<no connection>");
+	} else {
+		const struct connection *c = data;
+		jam(buf, "\"%s\" "PRI_CO, c->name, pri_co(c->serialno));
+	}
+}
+
+static hash_t connection_name_hasher(const void *data)
+{
+	const struct connection *c = data;
+	return hash_table_hasher(shunk1(c->name), zero_hash);
+}
+
+static struct list_entry *connection_name_entry(void *data)
+{
+	struct connection *c = data;
+	return &c->name_hash_entry;
+}
+
+static struct list_head connection_name_slots[STATE_TABLE_SIZE];
+
+static struct hash_table connection_name_table = {
+	.info = {
+		.name = "connection name table",
+		.jam = jam_connection_name,
+	},
+	.hasher = connection_name_hasher,
+	.entry = connection_name_entry,
+	.nr_slots = elemsof(connection_name_slots),
+	.slots = connection_name_slots,
+};
+
+struct connection *connection_by_name(const char *name, bool no_inst)
+{
+	hash_t hash = hash_table_hasher(shunk1(name), zero_hash);
+	struct list_head *bucket = hash_table_bucket(&connection_name_table, hash);
+	struct connection *c;
+	FOR_EACH_LIST_ENTRY_NEW2OLD(bucket, c) {
+		if (streq(c->name, name) &&
+		    (!no_inst || c->kind != CK_INSTANCE)) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * A table hashed by alias.
+ *
+ * A connection can have several whitespace separated aliases so each
+ * gets its own entry.
+ */
+
+struct connection_alias {
+	struct list_entry entry;
+	shunk_t alias;		/* points into .connection->connalias */
+	struct connection *connection;
+};
+
+static void jam_connection_alias(struct jambuf *buf, const void *data)
+{
+	if (data == NULL) {
+		jam(buf, "<no alias>");
+	} else {
+		const struct connection_alias *a = data;
+		jam(buf, "\""PRI_SHUNK"\" ", pri_shunk(a->alias));
+		jam_connection_name(buf, a->connection);
+	}
+}
+
+static hash_t connection_alias_hasher(const void *data)
+{
+	const struct connection_alias *a = data;
+	return hash_table_hasher(a->alias, zero_hash);
+}
+
+static struct list_entry *connection_alias_entry(void *data)
+{
+	struct connection_alias *a = data;
+	return &a->entry;
+}
+
+static struct list_head connection_alias_slots[STATE_TABLE_SIZE];
+
+static struct hash_table connection_alias_table = {
+	.info = {
+		.name = "connection alias table",
+		.jam = jam_connection_alias,
+	},
+	.hasher = connection_alias_hasher,
+	.entry = connection_alias_entry,
+	.nr_slots = elemsof(connection_alias_slots),
+	.slots = connection_alias_slots,
+};
+
+co_serial_t *connection_serialnos_by_alias(const char *alias, unsigned *nr)
+{
+	shunk_t key = shunk1(alias);
+	struct list_head *bucket = hash_table_bucket(&connection_alias_table,
+						     hash_table_hasher(key, zero_hash));
+	co_serial_t *serialnos = NULL;
+	*nr = 0;
+	/* two passes: count then fill */
+	for (unsigned pass = 0; pass < 2; pass++) {
+		unsigned n = 0;
+		struct connection_alias *a;
+		FOR_EACH_LIST_ENTRY_NEW2OLD(bucket, a) {
+			if (hunk_eq(a->alias, key)) {
+				if (serialnos != NULL) {
+					serialnos[n] = a->connection->serialno;
+				}
+				n++;
+			}
+		}
+		if (n == 0) {
+			break;
+		}
+		if (serialnos == NULL) {
+			serialnos = alloc_things(co_serial_t, n, "alias serialnos");
+			*nr = n;
+		}
+	}
+	return serialnos;
+}
+
+/*
+ * A table of spd_routes hashed by their remote client subnet.
+ *
+ * Used by find_connection_for_clients() (subnets containing an
+ * address) and route_owner() (the same subnet).  A containment
+ * lookup probes the table once for each prefix length in use, so it
+ * costs a few hash lookups rather than a walk of every connection.
+ *
+ * The key is saved in the spd_route so that the entry is found (and
+ * rehashed when the table grows) using the value it was added with.
+ */
+
+static void jam_spd_route_remote_client(struct jambuf *buf, const void *data)
+{
+	if (data == NULL) {
+		jam(buf, "<no spd_route>");
+	} else {
+		const struct spd_route *sr = data;
+		jam_address(buf, &sr->remote_client_prefix);
+		jam(buf, "/%u ", sr->remote_client_bits);
+		jam_connection_name(buf, sr->connection);
+	}
+}
+
+/*
+ * The selector's bytes need not be masked; key on the routing prefix
+ * so that subnets that compare equal hash the same.
+ */
+
+static ip_address routing_prefix(const ip_address *address, unsigned bits)
+{
+	ip_subnet subnet = subnet_from_address_prefix_bits(address, bits);
+	return subnet_prefix(&subnet);
+}
+
+static hash_t remote_client_hasher(const ip_address *prefix, unsigned bits)
+{
+	hash_t hash = hash_table_hasher(shunk2(&bits, sizeof(bits)), zero_hash);
+	return hash_table_hasher(address_as_shunk(prefix), hash);
+}
+
+static hash_t spd_route_remote_client_hasher(const void *data)
+{
+	const struct spd_route *sr = data;
+	return remote_client_hasher(&sr->remote_client_prefix, sr->remote_client_bits);
+}
+
+static struct list_entry *spd_route_remote_client_entry(void *data)
+{
+	struct spd_route *sr = data;
+	return &sr->remote_client_entry;
+}
+
+static struct list_head spd_route_remote_client_slots[STATE_TABLE_SIZE];
+
+static struct hash_table spd_route_remote_client_table = {
+	.info = {
+		.name = "spd_route remote client table",
+		.jam = jam_spd_route_remote_client,
+	},
+	.hasher = spd_route_remote_client_hasher,
+	.entry = spd_route_remote_client_entry,
+	.nr_slots = elemsof(spd_route_remote_client_slots),
+	.slots = spd_route_remote_client_slots,
+};
+
+/*
+ * How many entries use each prefix length; [0] is IPv4, [1] IPv6.
+ * Entries with an unset client are counted separately and always
+ * returned.
+ */
+static unsigned nr_remote_client_bits[2][128+1];
+static unsigned nr_unset_remote_clients;
+
+static unsigned *remote_client_bits_count(const ip_address *prefix, unsigned bits)
+{
+	switch (prefix->version) {
+	case 4: return &nr_remote_client_bits[0][bits];
+	case 6: return &nr_remote_client_bits[1][bits];
+	default: return &nr_unset_remote_clients;
+	}
+}
+
+void init_spd_route_db_entry(struct spd_route *sr)
+{
+	sr->connection = NULL;
+	sr->remote_client_entry = list_entry(&spd_route_remote_client_table.info, sr);
+	sr->remote_client_prefix = unset_address;
+	sr->remote_client_bits = 0;
+}
+
+static void del_spd_route_from_db(struct spd_route *sr)
+{
+	if (sr->connection == NULL) {
+		return;
+	}
+	del_hash_table_entry(&spd_route_remote_client_table, sr);
+	unsigned *count = remote_client_bits_count(&sr->remote_client_prefix,
+						   sr->remote_client_bits);
+	passert(*count > 0);
+	(*count)--;
+	sr->connection = NULL;
+}
+
+static void add_spd_route_to_db(struct connection *c, struct spd_route *sr)
+{
+	passert(sr->connection == NULL);
+	if (selector_is_unset(&sr->that.client)) {
+		sr->remote_client_prefix = unset_address;
+		sr->remote_client_bits = 0;
+	} else {
+		ip_address prefix = selector_prefix(&sr->that.client);
+		sr->remote_client_bits = selector_prefix_bits(&sr->that.client);
+		sr->remote_client_prefix = routing_prefix(&prefix, sr->remote_client_bits);
+		passert(sr->remote_client_bits <= 128);
+	}
+	sr->connection = c;
+	add_hash_table_entry(&spd_route_remote_client_table, sr);
+	(*remote_client_bits_count(&sr->remote_client_prefix,
+				   sr->remote_client_bits))++;
+}
+
+static void del_connection_spd_routes(struct connection *c)
+{
+	for (struct spd_route *sr = &c->spd; sr != NULL; sr = sr->spd_next) {
+		del_spd_route_from_db(sr);
+	}
+}
+
+void rehash_connection_spd_routes(struct connection *c)
+{
+	del_connection_spd_routes(c);
+	if (detached_list_entry(&c->name_hash_entry)) {
+		/* not on the connections list */
+		return;
+	}
+	for (struct spd_route *sr = &c->spd; sr != NULL; sr = sr->spd_next) {
+		add_spd_route_to_db(c, sr);
+	}
+}
+
+struct spd_routes {
+	struct spd_route **list;
+	unsigned len;
+	unsigned size;
+};
+
+static void add_matching_spd_routes(struct spd_routes *srs,
+				    const ip_address *prefix, unsigned bits)
+{
+	hash_t hash = remote_client_hasher(prefix, bits);
+	struct list_head *bucket = hash_table_bucket(&spd_route_remote_client_table, hash);
+	struct spd_route *sr;
+	FOR_EACH_LIST_ENTRY_NEW2OLD(bucket, sr) {
+		if (sr->remote_client_bits != bits ||
+		    !address_eq(&sr->remote_client_prefix, prefix)) {
+			continue;
+		}
+		if (srs->len == srs->size) {
+			unsigned size = (srs->size == 0 ? 16 : srs->size * 2);
+			realloc_things(srs->list, srs->size, size, "spd_routes");
+			srs->size = size;
+		}
+		srs->list[srs->len++] = sr;
+	}
+}
+
+static unsigned spd_route_position(const struct spd_route *sr)
+{
+	unsigned pos = 0;
+	for (const struct spd_route *p = &sr->connection->spd; p != sr; p = p->spd_next) {
+		passert(p != NULL);
+		pos++;
+	}
+	return pos;
+}
+
+/*
+ * The connections list is newest first, and connections are added
+ * to it in serialno order.
+ */
+
+static int spd_route_order(const void *lp, const void *rp)
+{
+	const struct spd_route *l = *(const struct spd_route *const *)lp;
+	const struct spd_route *r = *(const struct spd_route *const *)rp;
+	if (l->connection != r->connection) {
+		return (l->connection->serialno.co > r->connection->serialno.co ? -1 : 1);
+	}
+	unsigned lpos = spd_route_position(l);
+	unsigned rpos = spd_route_position(r);
+	return (lpos < rpos ? -1 : lpos > rpos ? 1 : 0);
+}
+
+static struct spd_route **sorted_spd_routes(struct spd_routes *srs, unsigned *nr)
+{
+	if (srs->len > 1) {
+		qsort(srs->list, srs->len, sizeof(srs->list[0]), spd_route_order);
+		/* drop duplicates */
+		unsigned len = 1;
+		for (unsigned i = 1; i < srs->len; i++) {
+			if (srs->list[i] != srs->list[len - 1]) {
+				srs->list[len++] = srs->list[i];
+			}
+		}
+		srs->len = len;
+	}
+	*nr = srs->len;
+	return srs->list;
+}
+
+static void add_unset_spd_routes(struct spd_routes *srs)
+{
+	if (nr_unset_remote_clients > 0) {
+		add_matching_spd_routes(srs, &unset_address, 0);
+	}
+}
+
+struct spd_route **spd_routes_by_remote_address(const ip_address *address, unsigned *nr)
+{
+	struct spd_routes srs = {0};
+	const struct ip_info *afi = address_type(address);
+	if (afi != NULL) {
+		unsigned *counts = nr_remote_client_bits[afi == &ipv4_info ? 0 : 1];
+		for (unsigned bits = 0; bits <= afi->mask_cnt; bits++) {
+			if (counts[bits] == 0) {
+				continue;
+			}
+			ip_address prefix = routing_prefix(address, bits);
+			add_matching_spd_routes(&srs, &prefix, bits);
+		}
+	}
+	add_unset_spd_routes(&srs);
+	return sorted_spd_routes(&srs, nr);
+}
+
+struct spd_route **spd_routes_by_remote_client(const struct spd_route *spd, unsigned *nr)
+{
+	struct spd_routes srs = {0};
+	for (const struct spd_route *sr = spd; sr != NULL; sr = sr->spd_next) {
+		if (!selector_is_unset(&sr->that.client)) {
+			ip_address address = selector_prefix(&sr->that.client);
+			unsigned bits = selector_prefix_bits(&sr->that.client);
+			ip_address prefix = routing_prefix(&address, bits);
+			add_matching_spd_routes(&srs, &prefix, bits);
+		}
+	}
+	add_unset_spd_routes(&srs);
+	return sorted_spd_routes(&srs, nr);
+}
+
+/*
+ * lsw_alias_cmp() treats CONNALIAS as whitespace separated names.
+ */
+
+static unsigned split_aliases(const char *connalias, struct connection_alias *aliases)
+{
+	unsigned n = 0;
+	if (connalias == NULL) {
+		return 0;
+	}
+	for (const char *s = connalias;;) {
+		s += strspn(s, " \t");	/* skip whitespace */
+		if (*s == '\0') {
+			return n;
+		}
+		size_t aw = strcspn(s, " \t");	/* alias width */
+		if (aliases != NULL) {
+			aliases[n].alias = shunk2(s, aw);
+		}
+		n++;
+		s += aw;
+	}
+}
+
+void add_connection_to_name_db(struct connection *c)
+{
+	dbg("Connection DB: indexing \"%s\" "PRI_CO, c->name, pri_co(c->serialno));
+	passert(detached_list_entry(&c->name_hash_entry));
+	passert(c->aliases == NULL);
+	add_hash_table_entry(&connection_name_table, c);
+
+	c->nr_aliases = split_aliases(c->connalias, NULL);
+	if (c->nr_aliases > 0) {
+		c->aliases = alloc_things(struct connection_alias, c->nr_aliases,
+					  "connection aliases");
+		split_aliases(c->connalias, c->aliases);
+		for (unsigned i = 0; i < c->nr_aliases; i++) {
+			c->aliases[i].connection = c;
+			add_hash_table_entry(&connection_alias_table, &c->aliases[i]);
+		}
+	}
+	rehash_connection_spd_routes(c);
+}
+
+void del_connection_from_name_db(struct connection *c)
+{
+	if (detached_list_entry(&c->name_hash_entry)) {
+		/* never added, or already deleted */
+		pexpect(c->aliases == NULL);
+		return;
+	}
+	dbg("Connection DB: un-indexing \"%s\" "PRI_CO, c->name, pri_co(c->serialno));
+	del_connection_spd_routes(c);
+	del_hash_table_entry(&connection_name_table, c);
+	for (unsigned i = 0; i < c->nr_aliases; i++) {
+		del_hash_table_entry(&connection_alias_table, &c->aliases[i]);
+	}
+	pfreeany(c->aliases);
+	c->nr_aliases = 0;
+}
+
 /*
  * Maintain the contents of the hash tables.
  *
@@ -93,7 +544,7 @@ static struct list_head hash_slots[CONNECTION_HASH_TABLES_ROOF][STATE_TABLE_SIZE
 static struct hash_table connection_hash_tables[] = {
 	[CONNECTION_SERIALNO_HASH_TABLE] = {
 		.info = {
-			.name = "st_serialno table",
+			.name = "co_serialno table",
 			.jam = jam_connection_serialno,
 		},
 		.hasher = connection_serialno_hasher,
@@ -122,6 +573,12 @@ static struct connection *finish_connection(struct connection *c, const char *na
 {
 	c->name = clone_str(name, __func__);
 	c->logger = alloc_logger(c, &logger_connection_vec, where);
+	/* not on the connections list (yet) */
+	c->name_hash_entry = list_entry(&connection_name_table.info, c);
+	c->aliases = NULL;
+	c->nr_aliases = 0;
+	/* the clone's .spd_next is reset by the caller */
+	init_spd_route_db_entry(&c->spd);
 	/* logger is GO! */
 	static co_serial_t connection_serialno;
 	c->serial_from = c->serialno;
@@ -146,6 +603,7 @@ struct connection *clone_connection(const char *name, struct connection *t, wher
 void remove_connection_from_db(struct connection *c)
 {
 	dbg("Connection DB: deleting connection "PRI_CO, pri_co(c->serialno));
+	del_connection_from_name_db(c);
 	remove_list_entry(&c->serialno_list_entry);
 	for (unsigned h = 0; h < elemsof(connection_hash_tables); h++) {
 		del_hash_table_entry(&connection_hash_tables[h], c);
@@ -157,4 +615,7 @@ void init_connection_db(void)
 	for (unsigned h = 0; h < elemsof(connection_hash_tables); h++) {
 		init_hash_table(&connection_hash_tables[h]);
 	}
+	init_hash_table(&connection_name_table);
+	init_hash_table(&connection_alias_table);
+	init_hash_table(&spd_route_remote_client_table);
 }
@@ -16,9 +16,13 @@
 #ifndef CONNECTION_DB_H
 #define CONNECTION_DB_H
 
+#include <stdbool.h>
+
 #include "where.h"
+#include "ip_address.h"
 
 struct connection;
+struct spd_route;
 
 typedef struct { unsigned long co; } co_serial_t;
 
@@ -41,6 +45,42 @@ void remove_connection_from_db(struct connection *c);
 
 struct connection *connection_by_serialno(co_serial_t serialno);
 
+/*
+ * Connections on the connections list indexed by name and by each
+ * of their aliases.
+ *
+ * Add once the connection is on the list (a connection being built
+ * must not find itself); del when it is taken off.
+ */
+void add_connection_to_name_db(struct connection *c);
+void del_connection_from_name_db(struct connection *c);
+
+/* newest first; NO_INST skips CK_INSTANCE */
+struct connection *connection_by_name(const char *name, bool no_inst);
+/* newest first; caller must pfree() the result */
+co_serial_t *connection_serialnos_by_alias(const char *alias, unsigned *nr);
+
+/*
+ * The spd_routes of connections on the connections list indexed by
+ * their remote client (that.client) subnet.
+ *
+ * Call rehash_connection_spd_routes() after changing a connection's
+ * .spd.that.client (or its spd_route chain); it is a no-op for
+ * connections that are not on the list.  Clones of a spd_route must
+ * be passed through init_spd_route_db_entry().
+ *
+ * Lookups return the spd_routes in connections list order (newest
+ * connection first, then along each connection's spd_route chain);
+ * the caller must pfree() the result and still check the selectors.
+ */
+void init_spd_route_db_entry(struct spd_route *sr);
+void rehash_connection_spd_routes(struct connection *c);
+
+/* remote client subnet contains ADDRESS */
+struct spd_route **spd_routes_by_remote_address(const ip_address *address, unsigned *nr);
+/* remote client subnet is the same as one in the SPD chain */
+struct spd_route **spd_routes_by_remote_client(const struct spd_route *spd, unsigned *nr);
+
 /*
  * All the hash tables states are stored in.
  */
@@ -54,6 +54,7 @@
 
 #include "defs.h"
 #include "connections.h" /* needs id.h */
+#include "connection_db.h"
 #include "pending.h"
 #include "foodgroups.h"
 #include "packet.h"
@@ -90,6 +91,7 @@
 #include "ip_selector.h"
 #include "nss_cert_reread.h"
 #include "security_selinux.h"
+#include "pubkey_db.h"
 
 struct connection *connections = NULL;
 
@@ -103,34 +105,13 @@ static bool idr_wildmatch(const struct end *this, const struct id *b, struct log
  *
  * no_inst: don't accept a CK_INSTANCE.
  *
- * If none is found, and strict&&!queit, a diagnostic is logged to
- * whack.
- *
- * XXX: Fun fact: this function re-orders the list, moving the entry
- * to the front as a side effect (ulgh)!.
+ * Uses the name index in connection_db.c; when several connections
+ * share the name (a template and its instances), the newest is
+ * returned.
  */
 struct connection *conn_by_name(const char *nm, bool no_inst)
 {
-	struct connection *p, *prev;
-
-	dbg("FOR_EACH_CONNECTION_... in %s", __func__);
-	for (prev = NULL, p = connections; ; prev = p, p = p->ac_next) {
-		if (p == NULL) {
-			break;
-		}
-		if (streq(p->name, nm) &&
-		    (!no_inst || p->kind != CK_INSTANCE)) {
-			if (prev != NULL) {
-				/* remove p from list */
-				prev->ac_next = p->ac_next;
-				/* and stick it on front */
-				p->ac_next = connections;
-				connections = p;
-			}
-			break;
-		}
-	}
-	return p;
+	return connection_by_name(nm, no_inst);
 }
 
 void release_connection(struct connection *c, bool relations, struct fd *whackfd)
@@ -237,6 +218,7 @@ static void discard_connection(struct connection *c,
 		if (*head == c) {
 			*head = c->ac_next;
 			c->ac_next = NULL;
+			del_connection_from_name_db(c);
 			break;
 		}
 	}
@@ -298,16 +280,25 @@ int foreach_connection_by_alias(const char *alias, struct fd *whackfd,
 					 void *arg),
 				void *arg)
 {
-	struct connection *p, *pnext;
 	int count = 0;
 
-	dbg("FOR_EACH_CONNECTION_... in %s", __func__);
-	for (p = connections; p != NULL; p = pnext) {
-		pnext = p->ac_next;
-
-		if (lsw_alias_cmp(alias, p->connalias))
-			count += (*f)(p, whackfd, arg);
+	/*
+	 * Grab the serialnos up front: F() may delete the connection
+	 * (and its instances).
+	 */
+	unsigned nr;
+	co_serial_t *serialnos = connection_serialnos_by_alias(alias, &nr);
+	for (unsigned i = 0; i < nr; i++) {
+		struct connection *p = connection_by_serialno(serialnos[i]);
+		if (p == NULL) {
+			dbg("connection "PRI_CO" with alias %s disappeared",
+			    pri_co(serialnos[i]), alias);
+			continue;
+		}
+		pexpect(lsw_alias_cmp(alias, p->connalias));
+		count += (*f)(p, whackfd, arg);
 	}
+	pfreeany(serialnos);
 	return count;
 }
 
@@ -1185,11 +1176,14 @@ diag_t add_end_cert_and_preload_private_key(CERTCertificate *cert,
 	}
 
 	dbg("loading %s certificate \'%s\' pubkey", dst_end->leftright, nickname);
-	if (!add_pubkey_from_nss_cert(&pluto_pubkeys, &dst_end->id, cert, logger)) {
+	struct pubkey_list *cert_pubkeys = NULL;
+	if (!add_pubkey_from_nss_cert(&cert_pubkeys, &dst_end->id, cert, logger)) {
+		free_public_keys(&cert_pubkeys);
 		/* XXX: push diag_t into add_pubkey_from_nss_cert()? */
 		return diag("%s certificate \'%s\' pubkey could not be loaded",
 			    dst_end->leftright, nickname);
 	}
+	replace_pubkey_db_keys(&cert_pubkeys);
 
 	dst_end->cert.ty = CERT_X509_SIGNATURE;
 	dst_end->cert.u.nss_cert = cert;
@@ -1954,6 +1948,7 @@ static bool extract_connection(const struct whack_message *wm,
 	 */
 	c->ac_next = connections;
 	connections = c;
+	add_connection_to_name_db(c);
 
 	/* set internal fields */
 	c->instance_serial = 0;
@@ -2175,6 +2170,7 @@ struct connection *add_group_instance(struct connection *group,
 	/* add to connections list */
 	t->ac_next = connections;
 	connections = t;
+	add_connection_to_name_db(t);
 
 	/* same host_pair as parent: stick after parent on list */
 	/* t->hp_next = group->hp_next; */	/* done by clone_thing */
@@ -2259,6 +2255,7 @@ struct connection *instantiate(struct connection *c,
 	/* set internal fields */
 	d->ac_next = connections;
 	connections = d;
+	add_connection_to_name_db(d);
 	d->spd.routing = RT_UNROUTED;
 	d->newest_isakmp_sa = SOS_NOBODY;
 	d->newest_ipsec_sa = SOS_NOBODY;
@@ -2307,6 +2304,7 @@ struct connection *rw_instantiate(struct connection *c,
 		 */
 		d->spd.that.client = selector_type(&d->spd.that.client)->selector.none;
 	}
+	rehash_connection_spd_routes(d);
 	connection_buf inst;
 	address_buf b;
 	dbg("rw_instantiate() instantiated "PRI_CONNECTION" for %s",
@@ -2412,6 +2410,75 @@ const char *str_connection_instance(const struct connection *c, connection_buf *
 	return buf->buf;
 }
 
+static void match_connection_for_clients(struct connection *c,
+					 struct spd_route *sr,
+					 const ip_endpoint *local_client,
+					 const ip_endpoint *remote_client,
+					 shunk_t sec_label,
+					 struct connection **best,
+					 struct spd_route **best_sr,
+					 policy_prio_t *best_prio,
+					 struct logger *logger UNUSED)
+{
+	int local_port = endpoint_hport(local_client);
+	int remote_port = endpoint_hport(remote_client);
+
+	if ( ((routed(sr->routing) || c->instance_initiation_ok) || sec_label.len != 0) &&
+	    endpoint_in_selector(local_client, &sr->this.client) &&
+	    endpoint_in_selector(remote_client, &sr->that.client)
+#ifdef HAVE_LABELED_IPSEC
+	     && se_label_match(sec_label, sr->this.sec_label, logger)
+#endif
+	     ) {
+		unsigned ipproto = endpoint_protocol(local_client)->ipproto;
+		policy_prio_t prio =
+			(8 * (c->policy_prio + (c->kind == CK_INSTANCE)) +
+			 2 * (sr->this.port == local_port) +
+			 2 * (sr->that.port == remote_port) +
+			 1 * (sr->this.protocol == ipproto));
+
+		if (DBGP(DBG_BASE)) {
+			connection_buf cib;
+			selectors_buf sb;
+			DBG_log("find_connection: conn "PRI_CONNECTION" has compatible peers: %s [pri: %" PRIu32 "]",
+				pri_connection(c, &cib),
+				str_selectors(&c->spd.this.client, &c->spd.that.client, &sb),
+				prio);
+
+			if (*best == NULL) {
+				connection_buf cib2;
+				DBG_log("find_connection: first OK "PRI_CONNECTION" [pri:%" PRIu32 "]{%p} (child %s)",
+					pri_connection(c, &cib2),
+					prio, c,
+					c->policy_next ?
+						c->policy_next->name :
+						"none");
+			} else {
+				connection_buf cib;
+				connection_buf cib2;
+				DBG_log("find_connection: comparing best "PRI_CONNECTION" [pri:%" PRIu32 "]{%p} (child %s) to "PRI_CONNECTION" [pri:%" PRIu32 "]{%p} (child %s)",
+					pri_connection(*best, &cib),
+					*best_prio,
+					*best,
+					(*best)->policy_next ?
+						(*best)->policy_next->name :
+						"none",
+					pri_connection(c, &cib2),
+					prio, c,
+					c->policy_next ?
+						c->policy_next->name :
+						"none");
+			}
+		}
+
+		if (*best == NULL || prio > *best_prio) {
+			*best = c;
+			*best_sr = sr;
+			*best_prio = prio;
+		}
+	}
+}
+
 /*
  * Find an existing connection for a trapped outbound packet.
  *
@@ -2433,16 +2500,13 @@ struct connection *find_connection_for_clients(struct spd_route **srp,
 					       const ip_endpoint *local_client,
 					       const ip_endpoint *remote_client,
 					       chunk_t csec_label,
-					       struct logger *logger UNUSED)
+					       struct logger *logger)
 {
 	shunk_t sec_label = HUNK_AS_SHUNK(csec_label);
 	passert(endpoint_is_specified(local_client));
 	passert(endpoint_is_specified(remote_client));
 	passert(endpoint_protocol(local_client) == endpoint_protocol(remote_client));
 
-	int local_port = endpoint_hport(local_client);
-	int remote_port = endpoint_hport(remote_client);
-
 	struct connection *best = NULL;
 	policy_prio_t best_prio = BOTTOM_PRIO;
 	struct spd_route *best_sr = NULL;
@@ -2451,72 +2515,24 @@ struct connection *find_connection_for_clients(struct spd_route **srp,
 	dbg("find_connection: looking for policy for connection: %s",
 	    str_endpoints(local_client, remote_client, &eb));
 
-	struct connection *c;
-
-	dbg("FOR_EACH_CONNECTION_... in %s", __func__);
-	for (c = connections; c != NULL; c = c->ac_next) {
-		if (c->kind == CK_GROUP)
+	/*
+	 * Only spd_routes whose remote client contains the peer can
+	 * match; they are returned in the order that the connections
+	 * list would be walked.
+	 */
+	ip_address remote_address = endpoint_address(remote_client);
+	unsigned nr_srs;
+	struct spd_route **srs = spd_routes_by_remote_address(&remote_address, &nr_srs);
+	for (unsigned i = 0; i < nr_srs; i++) {
+		struct spd_route *sr = srs[i];
+		struct connection *c = sr->connection;
+		if (c->kind == CK_GROUP || best == c)
 			continue;
-
-		struct spd_route *sr;
-
-		for (sr = &c->spd; best != c && sr; sr = sr->spd_next) {
-			if ( ((routed(sr->routing) || c->instance_initiation_ok) || sec_label.len != 0) &&
-			    endpoint_in_selector(local_client, &sr->this.client) &&
-			    endpoint_in_selector(remote_client, &sr->that.client)
-#ifdef HAVE_LABELED_IPSEC
-			     && se_label_match(sec_label, sr->this.sec_label, logger)
-#endif
-			     ) {
-				unsigned ipproto = endpoint_protocol(local_client)->ipproto;
-				policy_prio_t prio =
-					(8 * (c->policy_prio + (c->kind == CK_INSTANCE)) +
-					 2 * (sr->this.port == local_port) +
-					 2 * (sr->that.port == remote_port) +
-					 1 * (sr->this.protocol == ipproto));
-
-				if (DBGP(DBG_BASE)) {
-					connection_buf cib;
-					selectors_buf sb;
-					DBG_log("find_connection: conn "PRI_CONNECTION" has compatible peers: %s [pri: %" PRIu32 "]",
-						pri_connection(c, &cib),
-						str_selectors(&c->spd.this.client, &c->spd.that.client, &sb),
-						prio);
-
-					if (best == NULL) {
-						connection_buf cib2;
-						DBG_log("find_connection: first OK "PRI_CONNECTION" [pri:%" PRIu32 "]{%p} (child %s)",
-							pri_connection(c, &cib2),
-							prio, c,
-							c->policy_next ?
-								c->policy_next->name :
-								"none");
-					} else {
-						connection_buf cib;
-						connection_buf cib2;
-						DBG_log("find_connection: comparing best "PRI_CONNECTION" [pri:%" PRIu32 "]{%p} (child %s) to "PRI_CONNECTION" [pri:%" PRIu32 "]{%p} (child %s)",
-							pri_connection(best, &cib),
-							best_prio,
-							best,
-							best->policy_next ?
-								best->policy_next->name :
-								"none",
-							pri_connection(c, &cib2),
-							prio, c,
-							c->policy_next ?
-								c->policy_next->name :
-								"none");
-					}
-				}
-
-				if (best == NULL || prio > best_prio) {
-					best = c;
-					best_sr = sr;
-					best_prio = prio;
-				}
-			}
-		}
+		match_connection_for_clients(c, sr, local_client, remote_client,
+					     sec_label, &best, &best_sr, &best_prio,
+					     logger);
 	}
+	pfreeany(srs);
 
 	if (best != NULL && NEVER_NEGOTIATE(best->policy))
 		best = NULL;
@@ -2596,6 +2612,7 @@ struct connection *oppo_instantiate(struct connection *c,
 
 	if (address_eq(remote_address, &d->spd.that.host_addr))
 		d->spd.that.has_client = false;
+	rehash_connection_spd_routes(d);
 
 	/*
 	 * Adjust routing if something is eclipsing c.
@@ -2820,8 +2837,17 @@ struct connection *route_owner(struct connection *c,
 	enum routing_t best_routing = cur_spd->routing,
 		best_erouting = best_routing;
 
-	dbg("FOR_EACH_CONNECTION_... in %s", __func__);
-	for (struct connection *d = connections; d != NULL; d = d->ac_next) {
+	/*
+	 * Only spd_routes sharing one of c's remote clients can be
+	 * owners; they are returned in the order that the connections
+	 * list would be walked.
+	 */
+	unsigned nr_srds;
+	struct spd_route **srds = spd_routes_by_remote_client(&c->spd, &nr_srds);
+	for (unsigned i = 0; i < nr_srds; i++) {
+		struct spd_route *srd = srds[i];
+		struct connection *d = srd->connection;
+
 		if (!oriented(*d))
 			continue;
 
@@ -2829,7 +2855,7 @@ struct connection *route_owner(struct connection *c,
 		 * consider policies different if the either in or out marks
 		 * differ (after masking)
 		 */
-		if (DBGP(DBG_BASE)) {
+		if (DBGP(DBG_BASE) && (i == 0 || srds[i - 1]->connection != d)) {
 			DBG_log(" conn %s mark %" PRIu32 "/%#08" PRIx32 ", %" PRIu32 "/%#08" PRIx32 " vs",
 				c->name, c->sa_marks.in.val, c->sa_marks.in.mask,
 				c->sa_marks.out.val, c->sa_marks.out.mask);
@@ -2842,43 +2868,40 @@ struct connection *route_owner(struct connection *c,
 		     (c->sa_marks.out.val & c->sa_marks.out.mask) != (d->sa_marks.out.val & d->sa_marks.out.mask) )
 			continue;
 
-		struct spd_route *srd;
+		if (srd->routing == RT_UNROUTED)
+			continue;
 
-		for (srd = &d->spd; srd != NULL; srd = srd->spd_next) {
-			if (srd->routing == RT_UNROUTED)
-				continue;
+		const struct spd_route *src;
 
-			const struct spd_route *src;
-
-			for (src = &c->spd; src != NULL; src = src->spd_next) {
-				if (src == srd)
-					continue;
+		for (src = &c->spd; src != NULL; src = src->spd_next) {
+			if (src == srd)
+				continue;
 
-				if (!selector_subnet_eq(&src->that.client, &srd->that.client) ||
-				    src->that.protocol != srd->that.protocol ||
-				    src->that.port != srd->that.port ||
-				    !sameaddr(&src->this.host_addr,
-						&srd->this.host_addr))
-					continue;
+			if (!selector_subnet_eq(&src->that.client, &srd->that.client) ||
+			    src->that.protocol != srd->that.protocol ||
+			    src->that.port != srd->that.port ||
+			    !sameaddr(&src->this.host_addr,
+					&srd->this.host_addr))
+				continue;
 
-				if (srd->routing > best_routing) {
-					best_ro = d;
-					best_sr = srd;
-					best_routing = srd->routing;
-				}
+			if (srd->routing > best_routing) {
+				best_ro = d;
+				best_sr = srd;
+				best_routing = srd->routing;
+			}
 
-				if (selector_subnet_eq(&src->this.client, &srd->this.client) &&
-				    src->this.protocol == srd->this.protocol &&
-				    src->this.port == srd->this.port &&
-				    srd->routing > best_erouting)
-				{
-					best_ero = d;
-					best_esr = srd;
-					best_erouting = srd->routing;
-				}
+			if (selector_subnet_eq(&src->this.client, &srd->this.client) &&
+			    src->this.protocol == srd->this.protocol &&
+			    src->this.port == srd->this.port &&
+			    srd->routing > best_erouting)
+			{
+				best_ero = d;
+				best_esr = srd;
+				best_erouting = srd->routing;
 			}
 		}
 	}
+	pfreeany(srds);
 
 	LSWDBGP(DBG_BASE, buf) {
 		connection_buf cib;
@@ -3049,7 +3072,12 @@ struct connection *refine_host_connection(const struct state *st,
 	chunk_t peer_ca = get_peer_ca(&st->st_remote_certs.pubkey_db, peer_id);
 
 	if (hunk_isempty(peer_ca)) {
-		peer_ca = get_peer_ca(&pluto_pubkeys, peer_id);
+		unsigned nr_keys;
+		struct pubkey **keys = find_pubkey_db_keys(peer_id, &pubkey_type_rsa, &nr_keys);
+		if (nr_keys > 0) {
+			peer_ca = keys[0]->issuer;
+		}
+		pfreeany(keys);
 	}
 
 	{
@@ -4222,50 +4250,99 @@ void show_one_connection(struct show *s,
 	show_kernel_alg_connection(s, c, instance);
 }
 
-void show_connections_status(struct show *s)
+/*
+ * Collect the serial numbers of all connections, sorted by name when
+ * SORTED, ready to be shown one at a time.
+ *
+ * Returns NULL when there are no connections.  Caller is responsible
+ * for freeing the array.
+ */
+co_serial_t *connection_status_serials(bool sorted, unsigned *count,
+				       unsigned *active)
 {
-	int count = 0;
-	int active = 0;
 	struct connection *c;
 
-	show_separator(s);
-	show_comment(s, "Connection list:");
-	show_separator(s);
-
+	*count = 0;
+	*active = 0;
 	dbg("FOR_EACH_CONNECTION_... in %s", __func__);
 	for (c = connections; c != NULL; c = c->ac_next) {
-		count++;
+		(*count)++;
 		if (c->spd.routing == RT_ROUTED_TUNNEL)
-			active++;
+			(*active)++;
 	}
 
-	if (count != 0) {
-		/* make an array of connections, sort it, and report it */
+	if (*count == 0) {
+		return NULL;
+	}
 
-		struct connection **array =
-			alloc_bytes(sizeof(struct connection *) * count,
-				"connection array");
-		int i = 0;
+	/* make an array of connections, sort it, and record it */
+	struct connection **array = alloc_things(struct connection *, *count,
+						 "connection array");
+	unsigned i = 0;
+	dbg("FOR_EACH_CONNECTION_... in %s", __func__);
+	for (c = connections; c != NULL; c = c->ac_next)
+		array[i++] = c;
 
-		dbg("FOR_EACH_CONNECTION_... in %s", __func__);
-		for (c = connections; c != NULL; c = c->ac_next)
-			array[i++] = c;
+	if (sorted) {
+		qsort(array, *count, sizeof(struct connection *),
+		      connection_compare_qsort);
+	}
 
-		/* sort it! */
-		qsort(array, count, sizeof(struct connection *),
-			connection_compare_qsort);
+	co_serial_t *serials = alloc_things(co_serial_t, *count,
+					    "connection serials");
+	for (i = 0; i < *count; i++)
+		serials[i] = array[i]->serialno;
 
-		for (i = 0; i < count; i++)
-			show_one_connection(s, array[i]);
+	pfree(array);
+	return serials;
+}
 
-		pfree(array);
-		show_separator(s);
+/*
+ * Show the connection, if it still exists.
+ */
+void show_connection_status(struct show *s, co_serial_t serialno)
+{
+	struct connection *c = connection_by_serialno(serialno);
+	if (c != NULL) {
+		show_one_connection(s, c);
 	}
+}
 
-	show_comment(s, "Total IPsec connections: loaded %d, active %d",
+void show_connections_status_head(struct show *s)
+{
+	show_separator(s);
+	show_comment(s, "Connection list:");
+	show_separator(s);
+}
+
+void show_connections_status_tail(struct show *s, unsigned count,
+				  unsigned active)
+{
+	if (count != 0) {
+		show_separator(s);
+	}
+	show_comment(s, "Total IPsec connections: loaded %u, active %u",
 		     count, active);
 }
 
+void show_connections_status(struct show *s)
+{
+	unsigned count;
+	unsigned active;
+
+	show_connections_status_head(s);
+
+	co_serial_t *serials = connection_status_serials(true/*sorted*/,
+							 &count, &active);
+	if (serials != NULL) {
+		for (unsigned i = 0; i < count; i++)
+			show_connection_status(s, serials[i]);
+		pfree(serials);
+	}
+
+	show_connections_status_tail(s, count, active);
+}
+
 /*
  * Delete a connection if
  * - it is an instance and it is no longer in use.
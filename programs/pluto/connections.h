@@ -246,6 +246,11 @@ struct spd_route {
 	so_serial_t eroute_owner;
 	enum routing_t routing; /* level of routing in place */
 	reqid_t reqid;
+	/* indexed by that.client; see connection_db.c */
+	struct connection *connection;
+	struct list_entry remote_client_entry;
+	ip_address remote_client_prefix;
+	unsigned remote_client_bits;
 };
 
 struct sa_mark {
@@ -417,6 +422,10 @@ struct connection {
 
 	struct list_entry serialno_list_entry;
 	struct list_entry hash_table_entries[CONNECTION_HASH_TABLES_ROOF];
+	/* while on the connections list; see connection_db.c */
+	struct list_entry name_hash_entry;
+	struct connection_alias *aliases;	/* [nr_aliases] */
+	unsigned nr_aliases;
 };
 
 #define oriented(c) ((c).interface != NULL)
@@ -561,6 +570,14 @@ extern struct connection *eclipsed(const struct connection *c, struct spd_route
 extern void show_one_connection(struct show *s,
 				const struct connection *c);
 extern void show_connections_status(struct show *s);
+
+/* piecewise, so that status can be streamed a few connections at a time */
+extern co_serial_t *connection_status_serials(bool sorted, unsigned *count,
+					      unsigned *active);
+extern void show_connection_status(struct show *s, co_serial_t serialno);
+extern void show_connections_status_head(struct show *s);
+extern void show_connections_status_tail(struct show *s, unsigned count,
+					 unsigned active);
 extern int connection_compare(const struct connection *ca,
 			      const struct connection *cb);
 
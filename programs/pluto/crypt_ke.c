@@ -31,7 +31,7 @@
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <signal.h>
-
+#include <pthread.h>
 
 #include "sysdep.h"
 #include "constants.h"
@@ -53,6 +53,233 @@
 #include "ike_alg.h"
 #include "crypt_dh.h"
 #include "crypt_ke.h"
+#include "server.h"		/* for pluto_dh_pool_size et.al. */
+#include "show.h"
+
+/*
+ * Pools of pre-computed KE and nonce pairs, one per DH group.
+ *
+ * A pool is created the first time its group is asked for (see
+ * dh-pool-size=).  Helper threads, when they run out of jobs, top the
+ * pools up; the main thread takes pairs out and, when a pool falls
+ * to dh-pool-low-water=, pokes an idle helper.  Each pair is handed
+ * out exactly once and its slot is wiped.
+ */
+
+#define KE_POOL_GROUPS 8
+
+struct ke_and_nonce {
+	struct dh_local_secret *local_secret;
+	chunk_t nonce;
+};
+
+struct ke_pool {
+	const struct dh_desc *dh;
+	unsigned count;		/* pairs ready in .pairs[] */
+	unsigned computing;	/* slots reserved by a helper */
+	struct ke_and_nonce *pairs;
+};
+
+static pthread_mutex_t ke_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ke_pool ke_pools[KE_POOL_GROUPS];
+static unsigned nr_ke_pools;
+static bool ke_pool_poked;
+
+static struct {
+	unsigned long taken;
+	unsigned long empty;
+	unsigned long computed;
+} ke_pool_stats;
+
+static unsigned ke_pool_low_water(void)
+{
+	return (pluto_dh_pool_low_water > 0 ? min(pluto_dh_pool_low_water, pluto_dh_pool_size) :
+		pluto_dh_pool_size / 2);
+}
+
+static void compute_ke_and_nonce_pair(const struct dh_desc *dh,
+				      struct ke_and_nonce *pair,
+				      struct logger *logger)
+{
+	if (dh != NULL) {
+		pair->local_secret = calc_dh_local_secret(dh, logger);
+		if (DBGP(DBG_CRYPT)) {
+			DBG_log("NSS: Local DH %s secret (pointer): %p",
+				dh->common.fqn, pair->local_secret);
+		}
+	}
+	pair->nonce = alloc_chunk(DEFAULT_NONCE_SIZE, "nonce");
+	fill_rnd_chunk(pair->nonce);
+	if (DBGP(DBG_CRYPT)) {
+		DBG_dump_hunk("Generated nonce:", pair->nonce);
+	}
+}
+
+static void wipe_ke_and_nonce_pair(struct ke_and_nonce *pair)
+{
+	dh_local_secret_delref(&pair->local_secret, HERE);
+	if (pair->nonce.ptr != NULL) {
+		memset(pair->nonce.ptr, 0, pair->nonce.len);
+	}
+	free_chunk_content(&pair->nonce);
+}
+
+/*
+ * MAIN THREAD: take a pre-computed pair for DH; false when the pool
+ * is empty (or disabled).
+ */
+
+static bool take_ke_and_nonce(const struct dh_desc *dh,
+			      struct ke_and_nonce *pair)
+{
+	if (pluto_dh_pool_size == 0 || dh == NULL) {
+		return false;
+	}
+
+	bool taken = false;
+	bool poke = false;
+	pthread_mutex_lock(&ke_pool_mutex);
+	{
+		struct ke_pool *pool = NULL;
+		for (unsigned i = 0; i < nr_ke_pools; i++) {
+			if (ke_pools[i].dh == dh) {
+				pool = &ke_pools[i];
+				break;
+			}
+		}
+		if (pool == NULL && nr_ke_pools < elemsof(ke_pools)) {
+			pool = &ke_pools[nr_ke_pools++];
+			pool->dh = dh;
+			pool->pairs = alloc_things(struct ke_and_nonce, pluto_dh_pool_size,
+						   "KE and nonce pool");
+			dbg("KE pool: adding pool for %s", dh->common.fqn);
+		}
+		if (pool != NULL && pool->count > 0) {
+			struct ke_and_nonce *slot = &pool->pairs[--pool->count];
+			*pair = *slot;
+			zero(slot);
+			ke_pool_stats.taken++;
+			taken = true;
+		} else {
+			ke_pool_stats.empty++;
+		}
+		if (pool != NULL && pool->count + pool->computing <= ke_pool_low_water() &&
+		    !ke_pool_poked) {
+			ke_pool_poked = poke = true;
+		}
+	}
+	pthread_mutex_unlock(&ke_pool_mutex);
+
+	if (poke) {
+		poke_idle_helper();
+	}
+	return taken;
+}
+
+/*
+ * HELPER THREAD: add one pair to the emptiest pool; false when they
+ * are all full.
+ */
+
+bool refill_ke_and_nonce_pools(struct logger *logger)
+{
+	if (pluto_dh_pool_size == 0) {
+		return false;
+	}
+
+	struct ke_pool *pool = NULL;
+	const struct dh_desc *dh = NULL;
+	pthread_mutex_lock(&ke_pool_mutex);
+	{
+		ke_pool_poked = false;
+		for (unsigned i = 0; i < nr_ke_pools; i++) {
+			struct ke_pool *p = &ke_pools[i];
+			unsigned n = p->count + p->computing;
+			if (n < pluto_dh_pool_size &&
+			    (pool == NULL || n < pool->count + pool->computing)) {
+				pool = p;
+			}
+		}
+		if (pool != NULL) {
+			/* reserve the slot */
+			pool->computing++;
+			dh = pool->dh;
+		}
+	}
+	pthread_mutex_unlock(&ke_pool_mutex);
+
+	if (pool == NULL) {
+		return false;
+	}
+
+	struct ke_and_nonce pair = {0};
+	compute_ke_and_nonce_pair(dh, &pair, logger);
+
+	pthread_mutex_lock(&ke_pool_mutex);
+	{
+		pool->computing--;
+		pool->pairs[pool->count++] = pair;
+		ke_pool_stats.computed++;
+	}
+	pthread_mutex_unlock(&ke_pool_mutex);
+	return true;
+}
+
+void free_ke_and_nonce_pools(void)
+{
+	pthread_mutex_lock(&ke_pool_mutex);
+	{
+		for (unsigned i = 0; i < nr_ke_pools; i++) {
+			struct ke_pool *pool = &ke_pools[i];
+			pexpect(pool->computing == 0);
+			while (pool->count > 0) {
+				wipe_ke_and_nonce_pair(&pool->pairs[--pool->count]);
+			}
+			pfreeany(pool->pairs);
+			zero(pool);
+		}
+		nr_ke_pools = 0;
+	}
+	pthread_mutex_unlock(&ke_pool_mutex);
+}
+
+void show_ke_and_nonce_pool_stats(struct show *s)
+{
+	show_raw(s, "total.dh.pool.taken=%lu", ke_pool_stats.taken);
+	show_raw(s, "total.dh.pool.empty=%lu", ke_pool_stats.empty);
+	show_raw(s, "total.dh.pool.computed=%lu", ke_pool_stats.computed);
+}
+
+void clear_ke_and_nonce_pool_stats(void)
+{
+	pthread_mutex_lock(&ke_pool_mutex);
+	zero(&ke_pool_stats);
+	pthread_mutex_unlock(&ke_pool_mutex);
+}
+
+void show_ke_and_nonce_pool_status(struct show *s)
+{
+	if (pluto_dh_pool_size == 0) {
+		return;
+	}
+	SHOW_JAMBUF(RC_COMMENT, s, buf) {
+		jam(buf, "dh-pool: size=%u low-water=%u:",
+		    pluto_dh_pool_size, ke_pool_low_water());
+		pthread_mutex_lock(&ke_pool_mutex);
+		{
+			const char *sep = " ";
+			for (unsigned i = 0; i < nr_ke_pools; i++) {
+				jam(buf, "%s%s=%u", sep, ke_pools[i].dh->common.fqn,
+				    ke_pools[i].count);
+				sep = ", ";
+			}
+			if (nr_ke_pools == 0) {
+				jam(buf, " no groups used yet");
+			}
+		}
+		pthread_mutex_unlock(&ke_pool_mutex);
+	}
+}
 
 struct task {
 	const struct dh_desc *dh;
@@ -65,18 +292,14 @@ static void compute_ke_and_nonce(struct logger *logger,
 				 struct task *task,
 				 int thread_unused UNUSED)
 {
-	if (task->dh != NULL) {
-		task->local_secret = calc_dh_local_secret(task->dh, logger);
-		if (DBGP(DBG_CRYPT)) {
-			DBG_log("NSS: Local DH %s secret (pointer): %p",
-				task->dh->common.fqn, task->local_secret);
-		}
-	}
-	task->nonce = alloc_chunk(DEFAULT_NONCE_SIZE, "nonce");
-	fill_rnd_chunk(task->nonce);
-	if (DBGP(DBG_CRYPT)) {
-		DBG_dump_hunk("Generated nonce:", task->nonce);
+	if (task->nonce.ptr != NULL) {
+		/* taken from the pool */
+		return;
 	}
+	struct ke_and_nonce pair = {0};
+	compute_ke_and_nonce_pair(task->dh, &pair, logger);
+	task->local_secret = pair.local_secret;
+	task->nonce = pair.nonce;
 }
 
 static void cleanup_ke_and_nonce(struct task **task)
@@ -109,9 +332,31 @@ void submit_ke_and_nonce(struct state *st, const struct dh_desc *dh,
 	struct task *task = alloc_thing(struct task, "dh");
 	task->dh = dh;
 	task->cb = cb;
+	/* saves the helper the work, not the round trip */
+	struct ke_and_nonce pair;
+	if (take_ke_and_nonce(dh, &pair)) {
+		task->local_secret = pair.local_secret;
+		task->nonce = pair.nonce;
+	}
 	submit_task(st->st_logger, st, task, &ke_and_nonce_handler, name);
 }
 
+stf_status pooled_ke_and_nonce(struct state *st, struct msg_digest *md,
+			       const struct dh_desc *dh,
+			       ke_and_nonce_cb *cb, const char *name)
+{
+	struct ke_and_nonce pair;
+	if (!take_ke_and_nonce(dh, &pair)) {
+		submit_ke_and_nonce(st, dh, cb, name);
+		return STF_SUSPEND;
+	}
+	dbg("%s: using pre-computed %s KE and nonce", name, dh->common.fqn);
+	stf_status status = cb(st, md, pair.local_secret, &pair.nonce);
+	/* the callback takes its own reference; and steals the nonce */
+	wipe_ke_and_nonce_pair(&pair);
+	return status;
+}
+
 /*
  * Process KE values.
  */
@@ -27,6 +27,9 @@
 #ifndef CRYPT_KE_H
 #define CRYPT_KE_H
 
+struct show;
+struct logger;
+
 typedef stf_status (ke_and_nonce_cb)(struct state *st, struct msg_digest *md,
 				     struct dh_local_secret *local_secret,
 				     chunk_t *nonce/*steal*/);
@@ -38,6 +41,21 @@ typedef stf_status (ke_and_nonce_cb)(struct state *st, struct msg_digest *md,
 void submit_ke_and_nonce(struct state *st, const struct dh_desc *dh,
 			 ke_and_nonce_cb *cb, const char *name);
 
+/*
+ * When the dh-pool-size= pool for DH has a pre-computed pair, call CB
+ * directly and return its status; otherwise submit_ke_and_nonce()
+ * and return STF_SUSPEND.
+ */
+stf_status pooled_ke_and_nonce(struct state *st, struct msg_digest *md,
+			       const struct dh_desc *dh,
+			       ke_and_nonce_cb *cb, const char *name);
+
+bool refill_ke_and_nonce_pools(struct logger *logger); /* helper thread */
+void free_ke_and_nonce_pools(void);
+void show_ke_and_nonce_pool_status(struct show *s);
+void show_ke_and_nonce_pool_stats(struct show *s);
+void clear_ke_and_nonce_pool_stats(void);
+
 /*
  * KE and NONCE
  */
@@ -71,6 +71,7 @@
 #include "ikev2_send.h"
 #include "iface.h"
 #include "impair_message.h"
+#include "ikev2_cookie.h"
 
 /*
  * read the message.
@@ -99,6 +100,18 @@ static enum iface_status read_message(const struct iface_endpoint *ifp,
 		return status;
 	}
 
+	/*
+	 * Under DDOS, or from a source over ddos-source-rate=,
+	 * cookie-less IKE_SA_INIT requests are answered (or dropped)
+	 * before a message digest is created.
+	 */
+	if (v2_stateless_cookie_response(ifp, &packet.sender,
+					 shunk2(packet.ptr, packet.len),
+					 logger)) {
+		pstats_ike_in_bytes += packet.len;
+		return IFACE_IGNORE;
+	}
+
 	/*
 	 * Create the real message digest; and set up md->packet_pbs
 	 * to describe it.
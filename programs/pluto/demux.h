@@ -151,6 +151,7 @@ struct msg_digest {
 	bool event_already_set;			/* (v1) */
 	bool fake_clone;			/* is this a fake (clone) message */
 	bool fake_dne;				/* created as part of fake_md() */
+	bool v2_sk_decrypted;			/* (v2) SK/SKF decrypted by a helper */
 
 	/*
 	 * Note that .pbs[] is indexed using either enum v1_pbs or
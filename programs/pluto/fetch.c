@@ -42,11 +42,13 @@
 #include "secrets.h"
 #include "nss_err.h"
 #include "nss_crl_import.h"
+#include "nss_cert_verify.h"	/* for flush_cert_verify_cache() */
 #include "nss_err.h"
 #include "keys.h"
 #include "crl_queue.h"
 #include "server.h"
 #include "pluto_shutdown.h"		/* for exiting_pluto */
+#include "pubkey_db.h"
 
 #define FETCH_CMD_TIMEOUT       5       /* seconds */
 
@@ -393,6 +395,7 @@ static bool insert_crl_nss(chunk_t *blob, const chunk_t crl_uri, struct logger *
 				    nss_err_str((PRInt32)r));
 		} else {
 			dbg("CRL imported");
+			flush_cert_verify_cache("CRL imported");
 			ret = true;
 		}
 		pfreeany(uri_str);
@@ -498,8 +501,9 @@ void check_crls(struct logger *logger)
 
 	/* add the pubkeys distribution points to fetch list */
 
-	for (struct pubkey_list *pkl = pluto_pubkeys; pkl != NULL; pkl = pkl->next) {
-		struct pubkey *key = pkl->key;
+	struct pubkey_db_entry *e;
+	FOR_EACH_PUBKEY_DB_ENTRY(e) {
+		struct pubkey *key = e->key;
 		if (key != NULL) {
 			SECItem issuer = same_chunk_as_dercert_secitem(key->issuer);
 			requests = crl_fetch_request(&issuer, NULL,
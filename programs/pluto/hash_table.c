@@ -14,21 +14,134 @@
  */
 
 #include <stdint.h>
+#include <ctype.h>		/* for isalnum() */
+#include <limits.h>		/* for ULONG_MAX */
 
 
 #include "defs.h"
 #include "hash_table.h"
+#include "log.h"
+#include "show.h"
 
 const hash_t zero_hash = { 0 };
 
-void init_hash_table(struct hash_table *table)
+/*
+ * Grow once there are, on average, more than this many entries per
+ * slot; and then move this many old slots across per operation.
+ */
+#define HASH_TABLE_MAX_LOAD 2
+#define HASH_TABLE_MOVE_SLOTS 4
+
+static struct hash_table *hash_tables;
+
+static void init_slots(struct hash_table *table,
+		       struct list_head *slots, unsigned long nr_slots)
 {
-	for (unsigned i = 0; i < table->nr_slots; i++) {
-		struct list_head *slot = &table->slots[i];
+	for (unsigned long i = 0; i < nr_slots; i++) {
+		struct list_head *slot = &slots[i];
 		*slot = (struct list_head) INIT_LIST_HEAD(slot, &table->info);
 	}
 }
 
+void init_hash_table(struct hash_table *table)
+{
+	init_slots(table, table->slots, table->nr_slots);
+	table->initial_slots = table->slots;
+	table->next_table = hash_tables;
+	hash_tables = table;
+}
+
+static void free_old_slots(struct hash_table *table)
+{
+	if (table->old_slots != table->initial_slots) {
+		pfree(table->old_slots);
+	}
+	table->old_slots = NULL;
+	table->nr_old_slots = 0;
+	table->nr_old_slots_moved = 0;
+}
+
+void free_hash_tables(void)
+{
+	for (struct hash_table *table = hash_tables;
+	     table != NULL; table = table->next_table) {
+		if (table->old_slots != NULL) {
+			free_old_slots(table);
+		}
+		if (table->slots != table->initial_slots) {
+			pfree(table->slots);
+			table->slots = table->initial_slots;
+		}
+	}
+	hash_tables = NULL;
+}
+
+/*
+ * Move all the entries in an old slot to the new slots.
+ *
+ * The entries are moved oldest first so that entries with the same
+ * hash keep their relative order.
+ */
+
+static void move_old_slot(struct hash_table *table, struct list_head *old_slot)
+{
+	void *data;
+	FOR_EACH_LIST_ENTRY_OLD2NEW(old_slot, data) {
+		struct list_entry *entry = table->entry(data);
+		remove_list_entry(entry);
+		hash_t hash = table->hasher(data);
+		insert_list_entry(&table->slots[hash.hash % table->nr_slots], entry);
+	}
+}
+
+/*
+ * Make progress moving the old slots across; when HASH is non-NULL
+ * also make certain that all its entries are in the new slots.
+ */
+
+static void grow_hash_table_step(struct hash_table *table, const hash_t *hash,
+				 unsigned long nr_moves)
+{
+	if (table->old_slots == NULL) {
+		return;
+	}
+	if (hash != NULL) {
+		move_old_slot(table, &table->old_slots[hash->hash % table->nr_old_slots]);
+	}
+	for (unsigned long n = 0; n < nr_moves &&
+		     table->nr_old_slots_moved < table->nr_old_slots; n++) {
+		move_old_slot(table, &table->old_slots[table->nr_old_slots_moved++]);
+	}
+	if (table->nr_old_slots_moved == table->nr_old_slots) {
+		dbg("%s: finished growing from %lu to %lu slots",
+		    table->info.name, table->nr_old_slots, table->nr_slots);
+		free_old_slots(table);
+	}
+}
+
+void finish_hash_table_growth(struct hash_table *table)
+{
+	grow_hash_table_step(table, NULL, ULONG_MAX);
+}
+
+static void maybe_grow_hash_table(struct hash_table *table)
+{
+	if (table->nr_entries <= (long)(table->nr_slots * HASH_TABLE_MAX_LOAD)) {
+		return;
+	}
+	/* still moving the last lot? */
+	finish_hash_table_growth(table);
+	unsigned long nr_slots = table->nr_slots * 2 + 1;
+	dbg("%s: growing from %lu to %lu slots for %ld entries",
+	    table->info.name, table->nr_slots, nr_slots, table->nr_entries);
+	table->old_slots = table->slots;
+	table->nr_old_slots = table->nr_slots;
+	table->nr_old_slots_moved = 0;
+	table->slots = alloc_things(struct list_head, nr_slots, table->info.name);
+	table->nr_slots = nr_slots;
+	init_slots(table, table->slots, table->nr_slots);
+}
+
 hash_t hash_table_hasher(shunk_t data, hash_t hash)
 {
 	/*
@@ -43,8 +156,21 @@ hash_t hash_table_hasher(shunk_t data, hash_t hash)
 	return hash;
 }
 
+/*
+ * While growing, an old slot that still has entries holds every
+ * entry for its hashes: add_hash_table_entry() empties the old slot
+ * before adding to the new slots.  Hence a lookup can pick the
+ * bucket without moving anything.
+ */
+
 struct list_head *hash_table_bucket(struct hash_table *table, hash_t hash)
 {
+	if (table->old_slots != NULL) {
+		struct list_head *old_slot = &table->old_slots[hash.hash % table->nr_old_slots];
+		if (old_slot->head.newer != &old_slot->head) {
+			return old_slot;
+		}
+	}
 	return &table->slots[hash.hash % table->nr_slots];
 }
 
@@ -52,10 +178,11 @@ void add_hash_table_entry(struct hash_table *table, void *data)
 {
 	struct list_entry *entry = table->entry(data);
 	*entry = list_entry(&table->info, data);
-	hash_t hash = table->hasher(data);
-	struct list_head *bucket = hash_table_bucket(table, hash);
 	table->nr_entries++;
-	insert_list_entry(bucket, entry);
+	maybe_grow_hash_table(table);
+	hash_t hash = table->hasher(data);
+	grow_hash_table_step(table, &hash, HASH_TABLE_MOVE_SLOTS);
+	insert_list_entry(&table->slots[hash.hash % table->nr_slots], entry);
 }
 
 void del_hash_table_entry(struct hash_table *table, void *data)
@@ -63,6 +190,10 @@ void del_hash_table_entry(struct hash_table *table, void *data)
 	struct list_entry *entry = table->entry(data);
 	table->nr_entries--;
 	remove_list_entry(entry);
+	/*
+	 * Don't move slots here: a caller walking a bucket returned
+	 * by hash_table_bucket() may be deleting the entry it found.
+	 */
 }
 
 void rehash_table_entry(struct hash_table *table, void *data)
@@ -70,3 +201,56 @@ void rehash_table_entry(struct hash_table *table, void *data)
 	del_hash_table_entry(table, data);
 	add_hash_table_entry(table, data);
 }
+
+/*
+ * Chain lengths 0, 1, 2, 3, 4-7, 8-15, 16+.
+ */
+
+static unsigned histogram_bin(unsigned long len)
+{
+	unsigned bin = 0;
+	while (len > 3 && bin < 3) {
+		len >>= 1;
+		bin++;
+	}
+	return (bin == 0 ? len : 3 + bin);
+}
+
+void show_hash_table_stats(struct show *s)
+{
+	static const char *const bins[] = {
+		"0", "1", "2", "3", "4-7", "8-15", "16+",
+	};
+	for (struct hash_table *table = hash_tables;
+	     table != NULL; table = table->next_table) {
+		if (table->nr_entries == 0) {
+			continue;
+		}
+		unsigned long histogram[elemsof(bins)] = {0};
+		unsigned long longest = 0;
+		FOR_EACH_HASH_TABLE_BUCKET(table, bucket) {
+			unsigned long len = 0;
+			void *data;
+			FOR_EACH_LIST_ENTRY_OLD2NEW(bucket, data) {
+				len++;
+			}
+			histogram[histogram_bin(len)]++;
+			longest = (len > longest ? len : longest);
+		}
+		/* "IKE SPI[ir] table" -> IKE_SPI_ir__table */
+		char name[64];
+		size_t n;
+		for (n = 0; table->info.name[n] != '\0' && n < sizeof(name) - 1; n++) {
+			char c = table->info.name[n];
+			name[n] = (isalnum((unsigned char)c) || c == '-' ? c : '_');
+		}
+		name[n] = '\0';
+		show_raw(s, "current.hash.%s.entries=%ld", name, table->nr_entries);
+		show_raw(s, "current.hash.%s.slots=%lu", name, table->nr_slots);
+		show_raw(s, "current.hash.%s.longest=%lu", name, longest);
+		for (unsigned b = 0; b < elemsof(bins); b++) {
+			show_raw(s, "current.hash.%s.chain.%s=%lu",
+				 name, bins[b], histogram[b]);
+		}
+	}
+}
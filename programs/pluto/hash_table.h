@@ -19,8 +19,16 @@
 #include "list_entry.h"
 #include "shunk.h"		/* has constant ptr */
 
+struct show;
+
 /*
  * Generic hash table.
+ *
+ * The table starts out using the (typically static) SLOTS[NR_SLOTS]
+ * and then grows as NR_ENTRIES increases.  Growth is incremental:
+ * the old slots are kept and their entries are moved across a few
+ * slots at a time by each subsequent add, so no single insert has to
+ * rehash everything.  Lookups and deletes don't move entries.
  */
 
 typedef struct { unsigned hash; } hash_t;
@@ -33,9 +41,21 @@ struct hash_table {
 	long nr_entries; /* approx? */
 	unsigned long nr_slots;
 	struct list_head *slots;
+	/* private: growth */
+	struct list_head *initial_slots;	/* not allocated */
+	struct list_head *old_slots;		/* being emptied */
+	unsigned long nr_old_slots;
+	unsigned long nr_old_slots_moved;	/* [0..moved) are empty */
+	struct hash_table *next_table;		/* all tables */
 };
 
 void init_hash_table(struct hash_table *table);
+void free_hash_tables(void);
+
+/*
+ * Bucket length histograms, for whack --globalstatus.
+ */
+void show_hash_table_stats(struct show *s);
 
 hash_t hash_table_hasher(shunk_t data, hash_t hash);
 
@@ -55,9 +75,29 @@ void rehash_table_entry(struct hash_table *table, void *data);
  * Use this, in conjunction with FOR_EACH_LIST_ENTRY, when searching.
  *
  * Don't forget to also check that the object itself matches - more
- * than one hash can map to the same list of entries.
+ * than one hash can map to the same list of entries.  While the
+ * table is growing the list can be an old slot, so don't add to (or
+ * rehash in) the table while iterating over it; deleting is fine.
  */
 
 struct list_head *hash_table_bucket(struct hash_table *table, hash_t hash);
 
+/*
+ * Iterate over every bucket, for code that needs to visit all
+ * entries.  Any growth in progress is first completed so that no
+ * entries are hiding in the old slots.
+ *
+ * The body may delete entries but must not add any: an add can start
+ * growing the table, moving entries into buckets already visited.
+ * Collect what needs adding and do it after the walk.
+ */
+
+void finish_hash_table_growth(struct hash_table *table);
+
+#define FOR_EACH_HASH_TABLE_BUCKET(TABLE, BUCKET)			\
+	for (unsigned long i_ = (finish_hash_table_growth(TABLE), 0);	\
+	     i_ < (TABLE)->nr_slots; i_++)				\
+		for (struct list_head *BUCKET = &(TABLE)->slots[i_];	\
+		     BUCKET != NULL; BUCKET = NULL)
+
 #endif
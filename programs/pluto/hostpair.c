@@ -43,6 +43,7 @@
 
 #include "defs.h"
 #include "connections.h"        /* needs id.h */
+#include "connection_db.h"
 #include "pending.h"
 #include "foodgroups.h"
 #include "packet.h"
@@ -462,6 +463,7 @@ void update_host_pairs(struct connection *c)
 			 */
 			if (!d->spd.that.has_client) {
 				d->spd.that.client = selector_from_address(&new_addr);
+				rehash_connection_spd_routes(d);
 			}
 
 			d->spd.that.host_addr = new_addr;
@@ -520,8 +522,14 @@ void check_orientations(void)
 		if (i->ip_dev->ifd_change != IFD_ADD) {
 			continue;
 		}
-		for (unsigned u = 0; u < host_pairs.nr_slots; u++) {
-			struct list_head *bucket = &host_pairs.slots[u];
+		/*
+		 * Collect the host pairs first:
+		 * connect_to_host_pair() can add host pairs and
+		 * adding to the table during the walk isn't allowed.
+		 */
+		struct host_pair **hps = NULL;
+		unsigned nr_hps = 0;
+		FOR_EACH_HASH_TABLE_BUCKET(&host_pairs, bucket) {
 			struct host_pair *hp = NULL;
 			FOR_EACH_LIST_ENTRY_NEW2OLD(bucket, hp) {
 				/*
@@ -530,38 +538,40 @@ void check_orientations(void)
 				 */
 				if (sameaddr(&hp->remote,
 					     &i->ip_dev->id_address)) {
-					/*
-					 * bad news: the whole chain
-					 * of connections hanging off
-					 * this host pair has both
-					 * sides matching an
-					 * interface.  We'll get rid
-					 * of them, using orient and
-					 * connect_to_host_pair.
-					 */
-					struct connection *c =
-						hp->connections;
-					hp->connections = NULL;
-					while (c != NULL) {
-						struct connection *nxt =
-							c->hp_next;
-						c->interface = NULL;
-						c->host_pair = NULL;
-						c->hp_next = NULL;
-						orient(c);
-						connect_to_host_pair(c);
-						c = nxt;
-					}
-					/*
-					 * XXX: is this ever not the
-					 * case?
-					 */
-					if (hp->connections == NULL) {
-						free_host_pair(&hp, HERE);
-					}
+					realloc_things(hps, nr_hps, nr_hps + 1,
+						       "double-oriented host pairs");
+					hps[nr_hps++] = hp;
 				}
 			}
 		}
+		for (unsigned n = 0; n < nr_hps; n++) {
+			struct host_pair *hp = hps[n];
+			/*
+			 * bad news: the whole chain of connections
+			 * hanging off this host pair has both sides
+			 * matching an interface.  We'll get rid of
+			 * them, using orient and
+			 * connect_to_host_pair.
+			 */
+			struct connection *c = hp->connections;
+			hp->connections = NULL;
+			while (c != NULL) {
+				struct connection *nxt = c->hp_next;
+				c->interface = NULL;
+				c->host_pair = NULL;
+				c->hp_next = NULL;
+				orient(c);
+				connect_to_host_pair(c);
+				c = nxt;
+			}
+			/*
+			 * XXX: is this ever not the case?
+			 */
+			if (hp->connections == NULL) {
+				free_host_pair(&hp, HERE);
+			}
+		}
+		pfreeany(hps);
 	}
 }
 
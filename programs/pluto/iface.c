@@ -42,6 +42,7 @@
 #include "ip_info.h"
 #include "ip_sockaddr.h"
 #include "ip_encap.h"
+#include "send.h"			/* for free_iface_send_queue() */
 
 struct iface_endpoint  *interfaces = NULL;  /* public interfaces */
 
@@ -196,6 +197,8 @@ void free_ifaces(struct logger *logger)
 
 void free_any_iface_endpoint(struct iface_endpoint **ifp)
 {
+	/* send, and release, any queued messages */
+	free_iface_send_queue(*ifp);
 	/* generic stuff */
 	(*ifp)->io->cleanup(*ifp);
 	release_iface_dev(&(*ifp)->ip_dev);
@@ -509,5 +512,8 @@ void show_ifaces_status(struct show *s)
 			     p->ip_dev->id_rname,
 			     p->protocol->name,
 			     str_endpoint(&p->local_endpoint, &b));
+		if (p->io->show_status != NULL) {
+			p->io->show_status(s, p);
+		}
 	}
 }
@@ -39,6 +39,12 @@ struct iface_packet {
 	struct logger *logger; /*global*/
 };
 
+struct iface_outgoing_packet {
+	const uint8_t *ptr;
+	size_t len;
+	ip_endpoint remote_endpoint;
+};
+
 enum iface_status {
 	IFACE_OK = 0,
 	IFACE_EOF,
@@ -56,7 +62,16 @@ struct iface_io {
 				const void *ptr, size_t len,
 				const ip_endpoint *remote_endpoint,
 				struct logger *logger);
+	/*
+	 * Optional; send NR packets using as few system calls as
+	 * possible.  Returns the number of packets sent or -1 (and
+	 * errno) when the first packet couldn't be sent.
+	 */
+	ssize_t (*write_packets)(const struct iface_endpoint *ifp,
+				 const struct iface_outgoing_packet *packets,
+				 unsigned nr, struct logger *logger);
 	void (*cleanup)(struct iface_endpoint *ifp);
+	void (*show_status)(struct show *s, const struct iface_endpoint *ifp); /* optional */
 	void (*listen)(struct iface_endpoint *fip, struct logger *logger);
 	int (*bind_iface_endpoint)(struct iface_dev *ifd,
 				   ip_port port, bool esp_encapsulation_enabled,
@@ -157,6 +172,8 @@ struct iface_endpoint {
 	bool float_nat_initiator;
 	/* udp only */
 	struct event *udp_message_listener;
+	struct udp_reuseport *udp_reuseport; /* ike-socket-reuseport= */
+	struct send_queue *send_queue; /* ike-socket-batch=; see send.c */
 	/* tcp port only */
 	struct evconnlistener *tcp_accept_listener;
 	/* tcp stream only */
@@ -30,6 +30,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+# include <linux/filter.h>	/* for struct sock_filter */
+#endif
+
 #ifdef MSG_ERRQUEUE
 # include <netinet/in.h> 	/* for IP_RECVERR */
 # include <linux/errqueue.h>
@@ -48,6 +52,7 @@
 #include "ip_info.h"
 #include "ip_sockaddr.h"
 #include "nat_traversal.h"	/* for nat_traversal_enabled which seems like a broken idea */
+#include "pluto_stats.h"
 
 static int bind_udp_socket(const struct iface_dev *ifd, ip_port port,
 			   struct logger *logger)
@@ -85,6 +90,29 @@ static int bind_udp_socket(const struct iface_dev *ifd, ip_port port,
 		return -1;
 	}
 
+#ifdef SO_REUSEPORT
+	/*
+	 * With ike-socket-reuseport=, further sockets are bound to
+	 * the same endpoint; see udp_listen_reuseport().
+	 */
+	if (pluto_sock_reuseport > 1) {
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+			       (const void *)&on, sizeof(on)) < 0) {
+			log_errno(logger, errno, "setsockopt SO_REUSEPORT in create_socket()");
+			close(fd);
+			return -1;
+		}
+# ifdef SO_RXQ_OVFL
+		/* report per-socket drops */
+		if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL,
+			       (const void *)&on, sizeof(on)) < 0) {
+			log_errno(logger, errno, "setsockopt(SO_RXQ_OVFL) in create_udp_socket()");
+			/* non-fatal */
+		}
+# endif
+	}
+#endif
+
 #ifdef SO_PRIORITY
 	static const int so_prio = 6; /* rumored maximum priority, might be 7 on linux? */
 	if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY,
@@ -231,15 +259,79 @@ static bool nat_traversal_espinudp(int sk, struct iface_dev *ifd,
 }
 
 #ifdef MSG_ERRQUEUE
-static bool check_msg_errqueue(const struct iface_endpoint *ifp,
+static bool check_msg_errqueue(const struct iface_endpoint *ifp, int fd,
 			       short interest, const char *func,
 			       struct logger *logger);
 #endif
 
-static enum iface_status udp_read_packet(const struct iface_endpoint *ifp,
-					 struct iface_packet *packet,
-					 struct logger *logger)
+/*
+ * Additional SO_REUSEPORT sockets (ike-socket-reuseport=).
+ *
+ * .socket[0] is IFP->FD (listened to by .udp_message_listener); the
+ * rest are extra sockets bound to the same endpoint, each with its
+ * own read event, so that the kernel spreads incoming IKE (and the
+ * drops when a queue overflows) across several socket queues.
+ * Messages are always sent using IFP->FD.
+ */
+
+struct udp_reuseport {
+	unsigned nr;
+	struct udp_reuseport_socket {
+		int fd;
+		struct event *listener;
+		unsigned long packets;
+		uint32_t drops;	/* from SO_RXQ_OVFL */
+	} socket[];
+};
+
+static struct udp_reuseport_socket *udp_reuseport_socket(const struct iface_endpoint *ifp,
+							 int fd)
 {
+	if (ifp->udp_reuseport != NULL) {
+		for (unsigned i = 0; i < ifp->udp_reuseport->nr; i++) {
+			if (ifp->udp_reuseport->socket[i].fd == fd) {
+				return &ifp->udp_reuseport->socket[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Reading.
+ *
+ * handle_udp_packet_cb() reads the datagrams waiting on the socket
+ * that triggered the event into the ring below, performing the
+ * MSG_ERRQUEUE check once.  With ike-socket-batch=N, up to N
+ * datagrams are read using a single recvmmsg(); otherwise exactly
+ * one is read using recvmsg().  udp_read_packet() then hands them
+ * out, one per handle_packet_cb() call, so that each datagram takes
+ * the normal demux path.
+ *
+ * There's only one thread reading IKE sockets and the ring is always
+ * emptied before the event handler returns, so a single ring is
+ * shared by all interfaces.
+ */
+
+static struct {
+	const struct iface_endpoint *ifp;
+	unsigned nr;	/* datagrams in the ring */
+	unsigned next;	/* next datagram to hand out */
+	struct udp_slot {
+		ip_sockaddr from;
+		ssize_t len;
+		int error;	/* errno when LEN < 0 */
+		uint8_t buffer[MAX_INPUT_UDP_SIZE];
+	} slot[IKE_SOCKET_BATCH_MAX];
+} udp_ring;
+
+static unsigned udp_fill_ring(const struct iface_endpoint *ifp, int fd,
+			      struct logger *logger)
+{
+	pexpect(udp_ring.next == udp_ring.nr);
+	udp_ring.ifp = ifp;
+	udp_ring.nr = udp_ring.next = 0;
+
 #ifdef MSG_ERRQUEUE
 	/*
 	 * Even though select(2) says that there is a message, it
@@ -253,28 +345,125 @@ static enum iface_status udp_read_packet(const struct iface_endpoint *ifp,
 	 */
 	if (pluto_sock_errqueue) {
 		threadtime_t errqueue_start = threadtime_start();
-		bool errqueue_ok = check_msg_errqueue(ifp, POLLIN, __func__,
-						      packet->logger);
+		bool errqueue_ok = check_msg_errqueue(ifp, fd, POLLIN, __func__,
+						      logger);
 		threadtime_stop(&errqueue_start, SOS_NOBODY,
 				"%s() calling check_incoming_msg_errqueue()", __func__);
 		if (!errqueue_ok) {
-			return IFACE_IGNORE; /* no normal message to read */
+			return 0; /* no normal message to read */
 		}
 	}
 #endif
 
+	unsigned batch = 1;
+#ifdef MSG_WAITFORONE
+	if (pluto_sock_batch > 1) {
+		batch = (pluto_sock_batch < IKE_SOCKET_BATCH_MAX ?
+			 pluto_sock_batch : IKE_SOCKET_BATCH_MAX);
+	}
+#endif
+
 	/*
 	 * COVERITY reports an overflow because FROM.LEN (aka
 	 * sizeof(FROM.SA)) > sizeof(from.sa.sa).  That's the point.
 	 * The FROM.SA union is big enough to hold sockaddr,
 	 * sockaddr_in and sockaddr_in6.
 	 */
-	ip_sockaddr from = {
-		.len = sizeof(from.sa),
-	};
-	packet->len = recvfrom(ifp->fd, packet->ptr, packet->len, /*flags*/ 0,
-			       &from.sa.sa, &from.len);
-	int packet_errno = errno; /* save!!! */
+	struct iovec iov[IKE_SOCKET_BATCH_MAX];
+	union {
+		struct cmsghdr align;
+		uint8_t space[CMSG_SPACE(sizeof(uint32_t))];
+	} control[IKE_SOCKET_BATCH_MAX];
+	struct mmsghdr msgs[IKE_SOCKET_BATCH_MAX];
+	for (unsigned i = 0; i < batch; i++) {
+		struct udp_slot *slot = &udp_ring.slot[i];
+		slot->from = (ip_sockaddr) {
+			.len = sizeof(slot->from.sa),
+		};
+		iov[i] = (struct iovec) {
+			.iov_base = slot->buffer,
+			.iov_len = sizeof(slot->buffer),
+		};
+		msgs[i] = (struct mmsghdr) {
+			.msg_hdr = {
+				.msg_name = &slot->from.sa,
+				.msg_namelen = sizeof(slot->from.sa),
+				.msg_iov = &iov[i],
+				.msg_iovlen = 1,
+				.msg_control = &control[i],
+				.msg_controllen = sizeof(control[i]),
+			},
+		};
+	}
+
+	int nr;
+#ifdef MSG_WAITFORONE
+	if (batch > 1) {
+		nr = recvmmsg(fd, msgs, batch, MSG_DONTWAIT, NULL);
+		if (nr < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (nr > 0) {
+			pstats_ike_udp_batches++;
+			pstats_ike_udp_batched += nr;
+			dbg("recvmmsg on %s returned %d of %u datagrams",
+			    ifp->ip_dev->id_rname, nr, batch);
+		}
+	} else
+#endif
+	{
+		ssize_t len = recvmsg(fd, &msgs[0].msg_hdr, /*flags*/ 0);
+		msgs[0].msg_len = len;
+		nr = (len < 0 ? -1 : 1);
+	}
+
+	if (nr < 0) {
+		/* pass the failure on to udp_read_packet() */
+		struct udp_slot *slot = &udp_ring.slot[0];
+		slot->error = errno; /* save!!! */
+		slot->len = -1;
+		udp_ring.nr = 1;
+		return 1;
+	}
+
+	struct udp_reuseport_socket *socket = udp_reuseport_socket(ifp, fd);
+	for (int i = 0; i < nr; i++) {
+		struct udp_slot *slot = &udp_ring.slot[i];
+		slot->from.len = msgs[i].msg_hdr.msg_namelen;
+		slot->len = msgs[i].msg_len;
+		slot->error = 0;
+		if (socket == NULL) {
+			continue;
+		}
+		socket->packets++;
+#ifdef SO_RXQ_OVFL
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+		     cm != NULL; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET &&
+			    cm->cmsg_type == SO_RXQ_OVFL) {
+				memcpy(&socket->drops, CMSG_DATA(cm), sizeof(socket->drops));
+			}
+		}
+#endif
+	}
+	udp_ring.nr = nr;
+	return nr;
+}
+
+static enum iface_status udp_read_packet(const struct iface_endpoint *ifp,
+					 struct iface_packet *packet,
+					 struct logger *logger)
+{
+	/* hand out the next datagram read by udp_fill_ring() */
+	if (!pexpect(udp_ring.next < udp_ring.nr)) {
+		return IFACE_IGNORE;
+	}
+	passert(udp_ring.ifp == ifp);
+	struct udp_slot *slot = &udp_ring.slot[udp_ring.next++];
+	ip_sockaddr from = slot->from;
+	packet->ptr = slot->buffer;
+	packet->len = slot->len;
+	int packet_errno = slot->error;
 
 	/*
 	 * Try to decode the from address.
@@ -382,7 +571,7 @@ static ssize_t udp_write_packet(const struct iface_endpoint *ifp,
 {
 #ifdef MSG_ERRQUEUE
 	if (pluto_sock_errqueue) {
-		check_msg_errqueue(ifp, POLLOUT, __func__, logger);
+		check_msg_errqueue(ifp, ifp->fd, POLLOUT, __func__, logger);
 	}
 #endif
 
@@ -390,21 +579,56 @@ static ssize_t udp_write_packet(const struct iface_endpoint *ifp,
 	return sendto(ifp->fd, ptr, len, 0, &remote_sa.sa.sa, remote_sa.len);
 };
 
-static void handle_udp_packet_cb(evutil_socket_t unused_fd UNUSED,
+#ifdef MSG_WAITFORONE
+static ssize_t udp_write_packets(const struct iface_endpoint *ifp,
+				 const struct iface_outgoing_packet *packets,
+				 unsigned nr,
+				 struct logger *logger /*possibly*/UNUSED)
+{
+	passert(nr <= IKE_SOCKET_BATCH_MAX);
+
+#ifdef MSG_ERRQUEUE
+	/* see udp_write_packet(); once per batch is sufficient */
+	if (pluto_sock_errqueue) {
+		check_msg_errqueue(ifp, ifp->fd, POLLOUT, __func__, logger);
+	}
+#endif
+
+	ip_sockaddr remote_sa[IKE_SOCKET_BATCH_MAX];
+	struct iovec iov[IKE_SOCKET_BATCH_MAX];
+	struct mmsghdr msgs[IKE_SOCKET_BATCH_MAX];
+	for (unsigned i = 0; i < nr; i++) {
+		remote_sa[i] = sockaddr_from_endpoint(&packets[i].remote_endpoint);
+		iov[i] = (struct iovec) {
+			.iov_base = (void *)packets[i].ptr, /* discard const */
+			.iov_len = packets[i].len,
+		};
+		msgs[i] = (struct mmsghdr) {
+			.msg_hdr = {
+				.msg_name = &remote_sa[i].sa.sa,
+				.msg_namelen = remote_sa[i].len,
+				.msg_iov = &iov[i],
+				.msg_iovlen = 1,
+			},
+		};
+	}
+
+	int sent = sendmmsg(ifp->fd, msgs, nr, 0);
+	dbg("sendmmsg on %s sent %d of %u messages",
+	    ifp->ip_dev->id_rname, sent, nr);
+	return sent;
+}
+#endif
+
+static void handle_udp_packet_cb(evutil_socket_t fd,
 				 const short unused_event UNUSED,
 				 void *arg)
 {
 	struct logger logger[1] = { GLOBAL_LOGGER(null_fd), }; /* event-handler */
 	const struct iface_endpoint *ifp = arg;
-	handle_packet_cb(ifp, logger);
-}
-
-static void udp_listen(struct iface_endpoint *ifp,
-		       struct logger *unused_logger UNUSED)
-{
-	if (ifp->udp_message_listener == NULL) {
-		attach_fd_read_sensor(&ifp->udp_message_listener, ifp->fd,
-				      handle_udp_packet_cb, ifp);
+	udp_fill_ring(ifp, fd, logger);
+	while (udp_ring.next < udp_ring.nr) {
+		handle_packet_cb(ifp, logger);
 	}
 }
 
@@ -423,10 +647,118 @@ static int udp_bind_iface_endpoint(struct iface_dev *ifd, ip_port port,
 	return fd;
 }
 
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+/*
+ * Steer each message to socket[SPIi % NR] so that all the messages
+ * for an IKE SA land on the same socket.  For a reuseport program,
+ * offset 0 is the start of the UDP payload; skip the non-ESP marker
+ * and use the low half of the initiator's SPI.  Anything too short
+ * (for instance a NAT-T keep-alive) fails the load and goes to
+ * socket[0].
+ */
+static void attach_udp_spi_steering(const struct iface_endpoint *ifp,
+				    unsigned nr, struct logger *logger)
+{
+	uint32_t offset = ((ifp->esp_encapsulation_enabled ? NON_ESP_MARKER_SIZE : 0) +
+			   IKE_SA_SPI_SIZE / 2);
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offset),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nr),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = elemsof(code),
+		.filter = code,
+	};
+	if (setsockopt(ifp->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		       &prog, sizeof(prog)) < 0) {
+		log_errno(logger, errno,
+			  "setsockopt(SO_ATTACH_REUSEPORT_CBPF) in %s()", __func__);
+		/* non-fatal; the kernel falls back to hashing */
+		return;
+	}
+	dbg("IKE SPI steering enabled across %u sockets on fd %d", nr, ifp->fd);
+}
+#endif
+
+static void udp_listen_reuseport(struct iface_endpoint *ifp,
+				 struct logger *logger)
+{
+	unsigned nr = (pluto_sock_reuseport < IKE_SOCKET_REUSEPORT_MAX ?
+		       pluto_sock_reuseport : IKE_SOCKET_REUSEPORT_MAX);
+	ifp->udp_reuseport = alloc_bytes(sizeof(struct udp_reuseport) +
+					 nr * sizeof(struct udp_reuseport_socket),
+					 "udp reuseport sockets");
+	ifp->udp_reuseport->socket[0].fd = ifp->fd;
+	ifp->udp_reuseport->nr = 1;
+
+	ip_port port = endpoint_port(&ifp->local_endpoint);
+	for (unsigned i = 1; i < nr; i++) {
+		int fd = udp_bind_iface_endpoint(ifp->ip_dev, port,
+						 ifp->esp_encapsulation_enabled,
+						 logger);
+		if (fd < 0) {
+			/* already logged */
+			break;
+		}
+		struct udp_reuseport_socket *socket = &ifp->udp_reuseport->socket[i];
+		socket->fd = fd;
+		attach_fd_read_sensor(&socket->listener, fd,
+				      handle_udp_packet_cb, ifp);
+		ifp->udp_reuseport->nr++;
+	}
+
+	endpoint_buf b;
+	dbg("listening on %u SO_REUSEPORT sockets for %s %s",
+	    ifp->udp_reuseport->nr, ifp->ip_dev->id_rname,
+	    str_endpoint(&ifp->local_endpoint, &b));
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	if (pluto_sock_steer_spi && ifp->udp_reuseport->nr > 1) {
+		attach_udp_spi_steering(ifp, ifp->udp_reuseport->nr, logger);
+	}
+#endif
+}
+
+static void udp_listen(struct iface_endpoint *ifp,
+		       struct logger *logger /*possibly*/UNUSED)
+{
+	if (ifp->udp_message_listener == NULL) {
+		attach_fd_read_sensor(&ifp->udp_message_listener, ifp->fd,
+				      handle_udp_packet_cb, ifp);
+#ifdef SO_REUSEPORT
+		if (pluto_sock_reuseport > 1) {
+			udp_listen_reuseport(ifp, logger);
+		}
+#endif
+	}
+}
+
 static void udp_cleanup(struct iface_endpoint *ifp)
 {
 	event_free(ifp->udp_message_listener);
 	ifp->udp_message_listener = NULL;
+	if (ifp->udp_reuseport != NULL) {
+		/* .socket[0] is IFP->FD, closed by the caller */
+		for (unsigned i = 1; i < ifp->udp_reuseport->nr; i++) {
+			struct udp_reuseport_socket *socket = &ifp->udp_reuseport->socket[i];
+			event_free(socket->listener);
+			close(socket->fd);
+		}
+		pfree(ifp->udp_reuseport);
+		ifp->udp_reuseport = NULL;
+	}
+}
+
+static void udp_show_status(struct show *s, const struct iface_endpoint *ifp)
+{
+	if (ifp->udp_reuseport == NULL) {
+		return;
+	}
+	for (unsigned i = 0; i < ifp->udp_reuseport->nr; i++) {
+		const struct udp_reuseport_socket *socket = &ifp->udp_reuseport->socket[i];
+		show_comment(s, "  socket %u: fd=%d, packets=%lu, drops=%"PRIu32,
+			     i, socket->fd, socket->packets, socket->drops);
+	}
 }
 
 const struct iface_io udp_iface_io = {
@@ -434,9 +766,13 @@ const struct iface_io udp_iface_io = {
 	.protocol = &ip_protocol_udp,
 	.read_packet = udp_read_packet,
 	.write_packet = udp_write_packet,
+#ifdef MSG_WAITFORONE
+	.write_packets = udp_write_packets,
+#endif
 	.listen = udp_listen,
 	.bind_iface_endpoint = udp_bind_iface_endpoint,
 	.cleanup = udp_cleanup,
+	.show_status = udp_show_status,
 };
 
 #ifdef MSG_ERRQUEUE
@@ -573,14 +909,14 @@ static struct state *find_likely_sender(size_t packet_len, uint8_t *buffer,
 	return st;
 }
 
-static bool check_msg_errqueue(const struct iface_endpoint *ifp, short interest,
-			       const char *before,
+static bool check_msg_errqueue(const struct iface_endpoint *ifp, int fd,
+			       short interest, const char *before,
 			       struct logger *logger)
 {
 	struct pollfd pfd;
 	int again_count = 0;
 
-	pfd.fd = ifp->fd;
+	pfd.fd = fd;
 	pfd.events = interest | POLLPRI | POLLOUT;
 
 	while (/*clear .revents*/ pfd.revents = 0,
@@ -625,7 +961,7 @@ static bool check_msg_errqueue(const struct iface_endpoint *ifp, short interest,
 			.msg_flags = 0,
 		};
 
-		ssize_t packet_len = recvmsg(ifp->fd, &emh, MSG_ERRQUEUE);
+		ssize_t packet_len = recvmsg(fd, &emh, MSG_ERRQUEUE);
 
 		if (packet_len == -1) {
 			/* XXX: all paths either break. return, or continue */
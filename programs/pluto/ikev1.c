@@ -134,6 +134,7 @@
 #include "pluto_x509.h"
 #include "certs.h"
 #include "connections.h"        /* needs id.h */
+#include "connection_db.h"
 #include "state.h"
 #include "ikev1_msgid.h"
 #include "packet.h"
@@ -1111,6 +1112,7 @@ static stf_status informational(struct state *st, struct msg_digest *md)
 					    str_address(&old_addr, &ob),
 					    str_address(&new_peer, &nb));
 					tmp_c->spd.that.client = selector_from_address(&new_peer);
+					rehash_connection_spd_routes(tmp_c);
 				}
 
 				/*
@@ -2782,7 +2784,11 @@ void complete_v1_state_transition(struct state *st, struct msg_digest *md, stf_s
 					}
 				}
 				/* XXX: DELAY_MS should be a deltatime_t */
-				event_schedule(kind, deltatime_ms(delay_ms), st);
+				if (kind == EVENT_SA_EXPIRE) {
+					event_schedule(kind, deltatime_ms(delay_ms), st);
+				} else {
+					event_schedule_rekey(kind, deltatime_ms(delay_ms), st);
+				}
 				break;
 
 			case EVENT_SO_DISCARD:
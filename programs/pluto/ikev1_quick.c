@@ -43,6 +43,7 @@
 #include "x509.h"
 #include "certs.h"
 #include "connections.h"        /* needs id.h */
+#include "connection_db.h"
 #include "keys.h"
 #include "packet.h"
 #include "demux.h"      /* needs packet.h */
@@ -1155,6 +1156,7 @@ static stf_status quick_inI1_outR1_tail(struct state *p1st, struct msg_digest *m
 			if (selector_is_address(remote_client, &c->spd.that.host_addr)) {
 				c->spd.that.has_client = false;
 			}
+			rehash_connection_spd_routes(c);
 
 			LSWDBGP(DBG_BASE, buf) {
 				jam(buf, "setting phase 2 virtual values to ");
@@ -1611,6 +1613,7 @@ stf_status quick_inR1_outI2_tail(struct state *st, struct msg_digest *md)
 
 				st->st_connection->spd.that.client =
 					selector_from_address(&st->hidden_variables.st_nat_oa);
+				rehash_connection_spd_routes(st->st_connection);
 				subnet_buf buf;
 				log_state(RC_LOG_SERIOUS, st,
 					  "IDcr was FQDN: %s, using NAT_OA=%s as IDcr",
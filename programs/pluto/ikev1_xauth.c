@@ -57,6 +57,7 @@
 #include "x509.h"
 #include "certs.h"
 #include "connections.h"	/* needs id.h */
+#include "connection_db.h"
 #include "packet.h"
 #include "demux.h"		/* needs packet.h */
 #include "log.h"
@@ -1832,6 +1833,7 @@ stf_status modecfg_inR1(struct state *st, struct msg_digest *md)
 							/* new entry: add at end*/
 							sr = sr->spd_next = clone_thing(c->spd,
 								"remote subnets policies");
+							init_spd_route_db_entry(sr);
 							sr->spd_next = NULL;
 
 							sr->this.id.name = EMPTY_CHUNK;
@@ -1855,6 +1857,7 @@ stf_status modecfg_inR1(struct state *st, struct msg_digest *md)
 						}
 					}
 				}
+				rehash_connection_spd_routes(c);
 
 				/*
 				 * ??? this won't work because CISCO_SPLIT_INC is way bigger than LELEM_ROOF
@@ -64,7 +64,7 @@
 #include "ietf_constants.h"
 #include "ikev2_cookie.h"
 #include "plutoalg.h" /* for default_ike_groups */
-#include "ikev2_message.h"	/* for ikev2_decrypt_msg() */
+#include "ikev2_message.h"	/* for ikev2_decrypt_msg() et.al. */
 #include "pluto_stats.h"
 #include "keywords.h"
 #include "ikev2_msgid.h"
@@ -77,6 +77,7 @@
 #include "ikev2_notify.h"
 #include "unpack.h"
 #include "pending.h"		/* for release_pending_whacks() */
+#include "ikev2_half_open.h"
 
 static void v2_dispatch(struct ike_sa *ike, struct state *st,
 			struct msg_digest *md,
@@ -1127,8 +1128,8 @@ static bool is_duplicate_request(struct ike_sa *ike,
 				  "received duplicate %s message request (Message ID %jd); retransmitting response",
 				  enum_name_short(&ikev2_exchange_names, md->hdr.isa_xchg),
 				  msgid);
-			send_recorded_v2_message(ike, "ikev2-responder-retransmit",
-						 MESSAGE_RESPONSE);
+			queue_recorded_v2_message(ike, "ikev2-responder-retransmit",
+						  MESSAGE_RESPONSE);
 		} else if (fragment == 1) {
 			log_state(RC_LOG, &ike->sa,
 				  "received duplicate %s message request (Message ID %jd, fragment %u); retransmitting response",
@@ -1634,6 +1635,11 @@ void ikev2_process_packet(struct msg_digest *md)
 				return;
 			}
 
+			/* same again, but the IKE SA was compacted */
+			if (resend_v2_half_open_response(md)) {
+				return;
+			}
+
 			if (drop_new_exchanges()) {
 				/* only log for debug to prevent disk filling up */
 				dbg("pluto is overloaded with half-open IKE SAs; dropping new exchange");
@@ -1874,6 +1880,10 @@ void ikev2_process_packet(struct msg_digest *md)
 	 */
 	struct ike_sa *ike = find_v2_ike_sa(&md->hdr.isa_ike_spis,
 					    expected_local_ike_role);
+	if (ike == NULL && expected_local_ike_role == SA_RESPONDER) {
+		/* IKE_AUTH for a compacted half-open IKE SA? */
+		ike = promote_v2_half_open(md);
+	}
 	if (ike == NULL) {
 		esb_buf ixb;
 		rate_log(md, "%s message %s has no corresponding IKE SA",
@@ -2207,7 +2217,9 @@ void ikev2_process_state_packet(struct ike_sa *ike, struct state *st,
 			 * the fragments would be dropped).  Later.
 			 */
 			if (md->message_payloads.present & P(SKF)) {
-				if (have_all_fragments) {
+				if (md->v2_sk_decrypted) {
+					dbg("fragments already decrypted and re-assembled, skipping fragment collection");
+				} else if (have_all_fragments) {
 					dbg("already have all fragments, skipping fragment collection");
 				} else if (!ikev2_collect_fragment(md, ike)) {
 					return;
@@ -2245,8 +2257,16 @@ void ikev2_process_state_packet(struct ike_sa *ike, struct state *st,
 			 * Decrypt the packet, checking it for
 			 * integrity.  Anything lacking integrity is
 			 * dropped.
+			 *
+			 * With ike-sk-offload=yes this is done by a
+			 * helper which then re-enters this function
+			 * with .v2_sk_decrypted set.
 			 */
-			if (!ikev2_decrypt_msg(ike, md)) {
+			if (md->v2_sk_decrypted) {
+				dbg("message already decrypted by a helper");
+			} else if (submit_v2_decrypt_msg(ike, st, md)) {
+				return;
+			} else if (!ikev2_decrypt_msg(ike, md)) {
 				log_state(RC_LOG, &ike->sa,
 					  "encrypted payload seems to be corrupt; dropping packet");
 				return;
@@ -3171,8 +3191,8 @@ static void success_v2_state_transition(struct state *st, struct msg_digest *md,
 	switch (transition->send) {
 	case MESSAGE_REQUEST:
 	case MESSAGE_RESPONSE:
-		send_recorded_v2_message(ike, finite_states[from_state]->name,
-					 transition->send);
+		queue_recorded_v2_message(ike, finite_states[from_state]->name,
+					  transition->send);
 		break;
 	case NO_MESSAGE:
 		break;
@@ -3200,7 +3220,7 @@ static void success_v2_state_transition(struct state *st, struct msg_digest *md,
 			 */
 			if (LIN(POLICY_OPPORTUNISTIC, c->policy)) {
 				struct spd_route *sr = &c->spd;
-				struct bare_shunt **bs = bare_shunt_ptr(&sr->this.client,
+				struct bare_shunt *bs = find_bare_shunt(&sr->this.client,
 									&sr->that.client,
 									sr->this.protocol,
 									"old bare shunt to delete");
@@ -3296,6 +3316,16 @@ static void success_v2_state_transition(struct state *st, struct msg_digest *md,
 			event_schedule(EVENT_v2_LIVENESS, delay, st);
 		}
 	}
+
+	/*
+	 * A responder's new IKE SA now just waits for IKE_AUTH;
+	 * offer it for compaction (done later from a timer, as the
+	 * callers are still using ST and MD).
+	 */
+	if (from_state == STATE_PARENT_R0 &&
+	    st->st_state->kind == STATE_PARENT_R1) {
+		queue_v2_half_open(ike);
+	}
 }
 
 /*
@@ -20,6 +20,7 @@ struct spd_route;
 struct crypt_mac;
 struct hash_desc;
 struct payload_digest;
+struct signature_check;
 
 typedef stf_status crypto_transition_fn(struct state *st, struct msg_digest *md,
 					struct pluto_crypto_req *r);
@@ -178,15 +179,22 @@ extern bool ikev2_create_psk_auth(enum keyword_authby authby,
 				  const struct crypt_mac *idhash,
 				  chunk_t *additional_auth /* output */);
 
+/*
+ * When DEFERRED is non-NULL the candidate keys are only gathered into
+ * *DEFERRED, and the check is left for a helper thread (see
+ * submit_v2_auth_verify()).
+ */
 extern stf_status ikev2_verify_rsa_hash(struct ike_sa *ike,
 					const struct crypt_mac *idhash,
 					shunk_t signature,
-					const struct hash_desc *hash_algo);
+					const struct hash_desc *hash_algo,
+					struct signature_check **deferred);
 
 extern stf_status ikev2_verify_ecdsa_hash(struct ike_sa *ike,
 					const struct crypt_mac *idhash,
 					shunk_t signature,
-					const struct hash_desc *hash_algo);
+					const struct hash_desc *hash_algo,
+					struct signature_check **deferred);
 
 extern bool ikev2_verify_psk_auth(enum keyword_authby authby,
 				  const struct ike_sa *ike,
@@ -195,12 +203,42 @@ extern bool ikev2_verify_psk_auth(enum keyword_authby authby,
 
 extern void ikev2_derive_child_keys(struct child_sa *child);
 
+/*
+ * ikev2_derive_child_keys() split into its main thread (prepare,
+ * install) and any thread (compute) parts.
+ */
+struct v2_child_keymat;
+struct v2_child_keymat *prepare_v2_child_keymat(struct child_sa *child);
+void compute_v2_child_keymat(struct v2_child_keymat *keymat,
+			     struct logger *logger);
+void install_v2_child_keymat(struct child_sa *child,
+			     struct v2_child_keymat **keymat);
+void free_v2_child_keymat(struct v2_child_keymat **keymat);
+
+/*
+ * When ike-sk-offload=yes and MD is an IKE_AUTH response, compute
+ * CHILD's KEYMAT on a helper, returning true; once installed, CB is
+ * called on the main thread.  Return false when the caller should
+ * use ikev2_derive_child_keys().
+ */
+typedef stf_status (v2_child_keymat_cb)(struct child_sa *child,
+					struct msg_digest *md);
+bool submit_v2_child_keymat(struct child_sa *child, struct msg_digest *md,
+			    v2_child_keymat_cb *cb);
+
 stf_status ikev2_child_sa_respond(struct ike_sa *ike,
 				  struct child_sa *child,
 				  struct msg_digest *md,
 				  pb_stream *outpbs,
 				  enum isakmp_xchg_types isa_xchg);
 
+/*
+ * The tail of ikev2_child_sa_respond(), run once the CHILD SA's KEYMAT
+ * is known; with ike-sk-offload=yes, IKE_AUTH leaves it to the caller.
+ */
+stf_status ikev2_install_responder_child_sa(struct child_sa *child,
+					    enum isakmp_xchg_types isa_xchg);
+
 void v2_schedule_replace_event(struct state *st);
 
 bool emit_v2_child_configuration_payload(struct connection *c,
@@ -29,6 +29,7 @@ struct msg_digest;
 struct hash_desc;
 struct logger;
 struct private_key_stuff;
+struct signature_check;
 enum perspective;
 
 struct crypt_mac v2_calculate_sighash(const struct ike_sa *ike,
@@ -67,4 +68,17 @@ bool submit_v2_auth_signature(struct ike_sa *ike,
 			      enum ikev2_auth_method auth_method,
 			      v2_auth_signature_cb *cb);
 
+/*
+ * Try the candidate keys gathered by prepare_signature_check() on a
+ * helper thread; CB is called, on the main thread, with the result.
+ * Takes ownership of *CHECK.
+ */
+typedef stf_status (v2_auth_verify_cb)(struct ike_sa *ike,
+				       struct msg_digest *md,
+				       bool verified);
+
+void submit_v2_auth_verify(struct ike_sa *ike,
+			   struct signature_check **check,
+			   v2_auth_verify_cb *cb);
+
 #endif
@@ -306,7 +306,16 @@ stf_status ikev2_child_sa_respond(struct ike_sa *ike,
 	if (!emit_v2N_compression(cst, cst->st_seen_use_ipcomp, outpbs))
 		return STF_INTERNAL_ERROR;
 
-	ikev2_derive_child_keys(pexpect_child_sa(cst));
+	/*
+	 * With ike-sk-offload=yes, the IKE_AUTH reply is encrypted on
+	 * a helper thread and the CHILD SA's KEYMAT is computed there
+	 * as well; the SA is installed once both are done (see
+	 * submit_v2SK_message()).
+	 */
+	bool offload = (pluto_ike_sk_offload && isa_xchg == ISAKMP_v2_IKE_AUTH);
+	if (!offload) {
+		ikev2_derive_child_keys(pexpect_child_sa(cst));
+	}
 
 	/*
 	 * Check to see if we need to release an old instance
@@ -326,6 +335,18 @@ stf_status ikev2_child_sa_respond(struct ike_sa *ike,
 		IKE_SA_established(ike);
 	}
 
+	if (offload) {
+		return STF_OK;
+	}
+
+	return ikev2_install_responder_child_sa(child, isa_xchg);
+}
+
+stf_status ikev2_install_responder_child_sa(struct child_sa *child,
+					    enum isakmp_xchg_types isa_xchg)
+{
+	struct state *cst = &child->sa;
+
 	/* install inbound and outbound SPI info */
 	if (!install_ipsec_sa(cst, TRUE))
 		return STF_FATAL;
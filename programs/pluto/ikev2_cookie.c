@@ -37,6 +37,14 @@
 #include "log.h"
 #include "state.h"
 #include "ikev2.h"
+#include "iface.h"
+#include "send.h"
+#include "impair.h"
+#include "impair_message.h"	/* for impairing_incoming_messages() */
+#include "pluto_stats.h"
+#include "source_limit.h"
+#include "server.h"		/* for pluto_ddos_source_rate */
+#include "ikev2_half_open.h"	/* for have_v2_half_open() */
 
 /*
  * That the cookie size of 32-bytes happens to match
@@ -64,28 +72,36 @@ void refresh_v2_cookie_secret(void)
  * once a day and while under DOS attack, we could fail a few cookies
  * until the peer restarts from scratch.
  */
-static bool compute_v2_cookie_from_md(v2_cookie_t *cookie,
-				      struct msg_digest *md,
-				      shunk_t Ni)
+static void compute_v2_cookie(v2_cookie_t *cookie, shunk_t Ni,
+			      const ip_endpoint *sender,
+			      const ike_spi_t *initiator_spi,
+			      struct logger *logger)
 {
 	struct crypt_hash *ctx = crypt_hash_init("IKEv2 COOKIE",
 						 &ike_alg_hash_sha2_256,
-						 md->md_logger);
+						 logger);
 
 	crypt_hash_digest_hunk(ctx, "Ni", Ni);
 
-	ip_address sender = endpoint_address(&md->sender);
-	shunk_t IPi = address_as_shunk(&sender);
+	ip_address sender_address = endpoint_address(sender);
+	shunk_t IPi = address_as_shunk(&sender_address);
 	crypt_hash_digest_hunk(ctx, "IPi", IPi);
 
-	crypt_hash_digest_thing(ctx, "SPIi", md->hdr.isa_ike_initiator_spi);
+	crypt_hash_digest_thing(ctx, "SPIi", *initiator_spi);
 
 	crypt_hash_digest_thing(ctx, "<secret>", v2_cookie_secret);
 
 	/* happy coincidence? */
 	pexpect(sizeof(cookie->bytes) == SHA2_256_DIGEST_SIZE);
 	crypt_hash_final_bytes(&ctx, cookie->bytes, sizeof(cookie->bytes));
+}
 
+static bool compute_v2_cookie_from_md(v2_cookie_t *cookie,
+				      struct msg_digest *md,
+				      shunk_t Ni)
+{
+	compute_v2_cookie(cookie, Ni, &md->sender,
+			  &md->hdr.isa_ike_initiator_spi, md->md_logger);
 	return true;
 }
 
@@ -191,6 +207,216 @@ bool v2_rejected_initiator_cookie(struct msg_digest *md,
 	return false; /* love the cookie */
 }
 
+/*
+ * Stateless IKE_SA_INIT responder fast path.
+ *
+ * While cookies are being demanded, either from everyone or from a
+ * source prefix over ddos-source-rate=, answering a new IKE_SA_INIT
+ * request shouldn't cost much more than the hash.  Instead of
+ * allocating a msg_digest and feeding the message through the
+ * struct_desc interpreter, the raw packet is scanned in place for
+ * just the COOKIE notify and Ni, and the N(COOKIE) reply is stamped
+ * out of a pre-built template.
+ *
+ * Anything the scanner can't decide (a possible retransmit, an
+ * impaired test, a request carrying a valid cookie, ...) is handed
+ * back to the normal path by returning false.
+ */
+
+#define V2_NOTIFY_HDR_SIZE (NSIZEOF_isakmp_generic + 4)	/* + protoid, spisize, type */
+#define V2_COOKIE_REPLY_SIZE (NSIZEOF_isakmp_hdr + V2_NOTIFY_HDR_SIZE + sizeof(v2_cookie_t))
+
+static uint8_t v2_cookie_reply[V2_COOKIE_REPLY_SIZE];
+
+static void init_v2_cookie_reply(void)
+{
+	/* see open_v2_message() and emit_v2N_hunk() */
+	uint8_t *hdr = v2_cookie_reply;
+	/* SPIi (0-7) filled in per reply; SPIr (8-15) zero */
+	hdr[16] = ISAKMP_NEXT_v2N;
+	hdr[17] = (IKEv2_MAJOR_VERSION << ISA_MAJ_SHIFT) | IKEv2_MINOR_VERSION;
+	hdr[18] = ISAKMP_v2_IKE_SA_INIT;
+	hdr[19] = ISAKMP_FLAGS_v2_MSG_R;
+	/* Message ID (20-23) zero */
+	hdr[24] = 0;
+	hdr[25] = 0;
+	hdr[26] = 0;
+	hdr[27] = V2_COOKIE_REPLY_SIZE;
+
+	uint8_t *n = v2_cookie_reply + NSIZEOF_isakmp_hdr;
+	n[0] = ISAKMP_NEXT_v2NONE;
+	n[1] = ISAKMP_PAYLOAD_NONCRITICAL;
+	n[2] = 0;
+	n[3] = V2_NOTIFY_HDR_SIZE + sizeof(v2_cookie_t);
+	n[4] = 0; /* protoid */
+	n[5] = 0; /* spisize */
+	n[6] = v2N_COOKIE >> 8;
+	n[7] = v2N_COOKIE & 0xff;
+	/* cookie filled in per reply */
+}
+
+static unsigned get_u16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+bool v2_stateless_cookie_response(const struct iface_endpoint *ifp,
+				  const ip_endpoint *sender,
+				  shunk_t packet,
+				  struct logger *logger)
+{
+	if (ifp->protocol != &ip_protocol_udp ||
+	    (!require_ddos_cookies() && pluto_ddos_source_rate == 0)) {
+		return false;
+	}
+
+	/* let the normal path deal with anything impaired */
+	if (impair.replay_duplicates ||
+	    impair.replay_forward ||
+	    impair.replay_backward ||
+	    impair.major_version_bump ||
+	    impair.minor_version_bump ||
+	    impair.send_bogus_isakmp_flag ||
+	    impair.send_bogus_payload_flag ||
+	    impairing_incoming_messages()) {
+		return false;
+	}
+
+	/*
+	 * The IKE header (RFC 7296 3.1); only a well formed initial
+	 * IKE_SA_INIT request is of interest.
+	 */
+	const uint8_t *hdr = packet.ptr;
+	if (packet.len < NSIZEOF_isakmp_hdr) {
+		return false;
+	}
+	ike_spi_t spi_i, spi_r;
+	memcpy(spi_i.bytes, hdr + 0, sizeof(spi_i.bytes));
+	memcpy(spi_r.bytes, hdr + 8, sizeof(spi_r.bytes));
+	unsigned np = hdr[16];
+	size_t length = ((size_t)hdr[24] << 24 | (size_t)hdr[25] << 16 |
+			 (size_t)hdr[26] << 8 | (size_t)hdr[27]);
+	if (hdr[17] != ((IKEv2_MAJOR_VERSION << ISA_MAJ_SHIFT) | IKEv2_MINOR_VERSION) ||
+	    hdr[18] != ISAKMP_v2_IKE_SA_INIT ||
+	    (hdr[19] & (ISAKMP_FLAGS_v2_IKE_I | ISAKMP_FLAGS_v2_MSG_R)) != ISAKMP_FLAGS_v2_IKE_I ||
+	    (hdr[20] | hdr[21] | hdr[22] | hdr[23]) != 0 ||
+	    length < NSIZEOF_isakmp_hdr || length > packet.len ||
+	    ike_spi_is_zero(&spi_i) || !ike_spi_is_zero(&spi_r)) {
+		return false;
+	}
+
+	struct logger from_logger = logger_from(logger, sender);
+
+	bool want_cookie = require_ddos_cookies();
+	switch (check_ike_sa_init_source(sender)) {
+	case SOURCE_OK:
+		break;
+	case SOURCE_CHALLENGE:
+		want_cookie = true;
+		break;
+	case SOURCE_DROP:
+		rate_llog(&from_logger, "source is well over ddos-source-rate; dropping IKE_SA_INIT request");
+		return true;
+	}
+	if (!want_cookie) {
+		return false;
+	}
+
+	/* a retransmit needs the recorded response */
+	if (find_v2_ike_sa_by_initiator_spi(&spi_i, SA_RESPONDER) != NULL ||
+	    have_v2_half_open(&spi_i)) {
+		return false;
+	}
+
+	if (drop_new_exchanges()) {
+		/* only log for debug to prevent disk filling up */
+		dbg("pluto is overloaded with half-open IKE SAs; dropping new exchange");
+		return true;
+	}
+
+	/*
+	 * Walk the payload chain looking for Ni and, as the first
+	 * payload, N(COOKIE).  Same as the normal path, anything
+	 * malformed is dropped without a reply.
+	 */
+	shunk_t Ni = null_shunk;
+	const uint8_t *cookie_notify = NULL;
+	size_t cookie_notify_len = 0;
+	bool first = true;
+	size_t offset = NSIZEOF_isakmp_hdr;
+	while (np != ISAKMP_NEXT_v2NONE) {
+		if (length - offset < NSIZEOF_isakmp_generic) {
+			dbg("DDOS so not responding to invalid packet");
+			return true;
+		}
+		const uint8_t *payload = hdr + offset;
+		size_t payload_len = get_u16(payload + 2);
+		if (payload_len < NSIZEOF_isakmp_generic ||
+		    payload_len > length - offset) {
+			dbg("DDOS so not responding to invalid packet");
+			return true;
+		}
+		if (first && np == ISAKMP_NEXT_v2N &&
+		    payload_len >= V2_NOTIFY_HDR_SIZE &&
+		    get_u16(payload + 6) == v2N_COOKIE) {
+			cookie_notify = payload;
+			cookie_notify_len = payload_len;
+		}
+		if (np == ISAKMP_NEXT_v2Ni && Ni.ptr == NULL) {
+			Ni = shunk2(payload + NSIZEOF_isakmp_generic,
+				    payload_len - NSIZEOF_isakmp_generic);
+		}
+		first = false;
+		np = payload[0];
+		offset += payload_len;
+	}
+
+	/* see v2_rejected_initiator_cookie() */
+	if (Ni.ptr == NULL) {
+		rate_llog(&from_logger, "DDOS cookie requires Ni paylod - dropping message");
+		return true;
+	}
+	if (Ni.len < IKEv2_MINIMUM_NONCE_SIZE || IKEv2_MAXIMUM_NONCE_SIZE < Ni.len) {
+		rate_llog(&from_logger, "DOS cookie failed as Ni payload invalid  - dropping message");
+		return true;
+	}
+
+	v2_cookie_t my_cookie;
+	compute_v2_cookie(&my_cookie, Ni, sender, &spi_i, &from_logger);
+
+	if (cookie_notify != NULL) {
+		if (cookie_notify[4] != 0 || cookie_notify[5] != 0 ||
+		    cookie_notify_len != V2_NOTIFY_HDR_SIZE + sizeof(v2_cookie_t)) {
+			rate_llog(&from_logger, "DOS cookie notification corrupt, or invalid - dropping message");
+			return true;
+		}
+		if (memcmp(cookie_notify + V2_NOTIFY_HDR_SIZE, my_cookie.bytes,
+			   sizeof(my_cookie.bytes)) != 0) {
+			rate_llog(&from_logger, "DOS cookies do not match - dropping message");
+			return true;
+		}
+		/* the normal path re-checks it and creates the IKE SA */
+		dbg("cookies match; passing IKE_SA_INIT request on");
+		return false;
+	}
+
+	static bool initialized;
+	if (!initialized) {
+		init_v2_cookie_reply();
+		initialized = true;
+	}
+	memcpy(v2_cookie_reply, spi_i.bytes, sizeof(spi_i.bytes));
+	memcpy(v2_cookie_reply + NSIZEOF_isakmp_hdr + V2_NOTIFY_HDR_SIZE,
+	       my_cookie.bytes, sizeof(my_cookie.bytes));
+
+	rate_llog(&from_logger, "DOS mode on; responding to IKE_SA_INIT with cookie notification request");
+	send_chunk_using_iface(ifp, sender, "v2 notify",
+			       chunk2(v2_cookie_reply, sizeof(v2_cookie_reply)),
+			       &from_logger);
+	pstat(ikev2_sent_notifies_e, v2N_COOKIE);
+	return true;
+}
+
 static stf_status resume_IKE_SA_INIT_with_cookie(struct ike_sa *ike)
 {
 	if (!record_v2_IKE_SA_INIT_request(ike)) {
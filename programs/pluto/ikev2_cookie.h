@@ -19,15 +19,30 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "shunk.h"
+#include "ip_endpoint.h"
+
 struct msg_digest;
 struct ike_sa;
 struct child_sa;
+struct iface_endpoint;
+struct logger;
 
 void refresh_v2_cookie_secret(void);
 
 bool v2_rejected_initiator_cookie(struct msg_digest *md,
 				  bool me_want_cookies);
 
+/*
+ * Answer (or drop) an IKE_SA_INIT request straight from the receive
+ * buffer while under DDOS, or when its source is over
+ * ddos-source-rate=; false means process it normally.
+ */
+bool v2_stateless_cookie_response(const struct iface_endpoint *ifp,
+				  const ip_endpoint *sender,
+				  shunk_t packet,
+				  struct logger *logger);
+
 stf_status ikev2_in_IKE_SA_INIT_R_v2N_COOKIE(struct ike_sa *ike,
 					     struct child_sa *child,
 					     struct msg_digest *md);
@@ -47,11 +47,31 @@
 #include "crypt_symkey.h"
 #include "ikev2_prf.h"
 #include "kernel.h"
+#include "server.h"		/* for pluto_ike_sk_offload */
+#include "server_pool.h"
+/*
+ * What is needed to compute a CHILD SA's KEYMAT.
+ *
+ * Inline the keys and nonces are borrowed from the CHILD SA; when the
+ * KEYMAT is computed on a helper thread they are referenced and
+ * cloned (see prepare_v2_child_keymat()).
+ */
 
-void ikev2_derive_child_keys(struct child_sa *child)
+struct v2_child_keymat {
+	const struct prf_desc *prf;
+	PK11SymKey *skey_d;
+	PK11SymKey *shared;
+	chunk_t ni;
+	chunk_t nr;
+	size_t keymat_len;
+	/* out */
+	chunk_t ikeymat;
+	chunk_t rkeymat;
+};
+
+static struct ipsec_proto_info *child_proto_info(struct child_sa *child)
 {
 	struct state *st = &child->sa;
-	chunk_t ikeymat, rkeymat;
 	/* ??? note assumption that AH and ESP cannot be combined */
 	struct ipsec_proto_info *ipi =
 		st->st_esp.present? &st->st_esp :
@@ -60,6 +80,13 @@ void ikev2_derive_child_keys(struct child_sa *child)
 
 	passert(ipi != NULL);	/* ESP or AH must be present */
 	passert(st->st_esp.present != st->st_ah.present);	/* only one */
+	return ipi;
+}
+
+static struct v2_child_keymat v2_child_keymat(struct child_sa *child)
+{
+	struct state *st = &child->sa;
+	struct ipsec_proto_info *ipi = child_proto_info(child);
 
 	/*
 	 * Integrity seed (key).  AEAD, for instance has NULL (no)
@@ -88,6 +115,28 @@ void ikev2_derive_child_keys(struct child_sa *child)
 	    encrypt_key_size, encrypt_salt_size,
 	    ipi->keymat_len);
 
+	struct v2_child_keymat k = {
+		.prf = st->st_oakley.ta_prf,
+		.skey_d = st->st_skey_d_nss,
+		.ni = st->st_ni,
+		.nr = st->st_nr,
+		.keymat_len = ipi->keymat_len,
+	};
+	if (st->st_pfs_group != NULL) {
+		DBGF(DBG_CRYPT, "#%lu %s add g^ir to child key %p",
+		     st->st_serialno, st->st_state->name, st->st_dh_shared_secret);
+		k.shared = st->st_dh_shared_secret;
+	}
+	return k;
+}
+
+/*
+ * Compute the KEYMAT.  Only touches K so can be run on any thread.
+ */
+
+void compute_v2_child_keymat(struct v2_child_keymat *k,
+			     struct logger *logger)
+{
 	/*
 	 *
 	 * Keying material MUST be taken from the expanded KEYMAT in the
@@ -107,34 +156,38 @@ void ikev2_derive_child_keys(struct child_sa *child)
 	 *    For AES GCM (RFC 4106 Section 8,1) we need to add 4 bytes for
 	 *    salt (AES_GCM_SALT_BYTES)
 	 */
-	PK11SymKey *shared = NULL;
-	if (st->st_pfs_group != NULL) {
-		DBGF(DBG_CRYPT, "#%lu %s add g^ir to child key %p",
-		     st->st_serialno, st->st_state->name, st->st_dh_shared_secret);
-		shared = st->st_dh_shared_secret;
-	}
-
-	PK11SymKey *keymat = ikev2_child_sa_keymat(st->st_oakley.ta_prf,
-						   st->st_skey_d_nss,
-						   shared,
-						   st->st_ni,
-						   st->st_nr,
-						   ipi->keymat_len * 2,
-						   st->st_logger);
-	PK11SymKey *ikey = key_from_symkey_bytes(keymat, 0, ipi->keymat_len,
-						 HERE, st->st_logger);
-	ikeymat = chunk_from_symkey("initiator to responder keys", ikey,
-				    st->st_logger);
+	PK11SymKey *keymat = ikev2_child_sa_keymat(k->prf,
+						   k->skey_d,
+						   k->shared,
+						   k->ni,
+						   k->nr,
+						   k->keymat_len * 2,
+						   logger);
+	PK11SymKey *ikey = key_from_symkey_bytes(keymat, 0, k->keymat_len,
+						 HERE, logger);
+	k->ikeymat = chunk_from_symkey("initiator to responder keys", ikey,
+				       logger);
 	release_symkey(__func__, "ikey", &ikey);
 
-	PK11SymKey *rkey = key_from_symkey_bytes(keymat, ipi->keymat_len,
-						 ipi->keymat_len,
-						 HERE, st->st_logger);
-	rkeymat = chunk_from_symkey("responder to initiator keys:", rkey,
-				    st->st_logger);
+	PK11SymKey *rkey = key_from_symkey_bytes(keymat, k->keymat_len,
+						 k->keymat_len,
+						 HERE, logger);
+	k->rkeymat = chunk_from_symkey("responder to initiator keys:", rkey,
+				       logger);
 	release_symkey(__func__, "rkey", &rkey);
 
 	release_symkey(__func__, "keymat", &keymat);
+}
+
+/*
+ * Hand the KEYMAT over to the CHILD SA.
+ */
+
+static void store_child_keymat(struct child_sa *child,
+			       struct v2_child_keymat *k)
+{
+	struct ipsec_proto_info *ipi = child_proto_info(child);
+	pexpect(ipi->keymat_len == k->keymat_len);
 
 	/*
 	 * The initiator stores outgoing initiator-to-responder keymat
@@ -144,21 +197,127 @@ void ikev2_derive_child_keys(struct child_sa *child)
 	switch (child->sa.st_sa_role) {
 	case SA_RESPONDER:
 		if (DBGP(DBG_PRIVATE) || DBGP(DBG_CRYPT)) {
-			    DBG_dump_hunk("our  keymat", ikeymat);
-			    DBG_dump_hunk("peer keymat", rkeymat);
+			    DBG_dump_hunk("our  keymat", k->ikeymat);
+			    DBG_dump_hunk("peer keymat", k->rkeymat);
 		}
-		ipi->our_keymat = ikeymat.ptr;
-		ipi->peer_keymat = rkeymat.ptr;
+		ipi->our_keymat = k->ikeymat.ptr;
+		ipi->peer_keymat = k->rkeymat.ptr;
 		break;
 	case SA_INITIATOR:
 		if (DBGP(DBG_PRIVATE) || DBGP(DBG_CRYPT)) {
-			DBG_dump_hunk("our  keymat", rkeymat);
-			DBG_dump_hunk("peer keymat", ikeymat);
+			DBG_dump_hunk("our  keymat", k->rkeymat);
+			DBG_dump_hunk("peer keymat", k->ikeymat);
 		}
-		ipi->peer_keymat = ikeymat.ptr;
-		ipi->our_keymat = rkeymat.ptr;
+		ipi->peer_keymat = k->ikeymat.ptr;
+		ipi->our_keymat = k->rkeymat.ptr;
 		break;
 	default:
 		bad_case(child->sa.st_sa_role);
 	}
+	/* now owned by the CHILD SA */
+	k->ikeymat = empty_chunk;
+	k->rkeymat = empty_chunk;
+}
+
+void ikev2_derive_child_keys(struct child_sa *child)
+{
+	struct v2_child_keymat k = v2_child_keymat(child);
+	compute_v2_child_keymat(&k, child->sa.st_logger);
+	store_child_keymat(child, &k);
+}
+
+struct v2_child_keymat *prepare_v2_child_keymat(struct child_sa *child)
+{
+	struct v2_child_keymat k = v2_child_keymat(child);
+	struct v2_child_keymat *keymat = alloc_thing(struct v2_child_keymat, "child keymat");
+	*keymat = (struct v2_child_keymat) {
+		.prf = k.prf,
+		.skey_d = reference_symkey(__func__, "SK_d", k.skey_d),
+		.shared = reference_symkey(__func__, "g^ir", k.shared),
+		.ni = clone_hunk(k.ni, "Ni"),
+		.nr = clone_hunk(k.nr, "Nr"),
+		.keymat_len = k.keymat_len,
+	};
+	return keymat;
+}
+
+void install_v2_child_keymat(struct child_sa *child,
+			     struct v2_child_keymat **keymat)
+{
+	store_child_keymat(child, *keymat);
+	free_v2_child_keymat(keymat);
+}
+
+void free_v2_child_keymat(struct v2_child_keymat **keymat)
+{
+	if (*keymat == NULL) {
+		return;
+	}
+	release_symkey(__func__, "SK_d", &(*keymat)->skey_d);
+	release_symkey(__func__, "g^ir", &(*keymat)->shared);
+	free_chunk_content(&(*keymat)->ni);
+	free_chunk_content(&(*keymat)->nr);
+	free_chunk_content(&(*keymat)->ikeymat);
+	free_chunk_content(&(*keymat)->rkeymat);
+	pfreeany(*keymat);
+}
+
+/*
+ * With ike-sk-offload=yes, the IKE_AUTH initiator computes its CHILD
+ * SA's KEYMAT on a helper thread.
+ */
+
+struct task {
+	struct v2_child_keymat *keymat;
+	v2_child_keymat_cb *cb;
+};
+
+static task_computer_fn v2_child_keymat_computer; /* type check */
+static task_completed_cb v2_child_keymat_completed; /* type check */
+static task_cleanup_cb v2_child_keymat_cleanup; /* type check */
+
+static struct task_handler v2_child_keymat_handler = {
+	.name = "child keymat",
+	.computer_fn = v2_child_keymat_computer,
+	.completed_cb = v2_child_keymat_completed,
+	.cleanup_cb = v2_child_keymat_cleanup,
+};
+
+bool submit_v2_child_keymat(struct child_sa *child, struct msg_digest *md,
+			    v2_child_keymat_cb *cb)
+{
+	if (!pluto_ike_sk_offload ||
+	    md->hdr.isa_xchg != ISAKMP_v2_IKE_AUTH ||
+	    /* CHILD SA is what is made busy */
+	    md->st != &child->sa) {
+		return false;
+	}
+
+	struct task *task = alloc_thing(struct task, "child keymat task");
+	task->keymat = prepare_v2_child_keymat(child);
+	task->cb = cb;
+	submit_task(child->sa.st_logger, &child->sa /*state to resume*/, task,
+		    &v2_child_keymat_handler, "computing child keymat");
+	return true;
+}
+
+static void v2_child_keymat_computer(struct logger *logger, struct task *task,
+				     int unused_my_thread UNUSED)
+{
+	compute_v2_child_keymat(task->keymat, logger);
+}
+
+static stf_status v2_child_keymat_completed(struct state *st,
+					    struct msg_digest *md,
+					    struct task *task)
+{
+	struct child_sa *child = pexpect_child_sa(st);
+	install_v2_child_keymat(child, &task->keymat);
+	return task->cb(child, md);
+}
+
+static void v2_child_keymat_cleanup(struct task **task)
+{
+	free_v2_child_keymat(&(*task)->keymat);
+	pfreeany(*task);
 }
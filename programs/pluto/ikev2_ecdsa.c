@@ -166,7 +166,8 @@ static err_t try_signature_ECDSA_ikev2(const struct crypt_mac *hash,
 stf_status ikev2_verify_ecdsa_hash(struct ike_sa *ike,
 				   const struct crypt_mac *idhash,
 				   shunk_t signature,
-				   const struct hash_desc *hash_algo)
+				   const struct hash_desc *hash_algo,
+				   struct signature_check **deferred)
 {
 	if (hash_algo->common.ikev2_alg_id < 0) {
 		return STF_FATAL;
@@ -174,6 +175,11 @@ stf_status ikev2_verify_ecdsa_hash(struct ike_sa *ike,
 
 	struct crypt_mac calc_hash = v2_calculate_sighash(ike, idhash, hash_algo,
 							  REMOTE_PERSPECTIVE);
+	if (deferred != NULL) {
+		*deferred = prepare_signature_check(ike, &calc_hash, signature, hash_algo,
+						    &pubkey_type_ecdsa, try_signature_ECDSA_ikev2);
+		return STF_OK;
+	}
 	return check_signature_gen(ike, &calc_hash, signature, hash_algo,
 				   &pubkey_type_ecdsa, try_signature_ECDSA_ikev2);
 }
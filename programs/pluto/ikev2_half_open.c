@@ -0,0 +1,495 @@
+/* compact half-open IKEv2 responder SAs, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "defs.h"
+#include "log.h"
+#include "state.h"
+#include "state_db.h"		/* for state_by_serialno() */
+#include "connections.h"
+#include "connection_db.h"	/* for connection_by_serialno() */
+#include "demux.h"
+#include "iface.h"
+#include "ip_protocol.h"
+#include "ikev2.h"		/* for free_ikev2_proposal() */
+#include "ikev2_send.h"		/* for free_v2_outgoing_fragments() */
+#include "ikev2_half_open.h"
+#include "crypt_dh.h"		/* for dh_local_secret_delref() */
+#include "hash_table.h"
+#include "list_entry.h"
+#include "slab.h"
+#include "send.h"		/* for send_chunk_using_iface() */
+#include "server.h"		/* for pluto_compact_halfopen */
+#include "timer.h"
+#include "pluto_stats.h"
+
+/*
+ * Once the responder has sent its IKE_SA_INIT response all that is
+ * needed to finish the exchange is: the SPIs, the nonces and KE
+ * values (and local DH secret) for SKEYSEED, the accepted algorithms,
+ * the two IKE_SA_INIT messages for the AUTH payload, and the
+ * endpoints.  A full struct state (plus its logger, events and
+ * message queues) is a lot to keep around for a peer that may never
+ * send IKE_AUTH, so the record below holds just that and the state
+ * is freed.
+ *
+ * The SA's serial number is kept and, while compacted, it stays
+ * counted as STATE_PARENT_R1 so the half-open/DDOS thresholds still
+ * see it.
+ *
+ * IKE_AUTH is not authenticated here; the restored IKE SA does that
+ * when it computes SKEYSEED and decrypts the message, exactly as if
+ * it had never been compacted.
+ */
+
+struct v2_half_open {
+	struct list_entry spi_entry;		/* hashed on SPIi */
+	struct list_entry fifo_entry;		/* pending, then expiry */
+	so_serial_t serialno;
+	ike_spis_t spis;
+	monotime_t expires;
+	realtime_t inception;
+	struct state_timing timing;
+	struct {
+		enum sa_type sa_type;
+		enum delete_reason delete_reason;
+	} pstats;
+	/* the connection; or the template it was instantiated from */
+	co_serial_t connection;
+	bool instance;
+	ip_endpoint remote_endpoint;
+	ip_endpoint local_endpoint;
+	lset_t policy;
+	struct hidden_variables hidden_variables;
+	struct v2_msgid_windows msgid_windows;
+	/* negotiated */
+	struct trans_attrs oakley;
+	struct ikev2_proposal *accepted_ike_proposal;
+	lset_t hash_negotiated;
+	bool seen_fragmentation_supported;
+	bool seen_ppk;
+	bool seen_intermediate;
+	bool seen_redirect_sup;
+	bool seen_hashnotify;
+	/* keying material */
+	chunk_t ni;
+	chunk_t nr;
+	chunk_t gi;
+	chunk_t gr;
+	struct dh_local_secret *dh_local_secret;
+	/* IKE_SA_INIT request, and response */
+	chunk_t firstpacket_peer;
+	chunk_t firstpacket_me;	/* empty when same as RESPONSE */
+	struct v2_outgoing_fragment *response;
+};
+
+static struct slab_pool half_open_pool = SLAB_POOL(struct v2_half_open, "struct v2_half_open");
+
+static void jam_half_open(struct jambuf *buf, const void *data)
+{
+	if (data == NULL) {
+		jam(buf, "NULL half-open IKE SA");
+	} else {
+		const struct v2_half_open *h = data;
+		jam(buf, "half-open IKE SA #%lu", h->serialno);
+	}
+}
+
+static const struct list_info half_open_fifo_info = {
+	.name = "half-open IKE SA fifo",
+	.jam = jam_half_open,
+};
+
+/* queued by queue_v2_half_open(); waiting for the timer */
+static struct list_head pending_half_opens = INIT_LIST_HEAD(&pending_half_opens, &half_open_fifo_info);
+/* compacted, oldest (first to expire) first */
+static struct list_head compact_half_opens = INIT_LIST_HEAD(&compact_half_opens, &half_open_fifo_info);
+static bool compaction_scheduled;
+
+static hash_t half_open_hasher(const ike_spi_t *initiator)
+{
+	return hash_table_hasher(shunk2(initiator, sizeof(*initiator)), zero_hash);
+}
+
+static hash_t half_open_entry_hasher(const void *data)
+{
+	const struct v2_half_open *h = data;
+	return half_open_hasher(&h->spis.initiator);
+}
+
+static struct list_entry *half_open_entry(void *data)
+{
+	struct v2_half_open *h = data;
+	return &h->spi_entry;
+}
+
+static struct list_head half_open_slots[1021];
+
+static struct hash_table half_open_hash_table = {
+	.info = {
+		.name = "half-open IKE SA table",
+		.jam = jam_half_open,
+	},
+	.hasher = half_open_entry_hasher,
+	.entry = half_open_entry,
+	.nr_slots = elemsof(half_open_slots),
+	.slots = half_open_slots,
+};
+
+static struct v2_half_open *find_half_open(const ike_spi_t *initiator)
+{
+	hash_t hash = half_open_hasher(initiator);
+	struct list_head *bucket = hash_table_bucket(&half_open_hash_table, hash);
+	struct v2_half_open *h;
+	FOR_EACH_LIST_ENTRY_OLD2NEW(bucket, h) {
+		if (ike_spi_eq(&h->spis.initiator, initiator)) {
+			return h;
+		}
+	}
+	return NULL;
+}
+
+static void free_half_open(struct v2_half_open **hp)
+{
+	struct v2_half_open *h = *hp;
+	*hp = NULL;
+	free_chunk_content(&h->ni);
+	free_chunk_content(&h->nr);
+	free_chunk_content(&h->gi);
+	free_chunk_content(&h->gr);
+	free_chunk_content(&h->firstpacket_peer);
+	free_chunk_content(&h->firstpacket_me);
+	free_ikev2_proposal(&h->accepted_ike_proposal);
+	dh_local_secret_delref(&h->dh_local_secret, HERE);
+	free_v2_outgoing_fragments(&h->response);
+	slab_free(&half_open_pool, h);
+}
+
+/*
+ * Throw away a compacted SA that will never be restored; it is
+ * counted as a failed IKE SA.
+ */
+
+static void discard_half_open(struct v2_half_open **hp, enum delete_reason reason)
+{
+	struct v2_half_open *h = *hp;
+	del_hash_table_entry(&half_open_hash_table, h);
+	remove_list_entry(&h->fifo_entry);
+	pstat_compacted_ike_sa_deleted(reason);
+	uncount_compacted_state(STATE_PARENT_R1);
+	free_half_open(hp);
+}
+
+/*
+ * Is the IKE SA really just sitting in R1 waiting for IKE_AUTH?
+ * Anything else in flight (crypto, a suspended message, fragments,
+ * a further exchange) and it is left alone.
+ */
+
+static bool can_compact(const struct ike_sa *ike)
+{
+	const struct state *st = &ike->sa;
+	const struct connection *c = st->st_connection;
+	return (st->st_state->kind == STATE_PARENT_R1 &&
+		st->st_sa_role == SA_RESPONDER &&
+		st->st_offloaded_task == NULL &&
+		st->st_suspended_md == NULL &&
+		!st->st_intermediate_used &&
+		st->st_interface != NULL &&
+		st->st_interface->protocol == &ip_protocol_udp &&
+		!LIN(POLICY_OPPORTUNISTIC, c->policy) &&
+		st->st_v2_msgid_windows.responder.recv == 0 &&
+		st->st_v2_msgid_windows.responder.sent == 0 &&
+		st->st_v2_msgid_windows.initiator.pending == NULL &&
+		st->st_v2_msgid_wip.initiator == -1 &&
+		st->st_v2_msgid_wip.responder == -1 &&
+		st->st_event != NULL &&
+		st->st_event->ev_type == EVENT_SO_DISCARD &&
+		st->st_retransmit_event == NULL &&
+		st->st_liveness_event == NULL &&
+		st->st_rel_whack_event == NULL &&
+		st->st_send_xauth_event == NULL &&
+		st->st_addr_change_event == NULL &&
+		st->st_dpd_event == NULL &&
+		st->st_v2_outgoing[MESSAGE_REQUEST] == NULL &&
+		st->st_v2_outgoing[MESSAGE_RESPONSE] != NULL &&
+		st->st_v2_outgoing[MESSAGE_RESPONSE]->next == NULL &&
+		st->st_v2_incoming[MESSAGE_REQUEST] == NULL &&
+		st->st_v2_incoming[MESSAGE_RESPONSE] == NULL &&
+		st->st_v2_rfrags == NULL);
+}
+
+static void compact_half_open(struct ike_sa *ike, struct v2_half_open *h)
+{
+	struct state *st = &ike->sa;
+	const struct connection *c = st->st_connection;
+
+	h->spis = st->st_ike_spis;
+	h->expires = st->st_event->ev_time;
+	h->inception = st->st_inception;
+	h->timing = st->st_timing;
+	h->pstats.sa_type = st->st_pstats.sa_type;
+	h->pstats.delete_reason = st->st_pstats.delete_reason;
+	h->instance = (c->kind == CK_INSTANCE);
+	h->connection = (h->instance ? c->serial_from : c->serialno);
+	h->remote_endpoint = st->st_remote_endpoint;
+	h->local_endpoint = st->st_interface->local_endpoint;
+	h->policy = st->st_policy;
+	h->hidden_variables = st->hidden_variables;
+	h->msgid_windows = st->st_v2_msgid_windows;
+
+	h->oakley = st->st_oakley;
+	h->accepted_ike_proposal = st->st_accepted_ike_proposal;
+	st->st_accepted_ike_proposal = NULL;
+	h->hash_negotiated = st->st_hash_negotiated;
+	h->seen_fragmentation_supported = st->st_seen_fragmentation_supported;
+	h->seen_ppk = st->st_seen_ppk;
+	h->seen_intermediate = st->st_seen_intermediate;
+	h->seen_redirect_sup = st->st_seen_redirect_sup;
+	h->seen_hashnotify = st->st_seen_hashnotify;
+
+	h->ni = st->st_ni;
+	st->st_ni = empty_chunk;
+	h->nr = st->st_nr;
+	st->st_nr = empty_chunk;
+	h->gi = st->st_gi;
+	st->st_gi = empty_chunk;
+	h->gr = st->st_gr;
+	st->st_gr = empty_chunk;
+	h->dh_local_secret = st->st_dh_local_secret;
+	st->st_dh_local_secret = NULL;
+
+	h->firstpacket_peer = st->st_firstpacket_peer;
+	st->st_firstpacket_peer = empty_chunk;
+	h->response = st->st_v2_outgoing[MESSAGE_RESPONSE];
+	st->st_v2_outgoing[MESSAGE_RESPONSE] = NULL;
+	/* the response is what gets signed; don't keep it twice */
+	if (hunk_eq(st->st_firstpacket_me,
+		    shunk2(h->response->ptr, h->response->len))) {
+		free_chunk_content(&st->st_firstpacket_me);
+	} else {
+		h->firstpacket_me = st->st_firstpacket_me;
+		st->st_firstpacket_me = empty_chunk;
+	}
+
+	dbg("half-open: compacting IKE SA #%lu", h->serialno);
+	free_compacted_state(st);
+
+	add_hash_table_entry(&half_open_hash_table, h);
+	insert_list_entry(&compact_half_opens, &h->fifo_entry);
+}
+
+static void process_half_opens(struct logger *logger)
+{
+	compaction_scheduled = false;
+
+	struct v2_half_open *h;
+	FOR_EACH_LIST_ENTRY_OLD2NEW(&pending_half_opens, h) {
+		remove_list_entry(&h->fifo_entry);
+		struct state *st = state_by_serialno(h->serialno);
+		if (st != NULL && IS_IKE_SA(st) &&
+		    can_compact(pexpect_ike_sa(st))) {
+			compact_half_open(pexpect_ike_sa(st), h);
+		} else {
+			dbg("half-open: IKE SA #%lu moved on; not compacting",
+			    h->serialno);
+			slab_free(&half_open_pool, h);
+		}
+	}
+
+	monotime_t now = mononow();
+	FOR_EACH_LIST_ENTRY_OLD2NEW(&compact_half_opens, h) {
+		if (monobefore(now, h->expires)) {
+			schedule_oneshot_timer(EVENT_v2_HALF_OPEN,
+					       monotimediff(h->expires, now));
+			break;
+		}
+		struct logger from = logger_from(logger, &h->remote_endpoint);
+		deltatime_buf dtb;
+		llog(RC_LOG, &from,
+		     "half-open IKE SA #%lu: deleting incomplete state after %s seconds",
+		     h->serialno, str_deltatime(MAXIMUM_RESPONDER_WAIT_DELAY, &dtb));
+		discard_half_open(&h, REASON_EXCHANGE_TIMEOUT);
+	}
+}
+
+void queue_v2_half_open(struct ike_sa *ike)
+{
+	if (!pluto_compact_halfopen) {
+		return;
+	}
+	struct v2_half_open *h = slab_alloc_thing(&half_open_pool, struct v2_half_open,
+						  "half-open IKE SA");
+	h->serialno = ike->sa.st_serialno;
+	h->spi_entry = list_entry(&half_open_hash_table.info, h);
+	h->fifo_entry = list_entry(&half_open_fifo_info, h);
+	insert_list_entry(&pending_half_opens, &h->fifo_entry);
+	if (!compaction_scheduled) {
+		schedule_oneshot_timer(EVENT_v2_HALF_OPEN, deltatime(0));
+		compaction_scheduled = true;
+	}
+}
+
+bool have_v2_half_open(const ike_spi_t *initiator)
+{
+	return find_half_open(initiator) != NULL;
+}
+
+bool resend_v2_half_open_response(struct msg_digest *md)
+{
+	struct v2_half_open *h = find_half_open(&md->hdr.isa_ike_initiator_spi);
+	if (h == NULL) {
+		return false;
+	}
+	/* XXX: log messages match the state-based code */
+	intmax_t msgid = md->hdr.isa_msgid;
+	if (hunk_eq(h->firstpacket_peer, pbs_in_as_shunk(&md->message_pbs))) {
+		llog(RC_LOG, md->md_logger,
+		     "received duplicate %s message request (Message ID %jd); retransmitting response",
+		     enum_name_short(&ikev2_exchange_names, md->hdr.isa_xchg),
+		     msgid);
+		chunk_t response = chunk2(h->response->ptr, h->response->len);
+		send_chunk_using_iface(md->iface, &md->sender,
+				       "IKE_SA_INIT responder retransmit",
+				       response, md->md_logger);
+	} else {
+		llog(RC_LOG, md->md_logger,
+		     "received too old retransmit: %jd < %jd",
+		     msgid, h->msgid_windows.responder.sent);
+	}
+	return true;
+}
+
+struct ike_sa *promote_v2_half_open(struct msg_digest *md)
+{
+	if (md->hdr.isa_xchg != ISAKMP_v2_IKE_AUTH ||
+	    v2_msg_role(md) != MESSAGE_REQUEST ||
+	    md->hdr.isa_msgid != 1 ||
+	    (md->hdr.isa_np != ISAKMP_NEXT_v2SK &&
+	     md->hdr.isa_np != ISAKMP_NEXT_v2SKF)) {
+		return NULL;
+	}
+
+	struct v2_half_open *h = find_half_open(&md->hdr.isa_ike_initiator_spi);
+	if (h == NULL ||
+	    !ike_spis_eq(&h->spis, &md->hdr.isa_ike_spis)) {
+		return NULL;
+	}
+
+	ip_address remote_address = endpoint_address(&h->remote_endpoint);
+	if (!endpoint_address_eq(&md->sender, &remote_address)) {
+		dbg("half-open: IKE_AUTH for IKE SA #%lu from the wrong address",
+		    h->serialno);
+		return NULL;
+	}
+
+	/*
+	 * Find the connection again; a road warrior instance was
+	 * deleted along with the state so re-instantiate it.
+	 */
+	struct connection *c = connection_by_serialno(h->connection);
+	if (c != NULL && h->instance) {
+		c = (c->kind == CK_TEMPLATE ?
+		     rw_instantiate(c, &remote_address, NULL, NULL) : NULL);
+	}
+	struct iface_endpoint *ifp = find_iface_endpoint_by_local_endpoint(&h->local_endpoint);
+	if (c == NULL || ifp == NULL) {
+		llog(RC_LOG, md->md_logger,
+		     "half-open IKE SA #%lu: %s has gone; dropping IKE_AUTH request",
+		     h->serialno, (c == NULL ? "connection" : "interface"));
+		if (c != NULL && c->kind == CK_INSTANCE && h->instance) {
+			delete_connection(c, false);
+		}
+		discard_half_open(&h, REASON_UNKNOWN);
+		return NULL;
+	}
+
+	struct ike_sa *ike = restore_v2_ike_state(c, h->serialno, &h->spis,
+						  STATE_PARENT_R1,
+						  finite_states[STATE_PARENT_R0]->v2_transitions,
+						  h->policy);
+	struct state *st = &ike->sa;
+	st->st_inception = h->inception;
+	st->st_timing = h->timing;
+	st->st_pstats.sa_type = h->pstats.sa_type;
+	st->st_pstats.delete_reason = h->pstats.delete_reason;
+	st->st_interface = ifp;
+	st->st_remote_endpoint = h->remote_endpoint;
+	st->st_policy = h->policy;
+	st->hidden_variables = h->hidden_variables;
+	st->st_v2_msgid_windows = h->msgid_windows;
+
+	st->st_oakley = h->oakley;
+	st->st_accepted_ike_proposal = h->accepted_ike_proposal;
+	h->accepted_ike_proposal = NULL;
+	st->st_hash_negotiated = h->hash_negotiated;
+	st->st_seen_fragmentation_supported = h->seen_fragmentation_supported;
+	st->st_seen_ppk = h->seen_ppk;
+	st->st_seen_intermediate = h->seen_intermediate;
+	st->st_seen_redirect_sup = h->seen_redirect_sup;
+	st->st_seen_hashnotify = h->seen_hashnotify;
+
+	st->st_ni = h->ni;
+	h->ni = empty_chunk;
+	st->st_nr = h->nr;
+	h->nr = empty_chunk;
+	st->st_gi = h->gi;
+	h->gi = empty_chunk;
+	st->st_gr = h->gr;
+	h->gr = empty_chunk;
+	st->st_dh_local_secret = h->dh_local_secret;
+	h->dh_local_secret = NULL;
+
+	st->st_firstpacket_peer = h->firstpacket_peer;
+	h->firstpacket_peer = empty_chunk;
+	if (h->firstpacket_me.ptr == NULL) {
+		st->st_firstpacket_me = clone_bytes_as_chunk(h->response->ptr, h->response->len,
+							     "saved first packet");
+	} else {
+		st->st_firstpacket_me = h->firstpacket_me;
+		h->firstpacket_me = empty_chunk;
+	}
+	st->st_v2_outgoing[MESSAGE_RESPONSE] = h->response;
+	h->response = NULL;
+
+	monotime_t now = mononow();
+	deltatime_t remaining = (monobefore(now, h->expires) ?
+				 monotimediff(h->expires, now) : deltatime(0));
+	event_schedule(EVENT_SO_DISCARD, remaining, st);
+
+	dbg("half-open: restored IKE SA #%lu for IKE_AUTH", st->st_serialno);
+	del_hash_table_entry(&half_open_hash_table, h);
+	remove_list_entry(&h->fifo_entry);
+	free_half_open(&h);
+	return ike;
+}
+
+void init_v2_half_open(void)
+{
+	init_hash_table(&half_open_hash_table);
+	init_oneshot_timer(EVENT_v2_HALF_OPEN, process_half_opens);
+}
+
+void free_v2_half_open(void)
+{
+	struct v2_half_open *h;
+	FOR_EACH_LIST_ENTRY_OLD2NEW(&pending_half_opens, h) {
+		remove_list_entry(&h->fifo_entry);
+		slab_free(&half_open_pool, h);
+	}
+	FOR_EACH_LIST_ENTRY_OLD2NEW(&compact_half_opens, h) {
+		del_hash_table_entry(&half_open_hash_table, h);
+		remove_list_entry(&h->fifo_entry);
+		uncount_compacted_state(STATE_PARENT_R1);
+		free_half_open(&h);
+	}
+}
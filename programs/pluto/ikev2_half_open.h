@@ -0,0 +1,46 @@
+/* compact half-open IKEv2 responder SAs, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#ifndef IKEV2_HALF_OPEN_H
+#define IKEV2_HALF_OPEN_H
+
+#include <stdbool.h>
+
+#include "ike_spi.h"
+
+struct ike_sa;
+struct msg_digest;
+
+/*
+ * With compact-halfopen-ike=yes, once a responder has answered
+ * IKE_SA_INIT its IKE SA is swapped for a small record holding just
+ * the SPIs, nonces, KE, negotiated algorithms and endpoints.  The IKE
+ * SA is rebuilt when the matching IKE_AUTH request arrives.
+ */
+
+void init_v2_half_open(void);
+void free_v2_half_open(void);
+
+/* after the IKE_SA_INIT response; compacted from a timer */
+void queue_v2_half_open(struct ike_sa *ike);
+
+/* is there a compacted SA for SPIi? */
+bool have_v2_half_open(const ike_spi_t *initiator);
+
+/* true when MD was a duplicate IKE_SA_INIT for a compacted SA */
+bool resend_v2_half_open_response(struct msg_digest *md);
+
+/* rebuild the IKE SA for an IKE_AUTH request, or NULL */
+struct ike_sa *promote_v2_half_open(struct msg_digest *md);
+
+#endif
@@ -41,6 +41,7 @@
 #include "secrets.h"
 #include "ip_address.h"
 #include "ip_info.h"
+#include "pubkey_db.h"
 
 struct p_dns_req;
 
@@ -262,7 +263,7 @@ static err_t add_rsa_pubkey_to_pluto(struct p_dns_req *dnsr, ldns_rdf *rdf,
 			    str_id(&st->st_connection->spd.that.id, &thatidbuf));
 		}
 		/* delete only once. then multiple keys could be added */
-		delete_public_keys(&pluto_pubkeys, keyid, &pubkey_type_rsa);
+		delete_pubkey_db_keys(keyid, &pubkey_type_rsa);
 		dnsr->delete_existing_keys = FALSE;
 	}
 
@@ -285,10 +286,12 @@ static err_t add_rsa_pubkey_to_pluto(struct p_dns_req *dnsr, ldns_rdf *rdf,
 	}
 
 	realtime_t install_time = realnow();
+	struct pubkey_list *dns_pubkeys = NULL;
 	err_t ugh = add_public_key(keyid, /*dns_auth_level*/al,
 				   &pubkey_type_rsa,
 				   install_time, realtimesum(install_time, deltatime(ttl_used)),
-				   ttl, &keyval, NULL/*don't-return-pubkey*/, &pluto_pubkeys);
+				   ttl, &keyval, NULL/*don't-return-pubkey*/, &dns_pubkeys);
+	add_pubkey_db_keys(&dns_pubkeys);
 	if (ugh != NULL) {
 		id_buf thatidbuf;
 		llog(RC_LOG_SERIOUS, dnsr->logger,
@@ -47,6 +47,10 @@
 #include "iface.h"
 #include "ip_protocol.h"
 #include "ikev2_send.h"
+#include "ikev2.h"		/* for ikev2_process_state_packet() */
+#include "server_pool.h"
+#include "crypt_symkey.h"
+#include "state_db.h"		/* for child_sa_by_serialno() */
 
 /*
  * Determine the IKE version we will use for the IKE packet
@@ -490,72 +494,143 @@ static void compute_intermediate_mac(struct ike_sa *ike,
 	*out = clone_hunk(mac, "IntAuth");
 }
 
-stf_status encrypt_v2SK_payload(v2SK_payload_t *sk)
-{
-	struct ike_sa *ike = sk->ike;
-	uint8_t *auth_start = sk->pbs.container->start;
-	uint8_t *wire_iv_start = sk->iv.ptr;
-	uint8_t *enc_start = sk->cleartext.ptr;
-	uint8_t *integ_start = sk->integrity.ptr;
-	size_t integ_size = sk->integrity.len;
-	uint8_t exchange_type = *(auth_start + EXCH_TYPE_OFFSET);
-
-	passert(auth_start <= wire_iv_start);
-	passert(wire_iv_start <= enc_start);
-	passert(enc_start <= integ_start);
+/*
+ * What is needed to encrypt our, or verify and decrypt the peer's, SK
+ * payloads.
+ *
+ * Inline the keys are borrowed from the IKE SA; when the work is run
+ * on a helper thread they are referenced (see submit_v2_decrypt_msg()
+ * and submit_v2SK_message()).
+ */
 
-	chunk_t salt;
+struct v2_sk_keys {
+	const struct encrypt_desc *encrypt;
+	const struct integ_desc *integ;
 	PK11SymKey *cipherkey;
 	PK11SymKey *authkey;
-	PK11SymKey *intermediate_key;
-	/* encrypt with our end's key */
-	switch (ike->sa.st_sa_role) {
+	chunk_t salt;
+};
+
+static struct v2_sk_keys v2_sk_keys(struct ike_sa *ike, enum sa_role role)
+{
+	struct v2_sk_keys k = {
+		.encrypt = ike->sa.st_oakley.ta_encrypt,
+		.integ = ike->sa.st_oakley.ta_integ,
+	};
+	switch (role) {
 	case SA_INITIATOR:
-		cipherkey = ike->sa.st_skey_ei_nss;
-		authkey = ike->sa.st_skey_ai_nss;
-		salt = ike->sa.st_skey_initiator_salt;
-		intermediate_key = ike->sa.st_skey_pi_nss;
+		k.cipherkey = ike->sa.st_skey_ei_nss;
+		k.authkey = ike->sa.st_skey_ai_nss;
+		k.salt = ike->sa.st_skey_initiator_salt;
 		break;
 	case SA_RESPONDER:
-		cipherkey = ike->sa.st_skey_er_nss;
-		authkey = ike->sa.st_skey_ar_nss;
-		salt = ike->sa.st_skey_responder_salt;
-		intermediate_key = ike->sa.st_skey_pr_nss;
+		k.cipherkey = ike->sa.st_skey_er_nss;
+		k.authkey = ike->sa.st_skey_ar_nss;
+		k.salt = ike->sa.st_skey_responder_salt;
 		break;
+	default:
+		bad_case(role);
+	}
+	return k;
+}
+
+/* encrypt with our end's key */
+static struct v2_sk_keys v2_sk_encrypt_keys(struct ike_sa *ike)
+{
+	return v2_sk_keys(ike, ike->sa.st_sa_role);
+}
+
+/* decrypt with the peer's key */
+static struct v2_sk_keys v2_sk_decrypt_keys(struct ike_sa *ike)
+{
+	switch (ike->sa.st_sa_role) {
+	case SA_INITIATOR:
+		return v2_sk_keys(ike, SA_RESPONDER);
+	case SA_RESPONDER:
+		return v2_sk_keys(ike, SA_INITIATOR);
 	default:
 		bad_case(ike->sa.st_sa_role);
 	}
+}
+
+static struct v2_sk_keys reference_v2_sk_keys(struct v2_sk_keys k)
+{
+	return (struct v2_sk_keys) {
+		.encrypt = k.encrypt,
+		.integ = k.integ,
+		.cipherkey = reference_symkey(__func__, "cipherkey", k.cipherkey),
+		.authkey = reference_symkey(__func__, "authkey", k.authkey),
+		.salt = clone_hunk(k.salt, "SK salt"),
+	};
+}
+
+static void release_v2_sk_keys(struct v2_sk_keys *k)
+{
+	release_symkey(__func__, "cipherkey", &k->cipherkey);
+	release_symkey(__func__, "authkey", &k->authkey);
+	free_chunk_content(&k->salt);
+}
+
+/*
+ * Where, relative to the start of the message, the SK payload's
+ * parts are.
+ */
+
+struct v2_sk_offsets {
+	size_t iv;
+	size_t cleartext;
+	size_t integrity;
+	size_t integ_size;
+};
+
+static struct v2_sk_offsets v2_sk_offsets(const v2SK_payload_t *sk)
+{
+	const uint8_t *auth_start = sk->pbs.container->start;
+	passert(auth_start <= sk->iv.ptr);
+	passert(sk->iv.ptr <= sk->cleartext.ptr);
+	passert(sk->cleartext.ptr <= sk->integrity.ptr);
+	return (struct v2_sk_offsets) {
+		.iv = sk->iv.ptr - auth_start,
+		.cleartext = sk->cleartext.ptr - auth_start,
+		.integrity = sk->integrity.ptr - auth_start,
+		.integ_size = sk->integrity.len,
+	};
+}
+
+/*
+ * Encrypt and then authenticate, in-place, the SK payload of MESSAGE.
+ * Only touches K and MESSAGE so can be run on any thread.
+ */
+
+static bool encrypt_sk(const struct v2_sk_keys *k, uint8_t *message,
+		       const struct v2_sk_offsets *sk,
+		       struct logger *logger)
+{
+	uint8_t *auth_start = message;
+	uint8_t *wire_iv_start = message + sk->iv;
+	uint8_t *enc_start = message + sk->cleartext;
+	uint8_t *integ_start = message + sk->integrity;
+	size_t integ_size = sk->integ_size;
 
 	/* size of plain or cipher text.  */
 	size_t enc_size = integ_start - enc_start;
 
-	/*
-	 * For Intermediate Exchange, apply PRF to the peer's messages
-	 * and store in state for further authentication.
-	 */
-	if (exchange_type == ISAKMP_v2_IKE_INTERMEDIATE) {
-		compute_intermediate_mac(ike, intermediate_key,
-					 auth_start,
-					 sk->cleartext /* inner payloads */,
-					 &ike->sa.st_intermediate_packet_me);
-	}
-
 	/* encrypt and authenticate the block */
-	if (encrypt_desc_is_aead(ike->sa.st_oakley.ta_encrypt)) {
+	if (encrypt_desc_is_aead(k->encrypt)) {
 		/*
 		 * Additional Authenticated Data - AAD - size.
 		 * RFC5282 says: The Initialization Vector and Ciphertext
 		 * fields [...] MUST NOT be included in the associated
 		 * data.
 		 */
-		size_t wire_iv_size = ike->sa.st_oakley.ta_encrypt->wire_iv_size;
-		pexpect(integ_size == ike->sa.st_oakley.ta_encrypt->aead_tag_size);
+		size_t wire_iv_size = k->encrypt->wire_iv_size;
+		pexpect(integ_size == k->encrypt->aead_tag_size);
 		unsigned char *aad_start = auth_start;
 		size_t aad_size = enc_start - aad_start - wire_iv_size;
 
 		/* now, encrypt */
 		if (DBGP(DBG_CRYPT)) {
-		    DBG_dump_hunk("Salt before authenticated encryption:", salt);
+		    DBG_dump_hunk("Salt before authenticated encryption:", k->salt);
 		    DBG_dump("IV before authenticated encryption:",
 			     wire_iv_start, wire_iv_size);
 		    DBG_dump("AAD before authenticated encryption:",
@@ -566,14 +641,14 @@ stf_status encrypt_v2SK_payload(v2SK_payload_t *sk)
 			     integ_start, integ_size);
 		}
 
-		if (!ike->sa.st_oakley.ta_encrypt->encrypt_ops
-		    ->do_aead(ike->sa.st_oakley.ta_encrypt,
-			      salt.ptr, salt.len,
+		if (!k->encrypt->encrypt_ops
+		    ->do_aead(k->encrypt,
+			      k->salt.ptr, k->salt.len,
 			      wire_iv_start, wire_iv_size,
 			      aad_start, aad_size,
 			      enc_start, enc_size, integ_size,
-			      cipherkey, true, sk->logger)) {
-			return STF_FAIL;
+			      k->cipherkey, true, logger)) {
+			return false;
 		}
 
 		if (DBGP(DBG_CRYPT)) {
@@ -587,20 +662,20 @@ stf_status encrypt_v2SK_payload(v2SK_payload_t *sk)
 		/* note: no iv is longer than MAX_CBC_BLOCK_SIZE */
 		unsigned char enc_iv[MAX_CBC_BLOCK_SIZE];
 		construct_enc_iv("encryption IV/starting-variable", enc_iv,
-				 wire_iv_start, salt,
-				 ike->sa.st_oakley.ta_encrypt);
+				 wire_iv_start, k->salt,
+				 k->encrypt);
 
 		/* now, encrypt */
 		if (DBGP(DBG_CRYPT)) {
 			DBG_dump("data before encryption:", enc_start, enc_size);
 		}
 
-		ike->sa.st_oakley.ta_encrypt->encrypt_ops
-			->do_crypt(ike->sa.st_oakley.ta_encrypt,
+		k->encrypt->encrypt_ops
+			->do_crypt(k->encrypt,
 				   enc_start, enc_size,
-				   cipherkey,
+				   k->cipherkey,
 				   enc_iv, TRUE,
-				   sk->logger);
+				   logger);
 
 		if (DBGP(DBG_CRYPT)) {
 			DBG_dump("data after encryption:", enc_start, enc_size);
@@ -609,11 +684,11 @@ stf_status encrypt_v2SK_payload(v2SK_payload_t *sk)
 		/* note: saved_iv's updated value is discarded */
 
 		/* okay, authenticate from beginning of IV */
-		struct crypt_prf *ctx = crypt_prf_init_symkey("integ", ike->sa.st_oakley.ta_integ->prf,
-							      "authkey", authkey, sk->logger);
+		struct crypt_prf *ctx = crypt_prf_init_symkey("integ", k->integ->prf,
+							      "authkey", k->authkey, logger);
 		crypt_prf_update_bytes(ctx, "message", auth_start, integ_start - auth_start);
-		passert(integ_size == ike->sa.st_oakley.ta_integ->integ_output_size);
-		struct crypt_mac mac = crypt_prf_final_mac(&ctx, ike->sa.st_oakley.ta_integ);
+		passert(integ_size == k->integ->integ_output_size);
+		struct crypt_mac mac = crypt_prf_final_mac(&ctx, k->integ);
 		memcpy_hunk(integ_start, mac, integ_size);
 
 		if (DBGP(DBG_CRYPT)) {
@@ -623,6 +698,43 @@ stf_status encrypt_v2SK_payload(v2SK_payload_t *sk)
 		}
 	}
 
+	return true;
+}
+
+stf_status encrypt_v2SK_payload(v2SK_payload_t *sk)
+{
+	struct ike_sa *ike = sk->ike;
+	uint8_t *auth_start = sk->pbs.container->start;
+	uint8_t exchange_type = *(auth_start + EXCH_TYPE_OFFSET);
+	struct v2_sk_offsets offsets = v2_sk_offsets(sk);
+
+	/*
+	 * For Intermediate Exchange, apply PRF to the peer's messages
+	 * and store in state for further authentication.
+	 */
+	if (exchange_type == ISAKMP_v2_IKE_INTERMEDIATE) {
+		PK11SymKey *intermediate_key;
+		switch (ike->sa.st_sa_role) {
+		case SA_INITIATOR:
+			intermediate_key = ike->sa.st_skey_pi_nss;
+			break;
+		case SA_RESPONDER:
+			intermediate_key = ike->sa.st_skey_pr_nss;
+			break;
+		default:
+			bad_case(ike->sa.st_sa_role);
+		}
+		compute_intermediate_mac(ike, intermediate_key,
+					 auth_start,
+					 sk->cleartext /* inner payloads */,
+					 &ike->sa.st_intermediate_packet_me);
+	}
+
+	struct v2_sk_keys k = v2_sk_encrypt_keys(ike);
+	if (!encrypt_sk(&k, auth_start, &offsets, sk->logger)) {
+		return STF_FAIL;
+	}
+
 	return STF_OK;
 }
 
@@ -639,26 +751,21 @@ stf_status encrypt_v2SK_payload(v2SK_payload_t *sk)
  * the actual starting-variable (a.k.a. IV).
  */
 
-static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
-						struct msg_digest *md,
-						chunk_t text,
-						chunk_t *plain,
-						size_t iv_offset)
-{
-	if (!ike->sa.hidden_variables.st_skeyid_calculated) {
-		endpoint_buf b;
-		pexpect_fail(ike->sa.st_logger, HERE,
-			     "received encrypted packet from %s  but no exponents for state #%lu to decrypt it",
-			     str_endpoint(&md->sender, &b),
-			     ike->sa.st_serialno);
-		return false;
-	}
+/*
+ * Verify and then decrypt, in-place, TEXT.  Only touches D and TEXT
+ * so can be run on any thread.
+ */
 
+static bool verify_and_decrypt_sk(const struct v2_sk_keys *d,
+				  chunk_t text, chunk_t *plain,
+				  size_t iv_offset,
+				  struct logger *logger)
+{
 	uint8_t *wire_iv_start = text.ptr + iv_offset;
-	size_t wire_iv_size = ike->sa.st_oakley.ta_encrypt->wire_iv_size;
-	size_t integ_size = (encrypt_desc_is_aead(ike->sa.st_oakley.ta_encrypt)
-			     ? ike->sa.st_oakley.ta_encrypt->aead_tag_size
-			     : ike->sa.st_oakley.ta_integ->integ_output_size);
+	size_t wire_iv_size = d->encrypt->wire_iv_size;
+	size_t integ_size = (encrypt_desc_is_aead(d->encrypt)
+			     ? d->encrypt->aead_tag_size
+			     : d->integ->integ_output_size);
 
 	/*
 	 * check to see if length is plausible:
@@ -669,9 +776,9 @@ static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
 	 */
 	uint8_t *payload_end = text.ptr + text.len;
 	if (payload_end < (wire_iv_start + wire_iv_size + 1 + integ_size)) {
-		log_state(RC_LOG, &ike->sa,
-			  "encrypted payload impossibly short (%tu)",
-			  payload_end - wire_iv_start);
+		llog(RC_LOG, logger,
+		     "encrypted payload impossibly short (%tu)",
+		     payload_end - wire_iv_start);
 		return false;
 	}
 
@@ -679,7 +786,6 @@ static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
 	uint8_t *enc_start = wire_iv_start + wire_iv_size;
 	uint8_t *integ_start = payload_end - integ_size;
 	size_t enc_size = integ_start - enc_start;
-	uint8_t exchange_type = *(auth_start + EXCH_TYPE_OFFSET);
 
 	/*
 	 * Check that the payload is block-size aligned.
@@ -692,42 +798,19 @@ static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
 	 * (originally this was being done between integrity and
 	 * decrypt).
 	 */
-	size_t enc_blocksize = ike->sa.st_oakley.ta_encrypt->enc_blocksize;
-	bool pad_to_blocksize = ike->sa.st_oakley.ta_encrypt->pad_to_blocksize;
+	size_t enc_blocksize = d->encrypt->enc_blocksize;
+	bool pad_to_blocksize = d->encrypt->pad_to_blocksize;
 	if (pad_to_blocksize) {
 		if (enc_size % enc_blocksize != 0) {
-			log_state(RC_LOG, &ike->sa,
-				  "discarding invalid packet: %zu octet payload length is not a multiple of encryption block-size (%zu)",
-				  enc_size, enc_blocksize);
+			llog(RC_LOG, logger,
+			     "discarding invalid packet: %zu octet payload length is not a multiple of encryption block-size (%zu)",
+			     enc_size, enc_blocksize);
 			return false;
 		}
 	}
 
-	chunk_t salt;
-	PK11SymKey *cipherkey;
-	PK11SymKey *authkey;
-	PK11SymKey *intermediate_key;
-	switch (ike->sa.st_sa_role) {
-	case SA_INITIATOR:
-		/* need responders key */
-		cipherkey = ike->sa.st_skey_er_nss;
-		authkey = ike->sa.st_skey_ar_nss;
-		salt = ike->sa.st_skey_responder_salt;
-		intermediate_key = ike->sa.st_skey_pr_nss;
-		break;
-	case SA_RESPONDER:
-		/* need initiators key */
-		cipherkey = ike->sa.st_skey_ei_nss;
-		authkey = ike->sa.st_skey_ai_nss;
-		salt = ike->sa.st_skey_initiator_salt;
-		intermediate_key = ike->sa.st_skey_pi_nss;
-		break;
-	default:
-		bad_case(ike->sa.st_sa_role);
-	}
-
 	/* authenticate and decrypt the block. */
-	if (encrypt_desc_is_aead(ike->sa.st_oakley.ta_encrypt)) {
+	if (encrypt_desc_is_aead(d->encrypt)) {
 		/*
 		 * Additional Authenticated Data - AAD - size.
 		 * RFC5282 says: The Initialization Vector and Ciphertext
@@ -739,7 +822,7 @@ static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
 
 		/* decrypt */
 		if (DBGP(DBG_CRYPT)) {
-			DBG_dump_hunk("Salt before authenticated decryption:", salt);
+			DBG_dump_hunk("Salt before authenticated decryption:", d->salt);
 			DBG_dump("IV before authenticated decryption:",
 				 wire_iv_start, wire_iv_size);
 			DBG_dump("AAD before authenticated decryption:",
@@ -750,13 +833,13 @@ static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
 				 integ_start, integ_size);
 		}
 
-		if (!ike->sa.st_oakley.ta_encrypt->encrypt_ops
-		    ->do_aead(ike->sa.st_oakley.ta_encrypt,
-			      salt.ptr, salt.len,
+		if (!d->encrypt->encrypt_ops
+		    ->do_aead(d->encrypt,
+			      d->salt.ptr, d->salt.len,
 			      wire_iv_start, wire_iv_size,
 			      aad_start, aad_size,
 			      enc_start, enc_size, integ_size,
-			      cipherkey, false, ike->sa.st_logger)) {
+			      d->cipherkey, false, logger)) {
 			return false;
 		}
 
@@ -770,13 +853,13 @@ static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
 		 * check authenticator.  The last INTEG_SIZE bytes are
 		 * the truncated digest.
 		 */
-		struct crypt_prf *ctx = crypt_prf_init_symkey("auth", ike->sa.st_oakley.ta_integ->prf,
-							      "authkey", authkey, ike->sa.st_logger);
+		struct crypt_prf *ctx = crypt_prf_init_symkey("auth", d->integ->prf,
+							      "authkey", d->authkey, logger);
 		crypt_prf_update_bytes(ctx, "message", auth_start, integ_start - auth_start);
-		struct crypt_mac td = crypt_prf_final_mac(&ctx, ike->sa.st_oakley.ta_integ);
+		struct crypt_mac td = crypt_prf_final_mac(&ctx, d->integ);
 
 		if (!hunk_memeq(td, integ_start, integ_size)) {
-			log_state(RC_LOG, &ike->sa, "failed to match authenticator");
+			llog(RC_LOG, logger, "failed to match authenticator");
 			return false;
 		}
 
@@ -785,20 +868,20 @@ static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
 		/* note: no iv is longer than MAX_CBC_BLOCK_SIZE */
 		unsigned char enc_iv[MAX_CBC_BLOCK_SIZE];
 		construct_enc_iv("decryption IV/starting-variable", enc_iv,
-				 wire_iv_start, salt,
-				 ike->sa.st_oakley.ta_encrypt);
+				 wire_iv_start, d->salt,
+				 d->encrypt);
 
 		/* decrypt */
 		if (DBGP(DBG_CRYPT)) {
 			DBG_dump("payload before decryption:", enc_start, enc_size);
 		}
 
-		ike->sa.st_oakley.ta_encrypt->encrypt_ops
-			->do_crypt(ike->sa.st_oakley.ta_encrypt,
+		d->encrypt->encrypt_ops
+			->do_crypt(d->encrypt,
 				   enc_start, enc_size,
-				   cipherkey,
+				   d->cipherkey,
 				   enc_iv, FALSE,
-				   ike->sa.st_logger);
+				   logger);
 
 		if (DBGP(DBG_CRYPT)) {
 			DBG_dump("payload after decryption:", enc_start, enc_size);
@@ -819,9 +902,9 @@ static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
 	 */
 	uint8_t padlen = enc_start[enc_size - 1] + 1;
 	if (padlen > enc_size) {
-		log_state(RC_LOG, &ike->sa,
-			  "discarding invalid packet: padding-length %u (octet 0x%02x) is larger than %zu octet payload length",
-			  padlen, padlen - 1, enc_size);
+		llog(RC_LOG, logger,
+		     "discarding invalid packet: padding-length %u (octet 0x%02x) is larger than %zu octet payload length",
+		     padlen, padlen - 1, enc_size);
 		return false;
 	}
 	if (pad_to_blocksize) {
@@ -845,6 +928,29 @@ static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
 	dbg("stripping %u octets as pad", padlen);
 	*plain = chunk2(enc_start, enc_size - padlen);
 
+	return true;
+}
+
+static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
+						struct msg_digest *md,
+						chunk_t text,
+						chunk_t *plain,
+						size_t iv_offset)
+{
+	if (!ike->sa.hidden_variables.st_skeyid_calculated) {
+		endpoint_buf b;
+		pexpect_fail(ike->sa.st_logger, HERE,
+			     "received encrypted packet from %s  but no exponents for state #%lu to decrypt it",
+			     str_endpoint(&md->sender, &b),
+			     ike->sa.st_serialno);
+		return false;
+	}
+
+	struct v2_sk_keys d = v2_sk_decrypt_keys(ike);
+	if (!verify_and_decrypt_sk(&d, text, plain, iv_offset, ike->sa.st_logger)) {
+		return false;
+	}
+
 	/*
 	 * Now that the payload has been decrypted, perform the
 	 * intermediate exchange calculation.
@@ -852,9 +958,13 @@ static bool ikev2_verify_and_decrypt_sk_payload(struct ike_sa *ike,
 	 * For Intermediate Exchange, apply PRF to the peer's messages
 	 * and store in state for further authentication.
 	 */
+	uint8_t exchange_type = *(text.ptr + EXCH_TYPE_OFFSET);
 	if (exchange_type == ISAKMP_v2_IKE_INTERMEDIATE) {
+		PK11SymKey *intermediate_key =
+			(ike->sa.st_sa_role == SA_INITIATOR ? ike->sa.st_skey_pr_nss :
+			 ike->sa.st_skey_pi_nss);
 		compute_intermediate_mac(ike, intermediate_key,
-					 auth_start, *plain,
+					 text.ptr, *plain,
 					 &ike->sa.st_intermediate_packet_peer);
 	}
 	return true;
@@ -979,6 +1089,49 @@ bool ikev2_collect_fragment(struct msg_digest *md, struct ike_sa *ike)
 	return (*frags)->count == (*frags)->total;
 }
 
+/*
+ * All the fragments have been decrypted, re-assemble them into the
+ * .raw_packet buffer and then release them.
+ */
+
+static void reassemble_v2_fragments(struct msg_digest *md,
+				    struct v2_incoming_fragments **frags)
+{
+	unsigned int size = 0;
+	for (unsigned i = 1; i <= (*frags)->total; i++) {
+		size += (*frags)->frags[i].plain.len;
+	}
+
+	pexpect(md->raw_packet.ptr == NULL); /* empty */
+	md->raw_packet = alloc_chunk(size, "IKEv2 fragments buffer");
+	unsigned int offset = 0;
+	for (unsigned i = 1; i <= (*frags)->total; i++) {
+		struct v2_incoming_fragment *frag = &(*frags)->frags[i];
+		passert(offset + frag->plain.len <= size);
+		memcpy(md->raw_packet.ptr + offset,
+		       frag->plain.ptr, frag->plain.len);
+		offset += frag->plain.len;
+	}
+
+	/*
+	 * Fake up enough of an SK payload_digest to fool the caller
+	 * and then use that to scribble all over the SKF
+	 * payload_digest (remembering to also update the SK and SKF
+	 * chains).
+	 */
+	struct payload_digest sk = {
+		.pbs = same_chunk_as_in_pbs(md->raw_packet, "decrypted SFK payloads"),
+		.payload_type = ISAKMP_NEXT_v2SK,
+		.payload.generic.isag_np = (*frags)->first_np,
+	};
+	struct payload_digest *skf = md->chain[ISAKMP_NEXT_v2SKF];
+	md->chain[ISAKMP_NEXT_v2SKF] = NULL;
+	md->chain[ISAKMP_NEXT_v2SK] = skf;
+	*skf = sk; /* scribble */
+
+	free_v2_incoming_fragments(frags);
+}
+
 static bool ikev2_reassemble_fragments(struct ike_sa *ike,
 				       struct msg_digest *md)
 {
@@ -998,7 +1151,6 @@ static bool ikev2_reassemble_fragments(struct ike_sa *ike,
 	struct v2_incoming_fragments **frags = &ike->sa.st_v2_incoming[v2_msg_role(md)];
 	passert(*frags != NULL);
 
-	unsigned int size = 0;
 	for (unsigned i = 1; i <= (*frags)->total; i++) {
 		struct v2_incoming_fragment *frag = &(*frags)->frags[i];
 		/*
@@ -1013,42 +1165,9 @@ static bool ikev2_reassemble_fragments(struct ike_sa *ike,
 			free_v2_incoming_fragments(frags);
 			return false;
 		}
-		size += frag->plain.len;
-	}
-
-	/*
-	 * All the fragments have been disassembled, re-assemble them
-	 * into the .raw_packet buffer.
-	 */
-	pexpect(md->raw_packet.ptr == NULL); /* empty */
-	md->raw_packet = alloc_chunk(size, "IKEv2 fragments buffer");
-	unsigned int offset = 0;
-	for (unsigned i = 1; i <= (*frags)->total; i++) {
-		struct v2_incoming_fragment *frag = &(*frags)->frags[i];
-		passert(offset + frag->plain.len <= size);
-		memcpy(md->raw_packet.ptr + offset,
-		       frag->plain.ptr, frag->plain.len);
-		offset += frag->plain.len;
 	}
 
-	/*
-	 * Fake up enough of an SK payload_digest to fool the caller
-	 * and then use that to scribble all over the SKF
-	 * payload_digest (remembering to also update the SK and SKF
-	 * chains).
-	 */
-	struct payload_digest sk = {
-		.pbs = same_chunk_as_in_pbs(md->raw_packet, "decrypted SFK payloads"),
-		.payload_type = ISAKMP_NEXT_v2SK,
-		.payload.generic.isag_np = (*frags)->first_np,
-	};
-	struct payload_digest *skf = md->chain[ISAKMP_NEXT_v2SKF];
-	md->chain[ISAKMP_NEXT_v2SKF] = NULL;
-	md->chain[ISAKMP_NEXT_v2SK] = skf;
-	*skf = sk; /* scribble */
-
-	free_v2_incoming_fragments(frags);
-
+	reassemble_v2_fragments(md, frags);
 	return true;
 }
 
@@ -1097,6 +1216,165 @@ bool ikev2_decrypt_msg(struct ike_sa *ike, struct msg_digest *md)
 	return ok;
 }
 
+/*
+ * Verify and decrypt an IKE_AUTH message on a helper thread
+ * (ike-sk-offload=yes).
+ *
+ * IKE_AUTH messages are the large ones - certificate chains, CP,
+ * fragments - and, unlike IKE_SA_INIT, a forged one costs the
+ * attacker little.  The message's SK payload, or fragments, and a
+ * reference to each key are handed to the helper which decrypts
+ * in-place.
+ *
+ * While the task is outstanding the IKE SA is busy and further
+ * messages are dropped (and retransmitted) so messages for the IKE SA
+ * are still processed one at a time and in order.
+ *
+ * IKE_INTERMEDIATE (whose MAC is accumulated in the IKE SA) and
+ * impaired messages are always decrypted inline.
+ */
+
+/* also used by submit_v2SK_message() */
+struct task {
+	struct v2_sk_keys keys;
+	/* decrypt: */
+	struct msg_digest *md;
+	/* either the SK payload, in .md ... */
+	chunk_t text;
+	size_t iv_offset;
+	chunk_t plain;
+	/* ... or the fragments, taken from the IKE SA */
+	struct v2_incoming_fragments *frags;
+	/* encrypt: the message, or its fragments, and each's SK */
+	struct v2_outgoing_fragment *outgoing;
+	struct v2_sk_offsets sk[MAX_IKE_FRAGMENTS];
+	unsigned nr_sk;
+	enum message_role message;
+	const char *what;
+	/* ... and the IKE_AUTH responder's CHILD SA */
+	so_serial_t child;
+	struct v2_child_keymat *child_keymat;
+	/* out */
+	bool ok;
+	unsigned bad_fragment;
+};
+
+static task_computer_fn v2_decrypt_computer; /* type check */
+static task_completed_cb v2_decrypt_completed; /* type check */
+static task_cleanup_cb v2_decrypt_cleanup; /* type check */
+
+static struct task_handler v2_decrypt_handler = {
+	.name = "decrypt",
+	.computer_fn = v2_decrypt_computer,
+	.completed_cb = v2_decrypt_completed,
+	.cleanup_cb = v2_decrypt_cleanup,
+};
+
+bool submit_v2_decrypt_msg(struct ike_sa *ike, struct state *st,
+			   struct msg_digest *md)
+{
+	if (!pluto_ike_sk_offload ||
+	    md->hdr.isa_xchg != ISAKMP_v2_IKE_AUTH ||
+	    /* the IKE SA is what is made busy */
+	    st != &ike->sa ||
+	    !ike->sa.hidden_variables.st_skeyid_calculated ||
+	    impair.replay_encrypted || impair.corrupt_encrypted) {
+		return false;
+	}
+
+	struct task *task;
+	if (md->chain[ISAKMP_NEXT_v2SKF] != NULL) {
+		/* leave the sanity checks and their logging to inline */
+		if (md->chain[ISAKMP_NEXT_v2SK] != NULL ||
+		    md->digest_roof >= elemsof(md->digest)) {
+			return false;
+		}
+		struct v2_incoming_fragments **frags = &ike->sa.st_v2_incoming[v2_msg_role(md)];
+		passert(*frags != NULL);
+		task = alloc_thing(struct task, "decrypt task");
+		task->frags = *frags;
+		*frags = NULL;
+	} else {
+		pb_stream *e_pbs = &md->chain[ISAKMP_NEXT_v2SK]->pbs;
+		task = alloc_thing(struct task, "decrypt task");
+		task->text = chunk2(md->packet_pbs.start,
+				    e_pbs->roof - md->packet_pbs.start);
+		task->iv_offset = e_pbs->cur - md->packet_pbs.start;
+	}
+
+	/* the helper decrypts the packet in-place */
+	task->md = md_addref(md, HERE);
+	task->keys = reference_v2_sk_keys(v2_sk_decrypt_keys(ike));
+
+	submit_task(ike->sa.st_logger, &ike->sa /*state to resume*/, task,
+		    &v2_decrypt_handler, "decrypting message");
+	suspend_any_md(&ike->sa, md);
+	return true;
+}
+
+static void v2_decrypt_computer(struct logger *logger, struct task *task,
+				int unused_my_thread UNUSED)
+{
+	if (task->frags != NULL) {
+		for (unsigned i = 1; i <= task->frags->total; i++) {
+			struct v2_incoming_fragment *frag = &task->frags->frags[i];
+			if (!verify_and_decrypt_sk(&task->keys, frag->text,
+						   &frag->plain, frag->iv_offset,
+						   logger)) {
+				task->bad_fragment = i;
+				return;
+			}
+		}
+		task->ok = true;
+	} else {
+		task->ok = verify_and_decrypt_sk(&task->keys, task->text,
+						 &task->plain, task->iv_offset,
+						 logger);
+	}
+}
+
+static stf_status v2_decrypt_completed(struct state *st,
+				       struct msg_digest *md,
+				       struct task *task)
+{
+	struct ike_sa *ike = pexpect_ike_sa(st);
+	pexpect(md == task->md);
+
+	if (task->bad_fragment != 0) {
+		log_state(RC_LOG_SERIOUS, &ike->sa,
+			  "fragment %u of %u invalid",
+			  task->bad_fragment, task->frags->total);
+	} else if (task->ok && task->frags != NULL) {
+		reassemble_v2_fragments(md, &task->frags);
+	} else if (task->ok) {
+		md->chain[ISAKMP_NEXT_v2SK]->pbs = same_chunk_as_in_pbs(task->plain, "decrypted SK payload");
+	}
+
+	dbg("#%lu ikev2 %s decrypt %s (helper)",
+	    ike->sa.st_serialno,
+	    enum_name(&ikev2_exchange_names, md->hdr.isa_xchg),
+	    task->ok ? "success" : "failed");
+
+	if (!task->ok) {
+		log_state(RC_LOG, &ike->sa,
+			  "encrypted payload seems to be corrupt; dropping packet");
+		return STF_SKIP_COMPLETE_STATE_TRANSITION;
+	}
+
+	/* re-run the lookup, this time with the plain text */
+	md->v2_sk_decrypted = true;
+	ikev2_process_state_packet(ike, &ike->sa, md);
+	return STF_SKIP_COMPLETE_STATE_TRANSITION;
+}
+
+static void v2_decrypt_cleanup(struct task **task)
+{
+	release_v2_sk_keys(&(*task)->keys);
+	free_v2_incoming_fragments(&(*task)->frags);
+	md_delref(&(*task)->md, HERE);
+	pfreeany(*task);
+}
+
 /*
  * IKEv2 fragments:
  *
@@ -1129,7 +1407,8 @@ static bool record_outbound_fragment(struct logger *logger,
 				     struct v2_outgoing_fragment **fragp,
 				     chunk_t *fragment,	/* read-only */
 				     unsigned int number, unsigned int total,
-				     const char *desc)
+				     const char *desc,
+				     struct task *task)
 {
 	/* make sure HDR is at start of a clean buffer */
 	unsigned char frag_buffer[PMAX(MIN_MAX_UDP_DATA_v4, MIN_MAX_UDP_DATA_v6)];
@@ -1204,10 +1483,17 @@ static bool record_outbound_fragment(struct logger *logger,
 	close_output_pbs(&body);
 	close_output_pbs(&frag_stream);
 
-	stf_status ret = encrypt_v2SK_payload(&skf);
-	if (ret != STF_OK) {
-		llog(RC_LOG, logger, "error encrypting fragment %u", number);
-		return false;
+	if (task != NULL) {
+		/* leave the encryption to the helper */
+		passert(number <= elemsof(task->sk));
+		task->sk[number - 1] = v2_sk_offsets(&skf);
+		task->nr_sk = number;
+	} else {
+		stf_status ret = encrypt_v2SK_payload(&skf);
+		if (ret != STF_OK) {
+			llog(RC_LOG, logger, "error encrypting fragment %u", number);
+			return false;
+		}
 	}
 
 	dbg("recording fragment %u", number);
@@ -1218,7 +1504,8 @@ static bool record_outbound_fragment(struct logger *logger,
 static bool record_outbound_fragments(const pb_stream *body,
 				      v2SK_payload_t *sk,
 				      const char *desc,
-				      struct v2_outgoing_fragment **frags)
+				      struct v2_outgoing_fragment **frags,
+				      struct task *task)
 {
 	free_v2_outgoing_fragments(frags);
 
@@ -1311,7 +1598,7 @@ static bool record_outbound_fragments(const pb_stream *body,
 		chunk_t fragment = chunk2(sk->cleartext.ptr + offset,
 					  PMIN(sk->cleartext.len - offset, len));
 		if (!record_outbound_fragment(sk->logger, sk->ike, &hdr, skf_np, frag,
-					      &fragment, number, nfrags, desc)) {
+					      &fragment, number, nfrags, desc, task)) {
 			return false;
 		}
 		frag = &(*frag)->next;
@@ -1337,10 +1624,8 @@ static bool record_outbound_fragments(const pb_stream *body,
  * children trying to exchange messages.
  */
 
-stf_status record_v2SK_message(pb_stream *msg,
-			       v2SK_payload_t *sk,
-			       const char *what,
-			       enum message_role message)
+static bool v2SK_message_needs_fragmenting(const struct pbs_out *msg,
+					   const v2SK_payload_t *sk)
 {
 	size_t len = pbs_offset(msg);
 
@@ -1354,12 +1639,20 @@ stf_status record_v2SK_message(pb_stream *msg,
 		len += NON_ESP_MARKER_SIZE;
 
 	/* IPv4 and IPv6 have different fragment sizes */
-	if (sk->ike->sa.st_interface->protocol == &ip_protocol_udp &&
-	    LIN(POLICY_IKE_FRAG_ALLOW, sk->ike->sa.st_connection->policy) &&
-	    sk->ike->sa.st_seen_fragmentation_supported &&
-	    len >= endpoint_type(&sk->ike->sa.st_remote_endpoint)->ikev2_max_fragment_size) {
+	return (sk->ike->sa.st_interface->protocol == &ip_protocol_udp &&
+		LIN(POLICY_IKE_FRAG_ALLOW, sk->ike->sa.st_connection->policy) &&
+		sk->ike->sa.st_seen_fragmentation_supported &&
+		len >= endpoint_type(&sk->ike->sa.st_remote_endpoint)->ikev2_max_fragment_size);
+}
+
+stf_status record_v2SK_message(pb_stream *msg,
+			       v2SK_payload_t *sk,
+			       const char *what,
+			       enum message_role message)
+{
+	if (v2SK_message_needs_fragmenting(msg, sk)) {
 		struct v2_outgoing_fragment **frags = &sk->ike->sa.st_v2_outgoing[message];
-		if (!record_outbound_fragments(msg, sk, what, frags)) {
+		if (!record_outbound_fragments(msg, sk, what, frags, NULL)) {
 			dbg("record outbound fragments failed");
 			return STF_INTERNAL_ERROR;
 		}
@@ -1375,6 +1668,141 @@ stf_status record_v2SK_message(pb_stream *msg,
 	return STF_OK;
 }
 
+/*
+ * Encrypt an IKE_AUTH message on a helper thread (ike-sk-offload=yes).
+ *
+ * The message is fragmented (if needed) and recorded, still in the
+ * clear, in the task; the helper then encrypts each SK or SKF payload
+ * in-place.  For the responder, the CHILD SA's KEYMAT is also computed
+ * there (ikev2_child_sa_respond() left it) and, once back on the main
+ * thread, the CHILD SA is installed before the message is recorded in
+ * the IKE SA.
+ *
+ * MD.ST, which the transition will complete on, is what is made busy.
+ */
+
+static task_computer_fn v2_encrypt_computer; /* type check */
+static task_completed_cb v2_encrypt_completed; /* type check */
+static task_cleanup_cb v2_encrypt_cleanup; /* type check */
+
+static struct task_handler v2_encrypt_handler = {
+	.name = "encrypt",
+	.computer_fn = v2_encrypt_computer,
+	.completed_cb = v2_encrypt_completed,
+	.cleanup_cb = v2_encrypt_cleanup,
+};
+
+stf_status submit_v2SK_message(struct pbs_out *msg,
+			       v2SK_payload_t *sk,
+			       struct msg_digest *md,
+			       struct child_sa *child,
+			       const char *what,
+			       enum message_role message)
+{
+	struct ike_sa *ike = sk->ike;
+	uint8_t exchange_type = *(msg->start + EXCH_TYPE_OFFSET);
+
+	if (!pluto_ike_sk_offload || exchange_type != ISAKMP_v2_IKE_AUTH) {
+		/* CHILD, if any, was installed by ikev2_child_sa_respond() */
+		return record_v2SK_message(msg, sk, what, message);
+	}
+
+	if (md == NULL || md->st == NULL ||
+	    md->st->st_offloaded_task != NULL ||
+	    !pexpect(sk->pbs.container->start == msg->start)) {
+		dbg("encrypting %s inline", what);
+		if (child != NULL) {
+			ikev2_derive_child_keys(child);
+			stf_status status = ikev2_install_responder_child_sa(child, ISAKMP_v2_IKE_AUTH);
+			if (status != STF_OK) {
+				return status;
+			}
+		}
+		return record_v2SK_message(msg, sk, what, message);
+	}
+
+	struct task *task = alloc_thing(struct task, "encrypt task");
+	if (v2SK_message_needs_fragmenting(msg, sk)) {
+		if (!record_outbound_fragments(msg, sk, what, &task->outgoing, task)) {
+			dbg("record outbound fragments failed");
+			v2_encrypt_cleanup(&task);
+			return STF_INTERNAL_ERROR;
+		}
+	} else {
+		task->sk[0] = v2_sk_offsets(sk);
+		task->nr_sk = 1;
+		record_v2_outgoing_fragment(msg, what, &task->outgoing);
+	}
+
+	task->keys = reference_v2_sk_keys(v2_sk_encrypt_keys(ike));
+	task->message = message;
+	task->what = what;
+	if (child != NULL) {
+		task->child = child->sa.st_serialno;
+		task->child_keymat = prepare_v2_child_keymat(child);
+	}
+
+	submit_task(md->st->st_logger, md->st /*state to resume*/, task,
+		    &v2_encrypt_handler, "encrypting message");
+	return STF_SUSPEND;
+}
+
+static void v2_encrypt_computer(struct logger *logger, struct task *task,
+				int unused_my_thread UNUSED)
+{
+	struct v2_outgoing_fragment *frag = task->outgoing;
+	for (unsigned i = 0; i < task->nr_sk; i++) {
+		passert(frag != NULL);
+		if (!encrypt_sk(&task->keys, frag->ptr, &task->sk[i], logger)) {
+			return;
+		}
+		frag = frag->next;
+	}
+	if (task->child_keymat != NULL) {
+		compute_v2_child_keymat(task->child_keymat, logger);
+	}
+	task->ok = true;
+}
+
+static stf_status v2_encrypt_completed(struct state *st,
+				       struct msg_digest *unused_md UNUSED,
+				       struct task *task)
+{
+	struct ike_sa *ike = ike_sa(st, HERE);
+	if (!task->ok) {
+		log_state(RC_LOG, st, "error encrypting %s message", task->what);
+		return STF_INTERNAL_ERROR;
+	}
+
+	if (task->child_keymat != NULL) {
+		struct child_sa *child = child_sa_by_serialno(task->child);
+		if (!pexpect(child != NULL)) {
+			return STF_INTERNAL_ERROR;
+		}
+		install_v2_child_keymat(child, &task->child_keymat);
+		stf_status status = ikev2_install_responder_child_sa(child, ISAKMP_v2_IKE_AUTH);
+		if (status != STF_OK) {
+			return status;
+		}
+	}
+
+	dbg("#%lu recording %s (encrypted by helper)",
+	    ike->sa.st_serialno, task->what);
+	struct v2_outgoing_fragment **frags = &ike->sa.st_v2_outgoing[task->message];
+	free_v2_outgoing_fragments(frags);
+	*frags = task->outgoing;
+	task->outgoing = NULL;
+	return STF_OK;
+}
+
+static void v2_encrypt_cleanup(struct task **task)
+{
+	release_v2_sk_keys(&(*task)->keys);
+	free_v2_outgoing_fragments(&(*task)->outgoing);
+	free_v2_child_keymat(&(*task)->child_keymat);
+	pfreeany(*task);
+}
+
 struct ikev2_id build_v2_id_payload(const struct end *end, shunk_t *body,
 				    const char *what, struct logger *logger)
 {
@@ -23,6 +23,7 @@
 struct msg_digest;
 struct dh_desc;
 struct ike_sa;
+struct child_sa;
 struct state;
 struct end;
 
@@ -55,12 +56,34 @@ stf_status record_v2SK_message(struct pbs_out *msg,
 			       const char *what,
 			       enum message_role message);
 
+/*
+ * For IKE_AUTH: when ike-sk-offload=yes, encrypt MSG on a helper and
+ * return STF_SUSPEND; once the message is recorded MD.ST's transition
+ * completes.  CHILD, when non-NULL, is the responder's CHILD SA whose
+ * KEYMAT ikev2_child_sa_respond() left to be computed alongside.
+ * Otherwise, this is record_v2SK_message().
+ */
+stf_status submit_v2SK_message(struct pbs_out *msg,
+			       v2SK_payload_t *sk,
+			       struct msg_digest *md,
+			       struct child_sa *child,
+			       const char *what,
+			       enum message_role message);
+
 uint8_t build_ikev2_critical(bool impair, struct logger *logger);
 
 bool ikev2_collect_fragment(struct msg_digest *md, struct ike_sa *ike);
 
 bool ikev2_decrypt_msg(struct ike_sa *ike, struct msg_digest *md);
 
+/*
+ * When ike-sk-offload=yes, hand MD's SK (or SKF) payload to a helper
+ * and return true; once decrypted, ikev2_process_state_packet() is
+ * re-entered.  Return false when the caller should decrypt inline.
+ */
+bool submit_v2_decrypt_msg(struct ike_sa *ike, struct state *st,
+			   struct msg_digest *md);
+
 struct ikev2_id build_v2_id_payload(const struct end *end, shunk_t *body,
 				    const char *what, struct logger *logger);
 
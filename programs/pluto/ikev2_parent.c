@@ -107,6 +107,11 @@ static stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_tail(struct state *st,
 							  struct msg_digest *md,
 							  bool pam_status);
 
+static stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_authorized(struct ike_sa *ike,
+								 struct msg_digest *md);
+
+static v2_auth_verify_cb ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_verify_continue; /* type check */
+
 static stf_status ikev2_child_out_tail(struct ike_sa *ike,
 				       struct child_sa *child,
 				       struct msg_digest *request_md);
@@ -293,13 +298,36 @@ static bool v2_accept_ke_for_proposal(struct ike_sa *ike,
  *
  * This just needs to answer the very simple yes/no question.  Did
  * auth succeed.  Caller needs to decide what response is appropriate.
+ *
+ * When DEFERRED is non-NULL, a signature (RSA or Digital Signature)
+ * is not checked here; instead the candidate keys are returned in
+ * *DEFERRED for submit_v2_auth_verify() and true means "so far so
+ * good".  Everything else is still checked inline.
  */
+
+static void log_v2_signature_failure(struct ike_sa *ike,
+				     enum ikev2_auth_method recv_auth,
+				     enum keyword_authby that_authby,
+				     const char *context)
+{
+	if (recv_auth == IKEv2_AUTH_RSA) {
+		log_state(RC_LOG, &ike->sa,
+			  "RSA authentication of %s failed", context);
+	} else {
+		log_state(RC_LOG, &ike->sa,
+			  "Digital Signature authentication using %s failed in %s",
+			  enum_name(&keyword_authby_names, that_authby),
+			  context);
+	}
+}
+
 static bool v2_check_auth(enum ikev2_auth_method recv_auth,
 			  struct ike_sa *ike,
 			  const struct crypt_mac *idhash_in,
 			  pb_stream *pbs,
 			  const enum keyword_authby that_authby,
-			  const char *context)
+			  const char *context,
+			  struct signature_check **deferred)
 {
 	switch (recv_auth) {
 	case IKEv2_AUTH_RSA:
@@ -314,11 +342,11 @@ static bool v2_check_auth(enum ikev2_auth_method recv_auth,
 
 		shunk_t signature = pbs_in_left_as_shunk(pbs);
 		stf_status authstat = ikev2_verify_rsa_hash(ike, idhash_in,
-							    signature, &ike_alg_hash_sha1);
+							    signature, &ike_alg_hash_sha1,
+							    deferred);
 
 		if (authstat != STF_OK) {
-			log_state(RC_LOG, &ike->sa,
-				  "RSA authentication of %s failed", context);
+			log_v2_signature_failure(ike, recv_auth, that_authby, context);
 			return false;
 		}
 		return true;
@@ -423,13 +451,15 @@ static bool v2_check_auth(enum ikev2_auth_method recv_auth,
 		case AUTHBY_RSASIG:
 			authstat = ikev2_verify_rsa_hash(ike, idhash_in,
 							 signature,
-							 hap->algo);
+							 hap->algo,
+							 deferred);
 			break;
 
 		case AUTHBY_ECDSA:
 			authstat = ikev2_verify_ecdsa_hash(ike, idhash_in,
 							   signature,
-							   hap->algo);
+							   hap->algo,
+							   deferred);
 			break;
 
 		default:
@@ -437,10 +467,7 @@ static bool v2_check_auth(enum ikev2_auth_method recv_auth,
 		}
 
 		if (authstat != STF_OK) {
-			log_state(RC_LOG, &ike->sa,
-				  "Digital Signature authentication using %s failed in %s",
-				  enum_name(&keyword_authby_names, that_authby),
-				  context);
+			log_v2_signature_failure(ike, recv_auth, that_authby, context);
 			return FALSE;
 		}
 		return TRUE;
@@ -647,12 +674,17 @@ void ikev2_out_IKE_SA_INIT_I(struct fd *whack_sock,
 	}
 
 	/*
-	 * Calculate KE and Nonce.
+	 * Calculate KE and Nonce; or, when a pre-computed pair is
+	 * ready, use it and send the request now.
 	 */
-	submit_ke_and_nonce(st, st->st_oakley.ta_dh,
-			    ikev2_parent_outI1_continue,
-			    "ikev2_outI1 KE");
+	stf_status status = pooled_ke_and_nonce(st, NULL/*no-MD*/,
+						st->st_oakley.ta_dh,
+						ikev2_parent_outI1_continue,
+						"ikev2_outI1 KE");
 	statetime_stop(&start, "%s()", __func__);
+	if (status != STF_SUSPEND) {
+		complete_v2_state_transition(st, NULL/*no-MD*/, status);
+	}
 }
 
 /*
@@ -1005,12 +1037,11 @@ stf_status ikev2_in_IKE_SA_INIT_I_out_IKE_SA_INIT_R(struct ike_sa *ike,
 		ike->sa.st_seen_hashnotify = true;
 	}
 
-	/* calculate the nonce and the KE */
-	submit_ke_and_nonce(&ike->sa,
-			    ike->sa.st_oakley.ta_dh,
-			    ikev2_in_IKE_SA_INIT_I_out_IKE_SA_INIT_R_continue,
-			    "ikev2_in_IKE_SA_INIT_I_out_IKE_SA_INIT_R_continue");
-	return STF_SUSPEND;
+	/* calculate the nonce and the KE; or take them from the pool */
+	return pooled_ke_and_nonce(&ike->sa, md,
+				   ike->sa.st_oakley.ta_dh,
+				   ikev2_in_IKE_SA_INIT_I_out_IKE_SA_INIT_R_continue,
+				   "ikev2_in_IKE_SA_INIT_I_out_IKE_SA_INIT_R_continue");
 }
 
 static stf_status ikev2_in_IKE_SA_INIT_I_out_IKE_SA_INIT_R_continue(struct state *st,
@@ -2542,7 +2573,7 @@ static stf_status ikev2_in_IKE_SA_INIT_R_or_IKE_INTERMEDIATE_R_out_IKE_AUTH_I_si
 	 * For AUTH exchange, store the message in the IKE SA.  The
 	 * attempt to create the CHILD SA could have failed.
 	 */
-	return record_v2SK_message(&reply_stream, &sk,
+	return submit_v2SK_message(&reply_stream, &sk, md, NULL,
 				   "sending IKE_AUTH request",
 				   MESSAGE_REQUEST);
 }
@@ -3049,7 +3080,8 @@ stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_id_tail(struct msg_digest *md)
 
 		if (!v2_check_auth(md->chain[ISAKMP_NEXT_v2AUTH]->payload.v2auth.isaa_auth_method,
 				   ike, &idhash_in, &pbs_no_ppk_auth,
-				   ike->sa.st_connection->spd.that.authby, "no-PPK-auth")) {
+				   ike->sa.st_connection->spd.that.authby, "no-PPK-auth",
+				   NULL/*inline*/)) {
 			record_v2N_response(ike->sa.st_logger, ike, md,
 					    v2N_AUTHENTICATION_FAILED, NULL/*no data*/,
 					    ENCRYPTED_PAYLOAD);
@@ -3074,7 +3106,8 @@ stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_id_tail(struct msg_digest *md)
 			dbg("going to try to verify NULL_AUTH from Notify payload");
 			init_pbs(&pbs_null_auth, null_auth.ptr, len, "pb_stream for verifying NULL_AUTH");
 			if (!v2_check_auth(IKEv2_AUTH_NULL, ike, &idhash_in,
-					   &pbs_null_auth, AUTHBY_NULL, "NULL_auth from Notify Payload")) {
+					   &pbs_null_auth, AUTHBY_NULL, "NULL_auth from Notify Payload",
+					   NULL/*inline*/)) {
 				record_v2N_response(ike->sa.st_logger, ike, md,
 						    v2N_AUTHENTICATION_FAILED, NULL/*no data*/,
 						    ENCRYPTED_PAYLOAD);
@@ -3085,9 +3118,16 @@ stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_id_tail(struct msg_digest *md)
 			dbg("NULL_AUTH verified");
 		} else {
 			dbg("verifying AUTH payload");
+			/*
+			 * Public key operations are what a flood of
+			 * IKE_AUTH requests costs; try the keys on a
+			 * helper thread.
+			 */
+			struct signature_check *check = NULL;
 			if (!v2_check_auth(md->chain[ISAKMP_NEXT_v2AUTH]->payload.v2auth.isaa_auth_method,
 					   ike, &idhash_in, &md->chain[ISAKMP_NEXT_v2AUTH]->pbs,
-					   st->st_connection->spd.that.authby, "I2 Auth Payload")) {
+					   st->st_connection->spd.that.authby, "I2 Auth Payload",
+					   &check)) {
 				record_v2N_response(ike->sa.st_logger, ike, md,
 						    v2N_AUTHENTICATION_FAILED, NULL/*no data*/,
 						    ENCRYPTED_PAYLOAD);
@@ -3095,6 +3135,12 @@ stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_id_tail(struct msg_digest *md)
 				pstat_sa_failed(&ike->sa, REASON_AUTH_FAILED);
 				return STF_FATAL;
 			}
+			if (check != NULL) {
+				free_chunk_content(&null_auth);
+				submit_v2_auth_verify(ike, &check,
+						      ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_verify_continue);
+				return STF_SUSPEND;
+			}
 		}
 	}
 
@@ -3102,6 +3148,34 @@ stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_id_tail(struct msg_digest *md)
 
 	free_chunk_content(&null_auth);
 
+	return ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_authorized(ike, md);
+}
+
+static stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_verify_continue(struct ike_sa *ike,
+									struct msg_digest *md,
+									bool verified)
+{
+	if (!verified) {
+		log_v2_signature_failure(ike,
+					 md->chain[ISAKMP_NEXT_v2AUTH]->payload.v2auth.isaa_auth_method,
+					 ike->sa.st_connection->spd.that.authby,
+					 "I2 Auth Payload");
+		record_v2N_response(ike->sa.st_logger, ike, md,
+				    v2N_AUTHENTICATION_FAILED, NULL/*no data*/,
+				    ENCRYPTED_PAYLOAD);
+		pstat_sa_failed(&ike->sa, REASON_AUTH_FAILED);
+		return STF_FATAL;
+	}
+
+	/* AUTH succeeded */
+
+	return ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_authorized(ike, md);
+}
+
+static stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_authorized(struct ike_sa *ike,
+								 struct msg_digest *md)
+{
+	struct state *st = &ike->sa;
 #ifdef AUTH_HAVE_PAM
 	if (st->st_connection->policy & POLICY_IKEV2_PAM_AUTHORIZE)
 		return ikev2_start_pam_authorize(st);
@@ -3465,9 +3539,9 @@ static stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_auth_signature_continue(str
 	}
 	ike->sa.st_intermediate_used = false;
 
+	struct child_sa *child = NULL;
 	if (auth_np == ISAKMP_NEXT_v2SA || auth_np == ISAKMP_NEXT_v2CP) {
 		/* must have enough to build an CHILD_SA */
-		struct child_sa *child = NULL;
 		stf_status ret;
 		ret = ike_auth_child_responder(ike, &child, md);
 		if (ret != STF_OK) {
@@ -3502,7 +3576,7 @@ static stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_auth_signature_continue(str
 	 * The attempt to create the CHILD SA could have
 	 * failed.
 	 */
-	return record_v2SK_message(&reply_stream, &sk,
+	return submit_v2SK_message(&reply_stream, &sk, md, child,
 				   "replying to IKE_AUTH request",
 				   MESSAGE_RESPONSE);
 }
@@ -3692,6 +3766,8 @@ static void ikev2_rekey_expire_pred(const struct state *st, so_serial_t pred)
 	/* else it should be on its way to expire no need to kick dead state */
 }
 
+static v2_child_keymat_cb ikev2_install_child_sa_continue; /* type check */
+
 static stf_status ikev2_process_ts_and_rest(struct msg_digest *md)
 {
 	struct child_sa *child = pexpect_child_sa(md->st);
@@ -3793,9 +3869,21 @@ static stf_status ikev2_process_ts_and_rest(struct msg_digest *md)
 		st->st_seen_use_ipcomp = TRUE;
 	}
 
+	if (submit_v2_child_keymat(child, md, ikev2_install_child_sa_continue)) {
+		return STF_SUSPEND;
+	}
+
 	ikev2_derive_child_keys(child);
+	return ikev2_install_child_sa_continue(child, md);
+}
+
+static stf_status ikev2_install_child_sa_continue(struct child_sa *child,
+						  struct msg_digest *md UNUSED)
+{
+	struct state *st = &child->sa;
 
 #ifdef USE_XFRM_INTERFACE
+	struct connection *c = st->st_connection;
 	/* before calling do_command() */
 	if (st->st_state->kind != STATE_V2_REKEY_CHILD_I1)
 		if (c->xfrmi != NULL &&
@@ -3972,7 +4060,8 @@ static stf_status v2_inR2_post_cert_decode(struct state *st, struct msg_digest *
 	dbg("verifying AUTH payload");
 	if (!v2_check_auth(md->chain[ISAKMP_NEXT_v2AUTH]->payload.v2auth.isaa_auth_method,
 			   ike, &idhash_in, &md->chain[ISAKMP_NEXT_v2AUTH]->pbs,
-			   that_authby, "R2 Auth Payload"))
+			   that_authby, "R2 Auth Payload",
+			   NULL/*inline*/))
 	{
 		/*
 		 * We cannot send a response as we are processing IKE_AUTH reply
@@ -6510,7 +6599,11 @@ void v2_schedule_replace_event(struct state *st)
 	}
 
 	delete_event(st);
-	event_schedule(kind, deltatime(delay), st);
+	if (kind == EVENT_SA_EXPIRE) {
+		event_schedule(kind, deltatime(delay), st);
+	} else {
+		event_schedule_rekey(kind, deltatime(delay), st);
+	}
 }
 
 void v2_event_sa_rekey(struct state *st)
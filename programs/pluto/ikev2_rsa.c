@@ -145,7 +145,8 @@ bool ikev2_calculate_rsa_hash(struct ike_sa *ike,
 stf_status ikev2_verify_rsa_hash(struct ike_sa *ike,
 				 const struct crypt_mac *idhash,
 				 shunk_t signature,
-				 const struct hash_desc *hash_algo)
+				 const struct hash_desc *hash_algo,
+				 struct signature_check **deferred)
 {
 	statetime_t start = statetime_start(&ike->sa);
 
@@ -162,6 +163,12 @@ stf_status ikev2_verify_rsa_hash(struct ike_sa *ike,
 
 	struct crypt_mac hash = v2_calculate_sighash(ike, idhash, hash_algo,
 						     REMOTE_PERSPECTIVE);
+	if (deferred != NULL) {
+		*deferred = prepare_signature_check(ike, &hash, signature, hash_algo,
+						    &pubkey_type_rsa, try_signature_RSA);
+		statetime_stop(&start, "%s() deferred", __func__);
+		return STF_OK;
+	}
 	stf_status retstat = check_signature_gen(ike, &hash, signature, hash_algo,
 						 &pubkey_type_rsa, try_signature_RSA);
 	statetime_stop(&start, "%s()", __func__);
@@ -66,6 +66,24 @@ bool send_recorded_v2_message(struct ike_sa *ike,
 	return true;
 }
 
+/*
+ * A message that was fragmented is sent immediately:
+ * send_recorded_v2_message() stops at the first fragment that can't
+ * be sent.
+ */
+
+void queue_recorded_v2_message(struct ike_sa *ike,
+			       const char *where,
+			       enum message_role message)
+{
+	struct v2_outgoing_fragment *frags = ike->sa.st_v2_outgoing[message];
+	if (ike->sa.st_interface == NULL || frags == NULL || frags->next != NULL) {
+		send_recorded_v2_message(ike, where, message);
+		return;
+	}
+	queue_hunk_using_state(&ike->sa, where, *frags);
+}
+
 void record_v2_outgoing_fragment(struct pbs_out *pbs,
 				 const char *what,
 				 struct v2_outgoing_fragment **frags)
@@ -81,6 +81,9 @@ void record_v2N_spi_response(struct logger *logger,
 
 bool send_recorded_v2_message(struct ike_sa *ike, const char *where,
 			      enum message_role role);
+/* when the result isn't needed; see queue_chunk_using_state() */
+void queue_recorded_v2_message(struct ike_sa *ike, const char *where,
+			       enum message_role role);
 
 void send_v2N_response_from_md(struct msg_digest *md,
 			       v2_notification_t type,
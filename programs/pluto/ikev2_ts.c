@@ -28,6 +28,7 @@
 #include "log.h"
 #include "ikev2_ts.h"
 #include "connections.h"	/* for struct end */
+#include "connection_db.h"
 #include "demux.h"
 #include "virtual_ip.h"
 #include "hostpair.h"
@@ -1520,6 +1521,7 @@ bool v2_process_ts_response(struct child_sa *child,
 
 	dbg("initiator saving acceptable TSr response in that");
 	ts_to_end(best.tsr, &c->spd.that, &child->sa.st_ts_that);
+	rehash_connection_spd_routes(c);
 
 	return true;
 }
@@ -0,0 +1,77 @@
+/* IKEv2 signature verification helper, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#include "defs.h"
+#include "ikev2_auth.h"
+#include "keys.h"
+#include "server_pool.h"
+#include "state.h"
+#include "log.h"
+
+struct task {
+	/* in */
+	v2_auth_verify_cb *cb;
+	/* in/out */
+	struct signature_check *check;
+};
+
+static task_computer_fn v2_auth_verify_computer; /* type check */
+static task_completed_cb v2_auth_verify_completed; /* type check */
+static task_cleanup_cb v2_auth_verify_cleanup; /* type check */
+
+struct task_handler v2_auth_verify_handler = {
+	.name = "verify",
+	.computer_fn = v2_auth_verify_computer,
+	.completed_cb = v2_auth_verify_completed,
+	.cleanup_cb = v2_auth_verify_cleanup,
+};
+
+void submit_v2_auth_verify(struct ike_sa *ike,
+			   struct signature_check **check,
+			   v2_auth_verify_cb *cb)
+{
+	struct task task = {
+		.cb = cb,
+		.check = *check,
+	};
+	*check = NULL;
+
+	submit_task(ike->sa.st_logger, &ike->sa /*state to resume*/,
+		    clone_thing(task, "verify task"),
+		    &v2_auth_verify_handler,
+		    "verifying initiator signature");
+}
+
+static void v2_auth_verify_computer(struct logger *logger, struct task *task,
+				    int unused_my_thread UNUSED)
+{
+	run_signature_check(task->check, logger);
+}
+
+static stf_status v2_auth_verify_completed(struct state *st,
+					   struct msg_digest *md,
+					   struct task *task)
+{
+	struct ike_sa *ike = pexpect_ike_sa(st);
+	/* logs the result; frees and clears task->check */
+	bool verified = (finish_signature_check(ike, &task->check) == STF_OK);
+	return task->cb(ike, md, verified);
+}
+
+static void v2_auth_verify_cleanup(struct task **task)
+{
+	/* the pubkey references are released on the main thread */
+	free_signature_check(&(*task)->check);
+	pfreeany(*task);
+}
@@ -147,6 +147,11 @@ static bool impair_message(shunk_t message, struct direction_impairment *directi
 	return false;
 }
 
+bool impairing_incoming_messages(void)
+{
+	return incoming_impairments.impairments != NULL;
+}
+
 bool impair_incoming_message(struct msg_digest *md)
 {
 	struct message_impairment impairment;
@@ -57,6 +57,8 @@ enum impair_action;
 void add_message_impairment(unsigned nr, enum impair_action action, struct logger *logger);
 
 bool impair_incoming_message(struct msg_digest *md);
+/* true when incoming messages need to be numbered */
+bool impairing_incoming_messages(void);
 bool impair_outgoing_message(shunk_t message, struct logger *logger);
 
 void free_impair_message(struct logger *logger);
@@ -48,6 +48,7 @@
 
 #include "defs.h"
 #include "connections.h"        /* needs id.h */
+#include "connection_db.h"
 #include "pending.h"
 #include "foodgroups.h"
 #include "packet.h"
@@ -85,6 +86,7 @@ static void swap_ends(struct connection *c)
 
 	sr->this = sr->that;
 	sr->that = t;
+	rehash_connection_spd_routes(c);
 
 	/*
 	 * In case of asymmetric auth c->policy contains left.authby.
@@ -1048,6 +1050,7 @@ static void initiate_ondemand_body(struct find_oppo_bundle *b)
 	 */
 	c->spd.this.client = local_shunt;
 	c->spd.that.client = remote_shunt;
+	rehash_connection_spd_routes(c);
 
 	if (b->held) {
 		if (assign_holdpass(c, &c->spd,
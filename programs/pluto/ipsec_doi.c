@@ -81,6 +81,7 @@
 #include "pending.h"
 #include "iface.h"
 #include "ikev2_delete.h"	/* for record_v2_delete(); but call is dying */
+#include "pubkey_db.h"
 
 void ipsecdoi_initiate(struct fd *whack_sock,
 		       struct connection *c,
@@ -254,16 +255,17 @@ bool has_preloaded_public_key(const struct state *st)
 	 */
 	if (c->kind == CK_PERMANENT) {
 		/* look for a matching RSA public key */
-		for (const struct pubkey_list *p = pluto_pubkeys; p != NULL;
-		     p = p->next) {
-			const struct pubkey *key = p->key;
-
-			if (key->type == &pubkey_type_rsa &&
-			    same_id(&c->spd.that.id, &key->id) &&
-			    is_realtime_epoch(key->until_time)) {
-				/* found a preloaded public key */
-				return TRUE;
-			}
+		unsigned nr_keys;
+		struct pubkey **keys = find_pubkey_db_keys(&c->spd.that.id,
+							   &pubkey_type_rsa, &nr_keys);
+		bool found = false;
+		for (unsigned i = 0; i < nr_keys && !found; i++) {
+			/* found a preloaded public key? */
+			found = is_realtime_epoch(keys[i]->until_time);
+		}
+		pfreeany(keys);
+		if (found) {
+			return TRUE;
 		}
 	}
 	return FALSE;
@@ -56,6 +56,7 @@
 #include "id.h"
 #include "connections.h"        /* needs id.h */
 #include "state.h"
+#include "state_db.h"		/* for rehash_state_spis_in_db() */
 #include "timer.h"
 #include "kernel.h"
 #include "kernel_xfrm.h"
@@ -82,6 +83,8 @@
 #include "ip_selector.h"
 #include "ip_encap.h"
 #include "show.h"
+#include "hash_table.h"
+#include "pubkey_db.h"
 
 bool can_do_IPcomp = true;  /* can system actually perform IPCOMP? */
 
@@ -128,11 +131,11 @@ struct bare_shunt {
 	/* the connection from where it came - used to re-load /32 conns */
 	char *from_cn;
 
-	struct bare_shunt *next;
+	struct list_entry list_entry;	/* bare_shunt_list */
+	struct list_entry hash_entry;	/* bare_shunt_table */
+	unsigned heap_index;		/* bare_shunt_heap[] */
 };
 
-static struct bare_shunt *bare_shunts = NULL;
-
 #ifdef IPSEC_CONNECTION_LIMIT
 static int num_ipsec_eroute = 0;
 #endif
@@ -163,6 +166,196 @@ static void dbg_bare_shunt(const char *op, const struct bare_shunt *bs)
 	}
 }
 
+/*
+ * The bare shunt table.
+ *
+ * OE can leave tens of thousands of %hold and %pass shunts behind,
+ * so they are:
+ *
+ * - found by (our_client, peer_client, transport_proto) using a
+ *   hash table;
+ *
+ * - listed, newest first, for --shuntstatus;
+ *
+ * - kept in a min-heap ordered by .last_activity so that the
+ *   periodic scan stops at the first shunt that isn't yet due.
+ */
+
+static void jam_bare_shunt(struct jambuf *buf, const void *data)
+{
+	if (data == NULL) {
+		jam(buf, "<no bare shunt>");
+	} else {
+		const struct bare_shunt *bs = data;
+		jam_selector(buf, &bs->our_client);
+		jam(buf, " -%d-> ", bs->transport_proto);
+		jam_selector(buf, &bs->peer_client);
+	}
+}
+
+static const struct list_info bare_shunt_info = {
+	.name = "bare shunt",
+	.jam = jam_bare_shunt,
+};
+
+static struct list_head bare_shunt_list = INIT_LIST_HEAD(&bare_shunt_list,
+							  &bare_shunt_info);
+
+/*
+ * Shunts are matched using selector_subnet_eq() so hash the routing
+ * prefix and its length, ignoring any unmasked bits and the port.
+ */
+
+static hash_t hash_selector_subnet(const ip_selector *selector, hash_t hash)
+{
+	ip_address address = selector_prefix(selector);
+	unsigned bits = selector_prefix_bits(selector);
+	ip_subnet subnet = subnet_from_address_prefix_bits(&address, bits);
+	ip_address prefix = subnet_prefix(&subnet);
+	hash = hash_table_hasher(shunk2(&bits, sizeof(bits)), hash);
+	return hash_table_hasher(address_as_shunk(&prefix), hash);
+}
+
+static hash_t bare_shunt_hasher(const ip_selector *our_client,
+				const ip_selector *peer_client,
+				int transport_proto)
+{
+	hash_t hash = hash_table_hasher(shunk2(&transport_proto, sizeof(transport_proto)),
+					zero_hash);
+	hash = hash_selector_subnet(our_client, hash);
+	return hash_selector_subnet(peer_client, hash);
+}
+
+static hash_t bare_shunt_table_hasher(const void *data)
+{
+	const struct bare_shunt *bs = data;
+	return bare_shunt_hasher(&bs->our_client, &bs->peer_client,
+				 bs->transport_proto);
+}
+
+static struct list_entry *bare_shunt_table_entry(void *data)
+{
+	struct bare_shunt *bs = data;
+	return &bs->hash_entry;
+}
+
+static struct list_head bare_shunt_slots[STATE_TABLE_SIZE];
+
+static struct hash_table bare_shunt_table = {
+	.info = {
+		.name = "bare shunt table",
+		.jam = jam_bare_shunt,
+	},
+	.hasher = bare_shunt_table_hasher,
+	.entry = bare_shunt_table_entry,
+	.nr_slots = elemsof(bare_shunt_slots),
+	.slots = bare_shunt_slots,
+};
+
+static struct bare_shunt **bare_shunt_heap;
+static unsigned nr_bare_shunts;
+static unsigned bare_shunt_heap_size;
+
+static bool bare_shunt_due_before(const struct bare_shunt *l,
+				  const struct bare_shunt *r)
+{
+	return monobefore(l->last_activity, r->last_activity);
+}
+
+static void set_bare_shunt_heap(unsigned i, struct bare_shunt *bs)
+{
+	bare_shunt_heap[i] = bs;
+	bs->heap_index = i;
+}
+
+static void sift_bare_shunt_up(unsigned i)
+{
+	struct bare_shunt *bs = bare_shunt_heap[i];
+	while (i > 0) {
+		unsigned parent = (i - 1) / 2;
+		if (!bare_shunt_due_before(bs, bare_shunt_heap[parent])) {
+			break;
+		}
+		set_bare_shunt_heap(i, bare_shunt_heap[parent]);
+		i = parent;
+	}
+	set_bare_shunt_heap(i, bs);
+}
+
+static void sift_bare_shunt_down(unsigned i)
+{
+	struct bare_shunt *bs = bare_shunt_heap[i];
+	for (;;) {
+		unsigned child = 2 * i + 1;
+		if (child >= nr_bare_shunts) {
+			break;
+		}
+		if (child + 1 < nr_bare_shunts &&
+		    bare_shunt_due_before(bare_shunt_heap[child + 1],
+					  bare_shunt_heap[child])) {
+			child++;
+		}
+		if (!bare_shunt_due_before(bare_shunt_heap[child], bs)) {
+			break;
+		}
+		set_bare_shunt_heap(i, bare_shunt_heap[child]);
+		i = child;
+	}
+	set_bare_shunt_heap(i, bs);
+}
+
+static void link_bare_shunt(struct bare_shunt *bs)
+{
+	bs->list_entry = list_entry(&bare_shunt_info, bs);
+	insert_list_entry(&bare_shunt_list, &bs->list_entry);
+
+	bs->hash_entry = list_entry(&bare_shunt_table.info, bs);
+	add_hash_table_entry(&bare_shunt_table, bs);
+
+	if (nr_bare_shunts == bare_shunt_heap_size) {
+		unsigned size = (bare_shunt_heap_size == 0 ? 64 : bare_shunt_heap_size * 2);
+		realloc_things(bare_shunt_heap, bare_shunt_heap_size, size, "bare shunt heap");
+		bare_shunt_heap_size = size;
+	}
+	bare_shunt_heap[nr_bare_shunts] = bs;
+	sift_bare_shunt_up(nr_bare_shunts++);
+
+	dbg_bare_shunt("add", bs);
+}
+
+/*
+ * Restart the shunt's inactivity timeout; it can only move later.
+ */
+static void touch_bare_shunt(struct bare_shunt *bs)
+{
+	bs->count = 0;
+	bs->last_activity = mononow();
+	sift_bare_shunt_down(bs->heap_index);
+}
+
+static void free_bare_shunt(struct bare_shunt **bsp)
+{
+	struct bare_shunt *bs = *bsp;
+	passert(bs != NULL);
+	*bsp = NULL;
+
+	dbg_bare_shunt("delete", bs);
+	remove_list_entry(&bs->list_entry);
+	del_hash_table_entry(&bare_shunt_table, bs);
+
+	unsigned i = bs->heap_index;
+	passert(i < nr_bare_shunts && bare_shunt_heap[i] == bs);
+	struct bare_shunt *last = bare_shunt_heap[--nr_bare_shunts];
+	if (last != bs) {
+		set_bare_shunt_heap(i, last);
+		sift_bare_shunt_up(i);
+		sift_bare_shunt_down(last->heap_index);
+	}
+
+	pfreeany(bs->from_cn);
+	pfree(bs);
+}
+
 /*
  * Note: "why" must be in stable storage (not auto, not heap)
  * because we use it indefinitely without copying or pfreeing.
@@ -174,11 +367,11 @@ void add_bare_shunt(const ip_selector *our_client,
 		    const char *why)
 {
 	/* report any duplication; this should NOT happen */
-	struct bare_shunt **bspp = bare_shunt_ptr(our_client, peer_client, transport_proto, why);
+	struct bare_shunt *old = find_bare_shunt(our_client, peer_client, transport_proto, why);
 
-	if (bspp != NULL) {
-		/* maybe: passert(bsp == NULL); */
-		log_bare_shunt(RC_LOG, "CONFLICTING existing", *bspp);
+	if (old != NULL) {
+		/* maybe: passert(old == NULL); */
+		log_bare_shunt(RC_LOG, "CONFLICTING existing", old);
 	}
 
 	struct bare_shunt *bs = alloc_thing(struct bare_shunt,
@@ -196,12 +389,10 @@ void add_bare_shunt(const ip_selector *our_client,
 	bs->count = 0;
 	bs->last_activity = mononow();
 
-	bs->next = bare_shunts;
-	bare_shunts = bs;
-	dbg_bare_shunt("add", bs);
+	link_bare_shunt(bs);
 
 	/* report duplication; this should NOT happen */
-	if (bspp != NULL) {
+	if (old != NULL) {
 		log_bare_shunt(RC_LOG, "CONFLICTING      new", bs);
 	}
 }
@@ -240,11 +431,11 @@ void record_and_initiate_opportunistic(const ip_endpoint *local_client,
 	 * We need to do this because the %hold shunt was installed by
 	 * kernel and we want to keep track of it inside pluto.
 	 */
-	/*const*/ struct bare_shunt **bspp = bare_shunt_ptr(our_client, peer_client,
-							    transport_proto, why);
-	if (bspp != NULL &&
-	    (*bspp)->said.proto == &ip_protocol_internal &&
-	    (*bspp)->said.spi == htonl(SPI_HOLD)) {
+	const struct bare_shunt *bs = find_bare_shunt(our_client, peer_client,
+						      transport_proto, why);
+	if (bs != NULL &&
+	    bs->said.proto == &ip_protocol_internal &&
+	    bs->said.spi == htonl(SPI_HOLD)) {
 		log_global(RC_LOG_SERIOUS, null_fd, "existing bare shunt found - refusing to add a duplicate");
 		/* should we continue with initiate_ondemand() ? */
 	} else {
@@ -503,16 +694,17 @@ static void jam_common_shell_out(struct jambuf *buf, const struct connection *c,
 	jam(buf, "PLUTO_PEER_PROTOCOL='%u' ", sr->that.protocol);
 
 	jam(buf, "PLUTO_PEER_CA='");
-	for (struct pubkey_list *p = pluto_pubkeys; p != NULL; p = p->next) {
-		struct pubkey *key = p->key;
+	unsigned nr_keys;
+	struct pubkey **keys = find_pubkey_db_keys(&sr->that.id, &pubkey_type_rsa, &nr_keys);
+	for (unsigned i = 0; i < nr_keys; i++) {
+		struct pubkey *key = keys[i];
 		int pathlen;	/* value ignored */
-		if (key->type == &pubkey_type_rsa &&
-		    same_id(&sr->that.id, &key->id) &&
-		    trusted_ca_nss(key->issuer, sr->that.ca, &pathlen)) {
+		if (trusted_ca_nss(key->issuer, sr->that.ca, &pathlen)) {
 			jam_dn_or_null(buf, key->issuer, "", jam_meta_escaped_bytes);
 			break;
 		}
 	}
+	pfreeany(keys);
 	jam(buf, "' ");
 
 	jam(buf, "PLUTO_STACK='%s' ", kernel_ops->kern_name);
@@ -1174,11 +1366,11 @@ void set_text_said(char *text_said, const ip_address *dst,
 	jam_said(&jam, &said);
 }
 
-/* find an entry in the bare_shunt table.
- * Trick: return a pointer to the pointer to the entry;
- * this allows the entry to be deleted.
+/*
+ * Find an entry in the bare_shunt table; when there are duplicates
+ * the newest is returned.
  */
-struct bare_shunt **bare_shunt_ptr(const ip_selector *our_client,
+struct bare_shunt *find_bare_shunt(const ip_selector *our_client,
 				   const ip_selector *peer_client,
 				   int transport_proto,
 				   const char *why)
@@ -1193,43 +1385,23 @@ struct bare_shunt **bare_shunt_ptr(const ip_selector *our_client,
 	pexpect(selector_protocol(our_client)->ipproto == (unsigned)transport_proto);
 	pexpect(selector_protocol(peer_client)->ipproto == (unsigned)transport_proto);
 #endif
-	for (struct bare_shunt **pp = &bare_shunts; *pp != NULL; pp = &(*pp)->next) {
-		struct bare_shunt *p = *pp;
+	hash_t hash = bare_shunt_hasher(our_client, peer_client, transport_proto);
+	struct list_head *bucket = hash_table_bucket(&bare_shunt_table, hash);
+	struct bare_shunt *p;
+	FOR_EACH_LIST_ENTRY_NEW2OLD(bucket, p) {
 		dbg_bare_shunt("comparing", p);
 		if (transport_proto == p->transport_proto &&
 		    selector_subnet_eq(our_client, &p->our_client) &&
 		    selector_subnet_eq(peer_client, &p->peer_client)) {
-			return pp;
+			return p;
 		}
 	}
 	return NULL;
 }
 
-/* free a bare_shunt entry, given a pointer to the pointer */
-static void free_bare_shunt(struct bare_shunt **pp)
-{
-	struct bare_shunt *p;
-
-	passert(pp != NULL);
-
-	p = *pp;
-
-	*pp = p->next;
-	dbg_bare_shunt("delete", p);
-	pfreeany(p->from_cn);
-	pfree(p);
-}
-
 unsigned shunt_count(void)
 {
-	unsigned i = 0;
-
-	for (const struct bare_shunt *bs = bare_shunts; bs != NULL; bs = bs->next)
-	{
-		i++;
-	}
-
-	return i;
+	return nr_bare_shunts;
 }
 
 void show_shunt_status(struct show *s)
@@ -1238,7 +1410,8 @@ void show_shunt_status(struct show *s)
 	show_comment(s, "Bare Shunt list:");
 	show_separator(s);
 
-	for (const struct bare_shunt *bs = bare_shunts; bs != NULL; bs = bs->next) {
+	const struct bare_shunt *bs;
+	FOR_EACH_LIST_ENTRY_NEW2OLD(&bare_shunt_list, bs) {
 		/* Print interesting fields.  Ignore count and last_active. */
 		selector_buf ourb;
 		selector_buf peerb;
@@ -1259,25 +1432,30 @@ void show_shunt_status(struct show *s)
  * op is one of the ERO_* operators.
  */
 
-// should be made static again once we fix initiate.c calling this directly!
-bool raw_eroute(const ip_address *this_host,
-		const ip_selector *this_client,
-		const ip_address *that_host,
-		const ip_selector *that_client,
-		ipsec_spi_t cur_spi,
-		ipsec_spi_t new_spi,
-		const struct ip_protocol *sa_proto,
-		unsigned int transport_proto,
-		enum eroute_type esatype,
-		const struct pfkey_proto_info *proto_info,
-		deltatime_t use_lifetime,
-		uint32_t sa_priority,
-		const struct sa_marks *sa_marks,
-		const uint32_t xfrm_if_id,
-		enum pluto_sadb_operations op,
-		const char *opname,
-		const chunk_t *sec_label,
-		struct logger *logger)
+/*
+ * When QUEUE, and the kernel interface can pipeline the request, it
+ * is only queued and DONE is told the outcome later; otherwise it is
+ * sent and DONE, if any, is told the result straight away.
+ */
+static bool raw_eroute_or_queue(const ip_address *this_host,
+				const ip_selector *this_client,
+				const ip_address *that_host,
+				const ip_selector *that_client,
+				ipsec_spi_t cur_spi,
+				ipsec_spi_t new_spi,
+				const struct ip_protocol *sa_proto,
+				unsigned int transport_proto,
+				enum eroute_type esatype,
+				const struct pfkey_proto_info *proto_info,
+				deltatime_t use_lifetime,
+				uint32_t sa_priority,
+				const struct sa_marks *sa_marks,
+				const uint32_t xfrm_if_id,
+				enum pluto_sadb_operations op,
+				const char *opname,
+				const chunk_t *sec_label,
+				bool queue, kernel_ack_cb *done, void *arg,
+				struct logger *logger)
 {
 	char text_said[SATOT_BUF + SATOT_BUF];
 
@@ -1315,6 +1493,20 @@ bool raw_eroute(const ip_address *this_host,
 	    proto_info->proto,
 	    sec_label == NULL  ? "with" : "without");
 
+	if (queue && kernel_ops->queue_raw_eroute != NULL) {
+		kernel_ops->queue_raw_eroute(this_host, this_client,
+					     that_host, that_client,
+					     cur_spi, new_spi, sa_proto,
+					     transport_proto,
+					     esatype, proto_info,
+					     use_lifetime, sa_priority, sa_marks,
+					     xfrm_if_id, op, text_said,
+					     sec_label, done, arg,
+					     logger);
+		dbg("raw_eroute: queued");
+		return true;
+	}
+
 	bool result = kernel_ops->raw_eroute(this_host, this_client,
 					     that_host, that_client,
 					     cur_spi, new_spi, sa_proto,
@@ -1326,9 +1518,140 @@ bool raw_eroute(const ip_address *this_host,
 					     logger);
 	dbg("raw_eroute: result=%s", result ? "success" : "failed");
 
+	if (done != NULL) {
+		done(arg, result, logger);
+	}
 	return result;
 }
 
+// should be made static again once we fix initiate.c calling this directly!
+bool raw_eroute(const ip_address *this_host,
+		const ip_selector *this_client,
+		const ip_address *that_host,
+		const ip_selector *that_client,
+		ipsec_spi_t cur_spi,
+		ipsec_spi_t new_spi,
+		const struct ip_protocol *sa_proto,
+		unsigned int transport_proto,
+		enum eroute_type esatype,
+		const struct pfkey_proto_info *proto_info,
+		deltatime_t use_lifetime,
+		uint32_t sa_priority,
+		const struct sa_marks *sa_marks,
+		const uint32_t xfrm_if_id,
+		enum pluto_sadb_operations op,
+		const char *opname,
+		const chunk_t *sec_label,
+		struct logger *logger)
+{
+	return raw_eroute_or_queue(this_host, this_client, that_host, that_client,
+				   cur_spi, new_spi, sa_proto, transport_proto,
+				   esatype, proto_info, use_lifetime, sa_priority,
+				   sa_marks, xfrm_if_id, op, opname, sec_label,
+				   /*queue*/false, NULL, NULL, logger);
+}
+
+static void queue_raw_eroute(const ip_address *this_host,
+			     const ip_selector *this_client,
+			     const ip_address *that_host,
+			     const ip_selector *that_client,
+			     ipsec_spi_t cur_spi,
+			     ipsec_spi_t new_spi,
+			     const struct ip_protocol *sa_proto,
+			     unsigned int transport_proto,
+			     enum eroute_type esatype,
+			     const struct pfkey_proto_info *proto_info,
+			     deltatime_t use_lifetime,
+			     uint32_t sa_priority,
+			     const struct sa_marks *sa_marks,
+			     const uint32_t xfrm_if_id,
+			     enum pluto_sadb_operations op,
+			     const char *opname,
+			     const chunk_t *sec_label,
+			     kernel_ack_cb *done, void *arg,
+			     struct logger *logger)
+{
+	raw_eroute_or_queue(this_host, this_client, that_host, that_client,
+			    cur_spi, new_spi, sa_proto, transport_proto,
+			    esatype, proto_info, use_lifetime, sa_priority,
+			    sa_marks, xfrm_if_id, op, opname, sec_label,
+			    /*queue*/true, done, arg, logger);
+}
+
+/*
+ * Send anything the kernel interface has queued and wait for the
+ * answers; completions run before this returns.
+ */
+static void sync_kernel(struct logger *logger)
+{
+	if (kernel_ops->sync != NULL) {
+		kernel_ops->sync(logger);
+	}
+}
+
+/*
+ * Remove the kernel policy for a bare shunt; the caller then removes
+ * the shunt from pluto's table.
+ */
+static bool delete_bare_shunt_policy(const ip_selector *src,
+				     const ip_selector *dst,
+				     int transport_proto, ipsec_spi_t cur_shunt_spi,
+				     bool skip_xfrm_raw_eroute_delete,
+				     const char *why, struct logger *logger)
+{
+	bool ok;
+	if (kernel_ops->type == USE_XFRM && skip_xfrm_raw_eroute_delete) {
+		selectors_buf sb;
+		llog(RC_LOG, logger, "deleting bare shunt %s from pluto shunt table",
+		     str_selectors_sensitive(src, dst, &sb));
+		ok = true; /* always succeed */
+	} else {
+		selectors_buf sb;
+		dbg("deleting bare shunt %s from kernel for %s",
+		    str_selectors(src, dst, &sb), why);
+		const ip_address null_host = selector_type(src)->address.any;
+		/* assume low code logged action */
+		ok = raw_eroute(&null_host, src, &null_host, dst,
+				htonl(cur_shunt_spi), htonl(SPI_PASS),
+				&ip_protocol_internal,
+				transport_proto,
+				ET_INT, null_proto_info,
+				deltatime(SHUNT_PATIENCE),
+				0, /* we don't know connection for priority yet */
+				NULL, /* sa_marks */
+				0 /* xfrm interface id */,
+				ERO_DELETE, why, NULL, logger);
+		if (!ok) {
+			/* did/should kernel log this? */
+			selectors_buf sb;
+			llog(RC_LOG, logger,
+			     "delete kernel shunt %s failed - deleting from pluto shunt table",
+			     str_selectors_sensitive(src, dst, &sb));
+		}
+	}
+	return ok;
+}
+
+/*
+ * Delete the kernel policy for the bare shunt BS using its address
+ * prefixes, as delete_bare_shunt() would.  The caller then frees BS
+ * directly so that a duplicate can't be deleted in its place.
+ */
+static bool delete_bare_shunt_entry_policy(const struct bare_shunt *bs,
+					   bool skip_xfrm_raw_eroute_delete,
+					   const char *why, struct logger *logger)
+{
+	const ip_protocol *protocol = protocol_by_ipproto(bs->transport_proto);
+	ip_address our_addr = selector_prefix(&bs->our_client);
+	ip_address peer_addr = selector_prefix(&bs->peer_client);
+	/* port? assumed wide? */
+	ip_selector src = selector_from_address_protocol(&our_addr, protocol);
+	ip_selector dst = selector_from_address_protocol(&peer_addr, protocol);
+	return delete_bare_shunt_policy(&src, &dst, bs->transport_proto,
+					ntohl(bs->said.spi),
+					skip_xfrm_raw_eroute_delete, why, logger);
+}
+
 /*
  * Clear any bare shunt holds that overlap with the network we have
  * just routed.  We only consider "narrow" holds: ones for a single
@@ -1339,9 +1662,8 @@ static void clear_narrow_holds(const ip_selector *our_client,
 			       int transport_proto,
 			       struct logger *logger)
 {
-	struct bare_shunt *p, **pp;
-
-	for (pp = &bare_shunts; (p = *pp) != NULL; ) {
+	struct bare_shunt *p;
+	FOR_EACH_LIST_ENTRY_NEW2OLD(&bare_shunt_list, p) {
 		/*
 		 * is p->{local,remote} within {local,remote}.
 		 */
@@ -1349,35 +1671,15 @@ static void clear_narrow_holds(const ip_selector *our_client,
 		    transport_proto == p->transport_proto &&
 		    selector_in_selector(&p->our_client, our_client) &&
 		    selector_in_selector(&p->peer_client, peer_client)) {
-			ip_address our_addr = selector_prefix(&p->our_client);
-			ip_address peer_addr = selector_prefix(&p->peer_client);
-			if (!delete_bare_shunt(&our_addr, &peer_addr,
-					       transport_proto, SPI_HOLD,
-					       /*skip_xfrm_raw_eroute_delete?*/false,
-					       "removing clashing narrow hold",
-					       logger)) {
+			if (!delete_bare_shunt_entry_policy(p, /*skip_xfrm_raw_eroute_delete?*/false,
+							    "removing clashing narrow hold",
+							    logger)) {
 				/* ??? we could not delete a bare shunt */
 				log_bare_shunt(RC_LOG, "failed to delete", p);
+				free_bare_shunt(&p);
 				break;	/* unlikely to succeed a second time */
-			} else if (*pp == p) {
-				/*
-				 * ??? We deleted the wrong bare shunt!
-				 * This happened because more than one entry
-				 * matched and we happened to delete a
-				 * different one.
-				 * Log it!  And keep deleting.
-				 */
-				log_bare_shunt(RC_LOG, "UNEXPECTEDLY SURVIVING", p);
-				pp = &bare_shunts;	/* just in case, start over */
 			}
-			/*
-			 * ??? if we were sure that there could only be one
-			 * matching entry, we could break out of the FOR.
-			 * For an unknown reason this is not always the case,
-			 * so we will continue the loop, with pp unchanged.
-			 */
-		} else {
-			pp = &p->next;
+			free_bare_shunt(&p);
 		}
 	}
 }
@@ -1436,9 +1738,9 @@ bool replace_bare_shunt(const ip_address *src_address, const ip_address *dst_add
 	 * XXX: for instance, when whack initiates an OE connection.
 	 * There is no kernel-acquire shunt to remove.
 	 */
-	struct bare_shunt **bs_pp = bare_shunt_ptr(&src, &dst, transport_proto, why);
-	/* passert(bs_pp != NULL); */
-	if (bs_pp == NULL) {
+	struct bare_shunt *bs = find_bare_shunt(&src, &dst, transport_proto, why);
+	/* passert(bs != NULL); */
+	if (bs == NULL) {
 		selectors_buf sb;
 		llog(RC_LOG, logger,
 		     "can't find expected bare shunt to %s: %s",
@@ -1452,15 +1754,13 @@ bool replace_bare_shunt(const ip_address *src_address, const ip_address *dst_add
 		 * change over to new bare eroute ours, peers,
 		 * transport_proto are the same.
 		 */
-		struct bare_shunt *bs = *bs_pp;
 		bs->why = why;
 		bs->policy_prio = policy_prio;
 		bs->said = said3(&null_host, htonl(new_shunt_spi), &ip_protocol_internal);
-		bs->count = 0;
-		bs->last_activity = mononow();
+		touch_bare_shunt(bs);
 		dbg_bare_shunt("replace", bs);
 	} else {
-		free_bare_shunt(bs_pp);
+		free_bare_shunt(&bs);
 	}
 
 	return ok;
@@ -1479,36 +1779,8 @@ bool delete_bare_shunt(const ip_address *src_address,
 	ip_selector src = selector_from_address_protocol(src_address, protocol);
 	ip_selector dst = selector_from_address_protocol(dst_address, protocol);
 
-	bool ok;
-	if (kernel_ops->type == USE_XFRM && skip_xfrm_raw_eroute_delete) {
-		selectors_buf sb;
-		llog(RC_LOG, logger, "deleting bare shunt %s from pluto shunt table",
-		     str_selectors_sensitive(&src, &dst, &sb));
-		ok = true; /* always succeed */
-	} else {
-		selectors_buf sb;
-		dbg("deleting bare shunt %s from kernel for %s",
-		    str_selectors(&src, &dst, &sb), why);
-		const ip_address null_host = afi->address.any;
-		/* assume low code logged action */
-		ok = raw_eroute(&null_host, &src, &null_host, &dst,
-				htonl(cur_shunt_spi), htonl(SPI_PASS),
-				&ip_protocol_internal,
-				transport_proto,
-				ET_INT, null_proto_info,
-				deltatime(SHUNT_PATIENCE),
-				0, /* we don't know connection for priority yet */
-				NULL, /* sa_marks */
-				0 /* xfrm interface id */,
-				ERO_DELETE, why, NULL, logger);
-		if (!ok) {
-			/* did/should kernel log this? */
-			selectors_buf sb;
-			llog(RC_LOG, logger,
-			     "delete kernel shunt %s failed - deleting from pluto shunt table",
-			     str_selectors_sensitive(&src, &dst, &sb));
-		}
-	}
+	bool ok = delete_bare_shunt_policy(&src, &dst, transport_proto, cur_shunt_spi,
+					   skip_xfrm_raw_eroute_delete, why, logger);
 
 	/*
 	 * We can have proto mismatching acquires with xfrm - this is
@@ -1520,8 +1792,8 @@ bool delete_bare_shunt(const ip_address *src_address,
 	 * There is no kernel-acquire shunt to remove.
 	 */
 
-	struct bare_shunt **bs_pp = bare_shunt_ptr(&src, &dst, transport_proto, why);
-	if (bs_pp == NULL) {
+	struct bare_shunt *bs = find_bare_shunt(&src, &dst, transport_proto, why);
+	if (bs == NULL) {
 		selectors_buf sb;
 		llog(RC_LOG, logger,
 		     "can't find expected bare shunt to delete: %s",
@@ -1529,7 +1801,7 @@ bool delete_bare_shunt(const ip_address *src_address,
 		return ok;
 	}
 
-	free_bare_shunt(bs_pp);
+	free_bare_shunt(&bs);
 	return ok;
 }
 
@@ -1634,7 +1906,7 @@ bool assign_holdpass(const struct connection *c,
 		 * Although %hold or %pass is appropriately broad, it will
 		 * no longer be bare so we must ditch it from the bare table
 		 */
-		struct bare_shunt **old = bare_shunt_ptr(&sr->this.client, &sr->that.client,
+		struct bare_shunt *old = find_bare_shunt(&sr->this.client, &sr->that.client,
 							 sr->this.protocol, "assign_holdpass");
 
 		if (old == NULL) {
@@ -1644,7 +1916,7 @@ bool assign_holdpass(const struct connection *c,
 		} else {
 			/* ??? should this happen? */
 			dbg("assign_holdpass() removing bare shunt");
-			free_bare_shunt(old);
+			free_bare_shunt(&old);
 		}
 	} else {
 		dbg("assign_holdpass() need broad(er) shunt");
@@ -1754,6 +2026,36 @@ bool del_spi(ipsec_spi_t spi, const struct ip_protocol *proto,
 	return kernel_ops->del_sa(&sa, logger);
 }
 
+/*
+ * Like del_spi() but, when the kernel interface can pipeline it, the
+ * delete is only queued; a failure is logged when the answer
+ * arrives.
+ */
+static void queue_del_spi(ipsec_spi_t spi, const struct ip_protocol *proto,
+			  const ip_address *src, const ip_address *dest,
+			  struct logger *logger)
+{
+	if (kernel_ops->queue_del_sa == NULL) {
+		(void) del_spi(spi, proto, src, dest, logger);
+		return;
+	}
+
+	char text_said[SATOT_BUF];
+
+	set_text_said(text_said, dest, spi, proto);
+	dbg("queue delete %s", text_said);
+
+	struct kernel_sa sa = {
+		.spi = spi,
+		.proto = proto,
+		.src.address = src,
+		.dst.address = dest,
+		.text_said = text_said,
+	};
+
+	kernel_ops->queue_del_sa(&sa, NULL, NULL, logger);
+}
+
 static void setup_esp_nic_offload(struct kernel_sa *sa, struct connection *c,
 		bool *nic_offload_fallback)
 {
@@ -1777,6 +2079,134 @@ static void setup_esp_nic_offload(struct kernel_sa *sa, struct connection *c,
 	sa->nic_offload_dev = c->interface->ip_dev->id_rname;
 }
 
+/*
+ * Remove the inbound policy that setup_half_ipsec_sa() adds, towards
+ * REMOTE_ADDRESS.  When QUEUE the request may only be queued (true is
+ * returned and any failure is logged later).
+ */
+static bool delete_inbound_eroute(struct state *st, const ip_address *remote_address,
+				  bool queue)
+{
+	struct connection *const c = st->st_connection;
+	return raw_eroute_or_queue(remote_address,
+				   &c->spd.that.client,
+				   &c->spd.this.host_addr,
+				   &c->spd.this.client,
+				   SPI_PASS, SPI_PASS,
+				   c->ipsec_mode == ENCAPSULATION_MODE_TRANSPORT ?
+					&ip_protocol_esp : NULL,
+				   c->spd.this.protocol,
+				   c->ipsec_mode == ENCAPSULATION_MODE_TRANSPORT ?
+					ET_ESP : ET_UNSPEC,
+				   null_proto_info,
+				   deltatime(0),
+				   calculate_sa_prio(c, false),
+				   &c->sa_marks,
+				   0, /* xfrm_if_id. needed to tear down? */
+				   ERO_DEL_INBOUND,
+				   "delete inbound",
+				   &c->spd.this.sec_label,
+				   queue, NULL, NULL,
+				   st->st_logger);
+}
+
+/*
+ * One direction's SAs, added as a batch.
+ *
+ * When the kernel interface can pipeline requests, each add is only
+ * queued and its answer comes back through sa_bundle_ack(), which
+ * just records it.  The caller then only has to sync_kernel() to
+ * learn whether the whole bundle went in.
+ *
+ * Answers can arrive while the bundle is still being built (a
+ * synchronous NIC offload add, or a full batch, flushes the queue) so
+ * nothing is rolled back until every add has been issued and
+ * answered; see fail_sa_bundle().
+ */
+
+struct sa_bundle {
+	struct logger *logger;
+	unsigned outstanding;	/* queued adds not yet answered */
+	bool failed;
+	unsigned nr;
+	struct sa_bundle_entry {
+		struct sa_bundle *bundle;
+		const struct kernel_sa *sa;
+		bool added;
+	} entry[EM_MAXRELSPIS + 1];	/* +1 for a NIC offload retry */
+};
+
+static void roll_back_sa_bundle(struct sa_bundle *bundle)
+{
+	/* inner to outer; the reverse of the adds */
+	for (unsigned i = bundle->nr; i > 0; i--) {
+		struct sa_bundle_entry *e = &bundle->entry[i - 1];
+		if (!e->added) {
+			continue;
+		}
+		e->added = false;
+		dbg("rolling back %s", e->sa->text_said);
+		if (kernel_ops->queue_del_sa != NULL) {
+			kernel_ops->queue_del_sa(e->sa, NULL, NULL, bundle->logger);
+		} else {
+			(void) del_spi(e->sa->spi, e->sa->proto,
+				       e->sa->src.address, e->sa->dst.address,
+				       bundle->logger);
+		}
+	}
+}
+
+static void sa_bundle_ack(void *arg, bool ok, struct logger *unused_logger UNUSED)
+{
+	struct sa_bundle_entry *e = arg;
+	struct sa_bundle *bundle = e->bundle;
+	passert(bundle->outstanding > 0);
+	bundle->outstanding--;
+	e->added = ok;
+	bundle->failed |= !ok;
+}
+
+/*
+ * Returns false only when the add was sent straight away, and
+ * failed.
+ */
+static bool add_bundle_sa(struct sa_bundle *bundle,
+			  const struct kernel_sa *sa, bool replace)
+{
+	passert(bundle->nr < elemsof(bundle->entry));
+	struct sa_bundle_entry *e = &bundle->entry[bundle->nr++];
+	e->bundle = bundle;
+	e->sa = sa;
+	e->added = false;
+	if (kernel_ops->queue_add_sa == NULL || sa->nic_offload_dev != NULL) {
+		/* NIC offload is retried without; that needs the answer now */
+		e->added = kernel_ops->add_sa(sa, replace, bundle->logger);
+		return e->added;
+	}
+	bundle->outstanding++;
+	kernel_ops->queue_add_sa(sa, replace, sa_bundle_ack, e, bundle->logger);
+	return true;
+}
+
+/*
+ * Give up on the bundle: once every add has been answered, roll back
+ * all the SAs that went in, and wait for the deletes.
+ */
+static void fail_sa_bundle(struct sa_bundle *bundle)
+{
+	bundle->failed = true;
+	sync_kernel(bundle->logger);
+	passert(bundle->outstanding == 0);
+	roll_back_sa_bundle(bundle);
+	sync_kernel(bundle->logger);
+}
+
+static void note_kernel_ack(void *arg, bool ok, struct logger *unused_logger UNUSED)
+{
+	bool *result = arg;
+	*result &= ok;
+}
+
 /*
  * Set up one direction of the SA bundle
  */
@@ -1798,6 +2228,9 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 	/* SPIs, saved for spigrouping or undoing, if necessary */
 	struct kernel_sa said[EM_MAXRELSPIS];
 	struct kernel_sa *said_next = said;
+	struct sa_bundle bundle = {
+		.logger = st->st_logger,
+	};
 
 	char text_ipcomp[SATOT_BUF];
 	char text_esp[SATOT_BUF];
@@ -1891,6 +2324,7 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 		*said_next = said_boilerplate;
 		said_next->spi = ipcomp_spi;
 		said_next->esatype = ET_IPCOMP;
+		said_next->proto = &ip_protocol_comp;
 		said_next->compalg = compalg;
 		said_next->mode = encap_oneshot;
 		said_next->reqid = reqid_ipcomp(c->spd.reqid);
@@ -1908,7 +2342,7 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 			outgoing_ref_set  = true;
 		}
 
-		if (!kernel_ops->add_sa(said_next, replace, st->st_logger)) {
+		if (!add_bundle_sa(&bundle, said_next, replace)) {
 			log_state(RC_LOG, st, "add_sa ipcomp failed");
 			goto fail;
 		}
@@ -2029,6 +2463,7 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 		*said_next = said_boilerplate;
 		said_next->spi = esp_spi;
 		said_next->esatype = ET_ESP;
+		said_next->proto = &ip_protocol_esp;
 		said_next->replay_window = c->sa_replay_window;
 		dbg("setting IPsec SA replay-window to %d", c->sa_replay_window);
 
@@ -2126,13 +2561,13 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 		}
 		setup_esp_nic_offload(said_next, c, &nic_offload_fallback);
 
-		bool ret = kernel_ops->add_sa(said_next, replace, st->st_logger);
+		bool ret = add_bundle_sa(&bundle, said_next, replace);
 
 		if (!ret && nic_offload_fallback &&
 			said_next->nic_offload_dev != NULL) {
 			/* Fallback to non-nic-offload crypto */
 			said_next->nic_offload_dev = NULL;
-			ret = kernel_ops->add_sa(said_next, replace, st->st_logger);
+			ret = add_bundle_sa(&bundle, said_next, replace);
 		}
 
 		/* scrub keys from memory */
@@ -2186,6 +2621,7 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 		*said_next = said_boilerplate;
 		said_next->spi = ah_spi;
 		said_next->esatype = ET_AH;
+		said_next->proto = &ip_protocol_ah;
 		said_next->integ = integ;
 		said_next->authalg = authalg;
 		said_next->authkeylen = st->st_ah.keymat_len;
@@ -2218,7 +2654,7 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 			outgoing_ref_set = true;	/* outgoing_ref_set not subsequently used */
 		}
 
-		if (!kernel_ops->add_sa(said_next, replace, st->st_logger)) {
+		if (!add_bundle_sa(&bundle, said_next, replace)) {
 			/* scrub key from memory */
 			memset(said_next->authkey, 0, said_next->authkeylen);
 			goto fail;
@@ -2253,6 +2689,8 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 	 * Note reversed ends.
 	 * Not much to be done on failure.
 	 */
+	bool inbound_eroute = false;
+	bool inbound_eroute_ok = true;
 	dbg("%s() is installing inbound eroute? inbound=%d owner=#%lu mode=%d",
 	    __func__, inbound, c->spd.eroute_owner, mode);
 	if (inbound && c->spd.eroute_owner == SOS_NOBODY) {
@@ -2314,7 +2752,8 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 		dbg("%s() calling raw_eroute backwards (i.e., inbound)", __func__);
 		/* MCR - should be passed a spd_eroute structure here */
 		/* note: this and that are intentionally reversed */
-		if (!raw_eroute(&c->spd.that.host_addr,		/* this_host */
+		inbound_eroute = true;
+		queue_raw_eroute(&c->spd.that.host_addr,		/* this_host */
 				&c->spd.that.client,	/* this_client */
 				&c->spd.this.host_addr,	/* that_host */
 				&c->spd.this.client,	/* that_client */
@@ -2331,10 +2770,26 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 				ERO_ADD_INBOUND,	/* op */
 				"add inbound",		/* opname */
 				&c->spd.this.sec_label,
-				st->st_logger)) {
-			llog(RC_LOG, st->st_logger,
-				    "raw_eroute() in setup_half_ipsec_sa() failed to add inbound");
-		}
+				note_kernel_ack, &inbound_eroute_ok,
+				st->st_logger);
+	}
+
+	/*
+	 * Collect the answers; a failed add has already been rolled
+	 * back.  The inbound policy went out alongside the SAs so,
+	 * when either half of it or the SAs failed, take it out again.
+	 */
+	sync_kernel(st->st_logger);
+	if (!inbound_eroute_ok) {
+		llog(RC_LOG, st->st_logger,
+			    "raw_eroute() in setup_half_ipsec_sa() failed to add inbound");
+	}
+	if (inbound_eroute && (bundle.failed || !inbound_eroute_ok) &&
+	    kernel_ops->queue_raw_eroute != NULL) {
+		(void) delete_inbound_eroute(st, &c->spd.that.host_addr, /*queue*/false);
+	}
+	if (bundle.failed) {
+		goto fail;
 	}
 
 	/* If there are multiple SPIs, group them. */
@@ -2376,18 +2831,11 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 fail:
 	log_state(RC_LOG, st, "setup_half_ipsec_sa() hit fail:");
 	/* undo the done SPIs */
-	while (said_next-- != said) {
-		if (said_next->proto != 0) {
-			(void) del_spi(said_next->spi,
-				       said_next->proto,
-				       &src, said_next->dst.address,
-				       st->st_logger);
-		}
-	}
+	fail_sa_bundle(&bundle);
 	return false;
 }
 
-static bool teardown_half_ipsec_sa(struct state *st, bool inbound)
+static void teardown_half_ipsec_sa(struct state *st, bool inbound)
 {
 	/* Delete any AH, ESP, and IP in IP SPIs. */
 
@@ -2409,25 +2857,7 @@ static bool teardown_half_ipsec_sa(struct state *st, bool inbound)
 
 	/* ??? CLANG 3.5 thinks that c might be NULL */
 	if (inbound && c->spd.eroute_owner == SOS_NOBODY &&
-	    !raw_eroute(&effective_remote_address,
-			&c->spd.that.client,
-			&c->spd.this.host_addr,
-			&c->spd.this.client,
-			SPI_PASS, SPI_PASS,
-			c->ipsec_mode == ENCAPSULATION_MODE_TRANSPORT ?
-				&ip_protocol_esp : NULL,
-			c->spd.this.protocol,
-			c->ipsec_mode == ENCAPSULATION_MODE_TRANSPORT ?
-				ET_ESP : ET_UNSPEC,
-			null_proto_info,
-			deltatime(0),
-			calculate_sa_prio(c, false),
-			&c->sa_marks,
-			0, /* xfrm_if_id. needed to tear down? */
-			ERO_DEL_INBOUND,
-			"delete inbound",
-			&c->spd.this.sec_label,
-			st->st_logger)) {
+	    !delete_inbound_eroute(st, &effective_remote_address, /*queue*/true)) {
 		llog(RC_LOG, st->st_logger,
 			    "raw_eroute in teardown_half_ipsec_sa() failed to delete inbound");
 	}
@@ -2468,8 +2898,6 @@ static bool teardown_half_ipsec_sa(struct state *st, bool inbound)
 	protos[i].proto = NULL;
 
 	/* delete each proto that needs deleting */
-	bool result = true;
-
 	for (i = 0; protos[i].proto != NULL; i++) {
 		const struct ip_protocol *proto = protos[i].proto;
 		ipsec_spi_t spi;
@@ -2485,10 +2913,8 @@ static bool teardown_half_ipsec_sa(struct state *st, bool inbound)
 			dst = &effective_remote_address;
 		}
 
-		result &= del_spi(spi, proto, src, dst, st->st_logger);
+		queue_del_spi(spi, proto, src, dst, st->st_logger);
 	}
-
-	return result;
 }
 
 static event_callback_routine kernel_process_msg_cb;
@@ -2536,6 +2962,8 @@ void init_kernel(struct logger *logger)
 		    "using %s %s kernel support code on %s",
 		    un.sysname, kernel_ops->kern_name, un.version);
 
+	init_hash_table(&bare_shunt_table);
+
 	passert(kernel_ops->init != NULL);
 	kernel_ops->init(logger);
 
@@ -2768,11 +3196,11 @@ bool route_and_eroute(struct connection *c,
 	/* we should look for dest port as well? */
 	/* ports are now switched to the ones in this.client / that.client ??????? */
 	/* but port set is sr->this.port and sr.that.port ! */
-	struct bare_shunt **bspp = ((ero == NULL) ? bare_shunt_ptr(&sr->this.client,
-								   &sr->that.client,
-								   sr->this.protocol,
-								   "route and eroute") :
-				    NULL);
+	struct bare_shunt *bs = ((ero == NULL) ? find_bare_shunt(&sr->this.client,
+								 &sr->that.client,
+								 sr->this.protocol,
+								 "route and eroute") :
+				 NULL);
 
 	/* install the eroute */
 
@@ -2782,9 +3210,9 @@ bool route_and_eroute(struct connection *c,
 	bool new_eroute = false;
 #endif
 
-	passert(bspp == NULL || ero == NULL);   /* only one non-NULL */
+	passert(bs == NULL || ero == NULL);   /* only one non-NULL */
 
-	if (bspp != NULL || ero != NULL) {
+	if (bs != NULL || ero != NULL) {
 		dbg("we are replacing an eroute");
 		/* if no state provided, then install a shunt for later */
 		if (st == NULL) {
@@ -2797,7 +3225,7 @@ bool route_and_eroute(struct connection *c,
 						"replace");
 		}
 
-		/* remember to free bspp if we make it out of here alive */
+		/* remember to free bs if we make it out of here alive */
 	} else {
 		/* we're adding an eroute */
 #ifdef IPSEC_CONNECTION_LIMIT
@@ -2903,8 +3331,8 @@ bool route_and_eroute(struct connection *c,
 	if (route_installed) {
 		/* Success! */
 
-		if (bspp != NULL) {
-			free_bare_shunt(bspp);
+		if (bs != NULL) {
+			free_bare_shunt(&bs);
 		} else if (ero != NULL && ero != c) {
 			/* check if ero is an ancestor of c. */
 			struct connection *ero2;
@@ -2966,7 +3394,7 @@ bool route_and_eroute(struct connection *c,
 			 * Since there is nothing much to be done if
 			 * the restoration fails, ignore success or failure.
 			 */
-			if (bspp != NULL) {
+			if (bs != NULL) {
 				/*
 				 * Restore old bare_shunt.
 				 * I don't think that this case is very likely.
@@ -2974,8 +3402,6 @@ bool route_and_eroute(struct connection *c,
 				 * assigned to a connection before we've
 				 * gotten this far.
 				 */
-				struct bare_shunt *bs = *bspp;
-
 				if (!raw_eroute(&bs->said.dst,        /* should be useless */
 						&bs->our_client,
 						&bs->said.dst,        /* should be useless */
@@ -3103,6 +3529,9 @@ bool install_ipsec_sa(struct state *st, bool inbound_also)
 		st->st_connection->temp_vars.revive_delay = 0;
 	}
 
+	/* the SPIs are now final; index them */
+	rehash_state_spis_in_db(st);
+
 	if (rb == route_unnecessary)
 		return true;
 
@@ -3267,9 +3696,9 @@ void delete_ipsec_sa(struct state *st)
 					}
 				}
 			}
-			(void) teardown_half_ipsec_sa(st, false);
+			teardown_half_ipsec_sa(st, false);
 		}
-		(void) teardown_half_ipsec_sa(st, true);
+		teardown_half_ipsec_sa(st, true);
 
 		break;
 	default:
@@ -3440,13 +3869,13 @@ bool orphan_holdpass(const struct connection *c, struct spd_route *sr,
 		/* are we replacing a bare shunt ? */
 		update_selector_hport(&sr->this.client, sr->this.port);
 		update_selector_hport(&sr->that.client, sr->that.port);
-		struct bare_shunt **old = bare_shunt_ptr(&sr->this.client,
+		struct bare_shunt *old = find_bare_shunt(&sr->this.client,
 							 &sr->that.client,
 							 sr->this.protocol,
 							 "orphan holdpass");
 
 		if (old != NULL) {
-			free_bare_shunt(old);
+			free_bare_shunt(&old);
 		}
 	}
 
@@ -3469,9 +3898,7 @@ bool orphan_holdpass(const struct connection *c, struct spd_route *sr,
 			bs->from_cn = clone_str(c->name, "conn name in bare shunt");
 		}
 
-		bs->next = bare_shunts;
-		bare_shunts = bs;
-		dbg_bare_shunt("add", bs);
+		link_bare_shunt(bs);
 
 		/* update kernel policy if needed */
 		/* This really causes the name to remain "oe-failing", we should be able to update only only the name of the shunt */
@@ -3494,42 +3921,49 @@ bool orphan_holdpass(const struct connection *c, struct spd_route *sr,
 	return true;
 }
 
+static void expire_bare_shunt(struct bare_shunt *bsp, struct logger *logger)
+{
+	dbg_bare_shunt("expiring old", bsp);
+	if (bsp->from_cn != NULL) {
+		struct connection *c = conn_by_name(bsp->from_cn, false);
+		if (c != NULL) {
+			if (!shunt_eroute(c, &c->spd,
+					  RT_ROUTED_PROSPECTIVE, ERO_ADD,
+					  "add", logger)) {
+				llog(RC_LOG, logger,
+					    "trap shunt install failed ");
+			}
+		}
+	}
+	if (!delete_bare_shunt_entry_policy(bsp,
+					    /*skip_xfrm_raw_eroute_delete?*/(bsp->from_cn != NULL),
+					    "expire_bare_shunt", logger)) {
+		llog(RC_LOG_SERIOUS, logger,
+			    "failed to delete bare shunt");
+	}
+	free_bare_shunt(&bsp);
+}
+
 static void expire_bare_shunts(struct logger *logger, bool all)
 {
 	dbg("checking for aged bare shunts from shunt table to expire");
-	for (struct bare_shunt **bspp = &bare_shunts; *bspp != NULL; ) {
-		struct bare_shunt *bsp = *bspp;
-		time_t age = deltasecs(monotimediff(mononow(), bsp->last_activity));
-		struct connection *c = NULL;
-
-		if (age > deltasecs(pluto_shunt_lifetime) || all) {
-			dbg_bare_shunt("expiring old", bsp);
-			if (bsp->from_cn != NULL) {
-				c = conn_by_name(bsp->from_cn, false);
-				if (c != NULL) {
-					if (!shunt_eroute(c, &c->spd,
-							  RT_ROUTED_PROSPECTIVE, ERO_ADD,
-							  "add", logger)) {
-						llog(RC_LOG, logger,
-							    "trap shunt install failed ");
-					}
-				}
-			}
-			ip_address our_addr = selector_prefix(&bsp->our_client);
-			ip_address peer_addr = selector_prefix(&bsp->peer_client);
-			if (!delete_bare_shunt(&our_addr, &peer_addr,
-					       bsp->transport_proto,
-					       ntohl(bsp->said.spi),
-					       /*skip_xfrm_raw_eroute_delete?*/(bsp->from_cn != NULL),
-					       "expire_bare_shunt", logger)) {
-				llog(RC_LOG_SERIOUS, logger,
-					    "failed to delete bare shunt");
-			}
-			passert(bsp != *bspp);
-		} else {
+	if (all) {
+		struct bare_shunt *bsp;
+		FOR_EACH_LIST_ENTRY_NEW2OLD(&bare_shunt_list, bsp) {
+			expire_bare_shunt(bsp, logger);
+		}
+		return;
+	}
+	/* the heap's top is the least recently active */
+	monotime_t now = mononow();
+	while (nr_bare_shunts > 0) {
+		struct bare_shunt *bsp = bare_shunt_heap[0];
+		time_t age = deltasecs(monotimediff(now, bsp->last_activity));
+		if (age <= deltasecs(pluto_shunt_lifetime)) {
 			dbg_bare_shunt("keeping recent", bsp);
-			bspp = &bsp->next;
+			break;
 		}
+		expire_bare_shunt(bsp, logger);
 	}
 }
 
@@ -3538,10 +3972,23 @@ static void kernel_scan_shunts(struct logger *logger)
 	expire_bare_shunts(logger, false/*not-all*/);
 }
 
+/*
+ * Push out any requests the kernel interface is holding back so that
+ * whoever is watching (whack, say) sees them applied.
+ */
+void flush_kernel(struct logger *logger)
+{
+	if (kernel_ops->flush != NULL) {
+		kernel_ops->flush(logger);
+	}
+}
+
 void shutdown_kernel(struct logger *logger)
 {
 
 	if (kernel_ops->shutdown != NULL)
 		kernel_ops->shutdown(logger);
 	expire_bare_shunts(logger, true/*all*/);
+	pfreeany(bare_shunt_heap);
+	bare_shunt_heap_size = 0;
 }
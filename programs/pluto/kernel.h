@@ -192,6 +192,12 @@ extern char *pluto_listen;	/* from --listen flag */
 #define SADB_X_EALG_AESCBC SADB_X_EALG_AES
 #endif
 
+/*
+ * The outcome of a pipelined kernel request; see .queue_add_sa et.al.
+ * below.
+ */
+typedef void kernel_ack_cb(void *arg, bool ok, struct logger *logger);
+
 struct kernel_ops {
 	enum kernel_interface type;
 	const char *kern_name;
@@ -205,6 +211,8 @@ struct kernel_ops {
 	void (*shutdown)(struct logger *logger);
 	void (*pfkey_register)(void);
 	void (*process_queue)(void);
+	void (*flush)(struct logger *logger);	/* push out queued requests */
+	void (*sync)(struct logger *logger);	/* ... and wait for the answers */
 	void (*process_msg)(int, struct logger *);
 	bool (*raw_eroute)(const ip_address *this_host,
 			   const ip_selector *this_client,
@@ -243,6 +251,38 @@ struct kernel_ops {
 		       const struct kernel_sa *sa_inner);
 	bool (*del_sa)(const struct kernel_sa *sa,
 		       struct logger *logger);
+	/*
+	 * Optional pipelined .add_sa, .del_sa and .raw_eroute: the
+	 * request is only queued; failures are logged when the answer
+	 * arrives and DONE (when non-NULL) is told the outcome of each
+	 * message.  .sync waits for all of them.
+	 */
+	void (*queue_add_sa)(const struct kernel_sa *sa,
+			     bool replace,
+			     kernel_ack_cb *done, void *arg,
+			     struct logger *logger);
+	void (*queue_del_sa)(const struct kernel_sa *sa,
+			     kernel_ack_cb *done, void *arg,
+			     struct logger *logger);
+	void (*queue_raw_eroute)(const ip_address *this_host,
+				 const ip_selector *this_client,
+				 const ip_address *that_host,
+				 const ip_selector *that_client,
+				 ipsec_spi_t cur_spi,
+				 ipsec_spi_t new_spi,
+				 const struct ip_protocol *sa_proto,
+				 unsigned int transport_proto,
+				 enum eroute_type satype,
+				 const struct pfkey_proto_info *proto_info,
+				 deltatime_t use_lifetime,
+				 uint32_t sa_priority,
+				 const struct sa_marks *sa_marks,
+				 const uint32_t xfrm_if_id,
+				 enum pluto_sadb_operations op,
+				 const char *text_said,
+				 const chunk_t *sec_label,
+				 kernel_ack_cb *done, void *arg,
+				 struct logger *logger);
 	bool (*get_sa)(const struct kernel_sa *sa,
 		       uint64_t *bytes,
 		       uint64_t *add_time,
@@ -332,7 +372,7 @@ struct eroute_info {
 extern void show_shunt_status(struct show *);
 extern unsigned shunt_count(void);
 
-struct bare_shunt **bare_shunt_ptr(const ip_selector *ours,
+struct bare_shunt *find_bare_shunt(const ip_selector *ours,
 				   const ip_selector *peers,
 				   int transport_proto,
 				   const char *why);
@@ -436,6 +476,7 @@ static inline bool compatible_overlapping_connections(const struct connection *a
 
 extern void show_kernel_interface(struct show *s);
 void shutdown_kernel(struct logger *logger);
+void flush_kernel(struct logger *logger);
 
 /*
  * Note: "why" must be in stable storage (not auto, not heap)
@@ -38,6 +38,8 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <sys/socket.h>
@@ -60,6 +62,8 @@
 #include <linux/if_addr.h>
 #include <linux/if_link.h>
 
+#include <event2/event.h>
+
 /* work around weird combo's of glibc and kernel header conflicts */
 #ifndef GLIBC_KERN_FLIP_HEADERS
 # include "linux/xfrm.h" /* local (if configured) or system copy */
@@ -95,6 +99,8 @@
 #include "iface.h"
 #include "ip_selector.h"
 #include "ip_encap.h"
+#include "list_entry.h"
+#include "pluto_stats.h"
 
 #include "labeled_ipsec.h" /* TEMP for MAX_SECCTX_LEN */
 #include "security_selinux.h"	/* for vet_seclabel() */
@@ -105,6 +111,8 @@
 #endif
 
 static int nl_send_fd = NULL_FD; /* to send to NETLINK_XFRM */
+static uint32_t nl_send_seq;	/* last sequence number used on nl_send_fd */
+static int nl_batch_fd = NULL_FD; /* to send batched requests to NETLINK_XFRM */
 static int nl_xfrm_fd = NULL_FD; /* listen to NETLINK_XFRM broadcast */
 static int nl_route_fd = NULL_FD; /* listen to NETLINK_ROUTE broadcast */
 
@@ -249,6 +257,342 @@ static void init_netlink_route_fd(struct logger *logger)
 }
 
 
+/*
+ * Batched netlink requests.
+ *
+ * Requests are packed into a buffer and written to their own
+ * NETLINK_XFRM socket as a single datagram.  The kernel works
+ * through the messages in turn and sends back one ACK (an
+ * NLMSG_ERROR, possibly with error 0) for each, which is matched to
+ * its request by sequence number; the outcome is logged and then
+ * handed to the request's completion callback.
+ *
+ * The buffer is flushed from the event loop once the current event
+ * has been handled, or earlier when it fills up, and always before a
+ * synchronous request is sent so that the kernel still sees
+ * everything in program order.  Callers that need the answers
+ * (installing a Child SA, say) queue all their requests and then
+ * call sync_netlink_batch(), so the lot costs one write() and one
+ * pass over the ACKs instead of a round trip per message.
+ */
+
+#define NETLINK_BATCH_SIZE	(32 * 1024)
+#define NETLINK_BATCH_TIMEOUT_MS	1000
+
+enum netlink_request_state {
+	NETLINK_REQUEST_QUEUED,		/* in nl_batch.buf */
+	NETLINK_REQUEST_SENT,		/* awaiting an ACK */
+	NETLINK_REQUEST_LOST,		/* ... that won't come */
+};
+
+struct netlink_request {
+	struct list_entry entry;
+	enum netlink_request_state state;
+	uint32_t seq;
+	uint16_t type;
+	bool enoent_ok;
+	const char *description;
+	char text_said[SATOT_BUF];
+	kernel_ack_cb *done;
+	void *arg;
+	struct logger *logger;
+};
+
+static void jam_netlink_request(struct jambuf *buf, const void *data)
+{
+	if (data == NULL) {
+		jam(buf, "<no request>");
+	} else {
+		const struct netlink_request *req = data;
+		jam(buf, "%s %s seq %u", req->description, req->text_said, req->seq);
+	}
+}
+
+static const struct list_info netlink_request_info = {
+	.name = "netlink request",
+	.jam = jam_netlink_request,
+};
+
+static struct {
+	uint32_t seq;
+	size_t len;
+	unsigned nr_queued;		/* not yet written */
+	unsigned nr_requests;		/* queued or awaiting an ACK */
+	struct list_head requests;	/* oldest first */
+	struct event *flush;		/* flushes from the event loop */
+	struct pluto_event *ack_handler;
+	uint8_t buf[NETLINK_BATCH_SIZE];
+} nl_batch;
+
+static void complete_netlink_request(struct netlink_request *req, int error)
+{
+	remove_list_entry(&req->entry);
+	passert(nl_batch.nr_requests > 0);
+	nl_batch.nr_requests--;
+
+	if (error == ENOENT && req->enoent_ok) {
+		error = 0;
+	}
+	if (error != 0) {
+		llog(RC_LOG_SERIOUS, req->logger,
+		     "ERROR: netlink response for %s %s included errno %d: %s",
+		     req->description, req->text_said, error, strerror(error));
+	}
+	if (error == ESRCH && req->type == XFRM_MSG_UPDSA) {
+		llog(RC_LOG_SERIOUS, req->logger,
+		     "Warning: kernel expired our reserved IPsec SA SPI - negotiation took too long? Try increasing /proc/sys/net/core/xfrm_acq_expires");
+	}
+	if (req->done != NULL) {
+		req->done(req->arg, error == 0, req->logger);
+	}
+	free_logger(&req->logger, HERE);
+	pfree(req);
+}
+
+/*
+ * Complete, with ERROR, every request in STATE.  The list is
+ * re-scanned each time round as a completion may queue more.
+ */
+static void fail_netlink_requests(enum netlink_request_state state, int error)
+{
+	for (;;) {
+		struct netlink_request *req, *found = NULL;
+		FOR_EACH_LIST_ENTRY_OLD2NEW(&nl_batch.requests, req) {
+			if (req->state == state) {
+				found = req;
+				break;
+			}
+		}
+		if (found == NULL) {
+			return;
+		}
+		complete_netlink_request(found, error);
+	}
+}
+
+static void drain_netlink_batch(struct logger *logger)
+{
+	while (nl_batch.nr_requests > nl_batch.nr_queued) {
+		struct nlm_resp rsp;
+		struct sockaddr_nl addr;
+		socklen_t alen = sizeof(addr);
+		ssize_t r = recvfrom(nl_batch_fd, &rsp, sizeof(rsp), 0,
+				     (struct sockaddr *)&addr, &alen);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+			int error = errno;
+			log_errno(logger, error,
+				  "netlink recvfrom() of batched responses failed");
+			if (error == ENOBUFS) {
+				/* the ACKs are gone; the outcome is unknown */
+				struct netlink_request *req;
+				FOR_EACH_LIST_ENTRY_OLD2NEW(&nl_batch.requests, req) {
+					if (req->state == NETLINK_REQUEST_SENT) {
+						req->state = NETLINK_REQUEST_LOST;
+					}
+				}
+				fail_netlink_requests(NETLINK_REQUEST_LOST, error);
+			}
+			return;
+		}
+		if ((size_t)r < sizeof(rsp.n) || addr.nl_pid != 0 ||
+		    rsp.n.nlmsg_type != NLMSG_ERROR) {
+			dbg("netlink: ignoring batched %s response",
+			    sparse_val_show(xfrm_type_names, rsp.n.nlmsg_type));
+			continue;
+		}
+		struct netlink_request *req, *found = NULL;
+		FOR_EACH_LIST_ENTRY_OLD2NEW(&nl_batch.requests, req) {
+			if (req->state == NETLINK_REQUEST_SENT &&
+			    req->seq == rsp.n.nlmsg_seq) {
+				found = req;
+				break;
+			}
+		}
+		if (found == NULL) {
+			dbg("netlink: ignoring batched response with unknown seq %u",
+			    rsp.n.nlmsg_seq);
+			continue;
+		}
+		complete_netlink_request(found, -rsp.u.e.error);
+	}
+}
+
+static void flush_netlink_batch(struct logger *logger)
+{
+	if (nl_batch.nr_queued == 0) {
+		return;
+	}
+
+	ssize_t r;
+	do {
+		r = write(nl_batch_fd, nl_batch.buf, nl_batch.len);
+	} while (r < 0 && errno == EINTR);
+	bool ok = (r >= 0 && (size_t)r == nl_batch.len);
+	int error = (r < 0 ? errno : EIO);
+	if (ok) {
+		dbg("netlink: wrote %u batched messages (%zu bytes)",
+		    nl_batch.nr_queued, nl_batch.len);
+	} else {
+		log_errno(logger, error,
+			  "netlink write() of %u batched messages (%zu bytes) failed",
+			  nl_batch.nr_queued, nl_batch.len);
+	}
+
+	/* the buffer can hold keys; scrub it */
+	memset(nl_batch.buf, 0, nl_batch.len);
+	nl_batch.len = 0;
+	nl_batch.nr_queued = 0;
+
+	struct netlink_request *req;
+	FOR_EACH_LIST_ENTRY_OLD2NEW(&nl_batch.requests, req) {
+		if (req->state == NETLINK_REQUEST_QUEUED) {
+			req->state = (ok ? NETLINK_REQUEST_SENT : NETLINK_REQUEST_LOST);
+		}
+	}
+
+	if (!ok) {
+		/* fail the requests that never made it */
+		fail_netlink_requests(NETLINK_REQUEST_LOST, error);
+		return;
+	}
+
+	/*
+	 * The kernel processes the messages as part of the write() so
+	 * the ACKs are normally already waiting.
+	 */
+	drain_netlink_batch(logger);
+}
+
+/*
+ * Write out anything queued and wait until every request has been
+ * answered (and its completion, which may queue more, has run).
+ */
+static void sync_netlink_batch(struct logger *logger)
+{
+	while (nl_batch.nr_requests > 0) {
+		if (nl_batch.nr_queued > 0) {
+			flush_netlink_batch(logger);
+			continue;
+		}
+		struct pollfd pfd = {
+			.fd = nl_batch_fd,
+			.events = POLLIN,
+		};
+		int n = poll(&pfd, 1, NETLINK_BATCH_TIMEOUT_MS);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			int error = (n < 0 ? errno : ETIMEDOUT);
+			log_errno(logger, error,
+				  "netlink: gave up waiting for %u batched responses",
+				  nl_batch.nr_requests);
+			struct netlink_request *req;
+			FOR_EACH_LIST_ENTRY_OLD2NEW(&nl_batch.requests, req) {
+				if (req->state == NETLINK_REQUEST_SENT) {
+					req->state = NETLINK_REQUEST_LOST;
+				}
+			}
+			fail_netlink_requests(NETLINK_REQUEST_LOST, error);
+			continue;
+		}
+		drain_netlink_batch(logger);
+	}
+}
+
+static void netlink_batch_flush_cb(evutil_socket_t unused_fd UNUSED,
+				   const short unused_event UNUSED,
+				   void *unused_arg UNUSED)
+{
+	struct logger logger[1] = { GLOBAL_LOGGER(null_fd), }; /* event-handler */
+	flush_netlink_batch(logger);
+}
+
+static void netlink_batch_ack_cb(evutil_socket_t unused_fd UNUSED,
+				 const short unused_event UNUSED,
+				 void *unused_arg UNUSED)
+{
+	struct logger logger[1] = { GLOBAL_LOGGER(null_fd), }; /* event-handler */
+	drain_netlink_batch(logger);
+}
+
+static void init_netlink_batch(void)
+{
+	nl_batch.requests = (struct list_head)
+		INIT_LIST_HEAD(&nl_batch.requests, &netlink_request_info);
+	nl_batch.flush = event_new(get_pluto_event_base(), (evutil_socket_t)-1,
+				   EV_TIMEOUT, netlink_batch_flush_cb, NULL);
+	passert(nl_batch.flush != NULL);
+	nl_batch.ack_handler = add_fd_read_event_handler(nl_batch_fd,
+							 netlink_batch_ack_cb, NULL,
+							 "KERNEL_XFRM_BATCH_FD");
+}
+
+/*
+ * Queue HDR; once the kernel has answered, failures are logged
+ * against LOGGER and DONE (when non-NULL) is told the outcome.
+ */
+static void queue_netlink_msg(struct nlmsghdr *hdr, bool enoent_ok,
+			      const char *description, const char *text_said,
+			      kernel_ack_cb *done, void *arg,
+			      struct logger *logger)
+{
+	size_t len = NLMSG_ALIGN(hdr->nlmsg_len);
+	passert(len <= sizeof(nl_batch.buf));
+	if (nl_batch.len + len > sizeof(nl_batch.buf)) {
+		flush_netlink_batch(logger);
+	}
+
+	hdr->nlmsg_flags |= NLM_F_ACK;
+	hdr->nlmsg_seq = ++nl_batch.seq;
+	memset(nl_batch.buf + nl_batch.len, 0, len);
+	memcpy(nl_batch.buf + nl_batch.len, hdr, hdr->nlmsg_len);
+	nl_batch.len += len;
+
+	struct netlink_request *req = alloc_thing(struct netlink_request, "netlink request");
+	req->state = NETLINK_REQUEST_QUEUED;
+	req->seq = hdr->nlmsg_seq;
+	req->type = hdr->nlmsg_type;
+	req->enoent_ok = enoent_ok;
+	req->description = description;
+	jam_str(req->text_said, sizeof(req->text_said), text_said);
+	req->done = done;
+	req->arg = arg;
+	req->logger = clone_logger(logger, HERE);
+	req->entry = list_entry(&netlink_request_info, req);
+	insert_list_entry(&nl_batch.requests, &req->entry);
+	nl_batch.nr_requests++;
+
+	nl_batch.nr_queued++;
+
+	dbg("netlink: queued %s message for %s %s (seq %u, %u queued)",
+	    sparse_val_show(xfrm_type_names, hdr->nlmsg_type),
+	    description, text_said, req->seq, nl_batch.nr_queued);
+	if (nl_batch.flush == NULL) {
+		/* shutting down; there's no event loop to wait for */
+		flush_netlink_batch(logger);
+	} else if (nl_batch.nr_queued == 1) {
+		/* run once the current event has been handled */
+		event_active(nl_batch.flush, EV_TIMEOUT, 0);
+	}
+}
+
+static void netlink_flush(struct logger *logger)
+{
+	flush_netlink_batch(logger);
+}
+
+static void netlink_sync(struct logger *logger)
+{
+	sync_netlink_batch(logger);
+}
+
 /*
  * init_netlink - Initialize the netlink interface.  Opens the sockets and
  * then binds to the broadcast socket.
@@ -276,6 +620,24 @@ static void init_netlink(struct logger *logger)
 			    "fcntl(FD_CLOEXEC) in init_netlink()");
 	}
 
+	nl_batch_fd = safe_socket(AF_NETLINK, SOCK_DGRAM, NETLINK_XFRM);
+	if (nl_batch_fd < 0) {
+		fatal_errno(PLUTO_EXIT_FAIL, logger, errno,
+			    "socket() for batch in init_netlink()");
+	}
+
+	if (fcntl(nl_batch_fd, F_SETFD, FD_CLOEXEC) != 0) {
+		fatal_errno(PLUTO_EXIT_FAIL, logger, errno,
+			    "fcntl(FD_CLOEXEC) for batch in init_netlink()");
+	}
+
+	if (fcntl(nl_batch_fd, F_SETFL, O_NONBLOCK) != 0) {
+		fatal_errno(PLUTO_EXIT_FAIL, logger, errno,
+			    "fcntl(O_NONBLOCK) for batch in init_netlink()");
+	}
+
+	init_netlink_batch();
+
 	nl_xfrm_fd = safe_socket(AF_NETLINK, SOCK_DGRAM, NETLINK_XFRM);
 	if (nl_xfrm_fd < 0) {
 		fatal_errno(PLUTO_EXIT_FAIL, logger, errno,
@@ -362,11 +724,13 @@ static bool send_netlink_msg(struct nlmsghdr *hdr,
 	size_t len;
 	ssize_t r;
 	struct sockaddr_nl addr;
-	static uint32_t seq = 0;	/* STATIC */
 
 	netlink_errno = 0;
 
-	hdr->nlmsg_seq = ++seq;
+	/* keep the kernel's view in program order */
+	flush_netlink_batch(logger);
+
+	hdr->nlmsg_seq = ++nl_send_seq;
 	len = hdr->nlmsg_len;
 	do {
 		r = write(nl_send_fd, hdr, len);
@@ -411,9 +775,9 @@ static bool send_netlink_msg(struct nlmsghdr *hdr,
 			    sparse_val_show(xfrm_type_names, rsp.n.nlmsg_type),
 			    addr.nl_pid);
 			continue;
-		} else if (rsp.n.nlmsg_seq != seq) {
+		} else if (rsp.n.nlmsg_seq != hdr->nlmsg_seq) {
 			dbg("netlink: ignoring out of sequence (%u/%u) message %s",
-			    rsp.n.nlmsg_seq, seq,
+			    rsp.n.nlmsg_seq, hdr->nlmsg_seq,
 			    sparse_val_show(xfrm_type_names, rsp.n.nlmsg_type));
 			continue;
 		}
@@ -494,7 +858,7 @@ static bool netlink_policy(struct nlmsghdr *hdr, bool enoent_ok,
 }
 
 /*
- * netlink_raw_eroute
+ * netlink_raw_policy
  *
  * @param this_host ip_address
  * @param this_client ip_subnet
@@ -510,8 +874,12 @@ static bool netlink_policy(struct nlmsghdr *hdr, bool enoent_ok,
  * @param pluto_sadb_opterations sadb_op (operation - ie: ERO_DELETE)
  * @param text_said char
  * @return boolean True if successful
+ *
+ * When QUEUE, the policy messages are queued on the batch rather than
+ * sent, and DONE is told the outcome of each once it is known (a
+ * request that needs no message is not reported).
  */
-static bool netlink_raw_eroute(const ip_address *this_host,
+static bool netlink_raw_policy(const ip_address *this_host,
 			       const ip_selector *this_client,
 			       const ip_address *that_host,
 			       const ip_selector *that_client,
@@ -528,6 +896,7 @@ static bool netlink_raw_eroute(const ip_address *this_host,
 			       enum pluto_sadb_operations sadb_op,
 			       const char *text_said,
 			       const chunk_t *sec_label,
+			       bool queue, kernel_ack_cb *done, void *arg,
 			       struct logger *logger)
 {
 	struct {
@@ -796,6 +1165,29 @@ static bool netlink_raw_eroute(const ip_address *this_host,
 	bool enoent_ok = sadb_op == ERO_DEL_INBOUND ||
 		(sadb_op == ERO_DELETE && ntohl(cur_spi) == SPI_HOLD);
 
+	if (queue) {
+		/*
+		 * Unlike below, the FWD policy is queued without
+		 * waiting to see if the IN policy went in; DONE hears
+		 * about both so the caller can take them out again.
+		 */
+		queue_netlink_msg(&req.n, enoent_ok, "policy", text_said,
+				  done, arg, logger);
+		if (dir == XFRM_POLICY_IN) {
+			if (req.n.nlmsg_type == XFRM_MSG_DELPOLICY) {
+				req.u.id.dir = XFRM_POLICY_FWD;
+			} else if (proto_info[0].mode != ENCAPSULATION_MODE_TUNNEL &&
+				   esatype != ET_INT) {
+				return true;
+			} else {
+				req.u.p.dir = XFRM_POLICY_FWD;
+			}
+			queue_netlink_msg(&req.n, enoent_ok, "policy", text_said,
+					  done, arg, logger);
+		}
+		return true;
+	}
+
 	bool ok = netlink_policy(&req.n, enoent_ok, text_said, logger);
 
 	/* ??? deal with any forwarding policy */
@@ -818,6 +1210,59 @@ static bool netlink_raw_eroute(const ip_address *this_host,
 	return ok;
 }
 
+static bool netlink_raw_eroute(const ip_address *this_host,
+			       const ip_selector *this_client,
+			       const ip_address *that_host,
+			       const ip_selector *that_client,
+			       ipsec_spi_t cur_spi,
+			       ipsec_spi_t new_spi,
+			       const struct ip_protocol *sa_proto,
+			       unsigned int transport_proto,
+			       enum eroute_type esatype,
+			       const struct pfkey_proto_info *proto_info,
+			       deltatime_t use_lifetime,
+			       uint32_t sa_priority,
+			       const struct sa_marks *sa_marks,
+			       const uint32_t xfrm_if_id,
+			       enum pluto_sadb_operations sadb_op,
+			       const char *text_said,
+			       const chunk_t *sec_label,
+			       struct logger *logger)
+{
+	return netlink_raw_policy(this_host, this_client, that_host, that_client,
+				  cur_spi, new_spi, sa_proto, transport_proto,
+				  esatype, proto_info, use_lifetime, sa_priority,
+				  sa_marks, xfrm_if_id, sadb_op, text_said, sec_label,
+				  /*queue*/false, NULL, NULL, logger);
+}
+
+static void netlink_queue_raw_eroute(const ip_address *this_host,
+				     const ip_selector *this_client,
+				     const ip_address *that_host,
+				     const ip_selector *that_client,
+				     ipsec_spi_t cur_spi,
+				     ipsec_spi_t new_spi,
+				     const struct ip_protocol *sa_proto,
+				     unsigned int transport_proto,
+				     enum eroute_type esatype,
+				     const struct pfkey_proto_info *proto_info,
+				     deltatime_t use_lifetime,
+				     uint32_t sa_priority,
+				     const struct sa_marks *sa_marks,
+				     const uint32_t xfrm_if_id,
+				     enum pluto_sadb_operations sadb_op,
+				     const char *text_said,
+				     const chunk_t *sec_label,
+				     kernel_ack_cb *done, void *arg,
+				     struct logger *logger)
+{
+	netlink_raw_policy(this_host, this_client, that_host, that_client,
+			   cur_spi, new_spi, sa_proto, transport_proto,
+			   esatype, proto_info, use_lifetime, sa_priority,
+			   sa_marks, xfrm_if_id, sadb_op, text_said, sec_label,
+			   /*queue*/true, done, arg, logger);
+}
+
 static void  set_migration_attr(const struct kernel_sa *sa,
 		struct xfrm_user_migrate *m)
 {
@@ -1189,8 +1634,13 @@ static bool netlink_detect_offload(const struct raw_iface *ifp, struct logger *l
  * @param replace boolean - true if this replaces an existing SA
  * @return bool True if successful
  */
-static bool netlink_add_sa(const struct kernel_sa *sa, bool replace,
-			   struct logger *logger)
+/*
+ * Build and send (or, when QUEUE, queue) the XFRM_MSG_NEWSA (or
+ * UPDSA) for SA; see netlink_raw_policy() for DONE.
+ */
+static bool netlink_sa(const struct kernel_sa *sa, bool replace,
+		       bool queue, kernel_ack_cb *done, void *arg,
+		       struct logger *logger)
 {
 	struct {
 		struct nlmsghdr n;
@@ -1570,6 +2020,12 @@ static bool netlink_add_sa(const struct kernel_sa *sa, bool replace,
 		attr = (struct rtattr *)((char *)attr + attr->rta_len);
 	}
 
+	if (queue) {
+		queue_netlink_msg(&req.n, /*enoent_ok*/false,
+				  "Add SA", sa->text_said, done, arg, logger);
+		return true;
+	}
+
 	ret = send_netlink_msg(&req.n, NLMSG_NOOP, NULL,
 			       "Add SA", sa->text_said, logger);
 	if (!ret && netlink_errno == ESRCH &&
@@ -1580,14 +2036,25 @@ static bool netlink_add_sa(const struct kernel_sa *sa, bool replace,
 	return ret;
 }
 
+static bool netlink_add_sa(const struct kernel_sa *sa, bool replace,
+			   struct logger *logger)
+{
+	return netlink_sa(sa, replace, /*queue*/false, NULL, NULL, logger);
+}
+
+static void netlink_queue_add_sa(const struct kernel_sa *sa, bool replace,
+				 kernel_ack_cb *done, void *arg,
+				 struct logger *logger)
+{
+	netlink_sa(sa, replace, /*queue*/true, done, arg, logger);
+}
+
 /*
- * netlink_del_sa - Delete an SA from the Kernel
- *
- * @param sa Kernel SA to be deleted
- * @return bool True if successful
+ * Queue the XFRM_MSG_DELSA for SA; see netlink_raw_policy() for DONE.
  */
-static bool netlink_del_sa(const struct kernel_sa *sa,
-			   struct logger *logger)
+static void netlink_queue_del_sa(const struct kernel_sa *sa,
+				 kernel_ack_cb *done, void *arg,
+				 struct logger *logger)
 {
 	struct {
 		struct nlmsghdr n;
@@ -1609,8 +2076,32 @@ static bool netlink_del_sa(const struct kernel_sa *sa,
 
 	dbg("XFRM: deleting IPsec SA with reqid %d", sa->reqid);
 
-	return send_netlink_msg(&req.n, NLMSG_NOOP, NULL,
-				"Del SA", sa->text_said, logger);
+	queue_netlink_msg(&req.n, /*enoent_ok*/false, "Del SA", sa->text_said,
+			  done, arg, logger);
+}
+
+static void note_netlink_ack(void *arg, bool ok, struct logger *unused_logger UNUSED)
+{
+	bool *result = arg;
+	*result &= ok;
+}
+
+/*
+ * netlink_del_sa - Delete an SA from the Kernel
+ *
+ * @param sa Kernel SA to be deleted
+ * @return bool True if successful
+ *
+ * The delete still goes through the batch, along with anything
+ * already queued, but the answer is waited for.
+ */
+static bool netlink_del_sa(const struct kernel_sa *sa,
+			   struct logger *logger)
+{
+	bool ok = true;
+	netlink_queue_del_sa(sa, note_netlink_ack, &ok, logger);
+	sync_netlink_batch(logger);
+	return ok;
 }
 
 /*
@@ -2451,6 +2942,174 @@ static void netlink_process_raw_ifaces(struct raw_iface *rifaces, struct logger
 	}
 }
 
+/*
+ * Bulk SA counters.
+ *
+ * With sa-counter-cache= set, netlink_get_sa() answers from a
+ * snapshot of every SA's counters taken with a single XFRM_MSG_GETSA
+ * dump, and only takes a new one once the snapshot is older than the
+ * TTL.  Status of, and idle checks on, many SAs then cost one dump
+ * instead of a round trip each.  An SA missing from the snapshot
+ * (added since) is still looked up on its own.
+ */
+
+struct sa_counters {
+	ipsec_spi_t spi;
+	uint8_t proto;
+	uint16_t family;
+	xfrm_address_t daddr;
+	uint64_t bytes;
+	uint64_t add_time;
+};
+
+static struct {
+	struct sa_counters *sa;
+	unsigned nr;
+	unsigned size;
+	bool valid;
+	monotime_t taken;
+} sa_snapshot;
+
+static int sa_counters_cmp(const void *lp, const void *rp)
+{
+	const struct sa_counters *l = lp;
+	const struct sa_counters *r = rp;
+	if (l->spi != r->spi) {
+		return (l->spi < r->spi ? -1 : 1);
+	}
+	if (l->proto != r->proto) {
+		return (l->proto < r->proto ? -1 : 1);
+	}
+	if (l->family != r->family) {
+		return (l->family < r->family ? -1 : 1);
+	}
+	return memcmp(&l->daddr, &r->daddr,
+		      (l->family == AF_INET ? sizeof(l->daddr.a4) : sizeof(l->daddr.a6)));
+}
+
+static void add_sa_counters(const struct xfrm_usersa_info *info)
+{
+	if (sa_snapshot.nr == sa_snapshot.size) {
+		unsigned size = (sa_snapshot.size == 0 ? 64 : sa_snapshot.size * 2);
+		realloc_things(sa_snapshot.sa, sa_snapshot.size, size, "SA counter snapshot");
+		sa_snapshot.size = size;
+	}
+	struct sa_counters *sa = &sa_snapshot.sa[sa_snapshot.nr++];
+	zero(sa);
+	sa->spi = info->id.spi;
+	sa->proto = info->id.proto;
+	sa->family = info->family;
+	if (info->family == AF_INET) {
+		sa->daddr.a4 = info->id.daddr.a4;
+	} else {
+		sa->daddr = info->id.daddr;
+	}
+	sa->bytes = info->curlft.bytes;
+	sa->add_time = info->curlft.add_time;
+}
+
+static bool dump_sa_counters(struct logger *logger)
+{
+	struct {
+		struct nlmsghdr n;
+	} req;
+	zero(&req);
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.n.nlmsg_type = XFRM_MSG_GETSA;
+	req.n.nlmsg_len = NLMSG_LENGTH(0);
+
+	/* keep the kernel's view in program order */
+	flush_netlink_batch(logger);
+
+	req.n.nlmsg_seq = ++nl_send_seq;
+	ssize_t r;
+	do {
+		r = write(nl_send_fd, &req, req.n.nlmsg_len);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0 || (size_t)r != req.n.nlmsg_len) {
+		log_errno(logger, (r < 0 ? errno : EIO),
+			  "netlink write() of SA counter dump request failed");
+		return false;
+	}
+
+	sa_snapshot.nr = 0;
+	static uint8_t buf[64 * 1024];	/* STATIC */
+	for (;;) {
+		struct sockaddr_nl addr;
+		socklen_t alen = sizeof(addr);
+		r = recvfrom(nl_send_fd, buf, sizeof(buf), 0,
+			     (struct sockaddr *)&addr, &alen);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_errno(logger, errno,
+				  "netlink recvfrom() of SA counter dump failed");
+			return false;
+		}
+		if (addr.nl_pid != 0) {
+			continue;
+		}
+		size_t len = r;
+		for (struct nlmsghdr *n = (struct nlmsghdr *)buf;
+		     NLMSG_OK(n, len); n = NLMSG_NEXT(n, len)) {
+			if (n->nlmsg_seq != req.n.nlmsg_seq) {
+				dbg("netlink: ignoring out of sequence (%u/%u) message %s",
+				    n->nlmsg_seq, req.n.nlmsg_seq,
+				    sparse_val_show(xfrm_type_names, n->nlmsg_type));
+				continue;
+			}
+			switch (n->nlmsg_type) {
+			case NLMSG_DONE:
+				qsort(sa_snapshot.sa, sa_snapshot.nr,
+				      sizeof(sa_snapshot.sa[0]), sa_counters_cmp);
+				dbg("netlink: SA counter dump has %u SAs", sa_snapshot.nr);
+				pstats_kernel_sa_dumps++;
+				return true;
+			case NLMSG_ERROR:
+			{
+				const struct nlmsgerr *e = NLMSG_DATA(n);
+				llog(RC_LOG_SERIOUS, logger,
+				     "ERROR: netlink SA counter dump failed with errno %d: %s",
+				     -e->error, strerror(-e->error));
+				return false;
+			}
+			case XFRM_MSG_NEWSA:
+				if (n->nlmsg_len >= NLMSG_LENGTH(sizeof(struct xfrm_usersa_info))) {
+					add_sa_counters(NLMSG_DATA(n));
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+static const struct sa_counters *cached_sa_counters(const struct kernel_sa *sa,
+						    struct logger *logger)
+{
+	/* a failed dump isn't retried until the TTL is up either */
+	if (is_monotime_epoch(sa_snapshot.taken) ||
+	    deltatime_cmp(monotimediff(mononow(), sa_snapshot.taken), >=,
+			  pluto_sa_counter_cache)) {
+		sa_snapshot.valid = dump_sa_counters(logger);
+		sa_snapshot.taken = mononow();
+	}
+	if (!sa_snapshot.valid) {
+		return NULL;
+	}
+
+	struct sa_counters key;
+	zero(&key);
+	key.spi = sa->spi;
+	key.proto = sa->proto->ipproto;
+	key.family = addrtypeof(sa->src.address);
+	key.daddr = xfrm_from_address(sa->dst.address);
+	return bsearch(&key, sa_snapshot.sa, sa_snapshot.nr,
+		       sizeof(sa_snapshot.sa[0]), sa_counters_cmp);
+}
+
 /*
  * netlink_get_sa - Get SA information from the kernel
  *
@@ -2469,6 +3128,18 @@ static bool netlink_get_sa(const struct kernel_sa *sa, uint64_t *bytes,
 
 	struct nlm_resp rsp;
 
+	if (deltasecs(pluto_sa_counter_cache) > 0) {
+		const struct sa_counters *cached = cached_sa_counters(sa, logger);
+		if (cached != NULL) {
+			pstats_kernel_sa_cached++;
+			*bytes = cached->bytes;
+			*add_time = cached->add_time;
+			return TRUE;
+		}
+	}
+
+	pstats_kernel_sa_queries++;
+
 	zero(&req);
 	req.n.nlmsg_flags = NLM_F_REQUEST;
 	req.n.nlmsg_type = XFRM_MSG_GETSA;
@@ -2769,6 +3440,32 @@ static bool netlink_poke_ipsec_policy_hole(const struct iface_dev *ifd, int fd,
 	return true;
 }
 
+static void netlink_shutdown(struct logger *logger)
+{
+	flush_netlink_batch(logger);
+	/* forget any ACKs still outstanding */
+	struct netlink_request *req;
+	FOR_EACH_LIST_ENTRY_OLD2NEW(&nl_batch.requests, req) {
+		dbg("netlink: abandoning %s %s", req->description, req->text_said);
+		remove_list_entry(&req->entry);
+		free_logger(&req->logger, HERE);
+		pfree(req);
+	}
+	nl_batch.nr_requests = 0;
+	pfreeany(sa_snapshot.sa);
+	sa_snapshot.size = sa_snapshot.nr = 0;
+	sa_snapshot.valid = false;
+	sa_snapshot.taken = monotime_epoch;
+	delete_pluto_event(&nl_batch.ack_handler);
+	if (nl_batch.flush != NULL) {
+		event_free(nl_batch.flush);
+		nl_batch.flush = NULL;
+	}
+#ifdef USE_XFRM_INTERFACE
+	free_xfrmi_ipsec1(logger);
+#endif
+}
+
 const struct kernel_ops xfrm_kernel_ops = {
 	.kern_name = "xfrm",
 	.type = USE_XFRM,
@@ -2777,14 +3474,15 @@ const struct kernel_ops xfrm_kernel_ops = {
 	.replay_window = IPSEC_SA_DEFAULT_REPLAY_WINDOW,
 
 	.init = init_netlink,
-#ifdef USE_XFRM_INTERFACE
-	.shutdown = free_xfrmi_ipsec1,
-#else
-	.shutdown = NULL,
-#endif
+	.shutdown = netlink_shutdown,
+	.flush = netlink_flush,
+	.sync = netlink_sync,
 	.process_msg = netlink_process_msg,
 	.raw_eroute = netlink_raw_eroute,
 	.add_sa = netlink_add_sa,
+	.queue_add_sa = netlink_queue_add_sa,
+	.queue_del_sa = netlink_queue_del_sa,
+	.queue_raw_eroute = netlink_queue_raw_eroute,
 	.del_sa = netlink_del_sa,
 	.get_sa = netlink_get_sa,
 	.process_queue = NULL,
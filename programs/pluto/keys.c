@@ -68,6 +68,7 @@
 #include "secrets.h"
 #include "ike_alg_hash.h"
 #include "pluto_timing.h"
+#include "pubkey_db.h"
 
 static struct secret *pluto_secrets = NULL;
 
@@ -312,141 +313,131 @@ err_t try_signature_RSA(const struct crypt_mac *expected_hash,
  * Note: parameter keys_from_dns contains results of DNS lookup for
  * key or is NULL indicating lookup not yet tried.
  *
- * take_a_crack is a helper function.  Mostly forensic.  If only we
- * had coroutines. (XXX: generators).
+ * The check is split in three so that the expensive part can be run
+ * on a helper thread:
+ *
+ * prepare_signature_check() (main thread) filters the remote
+ * certificate and preloaded public keys down to the candidates that
+ * match the peer's ID, CA and key type, taking a reference to each;
+ *
+ * run_signature_check() (any thread) tries each candidate in turn,
+ * stopping at the first that verifies; it only touches the check;
+ *
+ * finish_signature_check() (main thread) logs the outcome and, on
+ * success, saves the key in the IKE SA.
  */
-struct tac_state {
+
+struct signature_candidate {
+	struct pubkey *key;
+	const char *description;	/* "remote certificates" ... */
+};
+
+struct signature_check {
+	/* in */
 	const struct pubkey_type *type;
-	const struct crypt_mac *hash;
-	shunk_t signature;
+	struct crypt_mac hash;
+	chunk_t signature;
 	const struct hash_desc *hash_algo;
 	try_signature_fn *try_signature;
-	realtime_t now;
-	struct logger *logger;
-	const struct end *remote;
+	struct signature_candidate *candidates;
+	unsigned nr_candidates;
 
-	/* state carried between calls */
+	/* out */
 	err_t best_ugh; /* most successful failure */
 	int tried_cnt;  /* number of keys tried */
 	char tried[50]; /* keyids of tried public keys */
-	struct jambuf tried_jambuf;
 	struct pubkey *key;
 };
 
-static bool try_all_keys(const char *pubkey_description,
-			 struct pubkey_list *pubkey_db,
-			 struct tac_state *s)
+static void add_signature_candidate(struct signature_check *check,
+				    const char *pubkey_description,
+				    struct pubkey *key,
+				    const struct end *remote,
+				    realtime_t now)
 {
+	if (key->type != check->type) {
+		id_buf printkid;
+		dbg("  skipping '%s' with type %s",
+		    str_id(&key->id, &printkid), key->type->name);
+		return;
+	}
 
-	id_buf thatid;
-	dbg("trying all %s public keys for %s key that matches ID: %s",
-	    pubkey_description, s->type->name, str_id(&s->remote->id, &thatid));
-
-	for (struct pubkey_list *p = pubkey_db; p != NULL; p = p->next) {
-		struct pubkey *key = p->key;
-
-		if (key->type != s->type) {
-			id_buf printkid;
-			dbg("  skipping '%s' with type %s",
-			    str_id(&key->id, &printkid), key->type->name);
-			continue;
-		}
-
-		if (!same_id(&s->remote->id, &key->id)) {
-			id_buf printkid;
-			dbg("  skipping '%s' with wrong ID",
-			    str_id(&key->id, &printkid));
-			continue;
-		}
-
-		int pl;	/* value ignored */
-		if (!trusted_ca_nss(key->issuer, s->remote->ca, &pl)) {
-			id_buf printkid;
-			dn_buf buf;
-			dbg("  skipping '%s' with untrusted CA '%s'",
-			    str_id(&key->id, &printkid),
-			    str_dn_or_null(key->issuer, "%any", &buf));
-			continue;
-		}
-
-		/*
-		 * XXX: even though loop above filtered out these
-		 * certs, keep this check, at some point the above
-		 * loop will be deleted.
-		 */
-		if (!is_realtime_epoch(key->until_time) &&
-		    realbefore(key->until_time, s->now)) {
-			id_buf printkid;
-			realtime_buf buf;
-			dbg("  skipping '%s' which expired on %s",
-			    str_id(&key->id, &printkid),
-			    str_realtime(key->until_time, /*utc?*/false, &buf));
-			continue;
-		}
+	if (!same_id(&remote->id, &key->id)) {
+		id_buf printkid;
+		dbg("  skipping '%s' with wrong ID",
+		    str_id(&key->id, &printkid));
+		return;
+	}
 
+	int pl;	/* value ignored */
+	if (!trusted_ca_nss(key->issuer, remote->ca, &pl)) {
 		id_buf printkid;
 		dn_buf buf;
-		dbg("  trying '%s' issued by CA '%s'",
-		    str_id(&key->id, &printkid), str_dn_or_null(key->issuer, "%any", &buf));
+		dbg("  skipping '%s' with untrusted CA '%s'",
+		    str_id(&key->id, &printkid),
+		    str_dn_or_null(key->issuer, "%any", &buf));
+		return;
+	}
 
-		const char *key_id_str = str_keyid(*pubkey_keyid(key));
+	/*
+	 * XXX: even though loop above filtered out these
+	 * certs, keep this check, at some point the above
+	 * loop will be deleted.
+	 */
+	if (!is_realtime_epoch(key->until_time) &&
+	    realbefore(key->until_time, now)) {
+		id_buf printkid;
+		realtime_buf buf;
+		dbg("  skipping '%s' which expired on %s",
+		    str_id(&key->id, &printkid),
+		    str_realtime(key->until_time, /*utc?*/false, &buf));
+		return;
+	}
 
-		s->tried_cnt++;
-		logtime_t try_time = logtime_start(s->logger);
-		err_t ugh = (s->try_signature)(s->hash, s->signature,
-					       key, s->hash_algo,
-					       s->logger);
-		logtime_stop(&try_time, "%s() trying a pubkey", __func__);
+	id_buf printkid;
+	dn_buf buf;
+	dbg("  candidate '%s' issued by CA '%s'",
+	    str_id(&key->id, &printkid), str_dn_or_null(key->issuer, "%any", &buf));
 
-		if (ugh == NULL) {
-			/*
-			 * Success: copy successful key into state.
-			 * There might be an old one if we previously
-			 * aborted this state transition.
-			 */
-			dbg("an %s signature check passed with *%s [%s]",
-			    key->type->name, key_id_str, pubkey_description);
-			s->key = key;
-			return true;
-		}
+	realloc_things(check->candidates, check->nr_candidates,
+		       check->nr_candidates + 1, "signature candidates");
+	check->candidates[check->nr_candidates++] = (struct signature_candidate) {
+		.key = pubkey_addref(key, HERE),
+		.description = pubkey_description,
+	};
+}
 
-		llog(RC_LOG_SERIOUS, s->logger,
-		     "an %s Sig check failed '%s' with *%s [%s]",
-		     key->type->name, ugh + 1, key_id_str, pubkey_description);
-		if (s->best_ugh == NULL || s->best_ugh[0] < ugh[0])
-			s->best_ugh = ugh;
-		if (ugh[0] > '0') {
-			jam(&s->tried_jambuf, " *%s", key_id_str);
-		}
+static void add_signature_candidates(struct signature_check *check,
+				     const char *pubkey_description,
+				     struct pubkey_list *pubkey_db,
+				     const struct end *remote,
+				     realtime_t now)
+{
+	id_buf thatid;
+	dbg("trying all %s public keys for %s key that matches ID: %s",
+	    pubkey_description, check->type->name, str_id(&remote->id, &thatid));
 
+	for (struct pubkey_list *p = pubkey_db; p != NULL; p = p->next) {
+		add_signature_candidate(check, pubkey_description, p->key,
+					remote, now);
 	}
-	return false;
 }
 
-stf_status check_signature_gen(struct ike_sa *ike,
-			       const struct crypt_mac *hash,
-			       shunk_t signature,
-			       const struct hash_desc *hash_algo,
-			       const struct pubkey_type *type,
-			       try_signature_fn *try_signature)
+struct signature_check *prepare_signature_check(struct ike_sa *ike,
+						const struct crypt_mac *hash,
+						shunk_t signature,
+						const struct hash_desc *hash_algo,
+						const struct pubkey_type *type,
+						try_signature_fn *try_signature)
 {
 	const struct connection *c = ike->sa.st_connection;
-	struct tac_state s = {
-		/* in */
-		.type = type,
-		.logger = ike->sa.st_logger,
-		.hash = hash,
-		.now = realnow(),
-		.signature = signature,
-		.hash_algo = hash_algo,
-		.remote = &c->spd.that,
-		.try_signature = try_signature,
-		/* out */
-		.best_ugh = NULL,
-		.tried_cnt = 0,
-		.key = NULL,
-	};
-	s.tried_jambuf = ARRAY_AS_JAMBUF(s.tried);
+	realtime_t now = realnow();
+	struct signature_check *check = alloc_thing(struct signature_check, "signature check");
+	check->type = type;
+	check->hash = *hash;
+	check->signature = clone_hunk(signature, "signature to check");
+	check->hash_algo = hash_algo;
+	check->try_signature = try_signature;
 
 	/* try all appropriate Public keys */
 
@@ -458,38 +449,110 @@ stf_status check_signature_gen(struct ike_sa *ike,
 	}
 
 	pexpect(ike->sa.st_remote_certs.processed);
-	bool found = try_all_keys("remote certificates", ike->sa.st_remote_certs.pubkey_db, &s);
+	add_signature_candidates(check, "remote certificates",
+				 ike->sa.st_remote_certs.pubkey_db,
+				 &c->spd.that, now);
 
 	/*
-	 * Prune the expired public keys from the pre-loaded public
-	 * key list.  But why here, and why not as a separate job?
+	 * Only tried when none of the certificate keys work.
+	 *
+	 * While at it, prune any expired keys with the peer's ID from
+	 * the database.  But why here, and why not as a separate job?
 	 * And why blame the IKE SA as it isn't really its fault?
 	 */
-	for (struct pubkey_list **pp = &pluto_pubkeys; *pp != NULL; ) {
-		struct pubkey *key = (*pp)->key;
+	id_buf thatid;
+	dbg("trying all preloaded keys public keys for %s key that matches ID: %s",
+	    type->name, str_id(&c->spd.that.id, &thatid));
+	unsigned nr_keys;
+	struct pubkey **keys = find_pubkey_db_keys(&c->spd.that.id, type, &nr_keys);
+	for (unsigned i = 0; i < nr_keys; i++) {
+		struct pubkey *key = keys[i];
 		if (!is_realtime_epoch(key->until_time) &&
-		    realbefore(key->until_time, s.now)) {
+		    realbefore(key->until_time, now)) {
 			id_buf printkid;
 			log_state(RC_LOG_SERIOUS, &ike->sa,
 				  "cached %s public key '%s' has expired and has been deleted",
 				  key->type->name, str_id(&key->id, &printkid));
-			*pp = free_public_keyentry(*(pp));
+			delete_pubkey_db_key(key);
 			continue; /* continue with next public key */
 		}
-		pp = &(*pp)->next;
+		add_signature_candidate(check, "preloaded keys", key,
+					&c->spd.that, now);
 	}
+	pfreeany(keys);
+
+	return check;
+}
 
-	if (!found) {
-		found = try_all_keys("preloaded keys", pluto_pubkeys, &s);
+void run_signature_check(struct signature_check *check, struct logger *logger)
+{
+	struct jambuf tried_jambuf = ARRAY_AS_JAMBUF(check->tried);
+	logtime_t verify_time = logtime_start(logger);
+
+	for (unsigned i = 0; i < check->nr_candidates; i++) {
+		const struct signature_candidate *candidate = &check->candidates[i];
+		struct pubkey *key = candidate->key;
+		const char *key_id_str = str_keyid(*pubkey_keyid(key));
+
+		check->tried_cnt++;
+		logtime_t try_time = logtime_start(logger);
+		err_t ugh = (check->try_signature)(&check->hash,
+						   HUNK_AS_SHUNK(check->signature),
+						   key, check->hash_algo,
+						   logger);
+		logtime_stop(&try_time, "%s() trying a pubkey", __func__);
+		if (ugh == NULL) {
+			dbg("an %s signature check passed with *%s [%s]",
+			    key->type->name, key_id_str, candidate->description);
+			check->key = key;
+			break;
+		}
+
+		llog(RC_LOG_SERIOUS, logger,
+		     "an %s Sig check failed '%s' with *%s [%s]",
+		     key->type->name, ugh + 1, key_id_str, candidate->description);
+		if (check->best_ugh == NULL || check->best_ugh[0] < ugh[0])
+			check->best_ugh = ugh;
+		if (ugh[0] > '0') {
+			jam(&tried_jambuf, " *%s", key_id_str);
+		}
 	}
 
-	if (found) {
+	logtime_stop(&verify_time, "%s() verifying %s signature using %d of %u keys",
+		     __func__, check->type->name, check->tried_cnt,
+		     check->nr_candidates);
+}
+
+void free_signature_check(struct signature_check **check)
+{
+	struct signature_check *sc = *check;
+	if (sc == NULL) {
+		return;
+	}
+	for (unsigned i = 0; i < sc->nr_candidates; i++) {
+		pubkey_delref(&sc->candidates[i].key, HERE);
+	}
+	pfreeany(sc->candidates);
+	free_chunk_content(&sc->signature);
+	pfree(sc);
+	*check = NULL;
+}
+
+stf_status finish_signature_check(struct ike_sa *ike,
+				  struct signature_check **check)
+{
+	const struct connection *c = ike->sa.st_connection;
+	struct signature_check *sc = *check;
+	const struct pubkey_type *type = sc->type;
+
+	if (sc->key != NULL) {
 		pubkey_delref(&ike->sa.st_peer_pubkey, HERE);
-		ike->sa.st_peer_pubkey = pubkey_addref(s.key, HERE);
+		ike->sa.st_peer_pubkey = pubkey_addref(sc->key, HERE);
 		log_state(RC_LOG_SERIOUS, &ike->sa,
 			  "authenticated using %s with %s",
 			  type->name,
-			  (c->ike_version == IKEv1) ? "SHA-1" : hash_algo->common.fqn);
+			  (c->ike_version == IKEv1) ? "SHA-1" : sc->hash_algo->common.fqn);
+		free_signature_check(check);
 		return STF_OK;
 	}
 
@@ -506,29 +569,45 @@ stf_status check_signature_gen(struct ike_sa *ike,
 	str_id(&c->spd.that.id, &id_str);
 	passert(id_str.buf[0] != '\0');
 
-	if (s.best_ugh == NULL) {
+	if (sc->best_ugh == NULL) {
 		log_state(RC_LOG_SERIOUS, &ike->sa,
 			  "no %s public key known for '%s'",
 			  type->name, id_str.buf);
 		/* ??? is this the best code there is? */
+		free_signature_check(check);
 		return STF_FAIL + INVALID_KEY_INFORMATION;
 	}
 
-	if (s.tried_cnt == 1) {
+	if (sc->tried_cnt == 1) {
 		log_state(RC_LOG_SERIOUS, &ike->sa,
 			  "%s Signature check (on %s) failed (wrong key?); tried%s",
-			  type->name, id_str.buf, s.tried);
+			  type->name, id_str.buf, sc->tried);
 	} else {
 		log_state(RC_LOG_SERIOUS, &ike->sa,
 			  "%s Signature check (on %s) failed: tried%s keys but none worked.",
-			  type->name, id_str.buf, s.tried);
+			  type->name, id_str.buf, sc->tried);
 	}
 	dbg("all %d %s public keys for %s failed: best decrypted SIG payload into a malformed ECB (%s)",
-	    s.tried_cnt, type->name, id_str.buf, s.best_ugh+1/*skip '9'*/);
+	    sc->tried_cnt, type->name, id_str.buf, sc->best_ugh+1/*skip '9'*/);
 
+	free_signature_check(check);
 	return STF_FAIL + INVALID_KEY_INFORMATION;
 }
 
+stf_status check_signature_gen(struct ike_sa *ike,
+			       const struct crypt_mac *hash,
+			       shunk_t signature,
+			       const struct hash_desc *hash_algo,
+			       const struct pubkey_type *type,
+			       try_signature_fn *try_signature)
+{
+	struct signature_check *check =
+		prepare_signature_check(ike, hash, signature, hash_algo,
+					type, try_signature);
+	run_signature_check(check, ike->sa.st_logger);
+	return finish_signature_check(ike, &check);
+}
+
 /*
  * find the struct secret associated with the combination of
  * me and the peer.  We match the Id (if none, the IP address).
@@ -798,13 +877,9 @@ const struct private_key_stuff *get_connection_private_key(const struct connecti
  * public key machinery
  */
 
-/* root of chained public key list */
-
-struct pubkey_list *pluto_pubkeys = NULL;       /* keys from ipsec.conf */
-
 void free_remembered_public_keys(void)
 {
-	free_public_keys(&pluto_pubkeys);
+	free_pubkey_db();
 }
 
 /*
@@ -812,8 +887,6 @@ void free_remembered_public_keys(void)
  */
 void list_public_keys(struct show *s, bool utc, bool check_pub_keys)
 {
-	struct pubkey_list *p = pluto_pubkeys;
-
 	if (!check_pub_keys) {
 		/*
 		 * XXX: when there are no keys, the tests expect the
@@ -835,8 +908,9 @@ void list_public_keys(struct show *s, bool utc, bool check_pub_keys)
 #endif
 	}
 
-	while (p != NULL) {
-		struct pubkey *key = p->key;
+	struct pubkey_db_entry *e;
+	FOR_EACH_PUBKEY_DB_ENTRY(e) {
+		struct pubkey *key = e->key;
 		const char *check_expiry_msg = check_expiry(key->until_time,
 							    PUBKEY_WARNING_INTERVAL,
 							    TRUE);
@@ -873,7 +947,6 @@ void list_public_keys(struct show *s, bool utc, bool check_pub_keys)
 					     str_dn(key->issuer, &b));
 			}
 		}
-		p = p->next;
 	}
 }
 
@@ -900,9 +973,16 @@ err_t preload_private_key_by_ckaid(const ckaid_t *ckaid, bool *load_needed, stru
 
 const struct pubkey *find_pubkey_by_ckaid(const char *ckaid)
 {
-	for (struct pubkey_list *p = pluto_pubkeys; p != NULL; p = p->next) {
+	/* a complete CKAID can use the index */
+	ckaid_t full;
+	if (string_to_ckaid(ckaid, &full) == NULL && full.len == CKAID_SIZE) {
+		return find_pubkey_db_key_by_ckaid(&full);
+	}
+
+	struct pubkey_db_entry *e;
+	FOR_EACH_PUBKEY_DB_ENTRY(e) {
 		DBG_log("looking at a PUBKEY");
-		struct pubkey *key = p->key;
+		struct pubkey *key = e->key;
 		const ckaid_t *key_ckaid = pubkey_ckaid(key);
 		if (ckaid_starts_with(key_ckaid, ckaid)) {
 			dbg("ckaid matching pubkey");
@@ -65,9 +65,6 @@ err_t preload_private_key_by_ckaid(const ckaid_t *ckaid, bool *load_needed, stru
 
 extern struct secret *lsw_get_xauthsecret(char *xauthname);
 
-/* keys from ipsec.conf */
-extern struct pubkey_list *pluto_pubkeys;
-
 const struct pubkey *find_pubkey_by_ckaid(const char *ckaid);
 
 typedef err_t (try_signature_fn) (const struct crypt_mac *hash,
@@ -85,4 +82,20 @@ extern stf_status check_signature_gen(struct ike_sa *ike,
 				      const struct pubkey_type *type,
 				      try_signature_fn *try_signature);
 
+/*
+ * check_signature_gen() broken into its main thread and helper thread
+ * parts; see keys.c.
+ */
+struct signature_check;
+struct signature_check *prepare_signature_check(struct ike_sa *ike,
+						const struct crypt_mac *hash,
+						shunk_t signature,
+						const struct hash_desc *hash_algo,
+						const struct pubkey_type *type,
+						try_signature_fn *try_signature);
+void run_signature_check(struct signature_check *check, struct logger *logger);
+stf_status finish_signature_check(struct ike_sa *ike,
+				  struct signature_check **check);
+void free_signature_check(struct signature_check **check);
+
 #endif /* _KEYS_H */
@@ -342,25 +342,41 @@ static void rate_log_raw(const char *prefix,
 	}
 }
 
-void rate_log(const struct msg_digest *md,
-	      const char *message, ...)
+PRINTF_LIKE_VA(2)
+static void rate_log_va_list(struct logger *logger,
+			     const char *message, va_list ap)
 {
 	unsigned limit = log_limit();
-	va_list ap;
-	va_start(ap, message);
 	if (nr_rate_limited_logs < limit) {
-		rate_log_raw("", md->md_logger, message, ap);
+		rate_log_raw("", logger, message, ap);
 	} else if (nr_rate_limited_logs == limit) {
-		rate_log_raw("", md->md_logger, message, ap);
+		rate_log_raw("", logger, message, ap);
 		log_global(LOG_STREAM, null_fd,
 			   "rate limited log reached limit of %u entries", limit);
 	} else if (DBGP(DBG_BASE)) {
-		rate_log_raw(DEBUG_PREFIX, md->md_logger, message, ap);
+		rate_log_raw(DEBUG_PREFIX, logger, message, ap);
 	}
-	va_end(ap);
 	nr_rate_limited_logs++;
 }
 
+void rate_log(const struct msg_digest *md,
+	      const char *message, ...)
+{
+	va_list ap;
+	va_start(ap, message);
+	rate_log_va_list(md->md_logger, message, ap);
+	va_end(ap);
+}
+
+void rate_llog(struct logger *logger,
+	       const char *message, ...)
+{
+	va_list ap;
+	va_start(ap, message);
+	rate_log_va_list(logger, message, ap);
+	va_end(ap);
+}
+
 static global_timer_cb reset_log_rate_limit;
 
 static void reset_log_rate_limit(struct logger *logger)
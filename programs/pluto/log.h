@@ -161,6 +161,8 @@ void log_state(lset_t rc_flags, const struct state *st,
  */
 void rate_log(const struct msg_digest *md,
 	      const char *message, ...) PRINTF_LIKE(2);
+void rate_llog(struct logger *logger,
+	       const char *message, ...) PRINTF_LIKE(2);
 
 /*
  * Whack only logging.
@@ -19,6 +19,9 @@
 #include "log.h"
 #include "demux.h"      /* needs packet.h */
 #include "iface.h"
+#include "slab.h"
+
+static struct slab_pool md_pool = SLAB_POOL(struct msg_digest, "struct msg_digest");
 
 struct msg_digest *alloc_md(const struct iface_endpoint *ifp, const ip_endpoint *sender, where_t where)
 {
@@ -27,7 +30,8 @@ struct msg_digest *alloc_md(const struct iface_endpoint *ifp, const ip_endpoint
 	 * - .note = NOTHING_WRONG
 	 * - .encrypted = FALSE
 	 */
-	struct msg_digest *md = refcnt_alloc(struct msg_digest, where);
+	struct msg_digest *md = slab_alloc_thing(&md_pool, struct msg_digest, where.func);
+	refcnt_init("struct msg_digest", md, &md->refcnt, where);
 	md->iface = ifp;
 	md->sender = *sender;
 	md->md_logger = alloc_logger(md, &logger_message_vec, where);
@@ -56,7 +60,7 @@ static void free_mdp(struct msg_digest **mdp, where_t where)
 	free_chunk_content(&(*mdp)->raw_packet);
 	free_logger(&(*mdp)->md_logger, where);
 	pfreeany((*mdp)->packet_pbs.start);
-	pfree(*mdp);
+	slab_free(&md_pool, *mdp);
 	*mdp = NULL;
 }
 
@@ -17,6 +17,7 @@
  *
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -45,6 +46,11 @@
 #include "root_certs.h"
 #include "ip_info.h"
 #include "log.h"
+#include "server.h"		/* for pluto_cert_verify_cache */
+#include "list_entry.h"
+#include "crypt_hash.h"
+#include "ike_alg_hash.h"	/* for ike_alg_hash_sha2_256 */
+#include "show.h"
 
 /*
  * set up the slot/handle/trust things that NSS needs
@@ -515,6 +521,279 @@ static struct certs *decode_cert_payloads(CERTCertDBHandle *handle,
 	return certs;
 }
 
+/*
+ * Cache of successful chain verifications (cert-verify-cache=).
+ *
+ * An entry is keyed by a SHA-256 over the revocation options and the
+ * DER of the end cert followed by the intermediates.  It expires when
+ * the first cert in the chain expires or after
+ * PLUTO_CERT_VERIFY_CACHE_LIFETIME seconds, whichever is sooner.
+ *
+ * A hit only skips verify_end_cert() - NSS's chain building and its
+ * OCSP/CRL checks.  The certs are still decoded (the caller needs
+ * them) and the CRL update check is still made.  Failures are not
+ * cached so that a transient OCSP or CRL failure doesn't stick.
+ *
+ * The cache is used by the helper threads so everything is under
+ * CERT_VERIFY_CACHE_MUTEX.  Importing a CRL or loading the root certs
+ * flushes the cache and bumps .generation; a verification that
+ * straddles a flush isn't added.
+ */
+
+struct cert_verify_entry {
+	struct crypt_mac key;
+	PRTime expires;
+	struct list_entry lru_entry;	/* newest is .head.older */
+	struct list_entry hash_entry;
+};
+
+static void jam_cert_verify_entry(struct jambuf *buf, const void *data)
+{
+	const struct cert_verify_entry *e = data;
+	jam_hex_bytes(buf, e->key.ptr, 4);
+}
+
+static const struct list_info cert_verify_lru_info = {
+	.name = "cert verify cache lru",
+	.jam = jam_cert_verify_entry,
+};
+
+static const struct list_info cert_verify_hash_info = {
+	.name = "cert verify cache hash",
+	.jam = jam_cert_verify_entry,
+};
+
+static pthread_mutex_t cert_verify_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	unsigned long generation;
+	unsigned nr_entries;
+	unsigned nr_buckets;
+	struct list_head *buckets;	/* allocated on first add */
+	struct list_head lru;
+	struct {
+		unsigned long hits;
+		unsigned long misses;
+		unsigned long expired;
+		unsigned long flushes;
+	} stats;
+} cert_verify_cache = {
+	.lru = INIT_LIST_HEAD(&cert_verify_cache.lru, &cert_verify_lru_info),
+};
+
+static struct crypt_mac cert_verify_key(const struct certs *chain,
+					const struct rev_opts *rev_opts,
+					struct logger *logger)
+{
+	struct crypt_hash *hash = crypt_hash_init("cert verify cache",
+						  &ike_alg_hash_sha2_256,
+						  logger);
+	crypt_hash_digest_thing(hash, "revocation options", *rev_opts);
+	for (const struct certs *entry = chain; entry != NULL; entry = entry->next) {
+		crypt_hash_digest_bytes(hash, "DER", entry->cert->derCert.data,
+					entry->cert->derCert.len);
+	}
+	return crypt_hash_final_mac(&hash);
+}
+
+static struct list_head *cert_verify_bucket(const struct crypt_mac *key)
+{
+	/* the key is a SHA-256 so any bits will do */
+	uint32_t h;
+	memcpy(&h, key->ptr, sizeof(h));
+	return &cert_verify_cache.buckets[h % cert_verify_cache.nr_buckets];
+}
+
+static struct cert_verify_entry *find_cert_verify_entry(const struct crypt_mac *key)
+{
+	if (cert_verify_cache.buckets == NULL) {
+		return NULL;
+	}
+	struct cert_verify_entry *e;
+	FOR_EACH_LIST_ENTRY_NEW2OLD(cert_verify_bucket(key), e) {
+		if (hunk_eq(e->key, *key)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void free_cert_verify_entry(struct cert_verify_entry **e)
+{
+	remove_list_entry(&(*e)->lru_entry);
+	remove_list_entry(&(*e)->hash_entry);
+	cert_verify_cache.nr_entries--;
+	pfree(*e);
+	*e = NULL;
+}
+
+/* is the chain known to be good?; returns the generation to add with */
+static bool cert_verify_cache_hit(const struct crypt_mac *key,
+				  unsigned long *generation)
+{
+	bool hit = false;
+	pthread_mutex_lock(&cert_verify_cache_mutex);
+	{
+		*generation = cert_verify_cache.generation;
+		struct cert_verify_entry *e = find_cert_verify_entry(key);
+		if (e != NULL && e->expires <= PR_Now()) {
+			free_cert_verify_entry(&e);
+			cert_verify_cache.stats.expired++;
+		}
+		if (e != NULL) {
+			/* make it the newest */
+			remove_list_entry(&e->lru_entry);
+			insert_list_entry(&cert_verify_cache.lru, &e->lru_entry);
+			cert_verify_cache.stats.hits++;
+			hit = true;
+		} else {
+			cert_verify_cache.stats.misses++;
+		}
+	}
+	pthread_mutex_unlock(&cert_verify_cache_mutex);
+	return hit;
+}
+
+static void add_cert_verify_entry(const struct crypt_mac *key,
+				  unsigned long generation,
+				  const struct certs *chain)
+{
+	PRTime expires = PR_Now() + (PRTime)PLUTO_CERT_VERIFY_CACHE_LIFETIME * PR_USEC_PER_SEC;
+	for (const struct certs *entry = chain; entry != NULL; entry = entry->next) {
+		PRTime not_before, not_after;
+		if (CERT_GetCertTimes(entry->cert, &not_before, &not_after) == SECSuccess &&
+		    not_after < expires) {
+			expires = not_after;
+		}
+	}
+
+	pthread_mutex_lock(&cert_verify_cache_mutex);
+	{
+		if (generation != cert_verify_cache.generation) {
+			dbg("cert verify cache flushed during verification; not adding");
+		} else {
+			if (cert_verify_cache.buckets == NULL) {
+				cert_verify_cache.nr_buckets = pluto_cert_verify_cache;
+				cert_verify_cache.buckets = alloc_things(struct list_head,
+									 cert_verify_cache.nr_buckets,
+									 "cert verify cache buckets");
+				for (unsigned i = 0; i < cert_verify_cache.nr_buckets; i++) {
+					struct list_head *bucket = &cert_verify_cache.buckets[i];
+					*bucket = (struct list_head) INIT_LIST_HEAD(bucket, &cert_verify_hash_info);
+				}
+			}
+			/* another helper may have got there first */
+			struct cert_verify_entry *e = find_cert_verify_entry(key);
+			if (e != NULL) {
+				free_cert_verify_entry(&e);
+			}
+			if (cert_verify_cache.nr_entries >= pluto_cert_verify_cache) {
+				struct cert_verify_entry *oldest = cert_verify_cache.lru.head.newer->data;
+				free_cert_verify_entry(&oldest);
+			}
+			e = alloc_thing(struct cert_verify_entry, "cert verify entry");
+			e->key = *key;
+			e->expires = expires;
+			e->lru_entry = list_entry(&cert_verify_lru_info, e);
+			e->hash_entry = list_entry(&cert_verify_hash_info, e);
+			insert_list_entry(&cert_verify_cache.lru, &e->lru_entry);
+			insert_list_entry(cert_verify_bucket(key), &e->hash_entry);
+			cert_verify_cache.nr_entries++;
+		}
+	}
+	pthread_mutex_unlock(&cert_verify_cache_mutex);
+}
+
+static void empty_cert_verify_cache(void)
+{
+	while (cert_verify_cache.nr_entries > 0) {
+		struct cert_verify_entry *oldest = cert_verify_cache.lru.head.newer->data;
+		free_cert_verify_entry(&oldest);
+	}
+}
+
+void flush_cert_verify_cache(const char *why)
+{
+	pthread_mutex_lock(&cert_verify_cache_mutex);
+	{
+		dbg("flushing %u cached cert verifications: %s",
+		    cert_verify_cache.nr_entries, why);
+		empty_cert_verify_cache();
+		cert_verify_cache.generation++;
+		cert_verify_cache.stats.flushes++;
+	}
+	pthread_mutex_unlock(&cert_verify_cache_mutex);
+}
+
+void free_cert_verify_cache(void)
+{
+	pthread_mutex_lock(&cert_verify_cache_mutex);
+	{
+		empty_cert_verify_cache();
+		pfreeany(cert_verify_cache.buckets);
+		cert_verify_cache.nr_buckets = 0;
+	}
+	pthread_mutex_unlock(&cert_verify_cache_mutex);
+}
+
+void show_cert_verify_cache_status(struct show *s)
+{
+	if (pluto_cert_verify_cache == 0) {
+		return;
+	}
+	pthread_mutex_lock(&cert_verify_cache_mutex);
+	{
+		show_comment(s, "cert-verify-cache: size=%u entries=%u, hits=%lu, misses=%lu, expired=%lu, flushes=%lu",
+			     pluto_cert_verify_cache,
+			     cert_verify_cache.nr_entries,
+			     cert_verify_cache.stats.hits,
+			     cert_verify_cache.stats.misses,
+			     cert_verify_cache.stats.expired,
+			     cert_verify_cache.stats.flushes);
+	}
+	pthread_mutex_unlock(&cert_verify_cache_mutex);
+}
+
+void show_cert_verify_cache_stats(struct show *s)
+{
+	show_raw(s, "total.cert.verify_cache.hits=%lu", cert_verify_cache.stats.hits);
+	show_raw(s, "total.cert.verify_cache.misses=%lu", cert_verify_cache.stats.misses);
+	show_raw(s, "total.cert.verify_cache.flushes=%lu", cert_verify_cache.stats.flushes);
+}
+
+void clear_cert_verify_cache_stats(void)
+{
+	pthread_mutex_lock(&cert_verify_cache_mutex);
+	zero(&cert_verify_cache.stats);
+	pthread_mutex_unlock(&cert_verify_cache_mutex);
+}
+
+static bool cached_verify_end_cert(struct logger *logger,
+				   const struct root_certs *root_certs,
+				   const struct rev_opts *rev_opts,
+				   CERTCertificate *end_cert,
+				   const struct certs *chain)
+{
+	if (pluto_cert_verify_cache == 0) {
+		return verify_end_cert(logger, root_certs, rev_opts, end_cert);
+	}
+
+	struct crypt_mac key = cert_verify_key(chain, rev_opts, logger);
+	unsigned long generation;
+	if (cert_verify_cache_hit(&key, &generation)) {
+		dbg("certificate chain for %s found in verify cache",
+		    end_cert->subjectName);
+		return true;
+	}
+
+	if (!verify_end_cert(logger, root_certs, rev_opts, end_cert)) {
+		return false;
+	}
+
+	add_cert_verify_entry(&key, generation, chain);
+	return true;
+}
+
 /*
  * Decode and verify the chain received by pluto.
  * ee_out is the resulting end cert
@@ -607,8 +886,9 @@ struct verified_certs find_and_verify_certs(struct logger *logger,
 	}
 
 	logtime_t verify_time = logtime_start(logger);
-	bool end_ok = verify_end_cert(logger, root_certs, rev_opts, end_cert);
-	logtime_stop(&verify_time, "%s() calling verify_end_cert()", __func__);
+	bool end_ok = cached_verify_end_cert(logger, root_certs, rev_opts,
+					     end_cert, result.cert_chain);
+	logtime_stop(&verify_time, "%s() calling cached_verify_end_cert()", __func__);
 	if (!end_ok) {
 		/*
 		 * XXX: preserve verify_end_cert()'s behaviour? only
@@ -26,6 +26,7 @@ struct certs;
 struct payload_digest;
 struct root_certs;
 struct logger;
+struct show;
 
 /*
  * Try to find and verify the end cert.  Sets CRL_NEEDED and BAD (for
@@ -55,6 +56,17 @@ struct verified_certs find_and_verify_certs(struct logger *log,
 					    struct root_certs *root_cert,
 					    const struct id *keyid);
 
+/*
+ * Cache of successful chain verifications, see cert-verify-cache=.
+ * Flush when what a verification depends on (CRLs, root certs)
+ * changes; safe to call from any thread.
+ */
+void flush_cert_verify_cache(const char *why);
+void free_cert_verify_cache(void);
+void show_cert_verify_cache_status(struct show *s);
+void show_cert_verify_cache_stats(struct show *s);
+void clear_cert_verify_cache_stats(void);
+
 extern bool cert_VerifySubjectAltName(const CERTCertificate *cert,
 				      const struct id *id, struct logger *logger);
 
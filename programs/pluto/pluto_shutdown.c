@@ -50,12 +50,19 @@
 #include "kernel.h"		/* for kernel_ops.shutdown() and free_kernel() */
 #include "virtual_ip.h"		/* for free_virtual_ip() */
 #include "server.h"		/* for free_server() */
+#include "timer.h"		/* for free_timer() */
+#include "show.h"		/* for free_show_streams() */
+#include "slab.h"		/* for free_slab_pools() */
 #include "revival.h"		/* for free_revivals() */
 #ifdef USE_DNSSEC
 #include "dnssec.h"		/* for unbound_ctx_free() */
 #endif
 #include "demux.h"		/* for free_demux() */
+#include "crypt_ke.h"		/* for free_ke_and_nonce_pools() */
+#include "nss_cert_verify.h"	/* for free_cert_verify_cache() */
 #include "impair_message.h"	/* for free_impair_message() */
+#include "hash_table.h"		/* for free_hash_tables() */
+#include "ikev2_half_open.h"	/* for free_v2_half_open() */
 
 volatile bool exiting_pluto = false;
 static bool pluto_leave_state = false;
@@ -118,10 +125,13 @@ void exit_epilogue(void)
 		exit(PLUTO_EXIT_LEAVE_STATE);
 	}
 
+	free_v2_half_open();	/* before NSS goes */
 	delete_every_connection();
 	free_root_certs(logger);
 	free_preshared_secrets(logger);
 	free_remembered_public_keys();
+	free_ke_and_nonce_pools();	/* helpers have stopped; before NSS */
+	free_cert_verify_cache();
 	/*
 	 * free memory allocated by initialization routines.  Please don't
 	 * forget to do this.
@@ -153,10 +163,14 @@ void exit_epilogue(void)
 	lsw_nss_shutdown();
 	delete_lock();	/* delete any lock files */
 	free_virtual_ip();	/* virtual_private= */
+	free_timer();
+	free_show_streams();
 	free_server(); /* no libevent evnts beyond this point */
 	free_demux();
 	free_pluto_main();	/* our static chars */
 	free_impair_message(logger);
+	free_hash_tables();
+	free_slab_pools();	/* no pooled objects beyond this point */
 #ifdef USE_DNSSEC
 	unbound_ctx_free();
 #endif
@@ -38,6 +38,13 @@
 #include "ike_alg.h"
 #include "pluto_stats.h"
 #include "nat_traversal.h"
+#include "server_pool.h"	/* for show_helper_stats() */
+#include "crypt_ke.h"		/* for show_ke_and_nonce_pool_stats() */
+#include "nss_cert_verify.h"	/* for show_cert_verify_cache_stats() */
+#include "pubkey_db.h"		/* for show_pubkey_db_stats() */
+#include "hash_table.h"		/* for show_hash_table_stats() */
+#include "timer.h"		/* for show_timer_wheel_stats() et.al. */
+#include "slab.h"		/* for show_slab_pool_stats() */
 
 unsigned long pstats_ipsec_sa;
 unsigned long pstats_ikev1_sa;
@@ -68,6 +75,22 @@ uint64_t pstats_ipsec_in_bytes;	/* total incoming IPsec traffic */
 uint64_t pstats_ipsec_out_bytes;	/* total outgoing IPsec traffic */
 unsigned long pstats_ike_in_bytes;	/* total incoming IPsec traffic */
 unsigned long pstats_ike_out_bytes;	/* total outgoing IPsec traffic */
+unsigned long pstats_ike_udp_batches;	/* recvmmsg() calls returning datagrams */
+unsigned long pstats_ike_udp_batched;	/* datagrams read by recvmmsg() */
+unsigned long pstats_ike_source_challenged;	/* IKE_SA_INIT requests from busy sources */
+unsigned long pstats_ike_source_dropped;
+/* CPU spent on established IKEv2 IKE SAs, see delete_state_tail() */
+static unsigned long pstats_ike_cpu_sas;
+static uint64_t pstats_ike_cpu_main_usec;
+static uint64_t pstats_ike_cpu_helper_usec;
+unsigned long pstats_resume_batches;	/* resume queue drains */
+unsigned long pstats_resume_events;	/* resumes delivered */
+unsigned long pstats_resume_max_batch;	/* most resumes in one drain */
+unsigned long pstats_resume_wait_usec;	/* total time resumes spent queued */
+unsigned long pstats_resume_max_wait_usec;
+unsigned long pstats_kernel_sa_dumps;	/* kernel SA counter dumps */
+unsigned long pstats_kernel_sa_cached;	/* SA counters answered from a dump */
+unsigned long pstats_kernel_sa_queries;	/* SA counters queried one by one */
 unsigned long pstats_ikev1_sent_notifies_e[v1N_ERROR_PSTATS_ROOF]; /* types of NOTIFY ERRORS */
 unsigned long pstats_ikev1_recv_notifies_e[v1N_ERROR_PSTATS_ROOF]; /* types of NOTIFY ERRORS */
 unsigned long pstats_ike_stf[10];	/* count state transitions */ /* ??? what is 10? */
@@ -193,10 +216,14 @@ void pstat_sa_deleted(struct state *st)
 			else
 				pstats_ikev1_fail++;
 		} else {
-			if (st->st_ike_version == IKEv2)
+			if (st->st_ike_version == IKEv2) {
 				pstats_ikev2_completed++;
-			else
+				pstats_ike_cpu_sas++;
+				pstats_ike_cpu_main_usec += st->st_timing.main_usage.thread_seconds * 1000000;
+				pstats_ike_cpu_helper_usec += st->st_timing.helper_usage.thread_seconds * 1000000;
+			} else {
 				pstats_ikev1_completed++;
+			}
 		}
 #ifdef NOT_YET
 		/*
@@ -208,9 +235,29 @@ void pstat_sa_deleted(struct state *st)
 			(st->st_pstats.delete_reason != REASON_UNKNOWN &&
 			 fail != (st->st_pstats.delete_reason == REASON_COMPLETED)));
 #endif
+	} else if (st->st_ike_version == IKEv2) {
+		/*
+		 * Some of an IKE_AUTH exchange is billed to its
+		 * CHILD SA (for instance when a helper's result is
+		 * resumed there) so include it in the IKE SA totals.
+		 */
+		pstats_ike_cpu_main_usec += st->st_timing.main_usage.thread_seconds * 1000000;
+		pstats_ike_cpu_helper_usec += st->st_timing.helper_usage.thread_seconds * 1000000;
 	}
 }
 
+/*
+ * A compacted half-open IKEv2 IKE SA (see ikev2_half_open.c) has no
+ * state left to pass to pstat_sa_deleted(); it was never established.
+ */
+void pstat_compacted_ike_sa_deleted(enum delete_reason reason)
+{
+	dbg("pstats %s deleted %s", pstats_sa_names[IKEv2][IKE_SA],
+	    pstats_sa_reasons[reason]);
+	pstats_sa_finished[IKEv2][IKE_SA][reason]++;
+	pstats_ikev2_fail++;
+}
+
 /*
  * Established SAs.
  */
@@ -431,6 +478,29 @@ void show_pluto_stats(struct show *s)
 	show_raw(s, "total.ike.dpd.replied=%lu", pstats_ike_dpd_replied);
 	show_raw(s, "total.ike.traffic.in=%lu", pstats_ike_in_bytes);
 	show_raw(s, "total.ike.traffic.out=%lu", pstats_ike_out_bytes);
+	show_raw(s, "total.ike.udp.recv.batches=%lu", pstats_ike_udp_batches);
+	show_raw(s, "total.ike.udp.recv.batched=%lu", pstats_ike_udp_batched);
+	show_raw(s, "total.ike.source.challenged=%lu", pstats_ike_source_challenged);
+	show_raw(s, "total.ike.source.dropped=%lu", pstats_ike_source_dropped);
+	show_raw(s, "total.ike.cpu.sas=%lu", pstats_ike_cpu_sas);
+	show_raw(s, "total.ike.cpu.main.usec=%" PRIu64, pstats_ike_cpu_main_usec);
+	show_raw(s, "total.ike.cpu.helper.usec=%" PRIu64, pstats_ike_cpu_helper_usec);
+	show_raw(s, "total.resume.batches=%lu", pstats_resume_batches);
+	show_raw(s, "total.resume.events=%lu", pstats_resume_events);
+	show_raw(s, "total.resume.batch.max=%lu", pstats_resume_max_batch);
+	show_raw(s, "total.resume.wait.usec=%lu", pstats_resume_wait_usec);
+	show_raw(s, "total.resume.wait.max.usec=%lu", pstats_resume_max_wait_usec);
+	show_raw(s, "total.kernel.sa.dumps=%lu", pstats_kernel_sa_dumps);
+	show_raw(s, "total.kernel.sa.cached=%lu", pstats_kernel_sa_cached);
+	show_raw(s, "total.kernel.sa.queries=%lu", pstats_kernel_sa_queries);
+	show_helper_stats(s);
+	show_ke_and_nonce_pool_stats(s);
+	show_cert_verify_cache_stats(s);
+	show_pubkey_db_stats(s);
+	show_hash_table_stats(s);
+	show_timer_wheel_stats(s);
+	show_rekey_schedule_stats(s);
+	show_slab_pool_stats(s);
 
 	show_raw(s, "total.pamauth.started=%lu", pstats_pamauth_started);
 	show_raw(s, "total.pamauth.stopped=%lu", pstats_pamauth_stopped);
@@ -494,6 +564,16 @@ void clear_pluto_stats(void)
 
 	pstats_ipsec_in_bytes = pstats_ipsec_out_bytes = 0;
 	pstats_ike_in_bytes = pstats_ike_out_bytes = 0;
+	pstats_ike_udp_batches = pstats_ike_udp_batched = 0;
+	pstats_ike_source_challenged = pstats_ike_source_dropped = 0;
+	pstats_ike_cpu_sas = pstats_ike_cpu_main_usec = pstats_ike_cpu_helper_usec = 0;
+	pstats_resume_batches = pstats_resume_events = pstats_resume_max_batch = 0;
+	pstats_resume_wait_usec = pstats_resume_max_wait_usec = 0;
+	pstats_kernel_sa_dumps = pstats_kernel_sa_cached = pstats_kernel_sa_queries = 0;
+	clear_helper_stats();
+	clear_ke_and_nonce_pool_stats();
+	clear_cert_verify_cache_stats();
+	clear_pubkey_db_stats();
 	pstats_ipsec_esp = pstats_ipsec_ah = pstats_ipsec_ipcomp = 0;
 	pstats_ipsec_encap_yes = pstats_ipsec_encap_no = 0;
 	pstats_ipsec_esn = pstats_ipsec_tfc = 0;
@@ -40,6 +40,18 @@ extern uint64_t pstats_ipsec_in_bytes;	/* total incoming IPsec traffic */
 extern uint64_t pstats_ipsec_out_bytes;	/* total outgoing IPsec traffic */
 extern unsigned long pstats_ike_in_bytes;	/* total incoming IPsec traffic */
 extern unsigned long pstats_ike_out_bytes;	/* total outgoing IPsec traffic */
+extern unsigned long pstats_ike_udp_batches;	/* recvmmsg() calls returning datagrams */
+extern unsigned long pstats_ike_udp_batched;	/* datagrams read by recvmmsg() */
+extern unsigned long pstats_ike_source_challenged;	/* IKE_SA_INIT requests from busy sources */
+extern unsigned long pstats_ike_source_dropped;
+extern unsigned long pstats_resume_batches;	/* resume queue drains */
+extern unsigned long pstats_resume_events;	/* resumes delivered */
+extern unsigned long pstats_resume_max_batch;
+extern unsigned long pstats_resume_wait_usec;	/* total time resumes spent queued */
+extern unsigned long pstats_resume_max_wait_usec;
+extern unsigned long pstats_kernel_sa_dumps;	/* kernel SA counter dumps */
+extern unsigned long pstats_kernel_sa_cached;	/* SA counters answered from a dump */
+extern unsigned long pstats_kernel_sa_queries;	/* SA counters queried one by one */
 extern unsigned long pstats_ikev1_sent_notifies_e[v1N_ERROR_PSTATS_ROOF]; /* types of NOTIFY ERRORS */
 extern unsigned long pstats_ikev1_recv_notifies_e[v1N_ERROR_PSTATS_ROOF]; /* types of NOTIFY ERRORS */
 extern const struct pluto_stat pstats_ikev2_sent_notifies_e; /* types of NOTIFY ERRORS */
@@ -97,5 +109,6 @@ void pstat_sa_started(struct state *st, enum sa_type sa_type);
 void pstat_sa_failed(struct state *st, enum delete_reason reason);
 void pstat_sa_established(struct state *st);
 void pstat_sa_deleted(struct state *st);
+void pstat_compacted_ike_sa_deleted(enum delete_reason reason);
 
 #endif /* _PLUTO_STATS_H */
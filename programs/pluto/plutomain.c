@@ -59,8 +59,10 @@
 #include "enum_names.h"
 #include "virtual_ip.h"
 #include "state_db.h"		/* for init_state_db() */
+#include "timer.h"		/* for init_timer() */
 #include "revival.h"		/* for init_revival() */
 #include "connection_db.h"	/* for connection_state_db() */
+#include "pubkey_db.h"		/* for init_pubkey_db() */
 #include "nat_traversal.h"
 #include "ike_alg.h"
 #include "ikev2_redirect.h"
@@ -72,6 +74,9 @@
 #include "crl_queue.h"		/* for free_crl_queue() */
 #include "iface.h"
 #include "server_pool.h"
+#include "send.h"		/* for init_send_queue() */
+#include "ikev2_half_open.h"	/* for init_v2_half_open() */
+#include "slab.h"		/* for pool_poison */
 
 #ifndef IPSECDIR
 #define IPSECDIR "/etc/ipsec.d"
@@ -462,10 +467,23 @@ uint16_t secctx_attr_type = SECCTX;
 enum {
 	OPT_OFFSET = 256, /* larger than largest char */
 	OPT_EFENCE_PROTECT,
+	OPT_POOL_POISON,
 	OPT_DEBUG,
 	OPT_IMPAIR,
 	OPT_DNSSEC_ROOTKEY_FILE,
 	OPT_DNSSEC_TRUSTED,
+	OPT_IKE_SOCKET_BATCH,
+	OPT_IKE_SOCKET_REUSEPORT,
+	OPT_IKE_SOCKET_STEER_SPI,
+	OPT_REKEY_WINDOW,
+	OPT_REKEY_RATE,
+	OPT_SA_COUNTER_CACHE,
+	OPT_DDOS_SOURCE_RATE,
+	OPT_DH_POOL_SIZE,
+	OPT_DH_POOL_LOW_WATER,
+	OPT_IKE_SK_OFFLOAD,
+	OPT_CERT_VERIFY_CACHE,
+	OPT_COMPACT_HALFOPEN_IKE,
 };
 
 static const struct option long_opts[] = {
@@ -511,6 +529,9 @@ static const struct option long_opts[] = {
 	{ "no-listen-udp\0", no_argument, NULL, 'p' },
 	{ "ike-socket-bufsize\0<buf-size>", required_argument, NULL, 'W' },
 	{ "ike-socket-no-errqueue\0", no_argument, NULL, '1' },
+	{ "ike-socket-batch\0<count>", required_argument, NULL, OPT_IKE_SOCKET_BATCH },
+	{ "ike-socket-reuseport\0<count>", required_argument, NULL, OPT_IKE_SOCKET_REUSEPORT },
+	{ "ike-socket-steer-spi\0", no_argument, NULL, OPT_IKE_SOCKET_STEER_SPI },
 	{ "nflog-all\0<group-number>", required_argument, NULL, 'G' },
 	{ "rundir\0<path>", required_argument, NULL, 'b' }, /* was ctlbase */
 	{ "secretsfile\0<secrets-file>", required_argument, NULL, 's' },
@@ -526,6 +547,15 @@ static const struct option long_opts[] = {
 	{ "virtual-private\0<network_list>", required_argument, NULL, '6' },
 	{ "nhelpers\0<number>", required_argument, NULL, 'j' },
 	{ "expire-shunt-interval\0<secs>", required_argument, NULL, '9' },
+	{ "rekey-window\0<secs>", required_argument, NULL, OPT_REKEY_WINDOW },
+	{ "rekey-rate\0<count>", required_argument, NULL, OPT_REKEY_RATE },
+	{ "sa-counter-cache\0<secs>", required_argument, NULL, OPT_SA_COUNTER_CACHE },
+	{ "ddos-source-rate\0<count>", required_argument, NULL, OPT_DDOS_SOURCE_RATE },
+	{ "compact-halfopen-ike\0", no_argument, NULL, OPT_COMPACT_HALFOPEN_IKE },
+	{ "dh-pool-size\0<count>", required_argument, NULL, OPT_DH_POOL_SIZE },
+	{ "dh-pool-low-water\0<count>", required_argument, NULL, OPT_DH_POOL_LOW_WATER },
+	{ "ike-sk-offload\0", no_argument, NULL, OPT_IKE_SK_OFFLOAD },
+	{ "cert-verify-cache\0<count>", required_argument, NULL, OPT_CERT_VERIFY_CACHE },
 	{ "seedbits\0<number>", required_argument, NULL, 'c' },
 	/* really an attribute type, not a value */
 	{ "ikev1-secctx-attr-type\0<number>", required_argument, NULL, 'w' },
@@ -541,6 +571,7 @@ static const struct option long_opts[] = {
 
 	{ "leak-detective\0", no_argument, NULL, 'X' },
 	{ "efence-protect\0", required_argument, NULL, OPT_EFENCE_PROTECT, },
+	{ "pool-poison\0", no_argument, NULL, OPT_POOL_POISON, },
 	{ "debug-none\0^", no_argument, NULL, 'N' },
 	{ "debug-all\0", no_argument, NULL, 'A' },
 	{ "debug\0", required_argument, NULL, OPT_DEBUG, },
@@ -900,6 +931,70 @@ int main(int argc, char **argv)
 			continue;
 		}
 
+		case OPT_REKEY_WINDOW:	/* --rekey-window <secs> */
+		{
+			unsigned long d = 0;
+			check_err(ttoulb(optarg, 0, 10, PLUTO_REKEY_WINDOW_MAX, &d), longindex, logger);
+			pluto_rekey_window = deltatime(d);
+			continue;
+		}
+
+		case OPT_REKEY_RATE:	/* --rekey-rate <count> */
+		{
+			unsigned long u = 0;
+			check_err(ttoulb(optarg, 0, 10, PLUTO_REKEY_RATE_MAX, &u), longindex, logger);
+			pluto_rekey_rate = u;
+			continue;
+		}
+
+		case OPT_SA_COUNTER_CACHE:	/* --sa-counter-cache <secs> */
+		{
+			unsigned long d = 0;
+			check_err(ttoulb(optarg, 0, 10, PLUTO_SA_COUNTER_CACHE_MAX, &d), longindex, logger);
+			pluto_sa_counter_cache = deltatime(d);
+			continue;
+		}
+
+		case OPT_DDOS_SOURCE_RATE:	/* --ddos-source-rate <count> */
+		{
+			unsigned long u = 0;
+			check_err(ttoulb(optarg, 0, 10, PLUTO_DDOS_SOURCE_RATE_MAX, &u), longindex, logger);
+			pluto_ddos_source_rate = u;
+			continue;
+		}
+
+		case OPT_DH_POOL_SIZE:	/* --dh-pool-size <count> */
+		{
+			unsigned long u = 0;
+			check_err(ttoulb(optarg, 0, 10, PLUTO_DH_POOL_SIZE_MAX, &u), longindex, logger);
+			pluto_dh_pool_size = u;
+			continue;
+		}
+
+		case OPT_DH_POOL_LOW_WATER:	/* --dh-pool-low-water <count> */
+		{
+			unsigned long u = 0;
+			check_err(ttoulb(optarg, 0, 10, PLUTO_DH_POOL_SIZE_MAX, &u), longindex, logger);
+			pluto_dh_pool_low_water = u;
+			continue;
+		}
+
+		case OPT_IKE_SK_OFFLOAD:	/* --ike-sk-offload */
+			pluto_ike_sk_offload = true;
+			continue;
+
+		case OPT_COMPACT_HALFOPEN_IKE:	/* --compact-halfopen-ike */
+			pluto_compact_halfopen = true;
+			continue;
+
+		case OPT_CERT_VERIFY_CACHE:	/* --cert-verify-cache <count> */
+		{
+			unsigned long u = 0;
+			check_err(ttoulb(optarg, 0, 10, PLUTO_CERT_VERIFY_CACHE_MAX, &u), longindex, logger);
+			pluto_cert_verify_cache = u;
+			continue;
+		}
+
 		case 'L':	/* --listen ip_addr */
 		{
 			ip_address lip;
@@ -1076,6 +1171,32 @@ int main(int argc, char **argv)
 			continue;
 		}
 
+		case OPT_IKE_SOCKET_BATCH:	/* --ike-socket-batch <count> */
+		{
+			unsigned long u;
+			check_err(ttoulb(optarg, 0, 10, IKE_SOCKET_BATCH_MAX, &u), longindex, logger);
+			if (u == 0) {
+				fatal_opt(longindex, logger, "must not be 0");
+			}
+			pluto_sock_batch = u;
+			continue;
+		}
+
+		case OPT_IKE_SOCKET_REUSEPORT:	/* --ike-socket-reuseport <count> */
+		{
+			unsigned long u;
+			check_err(ttoulb(optarg, 0, 10, IKE_SOCKET_REUSEPORT_MAX, &u), longindex, logger);
+			if (u == 0) {
+				fatal_opt(longindex, logger, "must not be 0");
+			}
+			pluto_sock_reuseport = u;
+			continue;
+		}
+
+		case OPT_IKE_SOCKET_STEER_SPI:	/* --ike-socket-steer-spi */
+			pluto_sock_steer_spi = true;
+			continue;
+
 		case 'p':	/* --no-listen-udp */
 			pluto_listen_udp = FALSE;
 			continue;
@@ -1215,11 +1336,35 @@ int main(int argc, char **argv)
 			/* ddos-ike-threshold and max-halfopen-ike */
 			pluto_ddos_threshold = cfg->setup.options[KBF_DDOS_IKE_THRESHOLD];
 			pluto_max_halfopen = cfg->setup.options[KBF_MAX_HALFOPEN_IKE];
+			/* compact-halfopen-ike= */
+			pluto_compact_halfopen = cfg->setup.options[KBF_COMPACT_HALFOPEN_IKE];
+			/* ddos-source-rate= */
+			pluto_ddos_source_rate = cfg->setup.options[KBF_DDOS_SOURCE_RATE];
+			/* dh-pool-size= and dh-pool-low-water= */
+			pluto_dh_pool_size = cfg->setup.options[KBF_DH_POOL_SIZE];
+			if (pluto_dh_pool_size > PLUTO_DH_POOL_SIZE_MAX) {
+				pluto_dh_pool_size = PLUTO_DH_POOL_SIZE_MAX;
+			}
+			pluto_dh_pool_low_water = cfg->setup.options[KBF_DH_POOL_LOW_WATER];
+			/* ike-sk-offload= */
+			pluto_ike_sk_offload = cfg->setup.options[KBF_IKE_SK_OFFLOAD];
+			/* cert-verify-cache= */
+			pluto_cert_verify_cache = cfg->setup.options[KBF_CERT_VERIFY_CACHE];
+			if (pluto_cert_verify_cache > PLUTO_CERT_VERIFY_CACHE_MAX) {
+				pluto_cert_verify_cache = PLUTO_CERT_VERIFY_CACHE_MAX;
+			}
 
 			crl_strict = cfg->setup.options[KBF_CRL_STRICT];
 
 			pluto_shunt_lifetime = deltatime(cfg->setup.options[KBF_SHUNTLIFETIME]);
 
+			/* rekey-window= / rekey-rate= */
+			pluto_rekey_window = deltatime(cfg->setup.options[KBF_REKEY_WINDOW]);
+			pluto_rekey_rate = cfg->setup.options[KBF_REKEY_RATE];
+
+			/* sa-counter-cache= */
+			pluto_sa_counter_cache = deltatime(cfg->setup.options[KBF_SA_COUNTER_CACHE]);
+
 			ocsp_enable = cfg->setup.options[KBF_OCSP_ENABLE];
 			ocsp_strict = cfg->setup.options[KBF_OCSP_STRICT];
 			ocsp_timeout = cfg->setup.options[KBF_OCSP_TIMEOUT];
@@ -1266,6 +1411,11 @@ int main(int argc, char **argv)
 			/* ike-socket-bufsize= */
 			pluto_sock_bufsize = cfg->setup.options[KBF_IKEBUF];
 			pluto_sock_errqueue = cfg->setup.options[KBF_IKE_ERRQUEUE];
+			/* ike-socket-batch= */
+			pluto_sock_batch = cfg->setup.options[KBF_IKE_BATCH];
+			/* ike-socket-reuseport= / ike-socket-steer-spi= */
+			pluto_sock_reuseport = cfg->setup.options[KBF_IKE_REUSEPORT];
+			pluto_sock_steer_spi = cfg->setup.options[KBF_IKE_STEER_SPI];
 
 			/* listen-tcp= / listen-udp= */
 			pluto_listen_tcp = cfg->setup.options[KBF_LISTEN_TCP];
@@ -1391,6 +1541,10 @@ int main(int argc, char **argv)
 #endif
 			continue;
 
+		case OPT_POOL_POISON:	/* --pool-poison */
+			pool_poison = true;
+			continue;
+
 		case OPT_DEBUG:
 		{
 			lmod_t mod = empty_lmod;
@@ -1733,8 +1887,12 @@ int main(int argc, char **argv)
 
 	init_state_db();
 	init_connection_db();
+	init_pubkey_db();
 	init_server_fork();
 	init_server(logger);
+	init_timer();
+	init_send_queue();
+	init_v2_half_open();
 
 	init_rate_log();
 	init_nat_traversal(keep_alive, logger);
@@ -1844,9 +2002,12 @@ void show_setup_plutomain(struct show *s)
 			pluto_ikev1_pol == GLOBAL_IKEv1_REJECT ? "reject" : "drop");
 
 	show_comment(s,
-		"ikebuf=%d, msg_errqueue=%s, crl-strict=%s, crlcheckinterval=%jd, listen=%s, nflog-all=%d",
+		"ikebuf=%d, msg_errqueue=%s, ike-socket-batch=%u, ike-socket-reuseport=%u, ike-socket-steer-spi=%s, crl-strict=%s, crlcheckinterval=%jd, listen=%s, nflog-all=%d",
 		pluto_sock_bufsize,
 		bool_str(pluto_sock_errqueue),
+		pluto_sock_batch,
+		pluto_sock_reuseport,
+		bool_str(pluto_sock_steer_spi),
 		bool_str(crl_strict),
 		deltasecs(crl_check_interval),
 		pluto_listen != NULL ? pluto_listen : "<any>",
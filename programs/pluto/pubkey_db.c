@@ -0,0 +1,364 @@
+/* Public key database, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "defs.h"
+#include "log.h"
+#include "id.h"
+#include "secrets.h"
+#include "x509.h"
+#include "show.h"
+#include "hash_table.h"
+#include "pubkey_db.h"
+
+static void jam_pubkey_db_entry(struct jambuf *buf, const void *data)
+{
+	const struct pubkey_db_entry *e = data;
+	jam(buf, "%s ", e->key->type->name);
+	jam_id(buf, &e->key->id, jam_sanitized_bytes);
+}
+
+static const struct list_info pubkey_db_info = {
+	.name = "pubkey db",
+	.jam = jam_pubkey_db_entry,
+};
+
+struct list_head pubkey_db_entries = INIT_LIST_HEAD(&pubkey_db_entries, &pubkey_db_info);
+
+static unsigned long nr_wildcard_keys;	/* with an ID_NONE ID */
+
+static struct {
+	unsigned long id_hits;
+	unsigned long id_misses;
+	unsigned long ckaid_hits;
+	unsigned long ckaid_misses;
+} pubkey_db_stats;
+
+/*
+ * IDs that same_id() considers equal must hash equal: FQDNs ignore
+ * case and trailing dots; DNs hash each RDN's OID and case folded
+ * value, which is what same_dn() compares (it only ignores case for
+ * some string types, so folding all of them merely shares buckets).
+ * A DN that doesn't parse can only match its exact bytes.
+ */
+
+static hash_t pubkey_folded_hash(const uint8_t *ptr, size_t len, hash_t hash)
+{
+	for (size_t i = 0; i < len; i++) {
+		char c = char_tolower(ptr[i]);
+		hash = hash_table_hasher(shunk2(&c, 1), hash);
+	}
+	return hash;
+}
+
+static void pubkey_dn_rdn_hash(chunk_t oid, chunk_t value, void *context)
+{
+	hash_t *hash = context;
+	*hash = hash_table_hasher(HUNK_AS_SHUNK(oid), *hash);
+	*hash = pubkey_folded_hash(value.ptr, value.len, *hash);
+}
+
+static hash_t pubkey_id_hash(const struct id *id)
+{
+	unsigned kind = id->kind;
+	hash_t hash = hash_table_hasher(shunk2(&kind, sizeof(kind)), zero_hash);
+	switch (id->kind) {
+	case ID_IPV4_ADDR:
+	case ID_IPV6_ADDR:
+		return hash_table_hasher(address_as_shunk(&id->ip_addr), hash);
+	case ID_FQDN:
+	case ID_USER_FQDN:
+	{
+		size_t len = id->name.len;
+		while (len > 0 && id->name.ptr[len - 1] == '.') {
+			len--;
+		}
+		return pubkey_folded_hash(id->name.ptr, len, hash);
+	}
+	case ID_DER_ASN1_DN:
+	{
+		hash_t dn_hash = hash;
+		if (walk_dn_rdns(id->name, pubkey_dn_rdn_hash, &dn_hash) != NULL) {
+			return hash_table_hasher(HUNK_AS_SHUNK(id->name), hash);
+		}
+		return dn_hash;
+	}
+	case ID_KEY_ID:
+		return hash_table_hasher(HUNK_AS_SHUNK(id->name), hash);
+	default:
+		return hash;
+	}
+}
+
+static hash_t pubkey_db_id_hasher(const void *data)
+{
+	const struct pubkey_db_entry *e = data;
+	return pubkey_id_hash(&e->key->id);
+}
+
+static struct list_entry *pubkey_db_id_entry(void *data)
+{
+	struct pubkey_db_entry *e = data;
+	return &e->id_entry;
+}
+
+static struct list_head pubkey_db_id_slots[STATE_TABLE_SIZE];
+
+static struct hash_table pubkey_db_id_table = {
+	.info = {
+		.name = "pubkey ID table",
+		.jam = jam_pubkey_db_entry,
+	},
+	.hasher = pubkey_db_id_hasher,
+	.entry = pubkey_db_id_entry,
+	.nr_slots = elemsof(pubkey_db_id_slots),
+	.slots = pubkey_db_id_slots,
+};
+
+static hash_t pubkey_ckaid_hash(const ckaid_t *ckaid)
+{
+	return hash_table_hasher(shunk2(ckaid->ptr, ckaid->len), zero_hash);
+}
+
+static hash_t pubkey_db_ckaid_hasher(const void *data)
+{
+	const struct pubkey_db_entry *e = data;
+	return pubkey_ckaid_hash(&e->key->ckaid);
+}
+
+static struct list_entry *pubkey_db_ckaid_entry(void *data)
+{
+	struct pubkey_db_entry *e = data;
+	return &e->ckaid_entry;
+}
+
+static struct list_head pubkey_db_ckaid_slots[STATE_TABLE_SIZE];
+
+static struct hash_table pubkey_db_ckaid_table = {
+	.info = {
+		.name = "pubkey CKAID table",
+		.jam = jam_pubkey_db_entry,
+	},
+	.hasher = pubkey_db_ckaid_hasher,
+	.entry = pubkey_db_ckaid_entry,
+	.nr_slots = elemsof(pubkey_db_ckaid_slots),
+	.slots = pubkey_db_ckaid_slots,
+};
+
+void init_pubkey_db(void)
+{
+	init_hash_table(&pubkey_db_id_table);
+	init_hash_table(&pubkey_db_ckaid_table);
+}
+
+static void add_pubkey_db_entry(struct pubkey **key)
+{
+	struct pubkey_db_entry *e = alloc_thing(struct pubkey_db_entry, "pubkey db entry");
+	e->key = *key;
+	*key = NULL; /* stolen */
+	e->all_entry = list_entry(&pubkey_db_info, e);
+	insert_list_entry(&pubkey_db_entries, &e->all_entry);
+	add_hash_table_entry(&pubkey_db_id_table, e);
+	add_hash_table_entry(&pubkey_db_ckaid_table, e);
+	if (e->key->id.kind == ID_NONE) {
+		nr_wildcard_keys++;
+	}
+}
+
+static void free_pubkey_db_entry(struct pubkey_db_entry **e)
+{
+	if ((*e)->key->id.kind == ID_NONE) {
+		nr_wildcard_keys--;
+	}
+	remove_list_entry(&(*e)->all_entry);
+	del_hash_table_entry(&pubkey_db_id_table, *e);
+	del_hash_table_entry(&pubkey_db_ckaid_table, *e);
+	pubkey_delref(&(*e)->key, HERE);
+	pfree(*e);
+	*e = NULL;
+}
+
+void free_pubkey_db(void)
+{
+	struct pubkey_db_entry *e;
+	FOR_EACH_PUBKEY_DB_ENTRY(e) {
+		free_pubkey_db_entry(&e);
+	}
+}
+
+/*
+ * KEYS has the newest key first; steal the oldest first so that,
+ * once in the database, the order is unchanged.
+ */
+
+static void move_pubkey_db_keys(struct pubkey_list **keys, bool replace)
+{
+	while (*keys != NULL) {
+		struct pubkey_list **oldest = keys;
+		while ((*oldest)->next != NULL) {
+			oldest = &(*oldest)->next;
+		}
+		struct pubkey *key = (*oldest)->key;
+		(*oldest)->key = NULL;
+		*oldest = free_public_keyentry(*oldest);
+		if (replace) {
+			delete_pubkey_db_keys(&key->id, key->type);
+		}
+		add_pubkey_db_entry(&key);
+	}
+}
+
+void add_pubkey_db_keys(struct pubkey_list **keys)
+{
+	move_pubkey_db_keys(keys, false);
+}
+
+void replace_pubkey_db_keys(struct pubkey_list **keys)
+{
+	move_pubkey_db_keys(keys, true);
+}
+
+static bool pubkey_db_match(const struct pubkey_db_entry *e,
+			    const struct id *id, const struct pubkey_type *type)
+{
+	return ((type == NULL || e->key->type == type) &&
+		same_id(id, &e->key->id));
+}
+
+/*
+ * Return the entries matching ID and TYPE, newest first.
+ *
+ * A lookup for ID_NONE (a wildcard) has to look at every entry.
+ * Otherwise only ID's bucket and, when there are any, the ID_NONE
+ * keys' bucket need to be searched.
+ */
+
+static struct pubkey_db_entry **find_pubkey_db_entries(const struct id *id,
+						       const struct pubkey_type *type,
+						       unsigned *nr_entries)
+{
+	struct pubkey_db_entry **entries = NULL;
+	*nr_entries = 0;
+	struct pubkey_db_entry *e;
+
+	if (id->kind == ID_NONE) {
+		FOR_EACH_PUBKEY_DB_ENTRY(e) {
+			if (pubkey_db_match(e, id, type)) {
+				realloc_things(entries, *nr_entries, *nr_entries + 1, "pubkey db entries");
+				entries[(*nr_entries)++] = e;
+			}
+		}
+		return entries;
+	}
+
+	struct list_head *bucket = hash_table_bucket(&pubkey_db_id_table, pubkey_id_hash(id));
+	FOR_EACH_LIST_ENTRY_NEW2OLD(bucket, e) {
+		if (e->key->id.kind != ID_NONE && pubkey_db_match(e, id, type)) {
+			realloc_things(entries, *nr_entries, *nr_entries + 1, "pubkey db entries");
+			entries[(*nr_entries)++] = e;
+		}
+	}
+
+	if (nr_wildcard_keys > 0) {
+		static const struct id wildcard = { .kind = ID_NONE, };
+		bucket = hash_table_bucket(&pubkey_db_id_table, pubkey_id_hash(&wildcard));
+		FOR_EACH_LIST_ENTRY_NEW2OLD(bucket, e) {
+			if (e->key->id.kind == ID_NONE && pubkey_db_match(e, id, type)) {
+				realloc_things(entries, *nr_entries, *nr_entries + 1, "pubkey db entries");
+				entries[(*nr_entries)++] = e;
+			}
+		}
+	}
+	return entries;
+}
+
+void delete_pubkey_db_keys(const struct id *id, const struct pubkey_type *type)
+{
+	unsigned nr_entries;
+	struct pubkey_db_entry **entries = find_pubkey_db_entries(id, type, &nr_entries);
+	for (unsigned i = 0; i < nr_entries; i++) {
+		free_pubkey_db_entry(&entries[i]);
+	}
+	pfreeany(entries);
+}
+
+void delete_pubkey_db_key(struct pubkey *key)
+{
+	struct pubkey_db_entry *e;
+	FOR_EACH_LIST_ENTRY_NEW2OLD(hash_table_bucket(&pubkey_db_id_table,
+						      pubkey_id_hash(&key->id)), e) {
+		if (e->key == key) {
+			free_pubkey_db_entry(&e);
+			return;
+		}
+	}
+	pexpect(false); /* not in database */
+}
+
+struct pubkey **find_pubkey_db_keys(const struct id *id,
+				    const struct pubkey_type *type,
+				    unsigned *nr_keys)
+{
+	struct pubkey_db_entry **entries = find_pubkey_db_entries(id, type, nr_keys);
+	if (*nr_keys == 0) {
+		pubkey_db_stats.id_misses++;
+		return NULL;
+	}
+	pubkey_db_stats.id_hits++;
+	struct pubkey **keys = alloc_things(struct pubkey *, *nr_keys, "pubkey db keys");
+	for (unsigned i = 0; i < *nr_keys; i++) {
+		keys[i] = entries[i]->key;
+	}
+	pfree(entries);
+	return keys;
+}
+
+struct pubkey *find_pubkey_db_key_by_ckaid(const ckaid_t *ckaid)
+{
+	struct pubkey_db_entry *e;
+	FOR_EACH_LIST_ENTRY_NEW2OLD(hash_table_bucket(&pubkey_db_ckaid_table,
+						      pubkey_ckaid_hash(ckaid)), e) {
+		if (e->key->ckaid.len == ckaid->len &&
+		    memeq(e->key->ckaid.ptr, ckaid->ptr, ckaid->len)) {
+			pubkey_db_stats.ckaid_hits++;
+			return e->key;
+		}
+	}
+	pubkey_db_stats.ckaid_misses++;
+	return NULL;
+}
+
+void show_pubkey_db_status(struct show *s)
+{
+	if (pubkey_db_id_table.nr_entries == 0) {
+		return;
+	}
+	show_comment(s, "pubkey-db: keys=%ld, id hits=%lu, id misses=%lu, ckaid hits=%lu, ckaid misses=%lu",
+		     pubkey_db_id_table.nr_entries,
+		     pubkey_db_stats.id_hits,
+		     pubkey_db_stats.id_misses,
+		     pubkey_db_stats.ckaid_hits,
+		     pubkey_db_stats.ckaid_misses);
+}
+
+void show_pubkey_db_stats(struct show *s)
+{
+	show_raw(s, "total.pubkey.db.id.hits=%lu", pubkey_db_stats.id_hits);
+	show_raw(s, "total.pubkey.db.id.misses=%lu", pubkey_db_stats.id_misses);
+	show_raw(s, "total.pubkey.db.ckaid.hits=%lu", pubkey_db_stats.ckaid_hits);
+	show_raw(s, "total.pubkey.db.ckaid.misses=%lu", pubkey_db_stats.ckaid_misses);
+}
+
+void clear_pubkey_db_stats(void)
+{
+	zero(&pubkey_db_stats);
+}
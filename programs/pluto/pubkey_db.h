@@ -0,0 +1,76 @@
+/* Public key database, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#ifndef PUBKEY_DB_H
+#define PUBKEY_DB_H
+
+#include "list_entry.h"
+#include "ckaid.h"
+
+struct id;
+struct pubkey;
+struct pubkey_list;
+struct pubkey_type;
+struct show;
+
+/*
+ * The remembered public keys: those from ipsec.conf, whack, DNS
+ * (IPSECKEY) and the peer certs of loaded connections.
+ *
+ * Each entry holds a reference to its key and is indexed by the key's
+ * ID and CKAID.  Main thread only.
+ */
+
+struct pubkey_db_entry {
+	struct pubkey *key;		/* counted reference */
+	struct list_entry all_entry;
+	struct list_entry id_entry;
+	struct list_entry ckaid_entry;
+};
+
+extern struct list_head pubkey_db_entries;
+
+/* newest first; the current entry can be deleted */
+#define FOR_EACH_PUBKEY_DB_ENTRY(ENTRY)					\
+	FOR_EACH_LIST_ENTRY_NEW2OLD(&pubkey_db_entries, ENTRY)
+
+void init_pubkey_db(void);
+void free_pubkey_db(void);
+
+/*
+ * Steal the keys in *KEYS (a list built by add_public_key() et.al.)
+ * leaving *KEYS empty.  When replacing, any existing key with the
+ * same ID and type is first deleted.
+ */
+void add_pubkey_db_keys(struct pubkey_list **keys);
+void replace_pubkey_db_keys(struct pubkey_list **keys);
+
+void delete_pubkey_db_keys(const struct id *id, const struct pubkey_type *type);
+void delete_pubkey_db_key(struct pubkey *key);
+
+/*
+ * Return the keys matching ID (see same_id()) and, when non-NULL,
+ * TYPE; newest first.  The array must be pfree()d; the keys are not
+ * referenced and so are only valid until the database changes.
+ */
+struct pubkey **find_pubkey_db_keys(const struct id *id,
+				    const struct pubkey_type *type,
+				    unsigned *nr_keys);
+
+struct pubkey *find_pubkey_db_key_by_ckaid(const ckaid_t *ckaid);
+
+void show_pubkey_db_status(struct show *s);
+void show_pubkey_db_stats(struct show *s);
+void clear_pubkey_db_stats(void);
+
+#endif
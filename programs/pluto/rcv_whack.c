@@ -94,6 +94,7 @@
 #include "nss_cert_reread.h"
 #include "send.h"			/* for impair: send_keepalive() */
 #include "pluto_shutdown.h"		/* for shutdown_pluto() */
+#include "pubkey_db.h"		/* for add_pubkey_db_keys() */
 
 static struct state *find_impaired_state(unsigned biased_what,
 					 struct logger *logger)
@@ -322,7 +323,7 @@ static void key_add_request(const struct whack_message *msg, struct logger *logg
 			llog(LOG_STREAM/*not-whack*/, logger,
 				    "delete keyid %s", msg->keyid);
 		}
-		delete_public_keys(&pluto_pubkeys, &keyid, type);
+		delete_pubkey_db_keys(&keyid, type);
 		/* XXX: what about private keys; suspect not easy as not 1:1? */
 	}
 
@@ -335,13 +336,15 @@ static void key_add_request(const struct whack_message *msg, struct logger *logg
 
 		/* add the public key */
 		struct pubkey *pubkey = NULL; /* must-delref */
+		struct pubkey_list *whack_pubkeys = NULL;
 		err_t ugh = add_public_key(&keyid, PUBKEY_LOCAL, type,
 					   /*install_time*/realnow(),
 					   /*until_time*/realtime_epoch,
 					   /*ttl*/0,
 					   &msg->keyval,
 					   &pubkey/*new-public-key:must-delref*/,
-					   &pluto_pubkeys);
+					   &whack_pubkeys);
+		add_pubkey_db_keys(&whack_pubkeys);
 		if (ugh != NULL) {
 			llog(RC_LOG_SERIOUS, logger, "%s", ugh);
 			free_id_content(&keyid);
@@ -837,7 +840,11 @@ static void whack_process(const struct whack_message *const m, struct show *s)
 
 	if (m->whack_status) {
 		dbg("whack: status ...");
-		show_status(s);
+		if (m->whack_unsorted) {
+			show_status_stream(show_logger(s), false/*sorted*/);
+		} else {
+			show_status(s);
+		}
 		dbg("whack: ... status");
 	}
 
@@ -988,6 +995,8 @@ void whack_handle_cb(evutil_socket_t fd, const short event UNUSED,
 		whack_log_fd = whackfd;
 		struct logger whack_logger[1] = { GLOBAL_LOGGER(whackfd), }; /*event-handler*/
 		whack_handle(whackfd, whack_logger);
+		/* apply any kernel changes before whack is released */
+		flush_kernel(whack_logger);
 		whack_log_fd = null_fd;
 		close_any(&whackfd);
 	}
@@ -1056,9 +1065,8 @@ static void whack_handle(struct fd *whackfd, struct logger *whack_logger)
 		if (msg.magic == WHACK_BASIC_MAGIC) {
 			/* Only basic commands.  Simpler inter-version compatibility. */
 			if (msg.whack_status) {
-				struct show *s = alloc_show(whack_logger);
-				show_status(s);
-				free_show(&s);
+				/* as used by monitoring scripts */
+				show_status_stream(whack_logger, true/*sorted*/);
 			}
 			/* bail early, but without complaint */
 			return; /* don't shutdown */
@@ -23,6 +23,7 @@
 #include "server.h"
 #include "pluto_timing.h"
 #include "log.h"
+#include "nss_cert_verify.h"	/* for flush_cert_verify_cache() */
 
 static struct root_certs *root_cert_db;
 
@@ -37,6 +38,7 @@ struct root_certs *root_certs_addref(where_t where)
 	}
 
 	log_global(LOG_STREAM, null_fd, "loading root certificate cache");
+	flush_cert_verify_cache("loading root certificates");
 
 	/*
 	 * Always allocate the ROOT_CERTS structure.  If things fail,
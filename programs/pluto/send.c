@@ -43,6 +43,8 @@
 #include "ip_protocol.h"
 #include "iface.h"
 #include "impair_message.h"
+#include "state_db.h"		/* for state_by_serialno() */
+#include "timer.h"		/* for schedule_oneshot_timer() */
 
 /* send_ike_msg logic is broken into layers.
  * The rest of the system thinks it is simple.
@@ -66,7 +68,182 @@
  * for NATT.  It accepts two chunks because this avoids double-copying.
  */
 
+/*
+ * Batched transmit (ike-socket-batch=).
+ *
+ * When batching is enabled, and the interface supports it, messages
+ * sent using queue_chunk_using_state() are copied into the sending
+ * interface's send queue and then, at the end of the current
+ * event-loop iteration, sent using the interface's write_packets()
+ * (for UDP, sendmmsg()).  This way a burst of retransmits or liveness
+ * probes fired by timers costs a few system calls instead of one per
+ * message.
+ *
+ * Only callers that ignore the result can queue; anything that checks
+ * for a failed send (for instance the loop sending each fragment of a
+ * message) uses send_chunk_using_state() and is sent immediately.  A
+ * failed queued send is logged against the sending state (when it
+ * still exists) using the same message as an immediate send.  WHERE
+ * must therefore be a static string.
+ */
+
+#define SEND_QUEUE_BYTES (4 * MAX_OUTPUT_UDP_SIZE)
+
+struct send_queue {
+	const struct iface_endpoint *interface;
+	struct send_queue *next_pending;
+	bool pending;
+	unsigned nr;
+	size_t used;	/* bytes of .buffer[] in use */
+	struct iface_outgoing_packet packets[IKE_SOCKET_BATCH_MAX];
+	struct {
+		const char *where;
+		so_serial_t serialno;
+	} senders[IKE_SOCKET_BATCH_MAX];
+	uint8_t buffer[SEND_QUEUE_BYTES];
+};
+
+/* queues with messages waiting for EVENT_FLUSH_SEND_QUEUE */
+static struct send_queue *pending_send_queues;
+
+static void log_queued_send_failure(const struct send_queue *queue,
+				    unsigned i, int error)
+{
+	const struct iface_endpoint *interface = queue->interface;
+	const ip_endpoint *remote_endpoint = &queue->packets[i].remote_endpoint;
+	struct logger global_logger = GLOBAL_LOGGER(null_fd);
+	struct logger from_logger = logger_from(&global_logger, remote_endpoint);
+	struct state *st = state_by_serialno(queue->senders[i].serialno);
+	endpoint_buf lb;
+	endpoint_buf rb;
+	log_errno((st != NULL ? st->st_logger : &from_logger), error,
+		  "send on %s from %s to %s using %s failed in %s",
+		  interface->ip_dev->id_rname,
+		  str_endpoint(&interface->local_endpoint, &lb),
+		  str_endpoint_sensitive(remote_endpoint, &rb),
+		  interface->protocol->name,
+		  queue->senders[i].where);
+}
+
+static void flush_queue(struct send_queue *queue)
+{
+	if (queue->nr == 0) {
+		return;
+	}
+
+	const struct iface_endpoint *interface = queue->interface;
+	dbg("flushing %u queued messages (%zu bytes) on %s",
+	    queue->nr, queue->used, interface->ip_dev->id_rname);
+	struct logger logger = GLOBAL_LOGGER(null_fd);
+	unsigned i = 0;
+	while (i < queue->nr) {
+		ssize_t n = interface->io->write_packets(interface,
+							 &queue->packets[i],
+							 queue->nr - i, &logger);
+		if (n <= 0) {
+			/* the first message failed; skip it */
+			int error = (n < 0 ? errno : 0);
+			log_queued_send_failure(queue, i, error);
+			i++;
+			continue;
+		}
+		for (unsigned s = i; s < i + n; s++) {
+			pstats_ike_out_bytes += queue->packets[s].len;
+		}
+		i += n;
+	}
+
+	queue->nr = 0;
+	queue->used = 0;
+}
+
+static void flush_send_queues(struct logger *unused_logger UNUSED)
+{
+	while (pending_send_queues != NULL) {
+		struct send_queue *queue = pending_send_queues;
+		pending_send_queues = queue->next_pending;
+		queue->next_pending = NULL;
+		queue->pending = false;
+		flush_queue(queue);
+	}
+}
+
+void init_send_queue(void)
+{
+	init_oneshot_timer(EVENT_FLUSH_SEND_QUEUE, flush_send_queues);
+}
+
+void free_iface_send_queue(struct iface_endpoint *ifp)
+{
+	struct send_queue *queue = ifp->send_queue;
+	if (queue == NULL) {
+		return;
+	}
+	/* don't leave messages, or the pending list, pointing at IFP */
+	flush_queue(queue);
+	if (queue->pending) {
+		for (struct send_queue **pp = &pending_send_queues;
+		     *pp != NULL; pp = &(*pp)->next_pending) {
+			if (*pp == queue) {
+				*pp = queue->next_pending;
+				break;
+			}
+		}
+	}
+	pfree(queue);
+	ifp->send_queue = NULL;
+}
+
+static bool queue_send(const char *where, so_serial_t serialno,
+		       const struct iface_endpoint *interface,
+		       const ip_endpoint *remote_endpoint,
+		       const uint8_t *ptr, size_t len)
+{
+	if (pluto_sock_batch <= 1 ||
+	    interface->io->write_packets == NULL) {
+		return false;
+	}
+
+	struct send_queue *queue = interface->send_queue;
+	if (queue == NULL) {
+		queue = alloc_thing(struct send_queue, "send queue");
+		queue->interface = interface;
+		/* the queue belongs to the interface */
+		((struct iface_endpoint *)interface)->send_queue = queue; /* discard const */
+	}
+
+	unsigned batch = (pluto_sock_batch < IKE_SOCKET_BATCH_MAX ?
+			  pluto_sock_batch : IKE_SOCKET_BATCH_MAX);
+	if (queue->nr >= batch ||
+	    queue->used + len > sizeof(queue->buffer)) {
+		flush_queue(queue);
+	}
+	if (!queue->pending) {
+		if (pending_send_queues == NULL) {
+			/* flush once this event-loop iteration is done */
+			schedule_oneshot_timer(EVENT_FLUSH_SEND_QUEUE, deltatime(0));
+		}
+		queue->next_pending = pending_send_queues;
+		pending_send_queues = queue;
+		queue->pending = true;
+	}
+
+	uint8_t *dst = queue->buffer + queue->used;
+	memcpy(dst, ptr, len);
+	queue->used += len;
+	queue->packets[queue->nr] = (struct iface_outgoing_packet) {
+		.ptr = dst,
+		.len = len,
+		.remote_endpoint = *remote_endpoint,
+	};
+	queue->senders[queue->nr].where = where;
+	queue->senders[queue->nr].serialno = serialno;
+	queue->nr++;
+	return true;
+}
+
 static bool send_chunks(const char *where, bool just_a_keepalive,
+			bool may_queue,
 			so_serial_t serialno, /* can be SOS_NOBODY */
 			const struct iface_endpoint *interface,
 			ip_endpoint remote_endpoint,
@@ -165,6 +342,12 @@ static bool send_chunks(const char *where, bool just_a_keepalive,
 	}
 
 	if (!impair_outgoing_message(shunk2(ptr, len), logger)) {
+		if (may_queue && !impair.jacob_two_two &&
+		    queue_send(where, serialno, interface, &remote_endpoint,
+			       ptr, len)) {
+			/* sent, or failure logged, by flush_queue() */
+			return true;
+		}
 		ssize_t wlen = interface->io->write_packet(interface, ptr, len,
 							   &remote_endpoint, logger);
 		if (wlen != (ssize_t)len) {
@@ -220,16 +403,27 @@ static bool send_chunks(const char *where, bool just_a_keepalive,
 
 bool send_pbs_out_using_md(struct msg_digest *md, const char *where, struct pbs_out *packet)
 {
-	return send_chunks(where, false, SOS_NOBODY,
+	return send_chunks(where, false, false, SOS_NOBODY,
 			   md->iface, md->sender,
 			   same_out_pbs_as_chunk(packet), EMPTY_CHUNK,
 			   md->md_logger);
 }
 
+bool send_chunk_using_iface(const struct iface_endpoint *ifp,
+			    const ip_endpoint *remote_endpoint,
+			    const char *where, chunk_t packet,
+			    struct logger *logger)
+{
+	return send_chunks(where, false, false, SOS_NOBODY,
+			   ifp, *remote_endpoint,
+			   packet, EMPTY_CHUNK,
+			   logger);
+}
+
 bool send_chunks_using_state(struct state *st, const char *where,
 			     chunk_t chunk_a, chunk_t chunk_b)
 {
-	return send_chunks(where, false, st->st_serialno,
+	return send_chunks(where, false, false, st->st_serialno,
 			   st->st_interface, st->st_remote_endpoint,
 			   chunk_a, chunk_b,
 			   st->st_logger);
@@ -240,6 +434,15 @@ bool send_chunk_using_state(struct state *st, const char *where, chunk_t packet)
 	return send_chunks_using_state(st, where, packet, EMPTY_CHUNK);
 }
 
+void queue_chunk_using_state(struct state *st, const char *where, chunk_t packet)
+{
+	/* any failure is logged against ST */
+	send_chunks(where, false, true, st->st_serialno,
+		    st->st_interface, st->st_remote_endpoint,
+		    packet, EMPTY_CHUNK,
+		    st->st_logger);
+}
+
 bool send_pbs_out_using_state(struct state *st, const char *where, struct pbs_out *pbs)
 {
 	return send_chunk_using_state(st, where, same_out_pbs_as_chunk(pbs));
@@ -254,7 +457,7 @@ bool send_keepalive_using_state(struct state *st, const char *where)
 {
 	static unsigned char ka_payload = 0xff;
 
-	return send_chunks(where, true, st->st_serialno, st->st_interface,
+	return send_chunks(where, true, false, st->st_serialno, st->st_interface,
 			   st->st_remote_endpoint,
 			   THING_AS_CHUNK(ka_payload), EMPTY_CHUNK,
 			   st->st_logger);
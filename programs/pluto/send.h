@@ -24,9 +24,15 @@
 struct iface_endpoint;
 struct state;
 struct msg_digest;
+struct logger;
 
 bool send_pbs_out_using_md(struct msg_digest *md, const char *where, struct pbs_out *packet);
 bool send_pbs_out_using_state(struct state *st, const char *where, struct pbs_out *packet);
+/* no MD or state; for stateless responses */
+bool send_chunk_using_iface(const struct iface_endpoint *ifp,
+			    const ip_endpoint *remote_endpoint,
+			    const char *where, chunk_t packet,
+			    struct logger *logger);
 
 bool send_chunks_using_state(struct state *st, const char *where,
 			     chunk_t a, chunk_t b);
@@ -39,6 +45,23 @@ bool send_chunk_using_state(struct state *st, const char *where, chunk_t packet)
 		send_chunk_using_state(ST, WHERE, h_);			\
 	})
 
+/*
+ * When ike-socket-batch= is enabled, queue the message and send it,
+ * along with the interface's other queued messages, once the current
+ * event has been processed; otherwise send it immediately.  Either
+ * way, a failure is only logged against ST.
+ */
+void queue_chunk_using_state(struct state *st, const char *where, chunk_t packet);
+
+#define queue_hunk_using_state(ST, WHERE, HUNK)				\
+	({								\
+		chunk_t h_ = { .ptr = (HUNK).ptr, .len = (HUNK).len, };	\
+		queue_chunk_using_state(ST, WHERE, h_);			\
+	})
+
 bool send_keepalive_using_state(struct state *st, const char *where);
 
+void init_send_queue(void);
+void free_iface_send_queue(struct iface_endpoint *ifp);
+
 #endif
@@ -47,6 +47,10 @@
 #include <sys/resource.h>
 #include <sys/wait.h>		/* for wait() and WIFEXITED() et.al. */
 #include <resolv.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include <event2/event.h>
 #include <event2/event_struct.h>
@@ -76,6 +80,7 @@
 #include "state_db.h"
 #include "iface.h"
 #include "server_fork.h"
+#include "pluto_stats.h"
 
 #ifdef USE_XFRM_INTERFACE
 #include "kernel_xfrm_interface.h"
@@ -94,6 +99,7 @@
 #include "ip_address.h"
 #include "hostpair.h"
 #include "ip_info.h"
+#include "slab.h"
 
 /*
  *  Server main loop and socket initialization routines.
@@ -104,7 +110,10 @@ char *pluto_vendorid;
 /* pluto's main Libevent event_base */
 static struct event_base *pluto_eb =  NULL;
 
+static void free_resume_queue(void);
+
 static  struct pluto_event *pluto_events_head = NULL;
+static struct slab_pool pluto_event_pool = SLAB_POOL(struct pluto_event, "struct pluto_event");
 
 /* control (whack) socket */
 int ctl_fd = NULL_FD;   /* file descriptor of control (whack) socket */
@@ -199,11 +208,23 @@ enum global_ikev1_policy pluto_ikev1_pol =
 enum seccomp_mode pluto_seccomp_mode = SECCOMP_DISABLED;
 #endif
 unsigned int pluto_max_halfopen = DEFAULT_MAXIMUM_HALFOPEN_IKE_SA;
+bool pluto_compact_halfopen = false; /* keep half-open responder IKE SAs in a compact table */
 unsigned int pluto_ddos_threshold = DEFAULT_IKE_SA_DDOS_THRESHOLD;
+unsigned int pluto_ddos_source_rate = PLUTO_DDOS_SOURCE_RATE_DEFAULT;
+unsigned int pluto_dh_pool_size = PLUTO_DH_POOL_SIZE_DEFAULT;
+unsigned int pluto_dh_pool_low_water = PLUTO_DH_POOL_LOW_WATER_DEFAULT;
+bool pluto_ike_sk_offload = false; /* IKE_AUTH SK payloads and CHILD KEYMAT on helpers */
+unsigned int pluto_cert_verify_cache = PLUTO_CERT_VERIFY_CACHE_DEFAULT; /* cached chain verifications */
 deltatime_t pluto_shunt_lifetime = DELTATIME_INIT(PLUTO_SHUNT_LIFE_DURATION_DEFAULT);
+deltatime_t pluto_rekey_window = DELTATIME_INIT(PLUTO_REKEY_WINDOW_DEFAULT);
+unsigned int pluto_rekey_rate = PLUTO_REKEY_RATE_DEFAULT; /* rekeys per second */
+deltatime_t pluto_sa_counter_cache = DELTATIME_INIT(PLUTO_SA_COUNTER_CACHE_DEFAULT);
 
 unsigned int pluto_sock_bufsize = IKE_BUF_AUTO; /* use system values */
 bool pluto_sock_errqueue = true; /* Enable MSG_ERRQUEUE on IKE socket */
+unsigned int pluto_sock_batch = IKE_SOCKET_BATCH_DEFAULT; /* datagrams per read event */
+unsigned int pluto_sock_reuseport = IKE_SOCKET_REUSEPORT_DEFAULT; /* SO_REUSEPORT sockets per endpoint */
+bool pluto_sock_steer_spi = false; /* BPF steering of SO_REUSEPORT sockets on SPIi */
 
 /*
  * Static events.
@@ -247,6 +268,8 @@ static struct global_timer_desc global_timers[] = {
 	E(EVENT_RESET_LOG_RATE_LIMIT),
 	E(EVENT_PROCESS_KERNEL_QUEUE),
 	E(EVENT_NAT_T_KEEPALIVE),
+	E(EVENT_FLUSH_SEND_QUEUE),
+	E(EVENT_v2_HALF_OPEN),
 #undef E
 };
 
@@ -474,7 +497,7 @@ static struct pluto_event *free_event_entry(struct pluto_event **evp)
 	}
 
 	dbg_free("pe", e, HERE);
-	pfree(e);
+	slab_free(&pluto_event_pool, e);
 	*evp = NULL;
 	return next;
 }
@@ -496,6 +519,7 @@ void free_server(void)
 		*head = free_event_entry(head);
 	free_global_timers();
 	free_signal_handlers();
+	free_resume_queue();
 
 	dbg("releasing event base");
 	event_base_free(pluto_eb);
@@ -582,11 +606,18 @@ void fire_timer_photon_torpedo(struct event **evp,
  * Schedule a resume event now.
  *
  * Unlike pluto_event_add(), it can't be canceled, can only run once,
- * doesn't show up in the event list, and leaks when the event-loop
- * aborts (like a few others).
+ * and doesn't show up in the event list.  Anything still queued when
+ * the server is freed is discarded by free_resume_queue().
  *
  * However, unlike pluto_event_add(), it works from any thread, and
  * cleans up after the event has run.
+ *
+ * Rather than allocating and firing a libevent event per resume
+ * (every helper answer goes through here), resumes are pushed onto
+ * a single lock-free list and the main thread is woken with one
+ * eventfd.  The eventfd is only written when the list goes from
+ * empty to non-empty, so under load many answers are delivered per
+ * wakeup.  The main thread drains the whole list in one go.
  */
 
 struct resume_event {
@@ -594,21 +625,16 @@ struct resume_event {
 	resume_cb *callback;
 	void *context;
 	const char *name;
-	struct event *event;
+	monotime_t queued;
+	struct resume_event *next;
 };
 
-static void resume_handler(evutil_socket_t fd UNUSED,
-			   short events UNUSED, void *arg)
+static _Atomic(struct resume_event *) resume_queue = NULL;
+static int resume_fd[2] = { -1, -1, };	/* [0] read, [1] write */
+static struct event *resume_sensor;
+
+static void run_resume(struct resume_event *e)
 {
-	struct resume_event *e = (struct resume_event *)arg;
-	/*
-	 * At one point, .ne_event was was being set after the event
-	 * was enabled.  With multiple threads this resulted in a race
-	 * where the event ran before .ne_event was set.  The
-	 * pexpect() followed by the passert() demonstrated this - the
-	 * pexpect() failed yet the passert() passed.
-	 */
-	pexpect(e->event != NULL);
 	dbg("processing resume %s for #%lu", e->name, e->serialno);
 	/*
 	 * XXX: Don't confuse this and the "callback") code path.
@@ -733,9 +759,56 @@ static void resume_handler(evutil_socket_t fd UNUSED,
 		release_any_md(&md);
 		statetime_stop(&start, "resume %s", e->name);
 	}
-	passert(e->event != NULL);
-	event_free(e->event);
-	pfree(e);
+}
+
+static void resume_handler(evutil_socket_t fd,
+			   short events UNUSED, void *arg UNUSED)
+{
+	/*
+	 * Clear the wakeup before grabbing the list; anything pushed
+	 * after the grab finds the list empty and wakes us again.
+	 */
+	uint64_t count;
+	while (read(fd, &count, sizeof(count)) > 0) {
+		continue;
+	}
+
+	struct resume_event *head = atomic_exchange(&resume_queue, NULL);
+	if (head == NULL) {
+		return;
+	}
+
+	/* the list is newest first; put it back in arrival order */
+	struct resume_event *todo = NULL;
+	while (head != NULL) {
+		struct resume_event *e = head;
+		head = e->next;
+		e->next = todo;
+		todo = e;
+	}
+
+	monotime_t now = mononow();
+	unsigned long nr = 0;
+	while (todo != NULL) {
+		struct resume_event *e = todo;
+		todo = e->next;
+		struct timeval wait = timeval_from_deltatime(monotimediff(now, e->queued));
+		unsigned long usec = wait.tv_sec * 1000000UL + wait.tv_usec;
+		pstats_resume_wait_usec += usec;
+		if (usec > pstats_resume_max_wait_usec) {
+			pstats_resume_max_wait_usec = usec;
+		}
+		nr++;
+		run_resume(e);
+		pfree(e);
+	}
+
+	dbg("processed %lu resumes", nr);
+	pstats_resume_batches++;
+	pstats_resume_events += nr;
+	if (nr > pstats_resume_max_batch) {
+		pstats_resume_max_batch = nr;
+	}
 }
 
 void schedule_resume(const char *name, so_serial_t serialno,
@@ -747,18 +820,81 @@ void schedule_resume(const char *name, so_serial_t serialno,
 		.callback = callback,
 		.context = context,
 		.name = name,
+		.queued = mononow(),
 	};
 	struct resume_event *e = clone_thing(tmp, name);
 	dbg("scheduling resume %s for #%lu",
 	    e->name, e->serialno);
 
 	/*
-	 * Everything set up; arm and fire the timer's photon torpedo.
-	 * Event may have even run on another thread before the below
-	 * call returns.
+	 * Everything set up; push it.  The resume may have even run
+	 * on the main thread before the below returns.
 	 */
-	fire_timer_photon_torpedo(&e->event, resume_handler, e,
-				  deltatime(0)/*now*/);
+	struct resume_event *old = atomic_load(&resume_queue);
+	do {
+		e->next = old;
+	} while (!atomic_compare_exchange_weak(&resume_queue, &old, e));
+
+	if (old == NULL) {
+		/* first on the list; wake up the main thread */
+		uint64_t one = 1;
+		if (write(resume_fd[1], &one, sizeof(one)) < 0) {
+			/* EAGAIN means a wakeup is already pending */
+			pexpect(errno == EAGAIN);
+		}
+	}
+}
+
+static void init_resume_queue(struct logger *logger)
+{
+#ifdef __linux__
+	int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd < 0) {
+		fatal_errno(PLUTO_EXIT_FAIL, logger, errno,
+			    "eventfd() for resume queue failed");
+	}
+	resume_fd[0] = resume_fd[1] = fd;
+#else
+	if (pipe(resume_fd) < 0) {
+		fatal_errno(PLUTO_EXIT_FAIL, logger, errno,
+			    "pipe() for resume queue failed");
+	}
+	for (unsigned i = 0; i < elemsof(resume_fd); i++) {
+		fcntl(resume_fd[i], F_SETFD, FD_CLOEXEC);
+		fcntl(resume_fd[i], F_SETFL, O_NONBLOCK);
+	}
+#endif
+	attach_fd_read_sensor(&resume_sensor, resume_fd[0], resume_handler, NULL);
+}
+
+static void free_resume_queue(void)
+{
+	/*
+	 * Discard anything still queued.  Like a resume for a state
+	 * that has gone away, the callback is passed no state so
+	 * that it releases the context.
+	 */
+	struct resume_event *e = atomic_exchange(&resume_queue, NULL);
+	while (e != NULL) {
+		struct resume_event *next = e->next;
+		dbg("discarding resume %s for #%lu", e->name, e->serialno);
+		stf_status status = e->callback(NULL, NULL, e->context);
+		pexpect(status == STF_SKIP_COMPLETE_STATE_TRANSITION);
+		pfree(e);
+		e = next;
+	}
+
+	if (resume_sensor != NULL) {
+		event_free(resume_sensor);
+		resume_sensor = NULL;
+	}
+	if (resume_fd[1] != resume_fd[0] && resume_fd[1] >= 0) {
+		close(resume_fd[1]);
+	}
+	if (resume_fd[0] >= 0) {
+		close(resume_fd[0]);
+	}
+	resume_fd[0] = resume_fd[1] = -1;
 }
 
 /*
@@ -773,6 +909,8 @@ struct callback_event {
 	struct event *event;
 };
 
+static struct slab_pool callback_event_pool = SLAB_POOL(struct callback_event, "struct callback_event");
+
 static void callback_handler(evutil_socket_t fd UNUSED,
 			     short events UNUSED, void *arg)
 {
@@ -797,7 +935,7 @@ static void callback_handler(evutil_socket_t fd UNUSED,
 		serialno = e->serialno;
 		context = e->context;
 		event_free(e->event);
-		pfree(e);
+		slab_free(&callback_event_pool, e);
 	}
 
 	if (serialno == SOS_NOBODY) {
@@ -830,7 +968,9 @@ extern void schedule_callback(const char *name, so_serial_t serialno,
 		.context = context,
 		.name = name,
 	};
-	struct callback_event *e = clone_thing(tmp, name);
+	struct callback_event *e = slab_alloc_thing(&callback_event_pool,
+						    struct callback_event, name);
+	*e = tmp;
 	dbg("scheduling callback %s (#%lu)", e->name, e->serialno);
 	/*
 	 * Everything set up; arm and fire the timer's photon torpedo.
@@ -862,7 +1002,7 @@ struct pluto_event *add_fd_read_event_handler(evutil_socket_t fd,
 {
 	passert(in_main_thread());
 	pexpect(fd >= 0);
-	struct pluto_event *e = alloc_thing(struct pluto_event, name);
+	struct pluto_event *e = slab_alloc_thing(&pluto_event_pool, struct pluto_event, name);
 	dbg_alloc("pe", e, HERE);
 	e->ev_type = EVENT_NULL;
 	e->ev_name = name;
@@ -886,6 +1026,7 @@ void list_timers(struct show *s, monotime_t now)
 
 	list_global_timers(s, now);
 	list_signal_handlers(s);
+	list_timer_wheel(s);
 
 	for (struct pluto_event *ev = pluto_events_head;
 	     ev != NULL; ev = ev->next) {
@@ -1017,6 +1158,7 @@ void init_server(struct logger *logger)
 	passert(pluto_eb != NULL);
 	int s = evthread_make_base_notifiable(pluto_eb);
 	passert(s >= 0);
+	init_resume_queue(logger);
 	dbg("libevent initialized");
 }
 
@@ -1134,11 +1276,9 @@ void stop_server(server_stopped_cb cb)
 
 bool ev_before(struct pluto_event *pev, deltatime_t delay)
 {
-	struct timeval timeout;
-	if (!(event_pending(pev->ev, EV_TIMEOUT, &timeout) & EV_TIMEOUT)) {
-		return false;
-	}
-	return deltatime_cmp(deltatime_from_timeval(timeout), <, delay);
+	/* state events are on the timer wheel, not libevent */
+	deltatime_t timeout = monotimediff(pev->ev_time, mononow());
+	return deltatime_cmp(timeout, <, delay);
 }
 
 void set_whack_pluto_ddos(enum ddos_mode mode, struct logger *logger)
@@ -56,10 +56,22 @@ extern bool pluto_listen_tcp;
 extern enum ddos_mode pluto_ddos_mode; /* auto-detect or manual */
 extern enum global_ikev1_policy pluto_ikev1_pol; /* accept, drop or reject */
 extern unsigned int pluto_max_halfopen; /* Max allowed half-open IKE SA's before refusing */
+extern bool pluto_compact_halfopen; /* shrink half-open responder IKE SAs until IKE_AUTH */
 extern unsigned int pluto_ddos_threshold; /* Max incoming IKE before activating DCOOKIES */
+extern unsigned int pluto_ddos_source_rate; /* IKE_SA_INIT requests per second per source prefix */
+extern unsigned int pluto_dh_pool_size; /* pre-computed KE and nonce pairs per DH group */
+extern unsigned int pluto_dh_pool_low_water; /* refill below this; 0 means half */
+extern bool pluto_ike_sk_offload; /* encrypt/decrypt IKE_AUTH SK payloads, and derive its CHILD SA KEYMAT, on helper threads */
+extern unsigned int pluto_cert_verify_cache; /* max cached certificate chain verifications */
 extern deltatime_t pluto_shunt_lifetime; /* lifetime before we cleanup bare shunts (for OE) */
+extern deltatime_t pluto_rekey_window; /* period over which rekeys are spread */
+extern unsigned int pluto_rekey_rate; /* rekeys per second budget within the window */
+extern deltatime_t pluto_sa_counter_cache; /* how long a kernel SA counter dump is reused */
 extern unsigned int pluto_sock_bufsize; /* pluto IKE socket buffer */
 extern bool pluto_sock_errqueue; /* Enable MSG_ERRQUEUE on IKE socket */
+extern unsigned int pluto_sock_batch; /* max datagrams read per IKE socket event */
+extern unsigned int pluto_sock_reuseport; /* SO_REUSEPORT sockets per UDP IKE endpoint */
+extern bool pluto_sock_steer_spi; /* steer SO_REUSEPORT sockets using IKE SPIi */
 
 extern enum pluto_ddos_mode ddos_mode;
 extern bool pluto_drop_oppo_null;
@@ -107,8 +107,7 @@ void show_process_status(struct show *s)
 	show_separator(s);
 	/* XXX: don't sort for now */
 	show_comment(s, "  PID  Process");
-	for (unsigned i = 0; i < elemsof(pid_entry_slots); i++) {
-		const struct list_head *h = &pid_entry_slots[i];
+	FOR_EACH_HASH_TABLE_BUCKET(&pids_hash_table, h) {
 		const struct pid_entry *e;
 		FOR_EACH_LIST_ENTRY_NEW2OLD(h, e) {
 			/*
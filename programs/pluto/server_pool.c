@@ -30,6 +30,9 @@
 #include <pthread.h>    /* Must be the first include file */
 #include <unistd.h>	/* for sleep() */
 #include <limits.h>	/* for UINT_MAX, ULONG_MAX */
+#include <semaphore.h>
+#include <errno.h>
+#include <stdatomic.h>
 
 #include "defs.h"
 #include "log.h"
@@ -39,6 +42,9 @@
 #include "server_pool.h"
 #include "list_entry.h"
 #include "pluto_timing.h"
+#include "show.h"
+#include "slab.h"
+#include "crypt_ke.h"		/* for refill_ke_and_nonce_pools() */
 
 #ifdef HAVE_SECCOMP
 # include "pluto_seccomp.h"
@@ -72,10 +78,36 @@ static resume_cb handle_helper_answer;
 typedef enum { JOB_ID_MIN = 1, JOB_ID_MAX = UINT_MAX, } job_id_t;
 typedef enum { HELPER_ID_MIN = 1, HELPER_ID_MAX = UINT_MAX, } helper_id_t;
 
+/*
+ * Jobs are queued by priority class so that, when the helpers are
+ * swamped by unauthenticated IKE_SA_INIT requests (i.e., under
+ * attack), established SAs can still rekey.  Helpers always take
+ * work from the highest priority class first.
+ */
+
+enum job_class {
+	JOB_CLASS_REKEY,	/* CREATE_CHILD_SA / Quick Mode under an existing IKE SA */
+	JOB_CLASS_IKE_AUTH,	/* IKE SA past its first exchange */
+	JOB_CLASS_IKE_SA_INIT,	/* responding to a new unauthenticated peer */
+#define JOB_CLASS_ROOF (JOB_CLASS_IKE_SA_INIT+1)
+};
+
+static const struct job_class_info {
+	const char *name;
+	unsigned limit;		/* max queued jobs; 0 means no limit */
+} job_classes[JOB_CLASS_ROOF] = {
+	[JOB_CLASS_REKEY] = { .name = "rekey", .limit = 0, },
+	[JOB_CLASS_IKE_AUTH] = { .name = "ike-auth", .limit = 4096, },
+	[JOB_CLASS_IKE_SA_INIT] = { .name = "ike-sa-init", .limit = 1024, },
+};
+
 struct job {
 	struct task *task;
 	const struct task_handler *handler;
 	struct list_entry backlog;
+	enum job_class class;
+	monotime_t queued;	/* submitted by the main thread */
+	monotime_t started;	/* picked up by a helper */
 	so_serial_t so_serialno;		/* sponsoring state-object's serial number */
 	bool cancelled;
 	const char *name;
@@ -87,6 +119,8 @@ struct job {
 	struct logger *logger;
 };
 
+static struct slab_pool job_pool = SLAB_POOL(struct job, "struct job");
+
 #define dbg_job(JOB, FMT, ...)						\
 	dbg("job %u for #%lu: %s (%s): "FMT,				\
 	    JOB->job_id, JOB->so_serialno,				\
@@ -95,7 +129,30 @@ struct job {
 	    ##__VA_ARGS__)
 
 /*
- * The work queue.  Accesses must be locked.
+ * The work queue.
+ *
+ * The main thread is the only producer and the helper threads are
+ * the consumers.  Jobs are passed through a bounded lock-free ring
+ * (Dmitry Vyukov's MPMC queue: each cell carries a sequence number
+ * saying whether it is free to write or ready to read) so that
+ * neither side needs a lock in the common case.
+ *
+ * When the ring is full, jobs spill onto the overflow list, which is
+ * locked.  Once anything is on the overflow list, new jobs are
+ * appended there too so that the queue stays FIFO.
+ *
+ * Helpers sleep on backlog_sem.  Before sleeping, a helper adds
+ * itself to nr_idle_helpers and then looks for work one last time.
+ * Waking takes one helper off that count and posts exactly one token
+ * for it; when no helper is idle nothing is posted.  A helper that
+ * finds work after all removes itself from the count or, when a
+ * waker got there first, consumes the token posted for it.  Tokens
+ * therefore never pile up and a burst of jobs doesn't leave idle
+ * helpers spinning through the queue.
+ *
+ * The fences order "queue a job, check for sleepers" against
+ * "announce sleeping, check for jobs" so that one side always sees
+ * the other.
  */
 
 static void jam_backlog(struct jambuf *buf, const void *data)
@@ -104,7 +161,7 @@ static void jam_backlog(struct jambuf *buf, const void *data)
 		jam(buf, "no job");
 	} else {
 		const struct job *job = data;
-		jam(buf, "job %ju", (uintmax_t)job->job_id);
+		jam(buf, "job %ju %s", (uintmax_t)job->job_id, job_classes[job->class].name);
 		if (job->so_serialno != SOS_NOBODY) {
 			jam(buf, " state #%lu", job->so_serialno);
 		}
@@ -128,22 +185,189 @@ static const struct list_info backlog_info = {
 	.jam = jam_backlog,
 };
 
-static pthread_mutex_t backlog_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t backlog_cond = PTHREAD_COND_INITIALIZER;
+#define JOB_RING_SIZE 4096	/* must be a power of 2 */
+
+struct job_queue {
+	atomic_size_t enqueue_pos;
+	atomic_size_t dequeue_pos;
+	struct job_ring_cell {
+		atomic_size_t sequence;
+		struct job *job;
+	} ring[JOB_RING_SIZE];
+	/* when the ring is full */
+	pthread_mutex_t overflow_mutex;
+	struct list_head overflow;
+	atomic_uint nr_overflow;
+	/* ring + overflow; checked against the class limit */
+	atomic_uint nr_queued;
+	/* main thread only */
+	struct {
+		unsigned long submitted;
+		unsigned long rejected;
+		unsigned long completed;
+		unsigned long wait_usec;
+		unsigned long max_wait_usec;
+	} stats;
+};
+
+#define JOB_QUEUE(CLASS)						\
+	[CLASS] = {							\
+		.overflow_mutex = PTHREAD_MUTEX_INITIALIZER,		\
+		.overflow = INIT_LIST_HEAD(&backlog[CLASS].overflow, &backlog_info), \
+	}
+
+static struct job_queue backlog[JOB_CLASS_ROOF] = {
+	JOB_QUEUE(JOB_CLASS_REKEY),
+	JOB_QUEUE(JOB_CLASS_IKE_AUTH),
+	JOB_QUEUE(JOB_CLASS_IKE_SA_INIT),
+};
+
+static sem_t backlog_sem;
+static atomic_uint nr_idle_helpers;	/* about to, or do, sem_wait() */
 
-struct list_head backlog = INIT_LIST_HEAD(&backlog, &backlog_info);
-static int backlog_queue_len = 0;
+static void init_job_queue(struct job_queue *queue)
+{
+	for (size_t i = 0; i < JOB_RING_SIZE; i++) {
+		atomic_init(&queue->ring[i].sequence, i);
+		queue->ring[i].job = NULL;
+	}
+	atomic_init(&queue->enqueue_pos, 0);
+	atomic_init(&queue->dequeue_pos, 0);
+	atomic_init(&queue->nr_overflow, 0);
+	atomic_init(&queue->nr_queued, 0);
+}
+
+static bool job_ring_push(struct job_queue *queue, struct job *job)
+{
+	size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+	while (true) {
+		struct job_ring_cell *cell = &queue->ring[pos & (JOB_RING_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			/* cell is free; try to claim it (updates POS on failure) */
+			if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed)) {
+				cell->job = job;
+				atomic_store_explicit(&cell->sequence, pos + 1,
+						      memory_order_release);
+				return true;
+			}
+		} else if (dif < 0) {
+			/* full */
+			return false;
+		} else {
+			pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+static struct job *job_ring_pop(struct job_queue *queue)
+{
+	size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+	while (true) {
+		struct job_ring_cell *cell = &queue->ring[pos & (JOB_RING_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			/* cell is ready; try to claim it (updates POS on failure) */
+			if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed)) {
+				struct job *job = cell->job;
+				atomic_store_explicit(&cell->sequence, pos + JOB_RING_SIZE,
+						      memory_order_release);
+				return job;
+			}
+		} else if (dif < 0) {
+			/* empty */
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+static void push_job(struct job_queue *queue, struct job *job)
+{
+	atomic_fetch_add(&queue->nr_queued, 1);
+	if (atomic_load(&queue->nr_overflow) == 0 &&
+	    job_ring_push(queue, job)) {
+		return;
+	}
+	pthread_mutex_lock(&queue->overflow_mutex);
+	{
+		insert_list_entry(&queue->overflow, &job->backlog);
+		atomic_fetch_add(&queue->nr_overflow, 1);
+	}
+	pthread_mutex_unlock(&queue->overflow_mutex);
+}
+
+static struct job *pop_job(struct job_queue *queue)
+{
+	struct job *job = job_ring_pop(queue);
+	if (job != NULL) {
+		atomic_fetch_sub(&queue->nr_queued, 1);
+		return job;
+	}
+	if (atomic_load(&queue->nr_overflow) == 0) {
+		return NULL;
+	}
+	pthread_mutex_lock(&queue->overflow_mutex);
+	{
+		FOR_EACH_LIST_ENTRY_OLD2NEW(&queue->overflow, job) { break; }
+		if (job != NULL) {
+			remove_list_entry(&job->backlog);
+			atomic_fetch_sub(&queue->nr_overflow, 1);
+			atomic_fetch_sub(&queue->nr_queued, 1);
+		}
+	}
+	pthread_mutex_unlock(&queue->overflow_mutex);
+	return job;
+}
+
+/* highest priority first */
+static struct job *pop_any_job(void)
+{
+	for (enum job_class c = 0; c < JOB_CLASS_ROOF; c++) {
+		struct job *job = pop_job(&backlog[c]);
+		if (job != NULL) {
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static bool claim_idle_helper(void)
+{
+	unsigned idle = atomic_load(&nr_idle_helpers);
+	while (idle > 0) {
+		/* updates IDLE on failure */
+		if (atomic_compare_exchange_weak(&nr_idle_helpers, &idle, idle - 1)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void sleep_on_backlog(void)
+{
+	/* EINTR leaves the token behind; wait again */
+	while (sem_wait(&backlog_sem) != 0 && errno == EINTR) {
+	}
+}
 
 static void message_helpers(struct job *job)
 {
-	pthread_mutex_lock(&backlog_mutex);
 	if (job != NULL) {
-		insert_list_entry(&backlog, &job->backlog);
-		backlog_queue_len++;
+		push_job(&backlog[job->class], job);
+	}
+	/* wake up a thread waiting for work, if there is one */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (claim_idle_helper()) {
+		sem_post(&backlog_sem);
 	}
-	/* wake up threads waiting for work */
-	pthread_cond_signal(&backlog_cond);
-	pthread_mutex_unlock(&backlog_mutex);
 }
 
 /*
@@ -160,6 +384,13 @@ static struct helper_thread *helper_threads = NULL;
 
 static int nr_helper_threads = 0;
 
+void poke_idle_helper(void)
+{
+	if (helper_threads != NULL) {
+		message_helpers(NULL);
+	}
+}
+
 /*
  * If there are any helper threads, this code is always executed IN A HELPER
  * THREAD. Otherwise it is executed in the main (only) thread.
@@ -215,42 +446,56 @@ static void *helper_thread(void *arg)
 
 	while (true) {
 		struct job *job = NULL;
-		pthread_mutex_lock(&backlog_mutex);
-		{
+		/*
+		 * Search the backlog for something to do.  If needed
+		 * wait.
+		 */
+		while (!exiting_pluto) {
+			/* grab the next entry, if there is one */
+			pexpect(job == NULL);
+			job = pop_any_job();
+			if (job != NULL) {
+				/* assign the entry to this thread */
+				job->helper_id = w->helper_id;
+				job->started = mononow();
+				break;
+			}
 			/*
-			 * Search the backlog[] for something to do.
-			 * If needed wait.
+			 * Nothing queued; use the time to top up
+			 * the pre-computed KE pools, one pair at a
+			 * time so that new jobs are not kept waiting.
 			 */
-			pexpect(job == NULL);
-			while (!exiting_pluto) {
-				/* grab the next entry, if there is one */
-				pexpect(job == NULL);
-				FOR_EACH_LIST_ENTRY_OLD2NEW(&backlog, job) { break; }
-				if (job != NULL) {
-					/*
-					 * Assign the entry to this
-					 * thread, removing it from
-					 * the backlog.
-					 */
-					remove_list_entry(&job->backlog);
-					job->helper_id = w->helper_id;
-					break;
-				}
+			if (refill_ke_and_nonce_pools(logger)) {
+				continue;
+			}
+			/* announce sleeping, then look one last time */
+			atomic_fetch_add(&nr_idle_helpers, 1);
+			atomic_thread_fence(memory_order_seq_cst);
+			job = (exiting_pluto ? NULL : pop_any_job());
+			if (job == NULL && !exiting_pluto) {
 				dbg("helper thread %d has nothing to do",
 				    w->helper_id);
-				pthread_cond_wait(&backlog_cond, &backlog_mutex);
+				/* the waker removed this helper from the count */
+				sleep_on_backlog();
+				continue;
+			}
+			if (!claim_idle_helper()) {
+				/* a waker counted on this helper; take its token */
+				sleep_on_backlog();
 			}
-			if (job == NULL) {
-				/*
-				 * No JOB implies pluto is exiting but
-				 * not reverse - could grab a JOB in
-				 * parallel to pluto starting to exit.
-				 */
-				pexpect(exiting_pluto);
+			if (job != NULL) {
+				job->helper_id = w->helper_id;
+				job->started = mononow();
+				break;
 			}
 		}
-		pthread_mutex_unlock(&backlog_mutex);
 		if (job == NULL) {
+			/*
+			 * No JOB implies pluto is exiting but not
+			 * reverse - could grab a JOB in parallel to
+			 * pluto starting to exit.
+			 */
+			pexpect(exiting_pluto);
 			/* per above, must be shutting down */
 			break;
 		}
@@ -325,13 +570,35 @@ static void inline_worker(struct state *unused_st UNUSED,
  *
  */
 
+static enum job_class job_class_of_state(const struct state *st)
+{
+	if (IS_CHILD_SA(st)) {
+		/* the IKE SA is already authenticated */
+		return JOB_CLASS_REKEY;
+	}
+	if (st->st_sa_role == SA_RESPONDER) {
+		switch (st->st_state->kind) {
+		case STATE_PARENT_R0:
+#ifdef USE_IKEv1
+		case STATE_MAIN_R1:
+		case STATE_AGGR_R0:
+#endif
+			/* anyone can send these */
+			return JOB_CLASS_IKE_SA_INIT;
+		default:
+			break;
+		}
+	}
+	return JOB_CLASS_IKE_AUTH;
+}
+
 void submit_task(const struct logger *logger,
 		 struct state *st,
 		 struct task *task,
 		 const struct task_handler *handler,
 		 const char *name)
 {
-	struct job *job = alloc_thing(struct job, name);
+	struct job *job = slab_alloc_thing(&job_pool, struct job, name);
 	job->cancelled = false;
 	job->name = name;
 	job->backlog = list_entry(&backlog_info, job);
@@ -352,6 +619,34 @@ void submit_task(const struct logger *logger,
 
 	job->handler = handler;
 	job->task = task;
+	job->class = job_class_of_state(st);
+	job->queued = mononow();
+	struct job_queue *queue = &backlog[job->class];
+	queue->stats.submitted++;
+
+	/*
+	 * Is this class's backlog full?
+	 *
+	 * Throw the job straight back as cancelled (so the task is
+	 * cleaned up the normal way) and let the crypto timeout,
+	 * scheduled for now, delete the state.
+	 */
+	unsigned limit = job_classes[job->class].limit;
+	if (helper_threads != NULL && limit > 0 &&
+	    atomic_load(&queue->nr_queued) >= limit) {
+		queue->stats.rejected++;
+		llog(RC_LOG, logger,
+		     "helper backlog for %s jobs is full (%u); abandoning %s",
+		     job_classes[job->class].name, limit, name);
+		job->cancelled = true;
+		job->logger = clone_logger(logger, HERE);
+		delete_event(st);
+		clear_retransmits(st);
+		event_schedule(EVENT_CRYPTO_TIMEOUT, deltatime(0), st);
+		schedule_resume("rejected helper job", job->so_serialno,
+				handle_helper_answer, job);
+		return;
+	}
 
 	/*
 	 * Save in case it needs to be cancelled.
@@ -416,6 +711,18 @@ static stf_status handle_helper_answer(struct state *st,
 	struct job *job = arg;
 	dbg_job(job, "processing response from helper %d", job->helper_id);
 
+	if (job->helper_id != 0) {
+		/* how long did it sit in the backlog */
+		struct job_queue *queue = &backlog[job->class];
+		struct timeval wait = timeval_from_deltatime(monotimediff(job->started, job->queued));
+		unsigned long usec = wait.tv_sec * 1000000UL + wait.tv_usec;
+		queue->stats.completed++;
+		queue->stats.wait_usec += usec;
+		if (usec > queue->stats.max_wait_usec) {
+			queue->stats.max_wait_usec = usec;
+		}
+	}
+
 	const struct task_handler *h = job->handler;
 	passert(h != NULL);
 
@@ -455,7 +762,7 @@ static stf_status handle_helper_answer(struct state *st,
 	pexpect(job->task == NULL); /* cross check - re-check */
 	/* now free up the continuation */
 	free_logger(&job->logger, HERE);
-	pfree(job);
+	slab_free(&job_pool, job);
 	return status;
 }
 
@@ -496,6 +803,12 @@ void start_server_helpers(int nhelpers, struct logger *logger)
 	nr_helper_threads = 0;
 
 	init_helper_thread_delay(logger);
+	for (enum job_class c = 0; c < JOB_CLASS_ROOF; c++) {
+		init_job_queue(&backlog[c]);
+	}
+	if (sem_init(&backlog_sem, /*pshared*/0, /*value*/0) != 0) {
+		fatal_errno(PLUTO_EXIT_FAIL, logger, errno, "sem_init() for helper backlog failed");
+	}
 
 	/* find out how many CPUs there are, if nhelpers is -1 */
 	/* if nhelpers == 0, then we do all the work ourselves */
@@ -549,6 +862,48 @@ void start_server_helpers(int nhelpers, struct logger *logger)
 	}
 }
 
+void show_helper_status(struct show *s)
+{
+	SHOW_JAMBUF(RC_COMMENT, s, buf) {
+		jam(buf, "helper-backlog:");
+		const char *sep = " ";
+		for (enum job_class c = 0; c < JOB_CLASS_ROOF; c++) {
+			const struct job_queue *queue = &backlog[c];
+			unsigned long avg_usec = (queue->stats.completed == 0 ? 0 :
+						  queue->stats.wait_usec / queue->stats.completed);
+			jam(buf, "%s%s=%u", sep, job_classes[c].name,
+			    atomic_load(&queue->nr_queued));
+			if (job_classes[c].limit > 0) {
+				jam(buf, "/%u", job_classes[c].limit);
+			}
+			jam(buf, " (rejected %lu, wait avg %lums max %lums)",
+			    queue->stats.rejected,
+			    avg_usec / 1000, queue->stats.max_wait_usec / 1000);
+			sep = ", ";
+		}
+	}
+}
+
+void show_helper_stats(struct show *s)
+{
+	for (enum job_class c = 0; c < JOB_CLASS_ROOF; c++) {
+		const struct job_queue *queue = &backlog[c];
+		const char *name = job_classes[c].name;
+		show_raw(s, "total.helper.%s.submitted=%lu", name, queue->stats.submitted);
+		show_raw(s, "total.helper.%s.rejected=%lu", name, queue->stats.rejected);
+		show_raw(s, "total.helper.%s.completed=%lu", name, queue->stats.completed);
+		show_raw(s, "total.helper.%s.wait.usec=%lu", name, queue->stats.wait_usec);
+		show_raw(s, "total.helper.%s.wait.max.usec=%lu", name, queue->stats.max_wait_usec);
+	}
+}
+
+void clear_helper_stats(void)
+{
+	for (enum job_class c = 0; c < JOB_CLASS_ROOF; c++) {
+		zero(&backlog[c].stats);
+	}
+}
+
 /*
  * Repeatedly nudge the helper threads until they all exit.
  *
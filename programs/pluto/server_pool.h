@@ -40,6 +40,7 @@
 struct state;
 struct msg_digest;
 struct logger;
+struct show;
 
 struct task; /*struct job*/
 
@@ -66,7 +67,16 @@ extern void submit_task(const struct logger *logger,
 			const struct task_handler *handler,
 			const char *name);
 
+/*
+ * Wake a helper with nothing queued so it can do background work
+ * (see refill_ke_and_nonce_pools()).
+ */
+extern void poke_idle_helper(void);
+
 extern void start_server_helpers(int nhelpers, struct logger *logger);
+void show_helper_status(struct show *s);
+void show_helper_stats(struct show *s);
+void clear_helper_stats(void);
 void stop_server_helpers(void);
 void server_helpers_stopped_callback(struct state *st, void *context); /* see pluto_shutdown.c */
 
@@ -23,6 +23,10 @@
  *
  */
 
+#include <sys/socket.h>		/* for recv() */
+
+#include <event2/event.h>
+
 #include "sysdep.h"
 #include "constants.h"
 #include "lswconf.h"
@@ -41,7 +45,14 @@
 #include "ikev1_db_ops.h"
 #include "kernel_xfrm_interface.h"
 #include "iface.h"
+#include "server_pool.h"	/* for show_helper_status() */
+#include "crypt_ke.h"		/* for show_ke_and_nonce_pool_status() */
+#include "nss_cert_verify.h"	/* for show_cert_verify_cache_status() */
+#include "pubkey_db.h"		/* for show_pubkey_db_status() */
 #include "show.h"
+#include "fd.h"
+#include "list_entry.h"
+#include "source_limit.h"
 #ifdef HAVE_SECCOMP
 #include "pluto_seccomp.h"
 #endif
@@ -189,18 +200,28 @@ void show_global_status(struct show *s)
 	show_pluto_stats(s);
 }
 
-void show_status(struct show *s)
+static void show_status_prologue(struct show *s)
 {
 	show_kernel_interface(s);
 	show_ifaces_status(s);
 	show_system_security(s);
 	show_setup_plutomain(s);
+	show_source_limit_status(s);
+	show_helper_status(s);
+	show_ke_and_nonce_pool_status(s);
+	show_cert_verify_cache_status(s);
+	show_pubkey_db_status(s);
 	show_debug_status(s);
 	show_setup_natt(s);
 	show_virtual_private(s);
 	show_kernel_alg_status(s);
 	show_ike_alg_status(s);
 	show_db_ops_status(s);
+}
+
+void show_status(struct show *s)
+{
+	show_status_prologue(s);
 	show_connections_status(s);
 	show_brief_status(s);
 	show_states(s);
@@ -209,6 +230,167 @@ void show_status(struct show *s)
 #endif
 }
 
+/*
+ * Streamed status.
+ *
+ * With a large number of connections and states, show_status() can
+ * stall the event loop for seconds.  Instead, the serial numbers of
+ * everything to be shown are captured up front and then emitted a
+ * slice at a time, each slice only once whack's socket is writable.
+ * In between, other events (such as packets) get to run.
+ *
+ * Since objects can come and go between slices, each is looked up by
+ * serial number and silently skipped when it has gone.  When SORTED
+ * is false the (potentially expensive) sort is skipped and states are
+ * shown newest first.
+ */
+
+#define SHOW_STREAM_SLICE 128
+
+struct show_stream {
+	struct list_entry entry;
+	struct logger *logger;	/* holds a reference to whack's socket */
+	struct show *s;
+	struct event *ev;
+	bool sorted;
+	enum { STREAM_CONNECTIONS, STREAM_STATES, } phase;
+	co_serial_t *connections;
+	unsigned nr_connections;
+	unsigned nr_active;
+	so_serial_t *states;
+	unsigned nr_states;
+	unsigned next;
+};
+
+static void jam_show_stream(struct jambuf *buf, const void *data)
+{
+	if (data == NULL) {
+		jam(buf, "<no stream>");
+	} else {
+		const struct show_stream *ss = data;
+		jam(buf, "show stream %s %u", ss->phase == STREAM_CONNECTIONS ?
+		    "connection" : "state", ss->next);
+	}
+}
+
+static const struct list_info show_stream_info = {
+	.name = "show stream",
+	.jam = jam_show_stream,
+};
+
+static struct list_head show_streams = INIT_LIST_HEAD(&show_streams, &show_stream_info);
+
+static void free_show_stream(struct show_stream **ssp)
+{
+	struct show_stream *ss = *ssp;
+	*ssp = NULL;
+	remove_list_entry(&ss->entry);
+	event_free(ss->ev);
+	free_show(&ss->s);
+	free_logger(&ss->logger, HERE);
+	pfreeany(ss->connections);
+	pfreeany(ss->states);
+	pfree(ss);
+}
+
+/*
+ * Emit up to a slice worth of output; return true when there's
+ * nothing more to show.
+ */
+static bool show_stream_slice(struct show_stream *ss)
+{
+	unsigned budget = SHOW_STREAM_SLICE;
+
+	if (ss->phase == STREAM_CONNECTIONS) {
+		for (; ss->next < ss->nr_connections && budget > 0; budget--) {
+			show_connection_status(ss->s, ss->connections[ss->next++]);
+		}
+		if (ss->next < ss->nr_connections) {
+			return false;
+		}
+		show_connections_status_tail(ss->s, ss->nr_connections,
+					     ss->nr_active);
+		show_brief_status(ss->s);
+		show_separator(ss->s);
+		ss->phase = STREAM_STATES;
+		ss->next = 0;
+		ss->states = state_status_serials(ss->sorted, &ss->nr_states);
+	}
+
+	monotime_t now = mononow();
+	for (; ss->next < ss->nr_states && budget > 0; budget--) {
+		show_state_status(ss->s, ss->states[ss->next++], now);
+	}
+	if (ss->next < ss->nr_states) {
+		return false;
+	}
+#if defined(XFRM_SUPPORT)
+	show_shunt_status(ss->s);
+#endif
+	return true;
+}
+
+static void show_stream_cb(evutil_socket_t fd, const short event UNUSED,
+			   void *arg)
+{
+	struct show_stream *ss = arg;
+
+	/* if whack went away, there's no one to show the rest to */
+	char c;
+	if (recv(fd, &c, sizeof(c), MSG_PEEK|MSG_DONTWAIT) == 0) {
+		dbg("whack closed its socket, abandoning %s status",
+		    ss->sorted ? "sorted" : "unsorted");
+		free_show_stream(&ss);
+		return;
+	}
+
+	if (show_stream_slice(ss)) {
+		free_show_stream(&ss);
+		return;
+	}
+
+	passert(event_add(ss->ev, NULL) >= 0);
+}
+
+void show_status_stream(struct logger *logger, bool sorted)
+{
+	int fd = fd_fileno(logger->global_whackfd);
+	if (fd < 0) {
+		/* nowhere to stream to; just do it */
+		struct show *s = alloc_show(logger);
+		show_status(s);
+		free_show(&s);
+		return;
+	}
+
+	struct show_stream *ss = alloc_thing(struct show_stream, "show stream");
+	ss->logger = clone_logger(logger, HERE);
+	ss->s = alloc_show(ss->logger);
+	ss->sorted = sorted;
+	ss->phase = STREAM_CONNECTIONS;
+	ss->entry = list_entry(&show_stream_info, ss);
+	insert_list_entry(&show_streams, &ss->entry);
+
+	/* the cheap bits */
+	show_status_prologue(ss->s);
+	show_connections_status_head(ss->s);
+	ss->connections = connection_status_serials(sorted, &ss->nr_connections,
+						    &ss->nr_active);
+
+	ss->ev = event_new(get_pluto_event_base(), fd, EV_WRITE,
+			   show_stream_cb, ss);
+	passert(ss->ev != NULL);
+	passert(event_add(ss->ev, NULL) >= 0);
+}
+
+void free_show_streams(void)
+{
+	struct show_stream *ss;
+	FOR_EACH_LIST_ENTRY_OLD2NEW(&show_streams, ss) {
+		free_show_stream(&ss);
+	}
+}
+
 /*
  * We store runtime info for stats/status this way.
  * You may be able to do something similar using these hooks.
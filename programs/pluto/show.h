@@ -16,6 +16,8 @@
 #ifndef SHOW_H
 #define SHOW_H
 
+#include <stdbool.h>
+
 /*
  * Try to deal with the separator (aka blank line or spacer) problem
  * in show output.
@@ -78,4 +80,12 @@ void show_comment(struct show *s, const char *message, ...) PRINTF_LIKE(2);
  */
 void show_raw(struct show *s, const char *message, ...) PRINTF_LIKE(2);
 
+/*
+ * Like show_status(), but emitted a slice at a time as whack's socket
+ * accepts it so that the event loop isn't stalled; unless SORTED,
+ * connections and states are shown in table order.
+ */
+void show_status_stream(struct logger *logger, bool sorted);
+void free_show_streams(void);
+
 #endif
@@ -0,0 +1,205 @@
+/* fixed-size object pools, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <pthread.h>
+#include <string.h>		/* for memset() */
+#include <ctype.h>		/* for isalnum() */
+
+#include "defs.h"
+#include "log.h"
+#include "show.h"
+#include "slab.h"
+
+bool pool_poison = false;
+
+/*
+ * Same byte pattern as leak-detective stomps on freed memory.
+ */
+#define SLAB_POISON 0xEF
+#define SLAB_OBJECTS 64
+
+/*
+ * A free object; the link is the only part not poisoned.
+ */
+struct slab_object {
+	struct slab_object *next;
+};
+
+struct slab {
+	struct slab *next;
+	/* followed by SLAB_OBJECTS objects */
+};
+
+static struct slab_pool *slab_pools;
+
+/* keep every object maximally aligned */
+static size_t object_size(const struct slab_pool *pool)
+{
+	const size_t align = sizeof(long double);
+	size_t size = (pool->size > sizeof(struct slab_object) ?
+		       pool->size : sizeof(struct slab_object));
+	return (size + align - 1) / align * align;
+}
+
+static size_t slab_header_size(void)
+{
+	const size_t align = sizeof(long double);
+	return (sizeof(struct slab) + align - 1) / align * align;
+}
+
+static void poison_object(const struct slab_pool *pool, struct slab_object *obj)
+{
+	memset((uint8_t *)obj + sizeof(*obj), SLAB_POISON,
+	       object_size(pool) - sizeof(*obj));
+}
+
+static void check_poison(const struct slab_pool *pool, const struct slab_object *obj)
+{
+	const uint8_t *bytes = (const uint8_t *)obj;
+	for (size_t i = sizeof(*obj); i < object_size(pool); i++) {
+		if (bytes[i] != SLAB_POISON) {
+			PASSERT_FAIL("%s %p modified at offset %zu after it was released",
+				     pool->name, obj, i);
+		}
+	}
+}
+
+/* caller holds the lock */
+static void grow_pool(struct slab_pool *pool)
+{
+	size_t size = object_size(pool);
+	struct slab *slab = alloc_bytes(slab_header_size() + size * SLAB_OBJECTS,
+					pool->name);
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->nr_slabs++;
+	uint8_t *objects = (uint8_t *)slab + slab_header_size();
+	for (unsigned i = 0; i < SLAB_OBJECTS; i++) {
+		struct slab_object *obj = (struct slab_object *)(objects + i * size);
+		if (pool_poison) {
+			poison_object(pool, obj);
+		}
+		obj->next = pool->free_list;
+		pool->free_list = obj;
+	}
+	pool->nr_free += SLAB_OBJECTS;
+	if (!pool->linked) {
+		pool->linked = true;
+		pool->next_pool = slab_pools;
+		slab_pools = pool;
+	}
+}
+
+void *slab_alloc_bytes(struct slab_pool *pool, size_t size, const char *name)
+{
+	passert(size == pool->size);
+	if (leak_detective) {
+		void *ptr = alloc_bytes(size, name);
+		pthread_mutex_lock(&pool->mutex);
+		pool->nr_allocs++;
+		pool->nr_in_use++;
+		pthread_mutex_unlock(&pool->mutex);
+		return ptr;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->free_list == NULL) {
+		grow_pool(pool);
+	}
+	struct slab_object *obj = pool->free_list;
+	pool->free_list = obj->next;
+	pool->nr_free--;
+	pool->nr_allocs++;
+	pool->nr_in_use++;
+	if (pool->nr_in_use > pool->high_water) {
+		pool->high_water = pool->nr_in_use;
+	}
+	if (pool_poison) {
+		check_poison(pool, obj);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	memset(obj, 0, pool->size);
+	return obj;
+}
+
+void slab_free(struct slab_pool *pool, void *ptr)
+{
+	passert(ptr != NULL);
+	if (leak_detective) {
+		pfree(ptr);
+		pthread_mutex_lock(&pool->mutex);
+		pool->nr_in_use--;
+		pthread_mutex_unlock(&pool->mutex);
+		return;
+	}
+
+	struct slab_object *obj = ptr;
+	if (pool_poison) {
+		poison_object(pool, obj);
+	}
+	pthread_mutex_lock(&pool->mutex);
+	passert(pool->nr_in_use > 0);
+	obj->next = pool->free_list;
+	pool->free_list = obj;
+	pool->nr_free++;
+	pool->nr_in_use--;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Only pools that own slabs are shown (with --leak-detective there
+ * are none).
+ */
+void show_slab_pool_stats(struct show *s)
+{
+	for (struct slab_pool *pool = slab_pools; pool != NULL;
+	     pool = pool->next_pool) {
+		/* "struct state" -> struct_state */
+		char name[64];
+		size_t n;
+		for (n = 0; pool->name[n] != '\0' && n < sizeof(name) - 1; n++) {
+			char c = pool->name[n];
+			name[n] = (isalnum((unsigned char)c) || c == '-' ? c : '_');
+		}
+		name[n] = '\0';
+		pthread_mutex_lock(&pool->mutex);
+		show_raw(s, "current.pool.%s.slabs=%lu", name, pool->nr_slabs);
+		show_raw(s, "current.pool.%s.in_use=%lu", name, pool->nr_in_use);
+		show_raw(s, "current.pool.%s.free=%lu", name, pool->nr_free);
+		show_raw(s, "current.pool.%s.high_water=%lu", name, pool->high_water);
+		show_raw(s, "total.pool.%s.allocs=%lu", name, pool->nr_allocs);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+
+void free_slab_pools(void)
+{
+	for (struct slab_pool *pool = slab_pools; pool != NULL;
+	     pool = pool->next_pool) {
+		if (pool->nr_in_use > 0) {
+			dbg("%s pool: %lu objects still in use",
+			    pool->name, pool->nr_in_use);
+		}
+		while (pool->slabs != NULL) {
+			struct slab *slab = pool->slabs;
+			pool->slabs = slab->next;
+			pfree(slab);
+		}
+		pool->free_list = NULL;
+		pool->nr_slabs = 0;
+		pool->nr_free = 0;
+		pool->linked = false;
+	}
+	slab_pools = NULL;
+}
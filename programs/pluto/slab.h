@@ -0,0 +1,74 @@
+/* fixed-size object pools, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdbool.h>
+#include <stddef.h>		/* for size_t */
+#include <pthread.h>
+
+struct show;
+
+/*
+ * Pool of same-sized objects carved out of larger slabs.
+ *
+ * Objects that are allocated and released at a high rate (states,
+ * message digests, events, helper jobs) are recycled through a free
+ * list instead of going back to malloc().  Slabs are kept until
+ * shutdown.
+ *
+ * With --leak-detective, the pool steps aside and each object is
+ * allocated (and reported) individually under its call-site name.
+ *
+ * With --pool-poison, released objects are filled with a pattern that
+ * is verified when the object is next handed out, catching writes
+ * after free.
+ */
+
+struct slab_pool {
+	const char *name;
+	size_t size;
+	/* private */
+	pthread_mutex_t mutex;
+	bool linked;
+	struct slab_object *free_list;
+	struct slab *slabs;
+	unsigned long nr_slabs;
+	unsigned long nr_in_use;
+	unsigned long nr_free;
+	unsigned long high_water;
+	unsigned long nr_allocs;
+	struct slab_pool *next_pool;
+};
+
+#define SLAB_POOL(THING, NAME)					\
+	{							\
+		.name = NAME,					\
+		.size = sizeof(THING),				\
+		.mutex = PTHREAD_MUTEX_INITIALIZER,		\
+	}
+
+extern bool pool_poison;
+
+/* zeroed; NAME is used when the pool is bypassed */
+void *slab_alloc_bytes(struct slab_pool *pool, size_t size, const char *name);
+void slab_free(struct slab_pool *pool, void *ptr);
+
+#define slab_alloc_thing(POOL, THING, NAME)				\
+	((THING *) slab_alloc_bytes(POOL, sizeof(THING), NAME))
+
+void show_slab_pool_stats(struct show *s);
+void free_slab_pools(void);
+
+#endif
@@ -0,0 +1,227 @@
+/* per-source IKE_SA_INIT rate limiting, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <stdlib.h>		/* for qsort() */
+#include <string.h>		/* for memset() */
+
+#include "defs.h"
+#include "log.h"
+#include "show.h"
+#include "rnd.h"
+#include "server.h"		/* for pluto_ddos_source_rate */
+#include "hash_table.h"		/* for hash_table_hasher() */
+#include "pluto_stats.h"
+#include "ip_info.h"
+#include "ip_subnet.h"
+#include "source_limit.h"
+
+/*
+ * Requests are counted per source prefix in a count-min sketch:
+ * SOURCE_LIMIT_DEPTH rows of SOURCE_LIMIT_WIDTH counters, each row
+ * indexed by a differently seeded hash of the prefix; the estimate is
+ * the smallest of the prefix's counters.  Collisions can only inflate
+ * an estimate, never hide a busy prefix.
+ *
+ * Instead of a timer, every counter is halved for each second that
+ * has passed since the last request; a steady rate of R requests per
+ * second settles at an estimate of about 2R.
+ *
+ * Prefixes found over the limit are also remembered in a small
+ * least-recently-seen table so that "ipsec status" can name them.
+ */
+
+#define SOURCE_LIMIT_DEPTH	4
+#define SOURCE_LIMIT_WIDTH	1024
+#define SOURCE_LIMIT_TALKERS	16
+#define SOURCE_LIMIT_IPv4_BITS	24
+#define SOURCE_LIMIT_IPv6_BITS	48
+
+static struct {
+	bool seeded;
+	hash_t seed[SOURCE_LIMIT_DEPTH];
+	intmax_t second;	/* counters were last decayed */
+	uint32_t counter[SOURCE_LIMIT_DEPTH][SOURCE_LIMIT_WIDTH];
+} sketch;
+
+struct source_talker {
+	ip_subnet prefix;	/* unset when the slot is empty */
+	intmax_t last_seen;	/* monotonic second */
+	unsigned long challenged;
+	unsigned long dropped;
+};
+
+static struct source_talker talkers[SOURCE_LIMIT_TALKERS];
+
+static ip_subnet source_prefix(const ip_endpoint *sender)
+{
+	ip_address address = endpoint_address(sender);
+	const struct ip_info *afi = address_type(&address);
+	unsigned bits = (afi == &ipv4_info ? SOURCE_LIMIT_IPv4_BITS :
+			 SOURCE_LIMIT_IPv6_BITS);
+	struct ip_bytes bytes = address.bytes;
+	for (unsigned i = 0; i < afi->ip_size; i++) {
+		if (i * 8 >= bits) {
+			bytes.byte[i] = 0;
+		} else if ((i + 1) * 8 > bits) {
+			bytes.byte[i] &= 0xff << (8 - (bits - i * 8));
+		}
+	}
+	return subnet_from_raw(afi->ip_version, bytes, bits);
+}
+
+static unsigned sketch_slot(const ip_subnet *prefix, unsigned row)
+{
+	const struct ip_info *afi = ip_version_info(prefix->version);
+	hash_t hash = hash_table_hasher(shunk2(prefix->bytes.byte, afi->ip_size),
+					sketch.seed[row]);
+	return hash.hash % SOURCE_LIMIT_WIDTH;
+}
+
+static void decay_sketch(intmax_t now)
+{
+	if (!sketch.seeded) {
+		get_rnd_bytes(sketch.seed, sizeof(sketch.seed));
+		sketch.seeded = true;
+		sketch.second = now;
+		return;
+	}
+	if (now <= sketch.second) {
+		return;
+	}
+	intmax_t halvings = now - sketch.second;
+	sketch.second = now;
+	if (halvings >= 32) {
+		memset(sketch.counter, 0, sizeof(sketch.counter));
+		return;
+	}
+	for (unsigned row = 0; row < SOURCE_LIMIT_DEPTH; row++) {
+		for (unsigned c = 0; c < SOURCE_LIMIT_WIDTH; c++) {
+			sketch.counter[row][c] >>= halvings;
+		}
+	}
+}
+
+/* count one request; return the new estimate */
+static uint32_t count_source(const ip_subnet *prefix)
+{
+	uint32_t estimate = UINT32_MAX;
+	for (unsigned row = 0; row < SOURCE_LIMIT_DEPTH; row++) {
+		uint32_t *counter = &sketch.counter[row][sketch_slot(prefix, row)];
+		if (*counter < UINT32_MAX) {
+			(*counter)++;
+		}
+		estimate = min(estimate, *counter);
+	}
+	return estimate;
+}
+
+static uint32_t source_estimate(const ip_subnet *prefix)
+{
+	uint32_t estimate = UINT32_MAX;
+	for (unsigned row = 0; row < SOURCE_LIMIT_DEPTH; row++) {
+		estimate = min(estimate, sketch.counter[row][sketch_slot(prefix, row)]);
+	}
+	return estimate;
+}
+
+static struct source_talker *source_talker(const ip_subnet *prefix, intmax_t now)
+{
+	struct source_talker *oldest = &talkers[0];
+	for (unsigned i = 0; i < elemsof(talkers); i++) {
+		struct source_talker *t = &talkers[i];
+		if (t->prefix.is_set && subnet_eq(&t->prefix, prefix)) {
+			t->last_seen = now;
+			return t;
+		}
+		if (!t->prefix.is_set ||
+		    (oldest->prefix.is_set && t->last_seen < oldest->last_seen)) {
+			oldest = t;
+		}
+	}
+	*oldest = (struct source_talker) {
+		.prefix = *prefix,
+		.last_seen = now,
+	};
+	return oldest;
+}
+
+enum source_verdict check_ike_sa_init_source(const ip_endpoint *sender)
+{
+	if (pluto_ddos_source_rate == 0) {
+		return SOURCE_OK;
+	}
+
+	intmax_t now = monosecs(mononow());
+	decay_sketch(now);
+
+	ip_subnet prefix = source_prefix(sender);
+	uint32_t estimate = count_source(&prefix);
+	/* a steady rate R settles at 2R */
+	uint64_t limit = 2 * (uint64_t)pluto_ddos_source_rate;
+	if (estimate <= limit) {
+		return SOURCE_OK;
+	}
+
+	struct source_talker *t = source_talker(&prefix, now);
+	if (estimate > 2 * limit) {
+		t->dropped++;
+		pstats_ike_source_dropped++;
+		return SOURCE_DROP;
+	}
+	t->challenged++;
+	pstats_ike_source_challenged++;
+	return SOURCE_CHALLENGE;
+}
+
+static int talker_cmp(const void *lp, const void *rp)
+{
+	const struct source_talker *l = lp;
+	const struct source_talker *r = rp;
+	/* empty slots sort last */
+	if (l->prefix.is_set != r->prefix.is_set) {
+		return l->prefix.is_set ? -1 : 1;
+	}
+	if (!l->prefix.is_set) {
+		return 0;
+	}
+	uint32_t le = source_estimate(&l->prefix);
+	uint32_t re = source_estimate(&r->prefix);
+	return (le > re ? -1 : le < re ? 1 : 0);
+}
+
+void show_source_limit_status(struct show *s)
+{
+	if (pluto_ddos_source_rate == 0) {
+		return;
+	}
+
+	show_separator(s);
+	show_comment(s, "ddos-source-rate=%u/s per /%u (IPv4) or /%u (IPv6) prefix, challenged=%lu, dropped=%lu",
+		     pluto_ddos_source_rate,
+		     SOURCE_LIMIT_IPv4_BITS, SOURCE_LIMIT_IPv6_BITS,
+		     pstats_ike_source_challenged,
+		     pstats_ike_source_dropped);
+
+	decay_sketch(monosecs(mononow()));
+	struct source_talker sorted[SOURCE_LIMIT_TALKERS];
+	memcpy(sorted, talkers, sizeof(sorted));
+	qsort(sorted, elemsof(sorted), sizeof(sorted[0]), talker_cmp);
+	for (unsigned i = 0; i < elemsof(sorted) && sorted[i].prefix.is_set; i++) {
+		const struct source_talker *t = &sorted[i];
+		subnet_buf sb;
+		show_comment(s, "ddos source %s: ~%u IKE_SA_INIT/s, challenged=%lu, dropped=%lu",
+			     str_subnet(&t->prefix, &sb),
+			     source_estimate(&t->prefix) / 2,
+			     t->challenged, t->dropped);
+	}
+}
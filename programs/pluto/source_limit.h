@@ -0,0 +1,36 @@
+/* per-source IKE_SA_INIT rate limiting, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#ifndef SOURCE_LIMIT_H
+#define SOURCE_LIMIT_H
+
+#include "ip_endpoint.h"
+
+struct show;
+
+/*
+ * What to do with a new IKE_SA_INIT request given the recent request
+ * rate from the sender's prefix (see ddos-source-rate=).
+ */
+
+enum source_verdict {
+	SOURCE_OK,		/* process normally */
+	SOURCE_CHALLENGE,	/* demand a cookie */
+	SOURCE_DROP,		/* drop, no reply */
+};
+
+enum source_verdict check_ike_sa_init_source(const ip_endpoint *sender);
+
+void show_source_limit_status(struct show *s);
+
+#endif
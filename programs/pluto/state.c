@@ -38,6 +38,7 @@
 #include "connections.h"	/* needs id.h */
 #include "state.h"
 #include "state_db.h"
+#include "slab.h"
 #include "ikev1_msgid.h"
 #include "log.h"
 #include "rnd.h"
@@ -295,6 +296,8 @@ void change_state(struct state *st, enum state_kind new_state_kind)
 		binlog_state(st, new_state_kind /* XXX */);
 		st->st_state = new_state;
 	}
+	/* any SPIs assigned along the way */
+	rehash_state_spis_in_db(st);
 }
 
 /*
@@ -391,28 +394,25 @@ union sas { struct child_sa child; struct ike_sa ike; struct state st; };
  * Caller must insert_state().
  */
 
-static struct state *new_state(struct connection *c,
-			       const ike_spi_t ike_initiator_spi,
-			       const ike_spi_t ike_responder_spi,
-			       enum sa_type sa_type, struct fd *whackfd)
+static struct slab_pool state_pool = SLAB_POOL(union sas, "struct state");
+
+static struct state *alloc_state(struct connection *c,
+				 so_serial_t serialno,
+				 const ike_spis_t *ike_spis,
+				 enum sa_type sa_type, struct fd *whackfd)
 {
-	static so_serial_t next_so = SOS_FIRST;
-	union sas *sas = alloc_thing(union sas, "struct state in new_state()");
+	union sas *sas = slab_alloc_thing(&state_pool, union sas, "struct state in new_state()");
 	passert(&sas->st == &sas->child.sa);
 	passert(&sas->st == &sas->ike.sa);
 	struct state *st = &sas->st;
 	*st = (struct state) {
 		.st_state = &state_undefined,
-		.st_serialno = next_so++,
+		.st_serialno = serialno,
 		.st_inception = realnow(),
 		.st_establishing_sa = sa_type,
 		.st_connection = c,
-		.st_ike_spis = {
-			.initiator = ike_initiator_spi,
-			.responder = ike_responder_spi,
-		},
+		.st_ike_spis = *ike_spis,
 	};
-	passert(next_so > SOS_FIRST);   /* overflow can't happen! */
 
 	st->st_logger = alloc_logger(st, &logger_state_vec, HERE);
 	st->st_logger->object_whackfd = dup_any(whackfd);
@@ -422,11 +422,26 @@ static struct state *new_state(struct connection *c,
 
 	dbg("creating state object #%lu at %p", st->st_serialno, (void *) st);
 	add_state_to_db(st);
-	pstat_sa_started(st, sa_type);
 
 	return st;
 }
 
+static struct state *new_state(struct connection *c,
+			       const ike_spi_t ike_initiator_spi,
+			       const ike_spi_t ike_responder_spi,
+			       enum sa_type sa_type, struct fd *whackfd)
+{
+	static so_serial_t next_so = SOS_FIRST;
+	ike_spis_t ike_spis = {
+		.initiator = ike_initiator_spi,
+		.responder = ike_responder_spi,
+	};
+	struct state *st = alloc_state(c, next_so++, &ike_spis, sa_type, whackfd);
+	passert(next_so > SOS_FIRST);   /* overflow can't happen! */
+	pstat_sa_started(st, sa_type);
+	return st;
+}
+
 struct ike_sa *new_v1_istate(struct connection *c, struct fd *whackfd)
 {
 	struct state *st = new_state(c, ike_initiator_spi(),
@@ -465,6 +480,36 @@ struct ike_sa *new_v2_ike_state(struct connection *c,
 	return ike;
 }
 
+/*
+ * Compacted half-open IKE SAs (see ikev2_half_open.c).
+ *
+ * While compacted, the IKE SA has no struct state but is still
+ * counted as being in its state (STATE_PARENT_R1) so that the DDOS
+ * thresholds see it.  Hence these bypass change_state().
+ */
+
+struct ike_sa *restore_v2_ike_state(struct connection *c,
+				    so_serial_t serialno,
+				    const ike_spis_t *ike_spis,
+				    enum state_kind kind,
+				    const struct state_v2_microcode *transition,
+				    lset_t policy)
+{
+	struct state *st = alloc_state(c, serialno, ike_spis, IKE_SA, null_fd);
+	struct ike_sa *ike = pexpect_ike_sa(st);
+	ike->sa.st_sa_role = SA_RESPONDER;
+	ike->sa.st_state = finite_states[kind];
+	set_v2_transition(&ike->sa, transition, HERE);
+	v2_msgid_init_ike(ike);
+	initialize_new_state(&ike->sa, policy, 0);
+	return ike;
+}
+
+void uncount_compacted_state(enum state_kind kind)
+{
+	update_state_stat(NULL, finite_states[kind], -1);
+}
+
 /*
  * Initialize the state table.
  */
@@ -828,6 +873,7 @@ void ikev2_schedule_next_child_delete(struct state *st, struct ike_sa *ike)
 }
 
 static void delete_state_tail(struct state *st);
+static void free_state(struct state *st);
 
 void delete_other_state(struct state *st, struct state *other_state)
 {
@@ -1122,6 +1168,32 @@ void delete_state_tail(struct state *st)
 
 	release_any_whack(st, HERE, "deleting state");
 
+	free_state(st);
+}
+
+/*
+ * Throw away a half-open IKE SA after its contents were moved to the
+ * half-open table.  Unlike delete_state() there's no one to tell and
+ * nothing to revive, and the SA stays counted in its state.
+ */
+void free_compacted_state(struct state *st)
+{
+	pexpect(st->st_offloaded_task == NULL);
+	pexpect(st->st_suspended_md == NULL);
+	delete_event(st);
+	clear_retransmits(st);
+	free_v2_message_queues(st);
+	del_state_from_db(st);
+	connection_delete_unused_instance(&st->st_connection, st,
+					  st->st_logger->global_whackfd);
+	st->st_interface = NULL;
+	v2_msgid_free(st);
+	release_any_whack(st, HERE, "compacting state");
+	free_state(st);
+}
+
+static void free_state(struct state *st)
+{
 	/* from here on we are just freeing RAM */
 
 #ifdef USE_IKEv1
@@ -1210,7 +1282,7 @@ void delete_state_tail(struct state *st)
 
 	free_logger(&st->st_logger, HERE);
 	messup(st);
-	pfree(st);
+	slab_free(&state_pool, st);
 }
 
 /*
@@ -1668,12 +1740,18 @@ struct ike_sa *find_v2_ike_sa_by_initiator_spi(const ike_spi_t *ike_initiator_sp
 struct v2_spi_filter {
 	uint8_t protoid;
 	ipsec_spi_t outbound_spi;
+	const struct ike_sa *ike;
 };
 
 static bool v2_spi_predicate(struct state *st, void *context)
 {
 	struct v2_spi_filter *filter = context;
 
+	if (st->st_clonedfrom != filter->ike->sa.st_serialno ||
+	    st->st_ike_version != IKEv2) {
+		return false;
+	}
+
 	struct ipsec_proto_info *pr;
 	switch (filter->protoid) {
 	case PROTO_IPSEC_AH:
@@ -1713,13 +1791,11 @@ struct child_sa *find_v2_child_sa_by_outbound_spi(struct ike_sa *ike,
 	struct v2_spi_filter filter = {
 		.protoid = protoid,
 		.outbound_spi = outbound_spi,
+		.ike = ike,
 	};
-	struct state *st = state_by_ike_spis(IKEv2,
-					     &ike->sa.st_serialno,
-					     NULL /* ignore v1 msgid */,
-					     NULL /* ignore-role */,
-					     &ike->sa.st_ike_spis,
-					     v2_spi_predicate, &filter, __func__);
+	struct state *st = state_by_outbound_spi(protoid, outbound_spi,
+						 v2_spi_predicate, &filter,
+						 __func__);
 	return pexpect_child_sa(st);
 }
 
@@ -1765,42 +1841,47 @@ struct state *find_v1_info_state(const ike_spis_t *ike_spis, msgid_t msgid)
  * Certain CISCO implementations send our side's SPI instead.
  * We'll accept this, but mark it as bogus.
  */
+struct phase2_delete_filter {
+	const struct connection *p1c;
+};
+
+static bool phase2_delete_predicate(struct state *st, void *context)
+{
+	const struct phase2_delete_filter *filter = context;
+	const struct connection *c = st->st_connection;
+	return (IS_IPSEC_SA_ESTABLISHED(st) &&
+		filter->p1c->host_pair == c->host_pair &&
+		same_peer_ids(filter->p1c, c, NULL));
+}
+
 struct state *find_phase2_state_to_delete(const struct state *p1st,
 					  uint8_t protoid,
 					  ipsec_spi_t spi,
 					  bool *bogus)
 {
-	const struct connection *p1c = p1st->st_connection;
-	struct state  *bogusst = NULL;
+	struct phase2_delete_filter filter = {
+		.p1c = p1st->st_connection,
+	};
+	if (protoid != PROTO_IPSEC_AH) {
+		/* as before, anything else is treated as ESP */
+		protoid = PROTO_IPSEC_ESP;
+	}
 
-	*bogus = FALSE;
-	dbg("FOR_EACH_STATE_... in %s", __func__);
-	struct state *st;
-	FOR_EACH_STATE_NEW2OLD(st) {
-		const struct connection *c = st->st_connection;
-		if (IS_IPSEC_SA_ESTABLISHED(st) &&
-		    p1c->host_pair == c->host_pair &&
-		    same_peer_ids(p1c, c, NULL))
-		{
-			struct ipsec_proto_info *pr =
-				protoid == PROTO_IPSEC_AH ?
-					&st->st_ah : &st->st_esp;
-
-			if (pr->present) {
-				if (pr->attrs.spi == spi) {
-					*bogus = FALSE;
-					return st;
-				}
+	*bogus = false;
+	struct state *st = state_by_outbound_spi(protoid, spi,
+						 phase2_delete_predicate,
+						 &filter, __func__);
+	if (st != NULL) {
+		return st;
+	}
 
-				if (pr->our_spi == spi) {
-					*bogus = TRUE;
-					bogusst = st;
-					/* don't return! */
-				}
-			}
-		}
+	st = state_by_inbound_spi(protoid, spi,
+				  phase2_delete_predicate,
+				  &filter, __func__);
+	if (st != NULL) {
+		*bogus = true;
 	}
-	return bogusst;
+	return st;
 }
 
 bool find_pending_phase2(const so_serial_t psn,
@@ -2389,40 +2470,94 @@ void show_brief_status(struct show *s)
 		  cat_count_child_sa[CAT_ANONYMOUS]);
 }
 
+/*
+ * Collect the serial numbers of all states, sorted by connection when
+ * SORTED, otherwise newest first, ready to be shown one at a time.
+ *
+ * Returns NULL when there are no states.  Caller is responsible for
+ * freeing the array.
+ */
+so_serial_t *state_status_serials(bool sorted, unsigned *count)
+{
+	*count = 0;
+	if (sorted) {
+		struct state **array = sort_states(state_compare_connection,
+						   __func__);
+		if (array == NULL) {
+			return NULL;
+		}
+		while (array[*count] != NULL)
+			(*count)++;
+		so_serial_t *serials = alloc_things(so_serial_t, *count,
+						    "state serials");
+		for (unsigned i = 0; i < *count; i++)
+			serials[i] = array[i]->st_serialno;
+		pfree(array);
+		return serials;
+	}
+
+	dbg("FOR_EACH_STATE_... in %s", __func__);
+	struct state *st;
+	FOR_EACH_STATE_NEW2OLD(st) {
+		(*count)++;
+	}
+	if (*count == 0) {
+		return NULL;
+	}
+	so_serial_t *serials = alloc_things(so_serial_t, *count,
+					    "state serials");
+	unsigned i = 0;
+	FOR_EACH_STATE_NEW2OLD(st) {
+		serials[i++] = st->st_serialno;
+	}
+	passert(i == *count);
+	return serials;
+}
+
+/*
+ * Show the state, if it still exists, along with any pending Phase
+ * 2s.
+ */
+void show_state_status(struct show *s, so_serial_t serialno, monotime_t now)
+{
+	struct state *st = state_by_serialno(serialno);
+	if (st == NULL) {
+		return;
+	}
+
+	char state_buf[LOG_WIDTH];
+	char state_buf2[LOG_WIDTH];
+	fmt_state(st, now, state_buf, sizeof(state_buf),
+		  state_buf2, sizeof(state_buf2));
+	show_comment(s, "%s", state_buf);
+	if (state_buf2[0] != '\0')
+		show_comment(s, "%s", state_buf2);
+
+	/* show any associated pending Phase 2s */
+	if (IS_IKE_SA(st))
+		show_pending_phase2(s, st->st_connection,
+				    pexpect_ike_sa(st));
+}
+
 void show_states(struct show *s)
 {
 	show_separator(s);
-	struct state **array = sort_states(state_compare_connection,
-					   __func__);
+	unsigned count;
+	so_serial_t *serials = state_status_serials(true/*sorted*/, &count);
 
-	if (array != NULL) {
+	if (serials != NULL) {
 		monotime_t n = mononow();
 		/* now print sorted results */
-		int i;
-		for (i = 0; array[i] != NULL; i++) {
-			struct state *st = array[i];
-
-			char state_buf[LOG_WIDTH];
-			char state_buf2[LOG_WIDTH];
-			fmt_state(st, n, state_buf, sizeof(state_buf),
-				  state_buf2, sizeof(state_buf2));
-			show_comment(s, "%s", state_buf);
-			if (state_buf2[0] != '\0')
-				show_comment(s, "%s", state_buf2);
-
-			/* show any associated pending Phase 2s */
-			if (IS_IKE_SA(st))
-				show_pending_phase2(s, st->st_connection,
-						    pexpect_ike_sa(st));
-		}
-		pfree(array);
+		for (unsigned i = 0; i < count; i++)
+			show_state_status(s, serials[i], n);
+		pfree(serials);
 	}
 }
 
 /*
  * Given that we've used up a range of unused CPI's,
- * search for a new range of currently unused ones.
- * Note: this is very expensive when not trivial!
+ * search for a new range of currently unused ones
+ * using the CPI map maintained by the state DB.
  * If we can't find one easily, choose 0 (a bad SPI,
  * no matter what order) indicating failure.
  */
@@ -2430,43 +2565,32 @@ void find_my_cpi_gap(cpi_t *latest_cpi, cpi_t *first_busy_cpi)
 {
 	int tries = 0;
 	cpi_t base = *latest_cpi;
-	cpi_t closest;
 
-startover:
-	closest = ~0;   /* not close at all */
-	dbg("FOR_EACH_STATE_... in %s", __func__);
-	struct state *st;
-	FOR_EACH_STATE_NEW2OLD(st) {
-		if (st->st_ipcomp.present) {
-			cpi_t c = ntohl(st->st_ipcomp.our_spi) - base;
-
-			if (c < closest) {
-				if (c == 0) {
-					/*
-					 * oops: next spot is
-					 * occupied; start over
-					 */
-					if (++tries == 20) {
-						/* FAILURE */
-						*latest_cpi = 0;
-						*first_busy_cpi = 0;
-						return;
-					}
-					base++;
-					if (base > IPCOMP_LAST_NEGOTIATED)
-						base = IPCOMP_FIRST_NEGOTIATED;
-
-					/* really a tail call */
-					goto startover;
-				}
-				closest = c;
-			}
+	while (cpi_in_use(base)) {
+		/* oops: next spot is occupied; start over */
+		if (++tries == 20) {
+			/* FAILURE */
+			*latest_cpi = 0;
+			*first_busy_cpi = 0;
+			return;
 		}
+		base++;
+		if (base > IPCOMP_LAST_NEGOTIATED)
+			base = IPCOMP_FIRST_NEGOTIATED;
 	}
+
+	cpi_t closest = cpi_distance_to_busy(base);
 	*latest_cpi = base;	/* base is first in next free range */
 	*first_busy_cpi = closest + base;	/* and this is the roof */
 }
 
+static bool same_peer_cpi_predicate(struct state *s, void *context)
+{
+	const struct state *st = context;
+	return sameaddr(&s->st_connection->spd.that.host_addr,
+			&st->st_connection->spd.that.host_addr);
+}
+
 /*
  * Muck with high-order 16 bits of this SPI in order to make
  * the corresponding SAID unique.
@@ -2485,21 +2609,14 @@ ipsec_spi_t uniquify_peer_cpi(ipsec_spi_t cpi, const struct state *st, int tries
 	get_rnd_bytes((uint8_t *)&cpi, 2);
 
 	/*
-	 * Make sure that the result is unique.
-	 * Hard work.  If there is no unique value, we'll loop forever!
+	 * Make sure that the result is unique (for this peer).
 	 */
-	dbg("FOR_EACH_STATE_... in %s", __func__);
-	struct state *s;
-	FOR_EACH_STATE_NEW2OLD(s) {
-		if (s->st_ipcomp.present &&
-		    sameaddr(&s->st_connection->spd.that.host_addr,
-			     &st->st_connection->spd.that.host_addr) &&
-		    cpi == s->st_ipcomp.attrs.spi)
-		{
-			if (++tries == 20)
-				return 0; /* FAILURE */
-			return uniquify_peer_cpi(cpi, st, tries);
-		}
+	if (state_by_outbound_spi(PROTO_IPCOMP, cpi,
+				  same_peer_cpi_predicate,
+				  (void *)st, __func__) != NULL) {
+		if (++tries == 20)
+			return 0; /* FAILURE */
+		return uniquify_peer_cpi(cpi, st, tries);
 	}
 	return cpi;
 }
@@ -2918,6 +3035,15 @@ void show_globalstate_status(struct show *s)
 
 	show_raw(s, "config.setup.ike.ddos_threshold=%u", pluto_ddos_threshold);
 	show_raw(s, "config.setup.ike.max_halfopen=%u", pluto_max_halfopen);
+	show_raw(s, "config.setup.ike.compact_halfopen=%s", bool_str(pluto_compact_halfopen));
+	show_raw(s, "config.setup.ike.ddos_source_rate=%u", pluto_ddos_source_rate);
+	show_raw(s, "config.setup.dh.pool_size=%u", pluto_dh_pool_size);
+	show_raw(s, "config.setup.dh.pool_low_water=%u", pluto_dh_pool_low_water);
+	show_raw(s, "config.setup.ike.sk_offload=%s", bool_str(pluto_ike_sk_offload));
+	show_raw(s, "config.setup.cert.verify_cache=%u", pluto_cert_verify_cache);
+	show_raw(s, "config.setup.rekey.window=%jd", deltasecs(pluto_rekey_window));
+	show_raw(s, "config.setup.rekey.rate=%u", pluto_rekey_rate);
+	show_raw(s, "config.setup.kernel.sa_counter_cache=%jd", deltasecs(pluto_sa_counter_cache));
 
 	/* technically shunts are not a struct state's - but makes it easier to group */
 	show_raw(s, "current.states.all="PRI_CAT, shunts + total_sa());
@@ -231,6 +231,12 @@ enum state_hash_tables {
 	STATE_REQID_HASH_TABLE,
 	STATE_IKE_SPIS_HASH_TABLE,
 	STATE_IKE_INITIATOR_SPI_HASH_TABLE,
+	/* only hashed while the SPI is known; see state_db.c */
+	STATE_ESP_OUTBOUND_SPI_HASH_TABLE,
+	STATE_AH_OUTBOUND_SPI_HASH_TABLE,
+	STATE_IPCOMP_OUTBOUND_CPI_HASH_TABLE,
+	STATE_ESP_INBOUND_SPI_HASH_TABLE,
+	STATE_AH_INBOUND_SPI_HASH_TABLE,
 	STATE_HASH_TABLES_ROOF,
 };
 
@@ -333,6 +339,7 @@ struct state {
 	struct ipsec_proto_info st_ah;
 	struct ipsec_proto_info st_esp;
 	struct ipsec_proto_info st_ipcomp;
+	cpi_t st_booked_cpi;		/* our CPI as entered in the CPI map */
 
 	ipsec_spi_t st_tunnel_in_spi;		/* KLUDGE */
 	ipsec_spi_t st_tunnel_out_spi;		/* KLUDGE */
@@ -778,6 +785,15 @@ struct ike_sa *new_v2_ike_state(struct connection *c,
 				const ike_spi_t ike_responder_spi,
 				lset_t policy,
 				int try, struct fd *whack_sock);
+/* compacted half-open IKE SAs; see ikev2_half_open.c */
+struct ike_sa *restore_v2_ike_state(struct connection *c,
+				    so_serial_t serialno,
+				    const ike_spis_t *ike_spis,
+				    enum state_kind kind,
+				    const struct state_v2_microcode *transition,
+				    lset_t policy);
+void free_compacted_state(struct state *st);
+void uncount_compacted_state(enum state_kind kind);
 /* could eventually be IKE or CHILD SA */
 struct child_sa *new_v2_child_state(struct connection *c,
 				    struct ike_sa *ike,
@@ -839,6 +855,10 @@ extern void initialize_new_state(struct state *st,
 extern void show_traffic_status(struct show *s, const char *name);
 extern void show_brief_status(struct show *s);
 extern void show_states(struct show *s);
+/* piecewise, so that status can be streamed a few states at a time */
+extern so_serial_t *state_status_serials(bool sorted, unsigned *count);
+extern void show_state_status(struct show *s, so_serial_t serialno,
+			      monotime_t now);
 
 void v2_migrate_children(struct ike_sa *from, struct child_sa *to);
 
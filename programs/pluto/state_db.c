@@ -367,6 +367,221 @@ struct state *state_by_ike_spis(enum ike_version ike_version,
 	return NULL;
 }
 
+/*
+ * Hash tables indexed by CHILD SA SPI, one per protocol and direction.
+ *
+ * The remote end identifies a CHILD SA, in a Delete payload or
+ * REKEY_SA notification, using its inbound (our outbound) SPI; some
+ * implementations instead send our inbound SPI.  Since SPIs are
+ * chosen well after the state is created, a state is only entered
+ * into these tables once its SPI is known, and is re-hashed on each
+ * state transition and when the SA is installed.  Because the kernel
+ * allocates inbound SPIs (and hence they are unique), there's no need
+ * to include the IKE SA in the key.
+ */
+
+static ipsec_spi_t state_spi(const struct state *st, enum state_hash_tables table)
+{
+	switch (table) {
+	case STATE_ESP_OUTBOUND_SPI_HASH_TABLE:
+		return st->st_esp.present ? st->st_esp.attrs.spi : 0;
+	case STATE_AH_OUTBOUND_SPI_HASH_TABLE:
+		return st->st_ah.present ? st->st_ah.attrs.spi : 0;
+	case STATE_IPCOMP_OUTBOUND_CPI_HASH_TABLE:
+		return st->st_ipcomp.present ? st->st_ipcomp.attrs.spi : 0;
+	case STATE_ESP_INBOUND_SPI_HASH_TABLE:
+		return st->st_esp.present ? st->st_esp.our_spi : 0;
+	case STATE_AH_INBOUND_SPI_HASH_TABLE:
+		return st->st_ah.present ? st->st_ah.our_spi : 0;
+	default:
+		bad_case(table);
+	}
+}
+
+static hash_t spi_hasher(const ipsec_spi_t *spi)
+{
+	return hash_table_hasher(shunk2(spi, sizeof(*spi)), zero_hash);
+}
+
+#define STATE_SPI_HASH_TABLE(NAME, TABLE)				\
+	static hash_t state_##NAME##_hasher(const void *data)		\
+	{								\
+		const struct state *st = data;				\
+		ipsec_spi_t spi = state_spi(st, TABLE);			\
+		return spi_hasher(&spi);				\
+	}								\
+	static struct list_entry *state_##NAME##_entry(void *data)	\
+	{								\
+		struct state *st = data;				\
+		return &st->st_hash_table_entries[TABLE];		\
+	}
+
+STATE_SPI_HASH_TABLE(esp_outbound_spi, STATE_ESP_OUTBOUND_SPI_HASH_TABLE)
+STATE_SPI_HASH_TABLE(ah_outbound_spi, STATE_AH_OUTBOUND_SPI_HASH_TABLE)
+STATE_SPI_HASH_TABLE(ipcomp_outbound_cpi, STATE_IPCOMP_OUTBOUND_CPI_HASH_TABLE)
+STATE_SPI_HASH_TABLE(esp_inbound_spi, STATE_ESP_INBOUND_SPI_HASH_TABLE)
+STATE_SPI_HASH_TABLE(ah_inbound_spi, STATE_AH_INBOUND_SPI_HASH_TABLE)
+
+static bool state_spi_table(enum state_hash_tables table)
+{
+	return (table >= STATE_ESP_OUTBOUND_SPI_HASH_TABLE &&
+		table <= STATE_AH_INBOUND_SPI_HASH_TABLE);
+}
+
+static struct state *state_by_spi(enum state_hash_tables table,
+				  ipsec_spi_t spi,
+				  state_by_predicate *predicate /*optional*/,
+				  void *predicate_context,
+				  const char *reason)
+{
+	if (spi == 0) {
+		/* never hashed */
+		return NULL;
+	}
+	hash_t hash = spi_hasher(&spi);
+	struct list_head *bucket = hash_table_bucket(&state_hash_tables[table], hash);
+	struct state *st;
+	FOR_EACH_LIST_ENTRY_NEW2OLD(bucket, st) {
+		if (state_spi(st, table) != spi) {
+			continue;
+		}
+		if (predicate != NULL &&
+		    !predicate(st, predicate_context)) {
+			continue;
+		}
+		dbg("State DB: found state #%lu in %s (%s)",
+		    st->st_serialno, st->st_state->short_name, reason);
+		return st;
+	}
+	dbg("State DB: state not found (%s)", reason);
+	return NULL;
+}
+
+struct state *state_by_outbound_spi(uint8_t protoid, ipsec_spi_t spi,
+				    state_by_predicate *predicate /*optional*/,
+				    void *predicate_context,
+				    const char *reason)
+{
+	switch (protoid) {
+	case PROTO_IPSEC_ESP:
+		return state_by_spi(STATE_ESP_OUTBOUND_SPI_HASH_TABLE, spi,
+				    predicate, predicate_context, reason);
+	case PROTO_IPSEC_AH:
+		return state_by_spi(STATE_AH_OUTBOUND_SPI_HASH_TABLE, spi,
+				    predicate, predicate_context, reason);
+	case PROTO_IPCOMP:
+		return state_by_spi(STATE_IPCOMP_OUTBOUND_CPI_HASH_TABLE, spi,
+				    predicate, predicate_context, reason);
+	default:
+		dbg("State DB: protocol %u has no SPI table (%s)", protoid, reason);
+		return NULL;
+	}
+}
+
+struct state *state_by_inbound_spi(uint8_t protoid, ipsec_spi_t spi,
+				   state_by_predicate *predicate /*optional*/,
+				   void *predicate_context,
+				   const char *reason)
+{
+	switch (protoid) {
+	case PROTO_IPSEC_ESP:
+		return state_by_spi(STATE_ESP_INBOUND_SPI_HASH_TABLE, spi,
+				    predicate, predicate_context, reason);
+	case PROTO_IPSEC_AH:
+		return state_by_spi(STATE_AH_INBOUND_SPI_HASH_TABLE, spi,
+				    predicate, predicate_context, reason);
+	default:
+		dbg("State DB: protocol %u has no SPI table (%s)", protoid, reason);
+		return NULL;
+	}
+}
+
+/*
+ * Map of our IPCOMP CPIs in use, so that a free range can be found
+ * without walking all states.
+ *
+ * Since a CHILD SA inherits its parent's CPI, more than one state can
+ * be using the same CPI; hence each bit is backed by a user count.
+ * Both arrays are only allocated while there are bookings.
+ */
+
+#define CPI_MAP_BITS	(sizeof(uint64_t) * 8)
+#define CPI_MAP_SIZE	(1 << (sizeof(cpi_t) * 8))
+
+static uint64_t *cpi_busy_map;	/* [CPI_MAP_SIZE / CPI_MAP_BITS] */
+static uint16_t *cpi_users;	/* [CPI_MAP_SIZE] */
+static unsigned nr_cpi_bookings;
+
+static void book_cpi(cpi_t cpi)
+{
+	if (cpi_users == NULL) {
+		cpi_busy_map = alloc_things(uint64_t, CPI_MAP_SIZE / CPI_MAP_BITS,
+					    "CPI busy map");
+		cpi_users = alloc_things(uint16_t, CPI_MAP_SIZE, "CPI users");
+	}
+	if (cpi_users[cpi]++ == 0) {
+		cpi_busy_map[cpi / CPI_MAP_BITS] |= (uint64_t)1 << (cpi % CPI_MAP_BITS);
+	}
+	nr_cpi_bookings++;
+}
+
+static void unbook_cpi(cpi_t cpi)
+{
+	passert(cpi_users != NULL && cpi_users[cpi] > 0);
+	if (--cpi_users[cpi] == 0) {
+		cpi_busy_map[cpi / CPI_MAP_BITS] &= ~((uint64_t)1 << (cpi % CPI_MAP_BITS));
+	}
+	if (--nr_cpi_bookings == 0) {
+		pfree(cpi_busy_map);
+		cpi_busy_map = NULL;
+		pfree(cpi_users);
+		cpi_users = NULL;
+	}
+}
+
+static void rebook_state_cpi(struct state *st)
+{
+	cpi_t cpi = st->st_ipcomp.present ? (cpi_t)ntohl(st->st_ipcomp.our_spi) : 0;
+	if (cpi == st->st_booked_cpi) {
+		return;
+	}
+	if (st->st_booked_cpi != 0) {
+		unbook_cpi(st->st_booked_cpi);
+	}
+	if (cpi != 0) {
+		book_cpi(cpi);
+	}
+	st->st_booked_cpi = cpi;
+}
+
+bool cpi_in_use(cpi_t cpi)
+{
+	return (cpi_busy_map != NULL &&
+		(cpi_busy_map[cpi / CPI_MAP_BITS] >> (cpi % CPI_MAP_BITS)) & 1);
+}
+
+cpi_t cpi_distance_to_busy(cpi_t base)
+{
+	if (cpi_busy_map == NULL) {
+		return ~0;	/* not close at all */
+	}
+	unsigned d = 1;
+	while (d < CPI_MAP_SIZE) {
+		cpi_t cpi = base + d;
+		/* skip whole words of free CPIs */
+		if (cpi % CPI_MAP_BITS == 0 &&
+		    cpi_busy_map[cpi / CPI_MAP_BITS] == 0) {
+			d += CPI_MAP_BITS;
+			continue;
+		}
+		if (cpi_in_use(cpi)) {
+			return d;
+		}
+		d++;
+	}
+	return ~0;	/* not close at all */
+}
+
 /*
  * Maintain the contents of the hash tables.
  *
@@ -426,6 +641,56 @@ static struct hash_table state_hash_tables[] = {
 		.nr_slots = elemsof(hash_slots[STATE_IKE_SPIS_HASH_TABLE]),
 		.slots = hash_slots[STATE_IKE_SPIS_HASH_TABLE],
 	},
+	[STATE_ESP_OUTBOUND_SPI_HASH_TABLE] = {
+		.info = {
+			.name = "ESP outbound SPI table",
+			.jam = jam_state,
+		},
+		.hasher = state_esp_outbound_spi_hasher,
+		.entry = state_esp_outbound_spi_entry,
+		.nr_slots = elemsof(hash_slots[STATE_ESP_OUTBOUND_SPI_HASH_TABLE]),
+		.slots = hash_slots[STATE_ESP_OUTBOUND_SPI_HASH_TABLE],
+	},
+	[STATE_AH_OUTBOUND_SPI_HASH_TABLE] = {
+		.info = {
+			.name = "AH outbound SPI table",
+			.jam = jam_state,
+		},
+		.hasher = state_ah_outbound_spi_hasher,
+		.entry = state_ah_outbound_spi_entry,
+		.nr_slots = elemsof(hash_slots[STATE_AH_OUTBOUND_SPI_HASH_TABLE]),
+		.slots = hash_slots[STATE_AH_OUTBOUND_SPI_HASH_TABLE],
+	},
+	[STATE_IPCOMP_OUTBOUND_CPI_HASH_TABLE] = {
+		.info = {
+			.name = "IPCOMP outbound CPI table",
+			.jam = jam_state,
+		},
+		.hasher = state_ipcomp_outbound_cpi_hasher,
+		.entry = state_ipcomp_outbound_cpi_entry,
+		.nr_slots = elemsof(hash_slots[STATE_IPCOMP_OUTBOUND_CPI_HASH_TABLE]),
+		.slots = hash_slots[STATE_IPCOMP_OUTBOUND_CPI_HASH_TABLE],
+	},
+	[STATE_ESP_INBOUND_SPI_HASH_TABLE] = {
+		.info = {
+			.name = "ESP inbound SPI table",
+			.jam = jam_state,
+		},
+		.hasher = state_esp_inbound_spi_hasher,
+		.entry = state_esp_inbound_spi_entry,
+		.nr_slots = elemsof(hash_slots[STATE_ESP_INBOUND_SPI_HASH_TABLE]),
+		.slots = hash_slots[STATE_ESP_INBOUND_SPI_HASH_TABLE],
+	},
+	[STATE_AH_INBOUND_SPI_HASH_TABLE] = {
+		.info = {
+			.name = "AH inbound SPI table",
+			.jam = jam_state,
+		},
+		.hasher = state_ah_inbound_spi_hasher,
+		.entry = state_ah_inbound_spi_entry,
+		.nr_slots = elemsof(hash_slots[STATE_AH_INBOUND_SPI_HASH_TABLE]),
+		.slots = hash_slots[STATE_AH_INBOUND_SPI_HASH_TABLE],
+	},
 };
 
 void add_state_to_db(struct state *st)
@@ -441,8 +706,32 @@ void add_state_to_db(struct state *st)
 			  &st->st_serialno_list_entry);
 
 	for (unsigned h = 0; h < elemsof(state_hash_tables); h++) {
-		add_hash_table_entry(&state_hash_tables[h], st);
+		if (!state_spi_table(h)) {
+			add_hash_table_entry(&state_hash_tables[h], st);
+		}
 	}
+	rehash_state_spis_in_db(st);
+}
+
+void rehash_state_spis_in_db(struct state *st)
+{
+	if (st->st_serialno_list_entry.newer == NULL) {
+		/* not (or no longer) in the DB */
+		return;
+	}
+	for (unsigned h = 0; h < elemsof(state_hash_tables); h++) {
+		if (!state_spi_table(h)) {
+			continue;
+		}
+		struct hash_table *table = &state_hash_tables[h];
+		if (table->entry(st)->newer != NULL) {
+			del_hash_table_entry(table, st);
+		}
+		if (state_spi(st, h) != 0) {
+			add_hash_table_entry(table, st);
+		}
+	}
+	rebook_state_cpi(st);
 }
 
 void rehash_state_cookies_in_db(struct state *st)
@@ -461,7 +750,14 @@ void del_state_from_db(struct state *st)
 	    st->st_serialno, st->st_state->short_name);
 	remove_list_entry(&st->st_serialno_list_entry);
 	for (unsigned h = 0; h < elemsof(state_hash_tables); h++) {
-		del_hash_table_entry(&state_hash_tables[h], st);
+		struct hash_table *table = &state_hash_tables[h];
+		if (table->entry(st)->newer != NULL) {
+			del_hash_table_entry(table, st);
+		}
+	}
+	if (st->st_booked_cpi != 0) {
+		unbook_cpi(st->st_booked_cpi);
+		st->st_booked_cpi = 0;
 	}
 }
 
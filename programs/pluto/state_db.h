@@ -18,6 +18,7 @@
 
 #include "ike_spi.h"
 #include "reqid.h"
+#include "ietf_constants.h"	/* for cpi_t */
 
 struct state;
 struct connection;
@@ -80,4 +81,24 @@ struct state *state_by_reqid(reqid_t reqid,
 			     const char *reason);
 void rehash_state_reqid(struct state *st);
 
+/*
+ * CHILD SA SPIs (and our IPCOMP CPIs) are only known well after the
+ * state is created; re-index them once they have been assigned.
+ */
+
+void rehash_state_spis_in_db(struct state *st);
+
+struct state *state_by_outbound_spi(uint8_t protoid, ipsec_spi_t spi,
+				    state_by_predicate *predicate /*optional*/,
+				    void *predicate_context,
+				    const char *reason);
+struct state *state_by_inbound_spi(uint8_t protoid, ipsec_spi_t spi,
+				   state_by_predicate *predicate /*optional*/,
+				   void *predicate_context,
+				   const char *reason);
+
+bool cpi_in_use(cpi_t cpi);
+/* distance from BASE to the next CPI in use; ~0 when there is none */
+cpi_t cpi_distance_to_busy(cpi_t base);
+
 #endif
@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>		/* for UINT_MAX */
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -49,6 +50,7 @@
 #include "log.h"
 #include "rnd.h"
 #include "timer.h"
+#include "slab.h"
 #include "whack.h"
 #include "ikev1_dpd.h"
 #include "ikev2.h"
@@ -115,6 +117,440 @@ struct pluto_event **state_event(struct state *st, enum event_type type)
 	bad_case(type);
 }
 
+/*
+ * Per-state event nodes; scheduling and dispatching state events is
+ * the hot path for half-open IKE SAs, so recycle the nodes.
+ */
+
+static struct slab_pool state_event_pool =
+	SLAB_POOL(struct pluto_event, "struct pluto_event (state)");
+
+/*
+ * Pluto's timer wheel.
+ *
+ * Per-state events are kept on a hierarchical timing wheel instead of
+ * each having its own libevent timer: scheduling or deleting an event
+ * is a list insert or remove, and a single libevent timer, armed for
+ * the next occupied tick, drives the lot.
+ *
+ * Level 0 has one bucket per tick; each higher level has buckets
+ * covering a whole rotation of the level below.  When level 0 wraps,
+ * the next bucket of level 1 is cascaded down (and so on up), so an
+ * event is moved at most once per level.
+ *
+ * With 10ms ticks: level 0 spans 2.56s, level 1 2.7 minutes, level 2
+ * 2.9 hours, level 3 7.7 days and level 4 well over a year.
+ */
+
+#define TIMER_WHEEL_TICK_MS	10
+#define TIMER_WHEEL_LEVEL0_BITS	8
+#define TIMER_WHEEL_LEVELN_BITS	6
+#define TIMER_WHEEL_LEVELS	5
+#define TIMER_WHEEL_LEVEL0_SLOTS	(1u << TIMER_WHEEL_LEVEL0_BITS)
+#define TIMER_WHEEL_LEVELN_SLOTS	(1u << TIMER_WHEEL_LEVELN_BITS)
+#define TIMER_WHEEL_BUCKETS	(TIMER_WHEEL_LEVEL0_SLOTS +			\
+				 (TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_LEVELN_SLOTS)
+#define TIMER_WHEEL_DUE		TIMER_WHEEL_BUCKETS	/* on the due list */
+
+static void jam_wheel_event(struct jambuf *buf, const void *data)
+{
+	if (data == NULL) {
+		jam(buf, "<no event>");
+	} else {
+		const struct pluto_event *ev = data;
+		jam(buf, "%s #%lu", ev->ev_name, ev->ev_state->st_serialno);
+	}
+}
+
+static const struct list_info timer_wheel_info = {
+	.name = "timer wheel",
+	.jam = jam_wheel_event,
+};
+
+static struct {
+	struct event *tick;		/* libevent timer driving the wheel */
+	uint64_t armed;			/* tick .tick is armed for */
+	uint64_t now;			/* next tick to run */
+	unsigned nr_events;
+	struct list_head bucket[TIMER_WHEEL_BUCKETS + 1/*due*/];
+	unsigned occupancy[TIMER_WHEEL_BUCKETS + 1/*due*/];
+} timer_wheel;
+
+static uint64_t monotime_tick(monotime_t t, bool round_up)
+{
+	intmax_t ms = deltamillisecs(monotimediff(t, monotime_epoch));
+	if (ms < 0) {
+		ms = 0;
+	}
+	return ((uint64_t)ms + (round_up ? TIMER_WHEEL_TICK_MS - 1 : 0)) / TIMER_WHEEL_TICK_MS;
+}
+
+static unsigned level_shift(unsigned level)
+{
+	passert(level > 0);
+	return TIMER_WHEEL_LEVEL0_BITS + (level - 1) * TIMER_WHEEL_LEVELN_BITS;
+}
+
+static unsigned level_bucket(unsigned level, uint64_t expires)
+{
+	return (TIMER_WHEEL_LEVEL0_SLOTS +
+		(level - 1) * TIMER_WHEEL_LEVELN_SLOTS +
+		((expires >> level_shift(level)) & (TIMER_WHEEL_LEVELN_SLOTS - 1)));
+}
+
+static void add_to_bucket(struct pluto_event *ev, unsigned bucket)
+{
+	ev->wheel_bucket = bucket;
+	timer_wheel.occupancy[bucket]++;
+	insert_list_entry(&timer_wheel.bucket[bucket], &ev->wheel_entry);
+}
+
+static void remove_from_bucket(struct pluto_event *ev)
+{
+	passert(timer_wheel.occupancy[ev->wheel_bucket] > 0);
+	timer_wheel.occupancy[ev->wheel_bucket]--;
+	remove_list_entry(&ev->wheel_entry);
+}
+
+static void arm_timer_wheel(uint64_t tick)
+{
+	if (tick >= timer_wheel.armed) {
+		return;
+	}
+	timer_wheel.armed = tick;
+	uint64_t now = monotime_tick(mononow(), false);
+	deltatime_t delay = deltatime_ms(tick > now ? (tick - now) * TIMER_WHEEL_TICK_MS : 0);
+	struct timeval tv = timeval_from_deltatime(delay);
+	passert(event_add(timer_wheel.tick, &tv) >= 0);
+}
+
+/*
+ * Put EV in the bucket for its expiry relative to .now; returns the
+ * tick by which the wheel needs to run to not miss it.
+ */
+static uint64_t place_wheel_event(struct pluto_event *ev)
+{
+	/* anything overdue runs on the next tick */
+	uint64_t expires = (ev->wheel_expires < timer_wheel.now ? timer_wheel.now :
+			    ev->wheel_expires);
+	uint64_t delta = expires - timer_wheel.now;
+	if (delta < TIMER_WHEEL_LEVEL0_SLOTS) {
+		add_to_bucket(ev, expires & (TIMER_WHEEL_LEVEL0_SLOTS - 1));
+		return expires;
+	}
+	unsigned level = 1;
+	while (level < TIMER_WHEEL_LEVELS - 1 &&
+	       delta >= (UINT64_C(1) << (level_shift(level) + TIMER_WHEEL_LEVELN_BITS))) {
+		level++;
+	}
+	uint64_t limit = UINT64_C(1) << (level_shift(level) + TIMER_WHEEL_LEVELN_BITS);
+	if (delta >= limit) {
+		/* beyond the top level; park it in its last bucket */
+		expires = timer_wheel.now + limit - 1;
+	}
+	add_to_bucket(ev, level_bucket(level, expires));
+	/* the next time level 0 wraps */
+	return (timer_wheel.now | (TIMER_WHEEL_LEVEL0_SLOTS - 1)) + 1;
+}
+
+static void cascade_timer_wheel(unsigned bucket)
+{
+	struct list_head *head = &timer_wheel.bucket[bucket];
+	while (head->head.newer != &head->head) {
+		/* oldest first, keeping FIFO order */
+		struct pluto_event *ev = head->head.newer->data;
+		remove_from_bucket(ev);
+		place_wheel_event(ev);
+	}
+}
+
+static void dispatch_state_event(struct pluto_event *ev);
+
+static void run_timer_wheel_tick(void)
+{
+	unsigned index = timer_wheel.now & (TIMER_WHEEL_LEVEL0_SLOTS - 1);
+	if (index == 0) {
+		for (unsigned level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			cascade_timer_wheel(level_bucket(level, timer_wheel.now));
+			if (((timer_wheel.now >> level_shift(level)) &
+			     (TIMER_WHEEL_LEVELN_SLOTS - 1)) != 0) {
+				break;
+			}
+		}
+	}
+
+	/*
+	 * Move this tick's events to the due list before running
+	 * any: a handler can schedule into the bucket just emptied.
+	 */
+	struct list_head *bucket = &timer_wheel.bucket[index];
+	struct list_head *due = &timer_wheel.bucket[TIMER_WHEEL_DUE];
+	while (bucket->head.newer != &bucket->head) {
+		struct pluto_event *ev = bucket->head.newer->data;
+		remove_from_bucket(ev);
+		add_to_bucket(ev, TIMER_WHEEL_DUE);
+	}
+	timer_wheel.now++;
+
+	/* a handler can delete any due event, so always take the oldest */
+	while (due->head.newer != &due->head) {
+		dispatch_state_event(due->head.newer->data);
+	}
+}
+
+static void timer_wheel_cb(evutil_socket_t unused_fd UNUSED,
+			   const short unused_event UNUSED,
+			   void *unused_arg UNUSED)
+{
+	timer_wheel.armed = UINT64_MAX;
+	uint64_t now = monotime_tick(mononow(), false);
+	while (timer_wheel.now <= now && timer_wheel.nr_events > 0) {
+		run_timer_wheel_tick();
+	}
+	if (timer_wheel.nr_events == 0) {
+		return;
+	}
+	/* the next occupied level 0 bucket, or the next wrap (to cascade) */
+	uint64_t next = timer_wheel.now;
+	while ((next & (TIMER_WHEEL_LEVEL0_SLOTS - 1)) != 0 &&
+	       timer_wheel.occupancy[next & (TIMER_WHEEL_LEVEL0_SLOTS - 1)] == 0) {
+		next++;
+	}
+	arm_timer_wheel(next);
+}
+
+static void schedule_wheel_event(struct pluto_event *ev)
+{
+	if (timer_wheel.nr_events == 0) {
+		/* nothing to miss; skip any idle ticks */
+		uint64_t now = monotime_tick(mononow(), false);
+		if (timer_wheel.now < now) {
+			timer_wheel.now = now;
+		}
+	}
+	ev->wheel_entry = list_entry(&timer_wheel_info, ev);
+	ev->wheel_expires = monotime_tick(ev->ev_time, true);
+	timer_wheel.nr_events++;
+	arm_timer_wheel(place_wheel_event(ev));
+}
+
+/*
+ * Rekey admission.
+ *
+ * SAs established together (after a restart, a link flap, a flood of
+ * road warriors) all come up for rekey together.  When rekey-window=
+ * is set the rekey (or replace) is pulled forward by a random amount,
+ * up to the window but never more than half the time remaining; when
+ * rekey-rate= is also set it is moved on to the nearest earlier second
+ * in the window that still has room in the per-second budget.  Events
+ * are only ever moved earlier so the SA's lifetime is still honoured.
+ *
+ * Bookings are kept in a ring indexed by monotonic second.  Rekeys
+ * are due within an SA lifetime, so the ring spans twice the longest
+ * lifetime: everything booked lies ahead of now and a slot is only
+ * reused for a later second once its bookings have run.  A slot still
+ * holding bookings for some other second is never reset; it is
+ * treated as full.
+ *
+ * The search for room is bounded to REKEY_SCHEDULE_PROBES seconds so
+ * that, once the window is fully booked, each SA doesn't walk all of
+ * it; the starting second is random so the probes still cover the
+ * window.
+ */
+
+#define REKEY_SCHEDULE_HORIZON	max(IKE_SA_LIFETIME_MAXIMUM, IPSEC_SA_LIFETIME_MAXIMUM)
+#define REKEY_SCHEDULE_SLOTS	(2 * REKEY_SCHEDULE_HORIZON)
+#define REKEY_SCHEDULE_PROBES	64
+
+static struct rekey_slot {
+	uint32_t second;	/* truncated; only compared */
+	unsigned count;
+} *rekey_schedule;
+
+static uintmax_t rekey_admitted;	/* rekeys moved earlier */
+static uintmax_t rekey_overbooked;	/* ... with no second in budget */
+
+static struct rekey_slot *rekey_slot(intmax_t second)
+{
+	return &rekey_schedule[(uintmax_t)second % REKEY_SCHEDULE_SLOTS];
+}
+
+static unsigned rekey_load(intmax_t second)
+{
+	const struct rekey_slot *slot = rekey_slot(second);
+	if (slot->second == (uint32_t)second) {
+		return slot->count;
+	}
+	return (slot->count > 0 ? UINT_MAX : 0);
+}
+
+static void book_rekey(struct pluto_event *ev, intmax_t second)
+{
+	struct rekey_slot *slot = rekey_slot(second);
+	if (slot->second != (uint32_t)second) {
+		if (slot->count > 0) {
+			/* still held by an overdue event; don't lose it */
+			dbg("rekey slot for %jd still holds %u bookings for %"PRIu32,
+			    second, slot->count, slot->second);
+			return;
+		}
+		slot->second = second;
+	}
+	slot->count++;
+	ev->rekey_booked = true;
+	ev->rekey_second = second;
+}
+
+static void unbook_rekey(struct pluto_event *ev)
+{
+	if (!ev->rekey_booked) {
+		return;
+	}
+	ev->rekey_booked = false;
+	struct rekey_slot *slot = rekey_slot(ev->rekey_second);
+	if (pexpect(slot->second == (uint32_t)ev->rekey_second) &&
+	    pexpect(slot->count > 0)) {
+		slot->count--;
+	}
+}
+
+/*
+ * Take the event *EVP off the wheel (or the due list) and release it;
+ * leave *EVP == NULL.
+ *
+ * A state has seven .st_*event fields but for most of its life only
+ * .st_event is armed, so nodes are taken from a pool when scheduled
+ * rather than reserved in every struct state.
+ */
+static void delete_wheel_event(struct pluto_event **evp)
+{
+	struct pluto_event *ev = *evp;
+	if (ev == NULL) {
+		return;
+	}
+	remove_from_bucket(ev);
+	unbook_rekey(ev);
+	passert(timer_wheel.nr_events > 0);
+	timer_wheel.nr_events--;
+	*evp = NULL;
+	slab_free(&state_event_pool, ev);
+}
+
+void init_timer(void)
+{
+	for (unsigned b = 0; b < elemsof(timer_wheel.bucket); b++) {
+		timer_wheel.bucket[b] = (struct list_head)
+			INIT_LIST_HEAD(&timer_wheel.bucket[b], &timer_wheel_info);
+	}
+	timer_wheel.armed = UINT64_MAX;
+	timer_wheel.now = monotime_tick(mononow(), false);
+	timer_wheel.tick = event_new(get_pluto_event_base(), (evutil_socket_t)-1,
+				     EV_TIMEOUT, timer_wheel_cb, NULL);
+	passert(timer_wheel.tick != NULL);
+}
+
+void free_timer(void)
+{
+	if (timer_wheel.nr_events > 0) {
+		dbg("timer wheel still has %u events", timer_wheel.nr_events);
+	}
+	if (timer_wheel.tick != NULL) {
+		event_free(timer_wheel.tick);
+		timer_wheel.tick = NULL;
+	}
+	pfreeany(rekey_schedule);
+}
+
+static void wheel_level_occupancy(unsigned level, unsigned *events, unsigned *buckets)
+{
+	unsigned first = (level == 0 ? 0 : level_bucket(level, 0));
+	unsigned nr = (level == 0 ? TIMER_WHEEL_LEVEL0_SLOTS : TIMER_WHEEL_LEVELN_SLOTS);
+	*events = *buckets = 0;
+	for (unsigned b = first; b < first + nr; b++) {
+		*events += timer_wheel.occupancy[b];
+		*buckets += (timer_wheel.occupancy[b] > 0);
+	}
+}
+
+void show_timer_wheel_stats(struct show *s)
+{
+	show_raw(s, "current.timer.wheel.events=%u", timer_wheel.nr_events);
+	for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		unsigned events, buckets;
+		wheel_level_occupancy(level, &events, &buckets);
+		show_raw(s, "current.timer.wheel.level%u.events=%u", level, events);
+		show_raw(s, "current.timer.wheel.level%u.buckets=%u", level, buckets);
+	}
+}
+
+void list_timer_wheel(struct show *s)
+{
+	show_comment(s, "timer wheel: %u events, %dms ticks, next tick %ju",
+		     timer_wheel.nr_events, TIMER_WHEEL_TICK_MS,
+		     (uintmax_t)timer_wheel.now);
+	for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		unsigned first = (level == 0 ? 0 : level_bucket(level, 0));
+		unsigned nr = (level == 0 ? TIMER_WHEEL_LEVEL0_SLOTS : TIMER_WHEEL_LEVELN_SLOTS);
+		for (unsigned b = first; b < first + nr; b++) {
+			if (timer_wheel.occupancy[b] > 0) {
+				show_comment(s, "timer wheel level %u bucket %u: %u events",
+					     level, b - first, timer_wheel.occupancy[b]);
+			}
+		}
+	}
+}
+
+/*
+ * Histogram of the rekey (and replace) events still to come, by how
+ * soon they are due.
+ */
+
+static const struct rekey_bin {
+	const char *name;
+	intmax_t secs;
+} rekey_bins[] = {
+	{ "1m", secs_per_minute, },
+	{ "5m", 5 * secs_per_minute, },
+	{ "15m", 15 * secs_per_minute, },
+	{ "1h", secs_per_hour, },
+	{ "4h", 4 * secs_per_hour, },
+	{ "24h", secs_per_day, },
+	{ "later", INTMAX_MAX, },
+};
+
+static bool is_rekey_event(enum event_type type)
+{
+	return (type == EVENT_SA_REKEY ||
+		type == EVENT_SA_REPLACE ||
+		type == EVENT_v1_SA_REPLACE_IF_USED);
+}
+
+void show_rekey_schedule_stats(struct show *s)
+{
+	unsigned count[elemsof(rekey_bins)] = {0};
+	monotime_t now = mononow();
+	for (unsigned b = 0; b < elemsof(timer_wheel.bucket); b++) {
+		struct pluto_event *ev;
+		FOR_EACH_LIST_ENTRY_OLD2NEW(&timer_wheel.bucket[b], ev) {
+			if (!is_rekey_event(ev->ev_type)) {
+				continue;
+			}
+			intmax_t due = deltasecs(monotimediff(ev->ev_time, now));
+			unsigned bin = 0;
+			while (due > rekey_bins[bin].secs) {
+				bin++;
+			}
+			count[bin]++;
+		}
+	}
+	for (unsigned bin = 0; bin < elemsof(rekey_bins); bin++) {
+		show_raw(s, "current.rekey.upcoming.%s=%u",
+			 rekey_bins[bin].name, count[bin]);
+	}
+	show_raw(s, "total.rekey.admitted=%ju", rekey_admitted);
+	show_raw(s, "total.rekey.overbooked=%ju", rekey_overbooked);
+}
+
 /*
  * This file has the event handling routines. Events are
  * kept as a linked list of event structures. These structures
@@ -122,10 +558,7 @@ struct pluto_event **state_event(struct state *st, enum event_type type)
  * to event specific data (for example, to a state structure).
  */
 
-static event_callback_routine timer_event_cb;
-static void timer_event_cb(evutil_socket_t unused_fd UNUSED,
-			   const short unused_event UNUSED,
-			   void *arg)
+static void dispatch_state_event(struct pluto_event *ev)
 {
 	threadtime_t inception = threadtime_start();
 
@@ -139,7 +572,6 @@ static void timer_event_cb(evutil_socket_t unused_fd UNUSED,
 	enum event_type type;
 	const char *event_name;
 	{
-		struct pluto_event *ev = arg;
 		dbg("%s: processing event@%p", __func__, ev);
 		passert(ev != NULL);
 		type = ev->ev_type;
@@ -166,22 +598,20 @@ static void timer_event_cb(evutil_socket_t unused_fd UNUSED,
 #endif
 
 		struct pluto_event **evp = state_event(st, type);
-		if (evp == NULL) {
+		if (evp == NULL || *evp != ev) {
 			pexpect_fail(st->st_logger, HERE,
-				     "#%lu has no .st_event field for %s",
-				     st->st_serialno, enum_name(&timer_event_names, type));
+				     "#%lu .st_event for %s is %p but should be pe@%p",
+				     st->st_serialno, enum_name(&timer_event_names, type),
+				     (evp == NULL ? NULL : *evp), ev);
+			/* don't spin on the due list */
+			remove_from_bucket(ev);
+			unbook_rekey(ev);
+			timer_wheel.nr_events--;
+			slab_free(&state_event_pool, ev);
 			return;
 		}
-		if (*evp != ev) {
-			pexpect_fail(st->st_logger, HERE,
-				     "#%lu .st_event is %p but should be %s-pe@%p",
-				     st->st_serialno, *evp,
-				     enum_name(&timer_event_names, (*evp)->ev_type),
-				     ev);
-			return;
-		}
-		delete_pluto_event(evp);
-		arg = ev = *evp = NULL; /* all gone */
+		delete_wheel_event(evp);
+		ev = NULL; /* all gone */
 	}
 
 	statetime_t start = statetime_backdate(st, &inception);
@@ -481,7 +911,7 @@ void delete_event(struct state *st)
 			dbg("state #%lu deleting .%s %s",
 			    st->st_serialno, l->name,
 			    enum_show(&timer_event_names, (*l->event)->ev_type, &b));
-			delete_pluto_event(l->event);
+			delete_wheel_event(l->event);
 		}
 	}
 }
@@ -514,15 +944,17 @@ void event_schedule(enum event_type type, deltatime_t delay, struct state *st)
 			     "#%lu already has a scheduled %s; forcing replacement",
 			     st->st_serialno,
 			     enum_name(&timer_event_names, type));
-		delete_pluto_event(evp);
+		delete_wheel_event(evp);
 	}
 
-	struct pluto_event *ev = alloc_thing(struct pluto_event, en);
+	struct pluto_event *ev = slab_alloc_thing(&state_event_pool, struct pluto_event,
+						  "struct pluto_event in event_schedule()");
 	dbg("%s: newref %s-pe@%p", __func__, en, ev);
 	ev->ev_type = type;
 	ev->ev_name = en;
 	ev->ev_state = st;
 	ev->ev_time = monotime_add(mononow(), delay);
+	ev->rekey_booked = false;
 	*evp = ev;
 
 	deltatime_buf buf;
@@ -530,7 +962,79 @@ void event_schedule(enum event_type type, deltatime_t delay, struct state *st)
 	    en, str_deltatime(delay, &buf),
 	    ev->ev_state->st_serialno);
 
-	fire_timer_photon_torpedo(&ev->ev, timer_event_cb, ev, delay);
+	schedule_wheel_event(ev);
+}
+
+/*
+ * Schedule a rekey or replace event, DELAY being the latest it can
+ * run; see "Rekey admission" above.
+ */
+void event_schedule_rekey(enum event_type type, deltatime_t delay, struct state *st)
+{
+	passert(is_rekey_event(type));
+	intmax_t spread = min(deltasecs(pluto_rekey_window), deltasecs(delay) / 2);
+	if (spread <= 0 || deltasecs(delay) >= REKEY_SCHEDULE_HORIZON) {
+		event_schedule(type, delay, st);
+		return;
+	}
+
+	if (rekey_schedule == NULL) {
+		rekey_schedule = alloc_things(struct rekey_slot, REKEY_SCHEDULE_SLOTS,
+					      "rekey schedule");
+	}
+
+	intmax_t deadline = monosecs(mononow()) + deltasecs(delay);
+	intmax_t earliest = deadline - spread;
+	intmax_t second = deadline - rand() % (spread + 1);
+
+	if (pluto_rekey_rate > 0 && rekey_load(second) >= pluto_rekey_rate) {
+		/*
+		 * Walk back (wrapping round to the deadline) looking
+		 * for room; failing that settle for the least loaded
+		 * second probed.
+		 */
+		intmax_t best = second;
+		unsigned best_load = rekey_load(second);
+		intmax_t probes = min(spread, (intmax_t)REKEY_SCHEDULE_PROBES);
+		for (intmax_t i = 1; i <= probes && best_load >= pluto_rekey_rate; i++) {
+			intmax_t s = second - i;
+			if (s < earliest) {
+				s += spread + 1;
+			}
+			unsigned load = rekey_load(s);
+			if (load < best_load) {
+				best = s;
+				best_load = load;
+			}
+		}
+		if (best_load >= pluto_rekey_rate) {
+			rekey_overbooked++;
+		}
+		second = best;
+	}
+
+	deltatime_t advance = deltatime(deadline - second);
+	if (deltasecs(advance) > 0) {
+		rekey_admitted++;
+		delay = deltatime_sub(delay, advance);
+		/*
+		 * The replace is followed by an expire after
+		 * .st_replace_margin; stretch that so the SA still
+		 * lives out its lifetime.  (An IKEv2 rekey instead
+		 * falls back to .st_replace_by.)
+		 */
+		if (type != EVENT_SA_REKEY) {
+			st->st_replace_margin = deltatime_add(st->st_replace_margin, advance);
+		}
+		deltatime_buf db, ab;
+		dbg("#%lu %s admitted in %s seconds, %s seconds early (load %u)",
+		    st->st_serialno, enum_name(&timer_event_names, type),
+		    str_deltatime(delay, &db), str_deltatime(advance, &ab),
+		    rekey_load(second));
+	}
+
+	event_schedule(type, delay, st);
+	book_rekey(*state_event(st, type), second);
 }
 
 /*
@@ -549,7 +1053,7 @@ void event_delete(enum event_type type, struct state *st)
 		dbg("#%lu requesting %s-pe@%p be deleted",
 		    st->st_serialno, enum_name(&timer_event_names, (*evp)->ev_type), *evp);
 		pexpect(st == (*evp)->ev_state);
-		delete_pluto_event(evp);
+		delete_wheel_event(evp);
 		pexpect((*evp) == NULL);
 	};
 }
@@ -588,5 +1092,5 @@ void call_state_event_inline(struct logger *logger, struct state *st,
 	 */
 	llog(RC_COMMENT, logger, "calling %s",
 		    enum_name(&timer_event_names, event));
-	timer_event_cb(0/*sock*/, 0/*event*/, *evp);
+	dispatch_state_event(*evp);
 }
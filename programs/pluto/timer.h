@@ -20,8 +20,12 @@
 #ifndef _TIMER_H
 #define _TIMER_H
 
+#include <stdbool.h>
+#include <stdint.h>		/* for uint64_t */
+
 #include "deltatime.h"
 #include "monotime.h"
+#include "list_entry.h"
 
 struct state;   /* forward declaration */
 struct fd;
@@ -35,16 +39,29 @@ struct pluto_event {
 	struct event *ev;               /* libevent data structure */
 	monotime_t ev_time;
 	struct pluto_event *next;
+	/*
+	 * State events don't use libevent; the node is taken from a
+	 * pool when scheduled and hangs off pluto's timer wheel.
+	 */
+	struct list_entry wheel_entry;
+	uint64_t wheel_expires;		/* in ticks */
+	unsigned wheel_bucket;
+	bool rekey_booked;		/* holds a slot in the rekey schedule */
+	intmax_t rekey_second;		/* ... for this (monotonic) second */
 };
 
 extern void event_schedule(enum event_type type, deltatime_t delay,
 			   struct state *st);
+void event_schedule_rekey(enum event_type type, deltatime_t delay,
+			  struct state *st);
 void event_delete(enum event_type type, struct state *st);
 struct pluto_event **state_event(struct state *st, enum event_type type);
 extern void event_force(enum event_type type, struct state *st);
 extern void delete_event(struct state *st);
-extern void handle_next_timer_event(void);
 extern void init_timer(void);
+extern void free_timer(void);
+void show_timer_wheel_stats(struct show *s);
+void show_rekey_schedule_stats(struct show *s);
 
 void call_state_event_inline(struct logger *logger, struct state *st,
 			     enum event_type type);
@@ -52,6 +69,7 @@ void call_global_event_inline(enum global_timer type,
 			      struct logger *logger);
 
 extern void list_timers(struct show *s, monotime_t now);
+void list_timer_wheel(struct show *s);
 extern char *revive_conn;
 
 /*
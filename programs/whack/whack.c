@@ -199,7 +199,7 @@ static void help(void)
 		"\n"
 		"reread: whack [--fetchcrls] [--rereadcerts] [--rereadsecrets] [--rereadall]\n"
 		"\n"
-		"status: whack [--status] | [--trafficstatus] | [--globalstatus] | \\\n"
+		"status: whack [--status [--unsorted]] | [--trafficstatus] | [--globalstatus] | \\\n"
 		"	[--clearstats] | [--shuntstatus] | [--fipsstatus] | [--briefstatus] \n"
 		"	[--showstates] | [--addresspoolstatus] [--processstatus]\n"
 		"\n"
@@ -356,6 +356,7 @@ enum option_enums {
 #define OPT_FIRST2  OPT_ASYNC	/* first normal option, range 2 */
 
 	OPT_ASYNC,
+	OPT_UNSORTED,
 
 	OPT_DELETECRASH,
 	OPT_USERNAME,
@@ -610,6 +611,7 @@ static const struct option long_opts[] = {
 	{ "briefstatus", no_argument, NULL, OPT_BRIEF_STATUS + OO },
 	{ "processstatus", no_argument, NULL, OPT_PROCESS_STATUS + OO },
 	{ "showstates", no_argument, NULL, OPT_SHOW_STATES + OO },
+	{ "unsorted", no_argument, NULL, OPT_UNSORTED + OO },
 #ifdef HAVE_SECCOMP
 	{ "seccomp-crashtest", no_argument, NULL, OPT_SECCOMP_CRASHTEST + OO },
 #endif
@@ -1543,6 +1545,10 @@ int main(int argc, char **argv)
 			msg.whack_async = TRUE;
 			continue;
 
+		case OPT_UNSORTED:	/* --unsorted */
+			msg.whack_unsorted = true;
+			continue;
+
 		/* List options */
 
 		case LST_UTC:	/* --utc */
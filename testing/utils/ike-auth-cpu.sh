@@ -0,0 +1,62 @@
+#!/bin/sh
+
+# Measure the main thread CPU pluto spends per IKE_AUTH exchange.
+#
+# Run on test guests with a connection between them (for instance
+# west-east), once with ike-sk-offload=no and once with
+# ike-sk-offload=yes in both ends' config setup:
+#
+#   east# ipsec restart ; ike-auth-cpu.sh clear
+#   west# ipsec restart ; ipsec auto --add west-east ; ike-auth-cpu.sh clear
+#   west# ike-auth-cpu.sh run west-east 100
+#   west# ike-auth-cpu.sh report ; east# ike-auth-cpu.sh report
+#
+# "run" brings the connection up and then down COUNT times; each
+# iteration is one IKE_SA_INIT and one IKE_AUTH exchange.  "report"
+# prints the total.ike.cpu.* counters from "ipsec whack
+# --globalstatus".  These are the main thread and helper thread times
+# that pluto_timing bills to each IKEv2 IKE SA (and its CHILD SAs),
+# added up as the SAs are deleted.
+
+set -e
+
+usage()
+{
+    echo "Usage: $0 clear | run <connection> <count> | report [<label>]" 1>&2
+    exit 1
+}
+
+case "$1" in
+    clear)
+	ipsec whack --clearstats
+	;;
+    run)
+	test $# -eq 3 || usage
+	conn=$2
+	count=$3
+	i=0
+	while test ${i} -lt ${count} ; do
+	    ipsec auto --up ${conn} > /dev/null
+	    ipsec auto --down ${conn} > /dev/null
+	    i=$((i + 1))
+	done
+	;;
+    report)
+	label=${2:-$(hostname)}
+	ipsec whack --globalstatus | awk -F = -v label="${label}" '
+$1 == "total.ike.cpu.sas" { sas = $2 }
+$1 == "total.ike.cpu.main.usec" { main = $2 }
+$1 == "total.ike.cpu.helper.usec" { helper = $2 }
+END {
+	if (sas == 0) {
+		printf "%s: no IKE SAs deleted\n", label
+		exit 1
+	}
+	printf "%s: %d IKE SAs; main %d usec (%d per SA); helper %d usec (%d per SA)\n",
+		label, sas, main, main / sas, helper, helper / sas
+}'
+	;;
+    *)
+	usage
+	;;
+esac